@@ -0,0 +1,405 @@
+#include "AdaptiveStream.hpp"
+
+#include <algorithm>
+#include "MediaConnectionPool.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+AdaptiveStream::AdaptiveStream(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	int aChannel,
+	const Options & aOptions
+):
+	mMainConnection(std::move(aMainConnection)),
+	mPool(std::move(aPool)),
+	mChannel(aChannel),
+	mOptions(aOptions),
+	mProbeInterval(aOptions.mInitialProbeInterval),
+	mIsProbing(false),
+	mIsRunning(false),
+	mCheckTimer(Root::instance().ioContext())
+{
+}
+
+
+
+
+
+std::shared_ptr<AdaptiveStream> AdaptiveStream::create(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	int aChannel,
+	const Options & aOptions
+)
+{
+	return std::shared_ptr<AdaptiveStream>(new AdaptiveStream(std::move(aMainConnection), std::move(aPool), aChannel, aOptions));
+}
+
+
+
+
+
+void AdaptiveStream::start(FrameCallback aOnFrame, StatusCallback aOnStatus)
+{
+	std::shared_ptr<LiveStream> toStart;
+	{
+		LockGuard lg(mMtx);
+		if (mIsRunning)
+		{
+			return aOnStatus(asio::error::already_started);
+		}
+		mIsRunning = true;
+		mOnFrame = std::move(aOnFrame);
+		mOnStatus = std::move(aOnStatus);
+		mActive = LiveStream::create(mMainConnection, mPool, mChannel, LiveStream::StreamType::Main);
+		mActiveSince = SteadyClock::now();
+		mProbeInterval = mOptions.mInitialProbeInterval;
+		mIsProbing = false;
+		toStart = mActive;
+	}
+	startStream(toStart, true);
+}
+
+
+
+
+
+void AdaptiveStream::stop()
+{
+	std::shared_ptr<LiveStream> active, pending;
+	{
+		LockGuard lg(mMtx);
+		mIsRunning = false;
+		mCheckTimer.cancel();
+		std::swap(active, mActive);
+		std::swap(pending, mPending);
+		mOnFrame = nullptr;
+		mOnStatus = nullptr;
+	}
+	if (active != nullptr)
+	{
+		active->stop();
+	}
+	if (pending != nullptr)
+	{
+		pending->stop();
+	}
+}
+
+
+
+
+
+LiveStream::StreamType AdaptiveStream::currentStreamType() const
+{
+	LockGuard lg(mMtx);
+	return (mActive != nullptr) ? mActive->streamType() : LiveStream::StreamType::Main;
+}
+
+
+
+
+
+StreamMeter::Stats AdaptiveStream::stats() const
+{
+	std::shared_ptr<LiveStream> active;
+	{
+		LockGuard lg(mMtx);
+		active = mActive;
+	}
+	if (active == nullptr)
+	{
+		return {0, std::chrono::milliseconds(0), 0, 0};
+	}
+	return active->stats();
+}
+
+
+
+
+
+void AdaptiveStream::startStream(const std::shared_ptr<LiveStream> & aStream, bool aIsInitial)
+{
+	std::weak_ptr<AdaptiveStream> weakSelf = shared_from_this();
+	std::weak_ptr<LiveStream> weakStream = aStream;
+	aStream->monitorFrames(
+		[weakSelf, weakStream](const MediaFrame & aFrame)
+		{
+			auto self = weakSelf.lock();
+			auto stream = weakStream.lock();
+			if ((self != nullptr) && (stream != nullptr))
+			{
+				self->onFrame(stream, aFrame);
+			}
+		}
+	);
+	aStream->start(
+		[weakSelf, weakStream](const std::error_code & aError, BufferSlice aData)
+		{
+			// The frames are delivered through monitorFrames(), only the errors are of interest here
+			auto self = weakSelf.lock();
+			auto stream = weakStream.lock();
+			if ((self != nullptr) && (stream != nullptr) && aError)
+			{
+				self->onStreamError(stream, aError);
+			}
+		},
+		[weakSelf, weakStream, aIsInitial](const std::error_code & aError)
+		{
+			auto self = weakSelf.lock();
+			auto stream = weakStream.lock();
+			if ((self == nullptr) || (stream == nullptr))
+			{
+				return;
+			}
+			if (aError)
+			{
+				return self->onStreamError(stream, aError);
+			}
+			if (aIsInitial)
+			{
+				StatusCallback onStatus;
+				{
+					LockGuard lg(self->mMtx);
+					onStatus = self->mOnStatus;
+				}
+				self->scheduleCheck();
+				if (onStatus)
+				{
+					onStatus({});
+				}
+			}
+		}
+	);
+}
+
+
+
+
+
+void AdaptiveStream::onFrame(const std::shared_ptr<LiveStream> & aStream, const MediaFrame & aFrame)
+{
+	std::shared_ptr<LiveStream> toStop;
+	FrameCallback onFrame;
+	LiveStream::StreamType streamType;
+	{
+		LockGuard lg(mMtx);
+		if (!mIsRunning)
+		{
+			return;
+		}
+		if (aStream == mPending)
+		{
+			if (aFrame.mKind != MediaFrame::Kind::IFrame)
+			{
+				// The new stream takes over only from a keyframe, until then the old one is delivered:
+				return;
+			}
+			toStop = std::move(mActive);
+			mActive = std::move(mPending);
+			mPending.reset();
+			mActiveSince = SteadyClock::now();
+		}
+		else if (aStream != mActive)
+		{
+			// The last frames of a stream already switched away from
+			return;
+		}
+		onFrame = mOnFrame;
+		streamType = aStream->streamType();
+	}
+	if (toStop != nullptr)
+	{
+		toStop->stop();
+	}
+	if (onFrame)
+	{
+		onFrame(streamType, aFrame);
+	}
+}
+
+
+
+
+
+void AdaptiveStream::onStreamError(const std::shared_ptr<LiveStream> & aStream, const std::error_code & aError)
+{
+	std::shared_ptr<LiveStream> active, pending;
+	StatusCallback onStatus;
+	{
+		LockGuard lg(mMtx);
+		if (!mIsRunning)
+		{
+			return;
+		}
+		if (aStream == mPending)
+		{
+			// Keep the current stream; a failed probe counts as a probe that didn't hold:
+			std::swap(pending, mPending);
+			if (mIsProbing)
+			{
+				mIsProbing = false;
+				mProbeInterval = std::min(mProbeInterval * 2, mOptions.mMaxProbeInterval);
+				mActiveSince = SteadyClock::now();
+			}
+		}
+		else if (aStream == mActive)
+		{
+			mIsRunning = false;
+			mCheckTimer.cancel();
+			std::swap(active, mActive);
+			std::swap(pending, mPending);
+			std::swap(onStatus, mOnStatus);
+			mOnFrame = nullptr;
+		}
+		else
+		{
+			// A stream already switched away from
+			return;
+		}
+	}
+	if (active != nullptr)
+	{
+		active->stop();
+	}
+	if (pending != nullptr)
+	{
+		pending->stop();
+	}
+	if (onStatus)
+	{
+		onStatus(aError);
+	}
+}
+
+
+
+
+
+void AdaptiveStream::scheduleCheck()
+{
+	LockGuard lg(mMtx);
+	if (!mIsRunning)
+	{
+		return;
+	}
+	mCheckTimer.expires_after(mOptions.mCheckInterval);
+	mCheckTimer.async_wait(
+		[self = shared_from_this()](const std::error_code & aError)
+		{
+			if (!aError)
+			{
+				self->check();
+			}
+		}
+	);
+}
+
+
+
+
+
+void AdaptiveStream::check()
+{
+	std::shared_ptr<LiveStream> toStart, toStop;
+	{
+		LockGuard lg(mMtx);
+		if (!mIsRunning || (mActive == nullptr))
+		{
+			return;
+		}
+		auto now = SteadyClock::now();
+		if (mPending != nullptr)
+		{
+			// Switching, give up if the new stream doesn't deliver a keyframe in time:
+			if (now - mPendingSince > mOptions.mMinDwell)
+			{
+				std::swap(toStop, mPending);
+				if (mIsProbing)
+				{
+					mIsProbing = false;
+					mProbeInterval = std::min(mProbeInterval * 2, mOptions.mMaxProbeInterval);
+					mActiveSince = now;
+				}
+			}
+		}
+		else
+		{
+			auto stats = mActive->stats();
+			auto activeFor = now - mActiveSince;
+			if (mActive->streamType() == LiveStream::StreamType::Main)
+			{
+				if (mIsProbing && (activeFor >= mOptions.mStableDuration))
+				{
+					// The probed main stream holds, the next fallback starts from the initial probe interval again:
+					mIsProbing = false;
+					mProbeInterval = mOptions.mInitialProbeInterval;
+				}
+				if ((activeFor >= mOptions.mMinDwell) && (stats.mLateness > mOptions.mMaxLateness))
+				{
+					if (mIsProbing)
+					{
+						// The probe failed, back off:
+						mIsProbing = false;
+						mProbeInterval = std::min(mProbeInterval * 2, mOptions.mMaxProbeInterval);
+					}
+					toStart = switchToLocked(LiveStream::StreamType::Extra);
+				}
+			}
+			else
+			{
+				if (
+					(activeFor >= std::max<SteadyClock::duration>(mProbeInterval, mOptions.mMinDwell)) &&
+					(stats.mLateness < mOptions.mMaxLateness / 2)
+				)
+				{
+					mIsProbing = true;
+					toStart = switchToLocked(LiveStream::StreamType::Main);
+				}
+			}
+		}
+	}
+	if (toStop != nullptr)
+	{
+		toStop->stop();
+	}
+	if (toStart != nullptr)
+	{
+		startStream(toStart, false);
+	}
+	scheduleCheck();
+}
+
+
+
+
+
+std::shared_ptr<LiveStream> AdaptiveStream::switchToLocked(LiveStream::StreamType aStreamType)
+{
+	mPending = LiveStream::create(mMainConnection, mPool, mChannel, aStreamType);
+	mPendingSince = SteadyClock::now();
+	return mPending;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
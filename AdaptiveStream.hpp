@@ -0,0 +1,168 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <asio.hpp>
+#include "LiveStream.hpp"
+#include "MediaFrame.hpp"
+#include "StreamMeter.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+class MediaConnectionPool;
+
+
+
+
+
+/** A live stream of a single channel that switches between the main and the extra stream to fit the connection.
+Starts with the main stream. While the main stream's frames fall behind the real-time pace by more than the
+configured lateness (see StreamMeter), after the minimum dwell time, it switches to the extra stream. Since the
+spare capacity of the link can't be measured without loading it, switching back is done by probing: after the probe
+interval on a healthy extra stream, the main stream is tried again; a probe that fails quickly doubles the next
+probe interval, a main stream that holds resets it.
+Each switch is make-before-break: the new stream is started alongside the old one, and the old one is stopped only
+once the new one delivers its first I-frame, so that the consumer sees no gap and always resumes on a keyframe. */
+class AdaptiveStream:
+	public std::enable_shared_from_this<AdaptiveStream>
+{
+public:
+
+	/** The tunables of the controller. */
+	struct Options
+	{
+		/** The lateness over which the main stream is considered not to keep up. */
+		std::chrono::milliseconds mMaxLateness = std::chrono::seconds(2);
+
+		/** The minimum time on a stream before switching away from it. */
+		std::chrono::seconds mMinDwell = std::chrono::seconds(10);
+
+		/** The time on the extra stream before the first probe of the main stream, and the limit of its doubling. */
+		std::chrono::seconds mInitialProbeInterval = std::chrono::seconds(30);
+		std::chrono::seconds mMaxProbeInterval = std::chrono::minutes(10);
+
+		/** A probed main stream that holds this long resets the probe interval. */
+		std::chrono::seconds mStableDuration = std::chrono::seconds(60);
+
+		/** How often the measurements are evaluated. */
+		std::chrono::milliseconds mCheckInterval = std::chrono::seconds(1);
+	};
+
+	/** The callback for the frames, with the stream type they come from. */
+	using FrameCallback = std::function<void(LiveStream::StreamType aStreamType, const MediaFrame & aFrame)>;
+
+	/** The callback called once the stream starts (or fails to start), and later whenever the stream fails. */
+	using StatusCallback = std::function<void(const std::error_code & aError)>;
+
+
+	/** Creates a new adaptive stream for the specified channel; doesn't start it yet. */
+	static std::shared_ptr<AdaptiveStream> create(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		int aChannel,
+		const Options & aOptions
+	);
+
+	/** Starts the stream (the main stream first). */
+	void start(FrameCallback aOnFrame, StatusCallback aOnStatus);
+
+	/** Stops the stream. */
+	void stop();
+
+	/** Returns the type of the stream currently delivered. */
+	LiveStream::StreamType currentStreamType() const;
+
+	/** Returns the measurements of the stream currently delivered. */
+	StreamMeter::Stats stats() const;
+
+
+protected:
+
+	using SteadyClock = std::chrono::steady_clock;
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::shared_ptr<Connection> mMainConnection;
+
+	std::shared_ptr<MediaConnectionPool> mPool;
+
+	const int mChannel;
+
+	const Options mOptions;
+
+	/** The stream whose frames are delivered. */
+	std::shared_ptr<LiveStream> mActive;
+
+	/** The stream being switched to, until it delivers its first I-frame; nullptr if not switching.
+	A pending stream that doesn't deliver an I-frame within mMinDwell is given up. */
+	std::shared_ptr<LiveStream> mPending;
+
+	/** When mActive became active, and when mPending was started. */
+	SteadyClock::time_point mActiveSince;
+	SteadyClock::time_point mPendingSince;
+
+	/** The time on the extra stream before the next probe of the main stream. */
+	std::chrono::seconds mProbeInterval;
+
+	/** True if mActive is the main stream being probed. */
+	bool mIsProbing;
+
+	bool mIsRunning;
+
+	FrameCallback mOnFrame;
+	StatusCallback mOnStatus;
+
+	/** The timer for evaluating the measurements. */
+	asio::steady_timer mCheckTimer;
+
+
+	AdaptiveStream(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		int aChannel,
+		const Options & aOptions
+	);
+
+	/** Starts the specified stream, routing its frames and errors to this object.
+	If aIsInitial is true, a successful start is reported to the status callback and starts the evaluations. */
+	void startStream(const std::shared_ptr<LiveStream> & aStream, bool aIsInitial);
+
+	/** Called for each frame of either the active or the pending stream. */
+	void onFrame(const std::shared_ptr<LiveStream> & aStream, const MediaFrame & aFrame);
+
+	/** Called when either stream fails (or fails to start).
+	A failed pending stream is dropped, keeping the active one; a failed active stream fails the whole stream. */
+	void onStreamError(const std::shared_ptr<LiveStream> & aStream, const std::error_code & aError);
+
+	/** Schedules the next evaluation. */
+	void scheduleCheck();
+
+	/** Evaluates the measurements, switching the streams if needed. */
+	void check();
+
+	/** Starts switching to the specified stream type. Assumes mMtx is locked; returns the stream to be started
+	(with startStream()) once mMtx is unlocked. */
+	std::shared_ptr<LiveStream> switchToLocked(LiveStream::StreamType aStreamType);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,230 @@
+#include "AlarmAggregator.hpp"
+
+#include <algorithm>
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+AlarmAggregator::AlarmAggregator(
+	std::chrono::milliseconds aTickInterval,
+	std::chrono::milliseconds aDefaultDebounce,
+	BatchCallback aOnBatch
+):
+	mTickInterval(std::max(aTickInterval, std::chrono::milliseconds(1))),
+	mDefaultDebounce(aDefaultDebounce),
+	mOnBatch(std::move(aOnBatch)),
+	mTimer(Root::instance().ioContext())
+{
+}
+
+
+
+
+
+std::shared_ptr<AlarmAggregator> AlarmAggregator::create(
+	std::chrono::milliseconds aTickInterval,
+	std::chrono::milliseconds aDefaultDebounce,
+	BatchCallback aOnBatch
+)
+{
+	auto res = std::shared_ptr<AlarmAggregator>(new AlarmAggregator(aTickInterval, aDefaultDebounce, std::move(aOnBatch)));
+	res->scheduleTick();
+	return res;
+}
+
+
+
+
+
+void AlarmAggregator::setDebounce(int aChannel, const std::string & aEventType, std::chrono::milliseconds aDebounce)
+{
+	LockGuard lg(mMtx);
+	mDebounce[std::make_pair(aChannel, aEventType)] = aDebounce;
+}
+
+
+
+
+
+Connection::AlarmCallback AlarmAggregator::input(uint32_t aSourceId)
+{
+	std::weak_ptr<AlarmAggregator> weakSelf = shared_from_this();
+	return [weakSelf, aSourceId](
+		const std::error_code & aError,
+		int aChannel,
+		bool aIsStart,
+		const std::string & aEventType,
+		const nlohmann::json & aWholeJson
+	)
+	{
+		if (aError)
+		{
+			return;
+		}
+		auto self = weakSelf.lock();
+		if (self != nullptr)
+		{
+			self->addAlarm(aSourceId, aChannel, aIsStart, aEventType);
+		}
+	};
+}
+
+
+
+
+
+void AlarmAggregator::addAlarm(uint32_t aSourceId, int aChannel, bool aIsStart, const std::string & aEventType)
+{
+	LockGuard lg(mMtx);
+	auto key = std::make_tuple(aSourceId, aChannel, aEventType);
+	auto itr = mIncidents.find(key);
+	if (aIsStart)
+	{
+		if (itr != mIncidents.end())
+		{
+			// A flap within the debounce window (or a repeated start), merge into the open incident:
+			itr->second.mIsStopPending = false;
+			itr->second.mNumRawMessages += 1;
+			return;
+		}
+		auto now = std::chrono::system_clock::now();
+		mIncidents[key] = Incident{now, now, false, {}, 1};
+		mPendingEvents.push_back(Event{aSourceId, aChannel, aEventType, true, now, {}, 1});
+		return;
+	}
+
+	// A stop message, start the debounce window; stops without an open incident are ignored:
+	if (itr == mIncidents.end())
+	{
+		return;
+	}
+	auto & incident = itr->second;
+	incident.mIsStopPending = true;
+	incident.mEndTime = std::chrono::system_clock::now();
+	incident.mStopDeadline = std::chrono::steady_clock::now() + debounceFor(aChannel, aEventType);
+	incident.mNumRawMessages += 1;
+}
+
+
+
+
+
+void AlarmAggregator::flush()
+{
+	{
+		LockGuard lg(mMtx);
+		endExpiredIncidents(std::chrono::steady_clock::now());
+	}
+	deliverPending();
+}
+
+
+
+
+
+std::chrono::milliseconds AlarmAggregator::debounceFor(int aChannel, const std::string & aEventType) const
+{
+	static const std::string anyEvent;
+	for (const auto & key: {
+		std::make_pair(aChannel, aEventType),
+		std::make_pair(-1, aEventType),
+		std::make_pair(aChannel, anyEvent),
+	})
+	{
+		auto itr = mDebounce.find(key);
+		if (itr != mDebounce.end())
+		{
+			return itr->second;
+		}
+	}
+	return mDefaultDebounce;
+}
+
+
+
+
+
+void AlarmAggregator::endExpiredIncidents(std::chrono::steady_clock::time_point aNow)
+{
+	for (auto itr = mIncidents.begin(); itr != mIncidents.end();)
+	{
+		const auto & incident = itr->second;
+		if (!incident.mIsStopPending || (incident.mStopDeadline > aNow))
+		{
+			++itr;
+			continue;
+		}
+		mPendingEvents.push_back(Event
+		{
+			std::get<0>(itr->first),
+			std::get<1>(itr->first),
+			std::get<2>(itr->first),
+			false,
+			incident.mStartTime,
+			incident.mEndTime,
+			incident.mNumRawMessages,
+		});
+		itr = mIncidents.erase(itr);
+	}
+}
+
+
+
+
+
+void AlarmAggregator::deliverPending()
+{
+	std::vector<Event> events;
+	{
+		LockGuard lg(mMtx);
+		std::swap(events, mPendingEvents);
+	}
+	if (!events.empty() && mOnBatch)
+	{
+		mOnBatch(events);
+	}
+}
+
+
+
+
+
+void AlarmAggregator::scheduleTick()
+{
+	std::weak_ptr<AlarmAggregator> weakSelf = shared_from_this();
+	LockGuard lg(mMtx);
+	mTimer.expires_after(mTickInterval);
+	mTimer.async_wait(
+		[weakSelf](const std::error_code & aError)
+		{
+			auto self = weakSelf.lock();
+			if ((self == nullptr) || aError)
+			{
+				return;
+			}
+			self->flush();
+			self->scheduleTick();
+		}
+	);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <asio.hpp>
+#include "Connection.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Coalesces the raw alarm start / stop messages into incidents and delivers them in batches.
+Devices report some alarms (typically VideoMotion in rain or snow) as rapid start / stop flaps. The aggregator
+keeps an incident open after a stop message for a debounce window; if another start arrives within the window,
+the stop is discarded and the flap is merged into the single incident. Only when the window passes without
+a new start, the incident is reported as ended. The debounce window can be configured per channel and per event type.
+The incident starts and ends are collected and delivered to the callback once per tick, as a single batch.
+Events from multiple recorders can be fed into a single aggregator, distinguished by their source ID.
+Thread-safe. */
+class AlarmAggregator:
+	public std::enable_shared_from_this<AlarmAggregator>
+{
+public:
+
+	/** A single change in an incident's state, as delivered in a batch. */
+	struct Event
+	{
+		/** The ID of the source (recorder) that reported the alarm, as given to input(). */
+		uint32_t mSourceId;
+
+		int mChannel;
+
+		/** The source of the alarm, typically "VideoMotion". */
+		std::string mEventType;
+
+		/** True if the incident has started, false if it has ended. */
+		bool mIsStart;
+
+		/** The time when the first start message of the incident was received. */
+		std::chrono::system_clock::time_point mStartTime;
+
+		/** The time when the last stop message of the incident was received. Only valid if mIsStart is false. */
+		std::chrono::system_clock::time_point mEndTime;
+
+		/** The number of raw start / stop messages merged into the incident so far. */
+		size_t mNumRawMessages;
+	};
+
+	/** The callback receiving the batches of events, called from an ASIO worker thread.
+	Never called with an empty batch. */
+	using BatchCallback = std::function<void(const std::vector<Event> & aEvents)>;
+
+
+	/** Creates a new aggregator that delivers the batches every aTickInterval, using aDefaultDebounce
+	as the debounce window for all channels and event types that don't have a specific one set. */
+	static std::shared_ptr<AlarmAggregator> create(
+		std::chrono::milliseconds aTickInterval,
+		std::chrono::milliseconds aDefaultDebounce,
+		BatchCallback aOnBatch
+	);
+
+	/** Sets the debounce window for the specified channel and event type.
+	aChannel of -1 applies to all channels, empty aEventType applies to all event types. The most specific setting
+	is used: (channel, event type), then (any channel, event type), then (channel, any event type), then the default. */
+	void setDebounce(int aChannel, const std::string & aEventType, std::chrono::milliseconds aDebounce);
+
+	/** Returns an alarm callback that feeds the alarms into this aggregator, tagged with the specified source ID.
+	To be passed to Recorder::monitorAlarms(). Alarms reported with an error are ignored.
+	The callback holds only a weak reference to the aggregator. */
+	Connection::AlarmCallback input(uint32_t aSourceId = 0);
+
+	/** Feeds a single raw alarm message into the aggregator. */
+	void addAlarm(uint32_t aSourceId, int aChannel, bool aIsStart, const std::string & aEventType);
+
+	/** Delivers the pending events immediately, without waiting for the next tick.
+	The incidents still within their debounce window are not ended. */
+	void flush();
+
+
+protected:
+
+	/** Identification of a single incident: source ID, channel, event type. */
+	using Key = std::tuple<uint32_t, int, std::string>;
+
+	/** The state of a single open incident. */
+	struct Incident
+	{
+		std::chrono::system_clock::time_point mStartTime;
+		std::chrono::system_clock::time_point mEndTime;
+
+		/** True if a stop message was received and the debounce window is running. */
+		bool mIsStopPending;
+
+		/** When the debounce window ends, valid only if mIsStopPending is true. */
+		std::chrono::steady_clock::time_point mStopDeadline;
+
+		size_t mNumRawMessages;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	const std::chrono::milliseconds mTickInterval;
+
+	/** The debounce window used if there's no specific one in mDebounce. */
+	const std::chrono::milliseconds mDefaultDebounce;
+
+	BatchCallback mOnBatch;
+
+	/** The specific debounce windows, keyed by (channel, event type); -1 and empty string are the wildcards. */
+	std::map<std::pair<int, std::string>, std::chrono::milliseconds> mDebounce;
+
+	/** The currently open incidents. */
+	std::map<Key, Incident> mIncidents;
+
+	/** The events to be delivered on the next tick. */
+	std::vector<Event> mPendingEvents;
+
+	/** The timer driving the ticks. */
+	asio::steady_timer mTimer;
+
+
+	AlarmAggregator(
+		std::chrono::milliseconds aTickInterval,
+		std::chrono::milliseconds aDefaultDebounce,
+		BatchCallback aOnBatch
+	);
+
+	/** Returns the debounce window for the specified channel and event type.
+	Assumes mMtx is held by the caller. */
+	std::chrono::milliseconds debounceFor(int aChannel, const std::string & aEventType) const;
+
+	/** Ends the incidents whose debounce window has passed, moving them into mPendingEvents.
+	Assumes mMtx is held by the caller. */
+	void endExpiredIncidents(std::chrono::steady_clock::time_point aNow);
+
+	/** Delivers mPendingEvents to the callback. */
+	void deliverPending();
+
+	/** Schedules the next tick. */
+	void scheduleTick();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
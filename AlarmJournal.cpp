@@ -0,0 +1,615 @@
+#include "AlarmJournal.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include "MemoryMappedFile.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+using SystemClock = std::chrono::system_clock;
+
+/** The magic identifying the segment files (and their format version). */
+static const char SEGMENT_MAGIC[8] = {'N', 'S', 'P', 'P', 'A', 'L', 'J', '1'};
+
+/** The size of the segment file header; the records start right after it. */
+static const size_t SEGMENT_HEADER_SIZE = 64;
+
+/** The offsets of the individual fields in the segment file header. */
+static const size_t HEADER_OFS_RECORD_SIZE = 8;
+static const size_t HEADER_OFS_CAPACITY = 12;
+static const size_t HEADER_OFS_NUM_RECORDS = 16;
+
+/** The flag in RawRecord::mFlags for the alarm start events. */
+static const uint8_t RECORD_FLAG_START = 0x01;
+
+
+
+
+
+/** The on-disk format of a single record. */
+struct RawRecord
+{
+	int64_t mTimeMs;
+	int64_t mIncidentStartMs;
+	uint32_t mRecorderId;
+	int16_t mChannel;
+	uint16_t mEventTypeId;
+	uint8_t mFlags;
+	uint8_t mReserved[7];
+};
+
+static_assert(sizeof(RawRecord) == 32, "The journal record layout must not change");
+
+
+
+
+
+/** Returns the number of milliseconds since the epoch for the specified time point. */
+static int64_t toMsec(SystemClock::time_point aTime)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(aTime.time_since_epoch()).count();
+}
+
+
+
+
+
+/** Returns the time point for the specified number of milliseconds since the epoch. */
+static SystemClock::time_point fromMsec(int64_t aMsec)
+{
+	return SystemClock::time_point(std::chrono::duration_cast<SystemClock::duration>(std::chrono::milliseconds(aMsec)));
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AlarmJournal:
+
+const uint32_t AlarmJournal::AnyRecorder;
+const uint32_t AlarmJournal::IndexBlockSize;
+
+
+
+
+
+AlarmJournal::AlarmJournal(const std::string & aDirectory, const Options & aOptions):
+	mDirectory(aDirectory),
+	mOptions(aOptions)
+{
+	mOptions.mRecordsPerSegment = std::max<uint32_t>(mOptions.mRecordsPerSegment, IndexBlockSize);
+}
+
+
+
+
+
+std::shared_ptr<AlarmJournal> AlarmJournal::open(const std::string & aDirectory, const Options & aOptions, std::error_code & aError)
+{
+	std::shared_ptr<AlarmJournal> res(new AlarmJournal(aDirectory, aOptions));
+	aError = res->load();
+	if (aError)
+	{
+		return nullptr;
+	}
+	return res;
+}
+
+
+
+
+
+std::error_code AlarmJournal::append(
+	uint32_t aRecorderId,
+	int aChannel,
+	const std::string & aEventType,
+	bool aIsStart,
+	SystemClock::time_point aTime,
+	SystemClock::time_point aIncidentStartTime
+)
+{
+	LockGuard lg(mMtx);
+
+	// Start a new segment if the current one is full:
+	if (mSegments.back().mNumRecords >= mSegments.back().mCapacity)
+	{
+		Segment segment;
+		auto err = openSegment(mSegments.size(), true, segment);
+		if (err)
+		{
+			return err;
+		}
+		mSegments.push_back(std::move(segment));
+	}
+
+	// Fill in the record:
+	RawRecord rec = {};
+	rec.mTimeMs = toMsec(aTime);
+	rec.mRecorderId = aRecorderId;
+	rec.mChannel = static_cast<int16_t>(aChannel);
+	rec.mEventTypeId = internEventType(aEventType);
+	rec.mFlags = aIsStart ? RECORD_FLAG_START : 0;
+	auto incidentKey = std::make_tuple(aRecorderId, aChannel, rec.mEventTypeId);
+	if (aIsStart)
+	{
+		rec.mIncidentStartMs = rec.mTimeMs;
+		mOpenIncidents[incidentKey] = rec.mTimeMs;
+	}
+	else
+	{
+		rec.mIncidentStartMs = rec.mTimeMs;
+		auto itr = mOpenIncidents.find(incidentKey);
+		if (itr != mOpenIncidents.end())
+		{
+			rec.mIncidentStartMs = itr->second;
+			mOpenIncidents.erase(itr);
+		}
+		if (aIncidentStartTime != SystemClock::time_point())
+		{
+			rec.mIncidentStartMs = toMsec(aIncidentStartTime);
+		}
+	}
+
+	// Write the record first, then publish it by updating the record count in the header:
+	auto & segment = mSegments.back();
+	auto data = segment.mFile->writableData();
+	auto idx = segment.mNumRecords;
+	std::memcpy(data + SEGMENT_HEADER_SIZE + idx * sizeof(RawRecord), &rec, sizeof(rec));
+	segment.mNumRecords = idx + 1;
+	std::memcpy(data + HEADER_OFS_NUM_RECORDS, &segment.mNumRecords, sizeof(segment.mNumRecords));
+
+	indexAppendedRecord(rec.mTimeMs);
+	return {};
+}
+
+
+
+
+
+Connection::AlarmCallback AlarmJournal::input(uint32_t aRecorderId)
+{
+	std::weak_ptr<AlarmJournal> weakSelf = shared_from_this();
+	return [weakSelf, aRecorderId](
+		const std::error_code & aError,
+		int aChannel,
+		bool aIsStart,
+		const std::string & aEventType,
+		const nlohmann::json & aWholeJson
+	)
+	{
+		if (aError)
+		{
+			return;
+		}
+		auto self = weakSelf.lock();
+		if (self != nullptr)
+		{
+			self->append(aRecorderId, aChannel, aEventType, aIsStart, SystemClock::now());
+		}
+	};
+}
+
+
+
+
+
+void AlarmJournal::query(
+	SystemClock::time_point aFrom,
+	SystemClock::time_point aTo,
+	const Filter & aFilter,
+	RecordCallback aCallback
+) const
+{
+	// Take a snapshot of the queried ranges; the records below the snapshotted counts are never modified again:
+	auto fromMs = toMsec(aFrom);
+	auto toMs = toMsec(aTo);
+	std::vector<QueryRange> ranges;
+	{
+		LockGuard lg(mMtx);
+		ranges = queryRangesLocked(fromMs, toMs);
+	}
+
+	for (const auto & range: ranges)
+	{
+		auto records = range.mFile->data() + SEGMENT_HEADER_SIZE;
+		for (size_t i = 0; i < range.mIndex.size(); ++i)
+		{
+			const auto & entry = range.mIndex[i];
+			if ((entry.mMaxTime < fromMs) || (entry.mMinTime > toMs))
+			{
+				continue;
+			}
+			auto first = (range.mFirstBlock + i) * IndexBlockSize;
+			auto last = std::min<size_t>(first + IndexBlockSize, range.mNumRecords);
+			for (auto i = first; i < last; ++i)
+			{
+				RawRecord rec;
+				std::memcpy(&rec, records + i * sizeof(RawRecord), sizeof(rec));
+				if (
+					(rec.mTimeMs < fromMs) || (rec.mTimeMs > toMs) ||
+					((aFilter.mRecorderId != AnyRecorder) && (rec.mRecorderId != aFilter.mRecorderId)) ||
+					((aFilter.mChannel >= 0) && (rec.mChannel != aFilter.mChannel)) ||
+					((aFilter.mEventTypeId >= 0) && (rec.mEventTypeId != aFilter.mEventTypeId))
+				)
+				{
+					continue;
+				}
+				Record res
+				{
+					rec.mRecorderId,
+					rec.mChannel,
+					rec.mEventTypeId,
+					(rec.mFlags & RECORD_FLAG_START) != 0,
+					fromMsec(rec.mTimeMs),
+					fromMsec(rec.mIncidentStartMs),
+				};
+				if (!aCallback(res))
+				{
+					return;
+				}
+			}
+		}
+	}
+}
+
+
+
+
+
+int AlarmJournal::eventTypeId(const std::string & aEventType) const
+{
+	LockGuard lg(mMtx);
+	auto itr = mEventTypeIds.find(aEventType);
+	if (itr == mEventTypeIds.end())
+	{
+		return -1;
+	}
+	return itr->second;
+}
+
+
+
+
+
+std::string AlarmJournal::eventTypeName(uint16_t aEventTypeId) const
+{
+	LockGuard lg(mMtx);
+	if (aEventTypeId >= mEventTypeNames.size())
+	{
+		return {};
+	}
+	return mEventTypeNames[aEventTypeId];
+}
+
+
+
+
+
+std::error_code AlarmJournal::flush()
+{
+	LockGuard lg(mMtx);
+	return mSegments.back().mFile->flush();
+}
+
+
+
+
+
+std::string AlarmJournal::segmentFileName(size_t aSegmentNumber) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/alarms-%06u.journal", static_cast<unsigned>(aSegmentNumber));
+	return mDirectory + name;
+}
+
+
+
+
+
+std::string AlarmJournal::eventTypesFileName() const
+{
+	return mDirectory + "/eventtypes.txt";
+}
+
+
+
+
+
+std::error_code AlarmJournal::load()
+{
+	// Load the event type names:
+	{
+		std::ifstream f(eventTypesFileName());
+		std::string name;
+		while (std::getline(f, name))
+		{
+			mEventTypeIds[name] = static_cast<uint16_t>(mEventTypeNames.size());
+			mEventTypeNames.push_back(name);
+		}
+	}
+
+	// Count the existing segments (they're numbered consecutively from 0):
+	size_t numSegments = 0;
+	while (std::ifstream(segmentFileName(numSegments)).good())
+	{
+		numSegments += 1;
+	}
+
+	// Open all the segments, only the last one writable; create the first segment if there's none:
+	for (size_t i = 0; i < std::max<size_t>(numSegments, 1); ++i)
+	{
+		Segment segment;
+		auto err = openSegment(i, (i + 1 >= numSegments), segment);
+		if (err)
+		{
+			return err;
+		}
+		mSegments.push_back(std::move(segment));
+	}
+	linkIndices();
+	replayIncidents();
+	return {};
+}
+
+
+
+
+
+std::error_code AlarmJournal::openSegment(size_t aSegmentNumber, bool aIsWritable, Segment & aSegment)
+{
+	std::error_code err;
+	auto fileName = segmentFileName(aSegmentNumber);
+	if (aIsWritable)
+	{
+		auto fileSize = SEGMENT_HEADER_SIZE + static_cast<size_t>(mOptions.mRecordsPerSegment) * sizeof(RawRecord);
+		aSegment.mFile = MemoryMappedFile::openWritable(fileName, fileSize, err);
+	}
+	else
+	{
+		aSegment.mFile = MemoryMappedFile::open(fileName, err);
+	}
+	if (err)
+	{
+		return err;
+	}
+	if (aSegment.mFile->size() < SEGMENT_HEADER_SIZE)
+	{
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+
+	// Initialize the header of a new segment:
+	auto data = aSegment.mFile->data();
+	uint32_t recordSize = 0;
+	uint32_t capacity = 0;
+	std::memcpy(&recordSize, data + HEADER_OFS_RECORD_SIZE, sizeof(recordSize));
+	if (aIsWritable && (recordSize == 0))
+	{
+		auto writable = aSegment.mFile->writableData();
+		recordSize = sizeof(RawRecord);
+		capacity = mOptions.mRecordsPerSegment;
+		std::memcpy(writable, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+		std::memcpy(writable + HEADER_OFS_RECORD_SIZE, &recordSize, sizeof(recordSize));
+		std::memcpy(writable + HEADER_OFS_CAPACITY, &capacity, sizeof(capacity));
+	}
+
+	// Validate the header:
+	std::memcpy(&capacity, data + HEADER_OFS_CAPACITY, sizeof(capacity));
+	std::memcpy(&aSegment.mNumRecords, data + HEADER_OFS_NUM_RECORDS, sizeof(aSegment.mNumRecords));
+	if (
+		(std::memcmp(data, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) ||
+		(recordSize != sizeof(RawRecord)) ||
+		(aSegment.mNumRecords > capacity) ||
+		(SEGMENT_HEADER_SIZE + static_cast<size_t>(capacity) * sizeof(RawRecord) > aSegment.mFile->size())
+	)
+	{
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+	aSegment.mCapacity = capacity;
+
+	// Rebuild the sparse time index:
+	aSegment.mIndex.clear();
+	auto records = data + SEGMENT_HEADER_SIZE;
+	for (uint32_t i = 0; i < aSegment.mNumRecords; ++i)
+	{
+		int64_t timeMs;
+		std::memcpy(&timeMs, records + i * sizeof(RawRecord) + offsetof(RawRecord, mTimeMs), sizeof(timeMs));
+		if (i % IndexBlockSize == 0)
+		{
+			aSegment.mIndex.push_back({timeMs, timeMs, timeMs, timeMs});
+		}
+		else
+		{
+			auto & entry = aSegment.mIndex.back();
+			entry.mMinTime = std::min(entry.mMinTime, timeMs);
+			entry.mMaxTime = std::max(entry.mMaxTime, timeMs);
+		}
+	}
+	return {};
+}
+
+
+
+
+
+void AlarmJournal::linkIndices()
+{
+	auto maxSoFar = std::numeric_limits<int64_t>::min();
+	for (auto & segment: mSegments)
+	{
+		for (auto & entry: segment.mIndex)
+		{
+			maxSoFar = std::max(maxSoFar, entry.mMaxTime);
+			entry.mMaxTimeSoFar = maxSoFar;
+		}
+	}
+	auto minAfter = std::numeric_limits<int64_t>::max();
+	for (auto segment = mSegments.rbegin(); segment != mSegments.rend(); ++segment)
+	{
+		for (auto entry = segment->mIndex.rbegin(); entry != segment->mIndex.rend(); ++entry)
+		{
+			minAfter = std::min(minAfter, entry->mMinTime);
+			entry->mMinTimeAfter = minAfter;
+		}
+	}
+}
+
+
+
+
+
+void AlarmJournal::replayIncidents()
+{
+	mOpenIncidents.clear();
+	for (const auto & segment: mSegments)
+	{
+		auto records = segment.mFile->data() + SEGMENT_HEADER_SIZE;
+		for (uint32_t i = 0; i < segment.mNumRecords; ++i)
+		{
+			RawRecord rec;
+			std::memcpy(&rec, records + i * sizeof(RawRecord), sizeof(rec));
+			auto incidentKey = std::make_tuple(rec.mRecorderId, static_cast<int>(rec.mChannel), rec.mEventTypeId);
+			if ((rec.mFlags & RECORD_FLAG_START) != 0)
+			{
+				mOpenIncidents[incidentKey] = rec.mTimeMs;
+			}
+			else
+			{
+				mOpenIncidents.erase(incidentKey);
+			}
+		}
+	}
+}
+
+
+
+
+
+void AlarmJournal::indexAppendedRecord(int64_t aTimeMs)
+{
+	auto & segment = mSegments.back();
+	auto block = (segment.mNumRecords - 1) / IndexBlockSize;
+	if (block >= segment.mIndex.size())
+	{
+		// Start a new block, continuing the running maximum from the previous block, possibly in the previous segment:
+		auto maxSoFar = aTimeMs;
+		for (auto prev = mSegments.rbegin(); prev != mSegments.rend(); ++prev)
+		{
+			if (!prev->mIndex.empty())
+			{
+				maxSoFar = std::max(maxSoFar, prev->mIndex.back().mMaxTimeSoFar);
+				break;
+			}
+		}
+		segment.mIndex.push_back({aTimeMs, aTimeMs, maxSoFar, aTimeMs});
+	}
+	else
+	{
+		auto & entry = segment.mIndex[block];
+		entry.mMinTime = std::min(entry.mMinTime, aTimeMs);
+		entry.mMaxTime = std::max(entry.mMaxTime, aTimeMs);
+		entry.mMaxTimeSoFar = std::max(entry.mMaxTimeSoFar, aTimeMs);
+	}
+
+	// Lower the minimum of the earlier blocks' suffixes; this stops right away for the records appended in time order:
+	for (auto seg = mSegments.rbegin(); seg != mSegments.rend(); ++seg)
+	{
+		for (auto entry = seg->mIndex.rbegin(); entry != seg->mIndex.rend(); ++entry)
+		{
+			if (entry->mMinTimeAfter <= aTimeMs)
+			{
+				return;
+			}
+			entry->mMinTimeAfter = aTimeMs;
+		}
+	}
+}
+
+
+
+
+
+std::vector<AlarmJournal::QueryRange> AlarmJournal::queryRangesLocked(int64_t aFromMs, int64_t aToMs) const
+{
+	// The segments before the first one that reaches aFromMs, and from the first one that starts past aToMs on,
+	// hold no records in the range (only the last segment may have an empty index, it sorts last in both searches):
+	auto firstSegment = std::partition_point(mSegments.begin(), mSegments.end(),
+		[aFromMs](const Segment & aSegment)
+		{
+			return (!aSegment.mIndex.empty() && (aSegment.mIndex.back().mMaxTimeSoFar < aFromMs));
+		}
+	);
+	auto endSegment = std::partition_point(firstSegment, mSegments.end(),
+		[aToMs](const Segment & aSegment)
+		{
+			return (!aSegment.mIndex.empty() && (aSegment.mIndex.front().mMinTimeAfter <= aToMs));
+		}
+	);
+
+	std::vector<QueryRange> res;
+	for (auto segment = firstSegment; segment != endSegment; ++segment)
+	{
+		const auto & index = segment->mIndex;
+		auto firstBlock = std::partition_point(index.begin(), index.end(),
+			[aFromMs](const IndexEntry & aEntry)
+			{
+				return (aEntry.mMaxTimeSoFar < aFromMs);
+			}
+		);
+		auto endBlock = std::partition_point(firstBlock, index.end(),
+			[aToMs](const IndexEntry & aEntry)
+			{
+				return (aEntry.mMinTimeAfter <= aToMs);
+			}
+		);
+		if (firstBlock == endBlock)
+		{
+			continue;
+		}
+		res.push_back({
+			segment->mFile,
+			segment->mNumRecords,
+			static_cast<size_t>(firstBlock - index.begin()),
+			std::vector<IndexEntry>(firstBlock, endBlock)
+		});
+	}
+	return res;
+}
+
+
+
+
+
+uint16_t AlarmJournal::internEventType(const std::string & aEventType)
+{
+	auto itr = mEventTypeIds.find(aEventType);
+	if (itr != mEventTypeIds.end())
+	{
+		return itr->second;
+	}
+	auto id = static_cast<uint16_t>(mEventTypeNames.size());
+	mEventTypeIds[aEventType] = id;
+	mEventTypeNames.push_back(aEventType);
+	std::ofstream(eventTypesFileName(), std::ios::app) << aEventType << '\n';
+	return id;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
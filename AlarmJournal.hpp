@@ -0,0 +1,245 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+#include "Connection.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class MemoryMappedFile;
+
+
+
+
+
+/** An embedded append-only journal of alarm events.
+The events are stored as fixed-size binary records in memory-mapped segment files (in the host byte order) within
+a single directory; the event type strings are interned into small integer IDs, persisted in a text file alongside.
+Each segment keeps a sparse time index (the time range of each block of records) in memory, rebuilt when the
+journal is opened, so that range queries binary-search the blocks that may overlap the queried time range, and only
+touch those. The incidents left open by the journaled records are restored when the journal is opened as well.
+Thread-safe; appends are serialized, queries run concurrently with the appends. */
+class AlarmJournal:
+	public std::enable_shared_from_this<AlarmJournal>
+{
+public:
+
+	/** A single journaled alarm event. */
+	struct Record
+	{
+		/** The ID of the recorder that reported the alarm, as given to append() / input(). */
+		uint32_t mRecorderId;
+
+		int mChannel;
+
+		/** The interned ID of the event type, see eventTypeName(). */
+		uint16_t mEventTypeId;
+
+		/** True for an alarm start, false for an alarm stop. */
+		bool mIsStart;
+
+		/** The time of the event. */
+		std::chrono::system_clock::time_point mTime;
+
+		/** The time of the start of the incident to which the event belongs; equal to mTime for the start events.
+		Equal to mTime for stop events without a journaled start. */
+		std::chrono::system_clock::time_point mIncidentStartTime;
+	};
+
+	/** The criteria for the records returned from a query, in addition to the time range. */
+	struct Filter
+	{
+		/** Only the records from this recorder; AnyRecorder for all. */
+		uint32_t mRecorderId = AnyRecorder;
+
+		/** Only the records of this channel; -1 for all. */
+		int mChannel = -1;
+
+		/** Only the records of this event type; -1 for all. */
+		int mEventTypeId = -1;
+	};
+
+	/** The callback called for each record found by a query.
+	Return false to stop the query early. */
+	using RecordCallback = std::function<bool(const Record & aRecord)>;
+
+	/** The tunables of the journal. */
+	struct Options
+	{
+		/** The number of records in a single segment file. */
+		uint32_t mRecordsPerSegment = 64 * 1024;
+	};
+
+	/** The recorder ID in Filter that matches all the recorders. */
+	static const uint32_t AnyRecorder = 0xffffffff;
+
+	/** The number of records per one entry of the sparse time index. */
+	static const uint32_t IndexBlockSize = 256;
+
+
+	/** Opens the journal in the specified (existing) directory, creating the journal files if needed.
+	Returns nullptr and sets aError on failure. */
+	static std::shared_ptr<AlarmJournal> open(const std::string & aDirectory, const Options & aOptions, std::error_code & aError);
+
+	/** Appends a single event to the journal.
+	aIncidentStartTime is the start of the incident for the stop events; the default (epoch) uses the time of the
+	last journaled start of the same recorder, channel and event type. */
+	std::error_code append(
+		uint32_t aRecorderId,
+		int aChannel,
+		const std::string & aEventType,
+		bool aIsStart,
+		std::chrono::system_clock::time_point aTime,
+		std::chrono::system_clock::time_point aIncidentStartTime = std::chrono::system_clock::time_point()
+	);
+
+	/** Returns an alarm callback that journals the alarms as coming from the specified recorder ID.
+	To be passed to Recorder::monitorAlarms(). Alarms reported with an error are ignored.
+	The callback holds only a weak reference to the journal. */
+	Connection::AlarmCallback input(uint32_t aRecorderId);
+
+	/** Calls the callback for all the records within the [aFrom, aTo] time range that match the filter,
+	in the order in which they were appended. The callback is called synchronously, without any lock held. */
+	void query(
+		std::chrono::system_clock::time_point aFrom,
+		std::chrono::system_clock::time_point aTo,
+		const Filter & aFilter,
+		RecordCallback aCallback
+	) const;
+
+	/** Returns the ID of the specified event type, or -1 if no such event type was ever journaled. */
+	int eventTypeId(const std::string & aEventType) const;
+
+	/** Returns the name of the event type with the specified ID, or an empty string if the ID is not valid. */
+	std::string eventTypeName(uint16_t aEventTypeId) const;
+
+	/** Schedules the modified segment data to be written to the disk (see MemoryMappedFile::flush()). */
+	std::error_code flush();
+
+
+protected:
+
+	/** The time range of a single block of records, in milliseconds since the epoch. */
+	struct IndexEntry
+	{
+		int64_t mMinTime;
+		int64_t mMaxTime;
+
+		/** The maximum time of this block and all the blocks before it (in all the segments); never decreasing, so
+		that the first block to query can be binary-searched even if the records weren't appended in time order. */
+		int64_t mMaxTimeSoFar;
+
+		/** The minimum time of this block and all the blocks after it (in all the segments); never decreasing, so
+		that the block past the last one to query can be binary-searched. */
+		int64_t mMinTimeAfter;
+	};
+
+	/** The part of a segment that a query scans, as taken under the lock. */
+	struct QueryRange
+	{
+		std::shared_ptr<MemoryMappedFile> mFile;
+
+		/** The number of the segment's records published at the time of the query. */
+		uint32_t mNumRecords;
+
+		/** The number of the first block to scan. */
+		size_t mFirstBlock;
+
+		/** The index entries of the blocks to scan, starting at mFirstBlock. */
+		std::vector<IndexEntry> mIndex;
+	};
+
+	/** A single segment file. */
+	struct Segment
+	{
+		std::shared_ptr<MemoryMappedFile> mFile;
+
+		/** The number of records written into the segment. */
+		uint32_t mNumRecords;
+
+		/** The maximum number of records in the segment (as stored in its header). */
+		uint32_t mCapacity;
+
+		/** The sparse time index, one entry per IndexBlockSize records. */
+		std::vector<IndexEntry> mIndex;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	/** The directory where the journal files are stored. */
+	std::string mDirectory;
+
+	Options mOptions;
+
+	/** All the segments, oldest first. Only the last one is mapped writable when opening the journal. */
+	std::vector<Segment> mSegments;
+
+	/** The interned event type names, indexed by their ID. */
+	std::vector<std::string> mEventTypeNames;
+
+	/** Map of event type name -> ID. */
+	std::map<std::string, uint16_t> mEventTypeIds;
+
+	/** The start times of the open incidents, for filling in the stop records.
+	Keyed by (recorder ID, channel, event type ID). */
+	std::map<std::tuple<uint32_t, int, uint16_t>, int64_t> mOpenIncidents;
+
+
+	AlarmJournal(const std::string & aDirectory, const Options & aOptions);
+
+	/** Returns the file name of the segment with the specified number. */
+	std::string segmentFileName(size_t aSegmentNumber) const;
+
+	/** Returns the file name of the event type names file. */
+	std::string eventTypesFileName() const;
+
+	/** Opens the existing segments and loads the event type names. */
+	std::error_code load();
+
+	/** Opens (or creates) the segment with the specified number, validates its header and builds its time index.
+	The index entries' mMaxTimeSoFar and mMinTimeAfter only cover the segment itself, see linkIndices(). */
+	std::error_code openSegment(size_t aSegmentNumber, bool aIsWritable, Segment & aSegment);
+
+	/** Fills in the mMaxTimeSoFar and mMinTimeAfter of all the index entries across all the loaded segments. */
+	void linkIndices();
+
+	/** Restores mOpenIncidents by replaying all the journaled records, in the order in which they were appended. */
+	void replayIncidents();
+
+	/** Adds the record just appended to the last segment, with the specified time, to the time index.
+	Assumes mMtx is held by the caller. */
+	void indexAppendedRecord(int64_t aTimeMs);
+
+	/** Returns the parts of the segments that may contain the records within the [aFromMs, aToMs] time range.
+	Assumes mMtx is held by the caller. */
+	std::vector<QueryRange> queryRangesLocked(int64_t aFromMs, int64_t aToMs) const;
+
+	/** Returns the ID for the specified event type, interning (and persisting) it if it's new.
+	Assumes mMtx is held by the caller. */
+	uint16_t internEventType(const std::string & aEventType);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
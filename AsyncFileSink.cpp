@@ -0,0 +1,1035 @@
+#include "AsyncFileSink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+#ifdef _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+	#include <malloc.h>
+	#include <sys/stat.h>
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#ifdef NETSURVEILLANCEPP_HAS_IO_URING
+	#include <liburing.h>
+#endif
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+const size_t DiskIo::Alignment;
+const size_t DiskIo::BuffersPerSink;
+
+/** The single instance of DiskIo, created on the first use. */
+static std::mutex gDiskIoMtx;
+static std::unique_ptr<DiskIo> gDiskIo;
+
+
+
+
+
+static char * alignedAlloc(size_t aSize)
+{
+	#ifdef _WIN32
+		return static_cast<char *>(_aligned_malloc(aSize, DiskIo::Alignment));
+	#else
+		void * res = nullptr;
+		if (posix_memalign(&res, DiskIo::Alignment, aSize) != 0)
+		{
+			return nullptr;
+		}
+		return static_cast<char *>(res);
+	#endif
+}
+
+
+
+
+
+static void alignedFree(char * aData)
+{
+	#ifdef _WIN32
+		_aligned_free(aData);
+	#else
+		free(aData);
+	#endif
+}
+
+
+
+
+
+static void closeFile(int aFile)
+{
+	#ifdef _WIN32
+		_close(aFile);
+	#else
+		::close(aFile);
+	#endif
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DiskIo::Backend:
+
+/** The interface of the backends doing the actual writes. */
+class DiskIo::Backend
+{
+public:
+
+	/** Waits for the submitted writes to finish. */
+	virtual ~Backend() {}
+
+	/** Starts the write; calls the request's callback once done. */
+	virtual void submit(std::unique_ptr<Request> aRequest) = 0;
+
+	virtual const char * name() const = 0;
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DiskIo::ThreadBackend:
+
+/** The portable backend: a few threads doing the blocking positioned writes. */
+class DiskIo::ThreadBackend:
+	public DiskIo::Backend
+{
+public:
+
+	explicit ThreadBackend(size_t aNumThreads):
+		mShouldStop(false)
+	{
+		for (size_t i = 0; i < std::max<size_t>(aNumThreads, 1); ++i)
+		{
+			mThreads.emplace_back([this](){ run(); });
+		}
+	}
+
+
+	~ThreadBackend() override
+	{
+		{
+			LockGuard lg(mMtx);
+			mShouldStop = true;
+		}
+		mCV.notify_all();
+		for (auto & thr: mThreads)
+		{
+			thr.join();
+		}
+	}
+
+
+	void submit(std::unique_ptr<Request> aRequest) override
+	{
+		{
+			LockGuard lg(mMtx);
+			mQueue.push_back(std::move(aRequest));
+		}
+		mCV.notify_one();
+	}
+
+
+	const char * name() const override { return "threads"; }
+
+
+protected:
+
+	/** The mutex protecting mQueue and mShouldStop against multithreaded access. */
+	std::mutex mMtx;
+
+	/** Signalled when a request is queued, or the threads are to stop. */
+	std::condition_variable mCV;
+
+	/** The requests waiting for a thread. */
+	std::deque<std::unique_ptr<Request>> mQueue;
+
+	/** Set when the threads are to stop, once the queue is empty. */
+	bool mShouldStop;
+
+	std::vector<std::thread> mThreads;
+
+
+	/** The thread procedure: writes the queued requests until stopped. */
+	void run()
+	{
+		for (;;)
+		{
+			std::unique_ptr<Request> req;
+			{
+				std::unique_lock<std::mutex> lock(mMtx);
+				mCV.wait(lock, [this](){ return (mShouldStop || !mQueue.empty()); });
+				if (mQueue.empty())
+				{
+					return;
+				}
+				req = std::move(mQueue.front());
+				mQueue.pop_front();
+			}
+			auto err = DiskIo::writeAll(*req);
+			req->mOnWritten(err);
+		}
+	}
+};
+
+
+
+
+
+#ifdef NETSURVEILLANCEPP_HAS_IO_URING
+
+////////////////////////////////////////////////////////////////////////////////
+// DiskIo::IoUringBackend:
+
+/** The Linux backend: the writes are submitted to an io_uring, a single thread reaps the completions.
+The pool buffers are registered with the ring, if the memlock limit allows it. */
+class DiskIo::IoUringBackend:
+	public DiskIo::Backend
+{
+public:
+
+	/** Creates the backend for the specified fixed pool buffers (registered with the ring, if possible), sized for
+	aMaxNumBuffers writes in flight; returns nullptr if io_uring is not available. */
+	static std::unique_ptr<Backend> create(const std::vector<char *> & aBuffers, size_t aBufferSize, size_t aMaxNumBuffers)
+	{
+		std::unique_ptr<IoUringBackend> res(new IoUringBackend);
+
+		// A single entry per buffer (the writes in flight) and one for the wake-up on shutdown:
+		if (io_uring_queue_init(static_cast<unsigned>(std::max(aMaxNumBuffers, aBuffers.size()) + 1), &res->mRing, 0) < 0)
+		{
+			return nullptr;
+		}
+		res->mNumFixedBuffers = aBuffers.size();
+		res->mIsRingValid = true;
+		std::vector<iovec> iovs;
+		for (auto buf: aBuffers)
+		{
+			iovs.push_back({buf, aBufferSize});
+		}
+		res->mHasFixedBuffers = (io_uring_register_buffers(&res->mRing, iovs.data(), static_cast<unsigned>(iovs.size())) == 0);
+		auto backend = res.get();
+		res->mCompletionThread = std::thread([backend](){ backend->run(); });
+		return std::unique_ptr<Backend>(res.release());
+	}
+
+
+	~IoUringBackend() override
+	{
+		if (mCompletionThread.joinable())
+		{
+			{
+				LockGuard lg(mMtx);
+				mShouldStop = true;
+			}
+
+			// Wake the completion thread up with a NOP; if the submission queue is full, flush it and retry (the
+			// completion thread keeps reaping meanwhile), the thread must not be left blocked in io_uring_wait_cqe():
+			for (;;)
+			{
+				{
+					LockGuard lg(mMtx);
+					auto sqe = io_uring_get_sqe(&mRing);
+					if (sqe == nullptr)
+					{
+						io_uring_submit(&mRing);
+						sqe = io_uring_get_sqe(&mRing);
+					}
+					if (sqe != nullptr)
+					{
+						io_uring_prep_nop(sqe);
+						io_uring_sqe_set_data(sqe, nullptr);
+						io_uring_submit(&mRing);
+						break;
+					}
+				}
+				std::this_thread::yield();
+			}
+			mCompletionThread.join();
+		}
+		if (mIsRingValid)
+		{
+			io_uring_queue_exit(&mRing);
+		}
+	}
+
+
+	void submit(std::unique_ptr<Request> aRequest) override
+	{
+		LockGuard lg(mMtx);
+		mNumInFlight += 1;
+		auto req = aRequest.release();
+		if (!queueLocked(req))
+		{
+			mOverflow.push_back(req);
+		}
+	}
+
+
+	const char * name() const override { return "io_uring"; }
+
+
+protected:
+
+	/** The mutex protecting the submission side of mRing and the other members against multithreaded access.
+	The completion side is only used by mCompletionThread. */
+	std::mutex mMtx;
+
+	io_uring mRing;
+
+	bool mIsRingValid;
+
+	/** True if the fixed pool buffers are registered with the ring. */
+	bool mHasFixedBuffers;
+
+	/** The number of the fixed pool buffers (indices 0 .. mNumFixedBuffers - 1); the buffers the pool grows by later,
+	and the data outside the pool, are not registered. */
+	size_t mNumFixedBuffers;
+
+	/** The number of requests submitted and not yet completed. */
+	size_t mNumInFlight;
+
+	/** The requests that didn't fit into the submission queue, to be submitted after the next completion. */
+	std::deque<Request *> mOverflow;
+
+	/** Set when the completion thread is to stop, once there are no requests in flight. */
+	bool mShouldStop;
+
+	std::thread mCompletionThread;
+
+
+	IoUringBackend():
+		mIsRingValid(false),
+		mHasFixedBuffers(false),
+		mNumFixedBuffers(0),
+		mNumInFlight(0),
+		mShouldStop(false)
+	{
+	}
+
+
+	/** Puts the request into the submission queue and submits it.
+	Returns false if the queue is full. Assumes mMtx is locked. */
+	bool queueLocked(Request * aRequest)
+	{
+		auto sqe = io_uring_get_sqe(&mRing);
+		if (sqe == nullptr)
+		{
+			return false;
+		}
+		auto size = static_cast<unsigned>(aRequest->mSize);
+		if (
+			mHasFixedBuffers &&
+			(aRequest->mBufferIndex >= 0) &&
+			(static_cast<size_t>(aRequest->mBufferIndex) < mNumFixedBuffers)
+		)
+		{
+			io_uring_prep_write_fixed(sqe, aRequest->mFile, aRequest->mData, size, aRequest->mOffset, aRequest->mBufferIndex);
+		}
+		else
+		{
+			io_uring_prep_write(sqe, aRequest->mFile, aRequest->mData, size, aRequest->mOffset);
+		}
+		io_uring_sqe_set_data(sqe, aRequest);
+		io_uring_submit(&mRing);
+		return true;
+	}
+
+
+	/** Re-submits the remainder of a request. */
+	void resubmit(Request * aRequest)
+	{
+		LockGuard lg(mMtx);
+		if (!queueLocked(aRequest))
+		{
+			mOverflow.push_back(aRequest);
+		}
+	}
+
+
+	/** The completion thread procedure: reaps the completions until stopped. */
+	void run()
+	{
+		for (;;)
+		{
+			io_uring_cqe * cqe = nullptr;
+			auto ret = io_uring_wait_cqe(&mRing, &cqe);
+			if (ret < 0)
+			{
+				if ((ret == -EINTR) || (ret == -EAGAIN))
+				{
+					continue;
+				}
+				return;
+			}
+			auto req = static_cast<Request *>(io_uring_cqe_get_data(cqe));
+			auto res = cqe->res;
+			io_uring_cqe_seen(&mRing, cqe);
+			if (req == nullptr)
+			{
+				// The shutdown wake-up
+				LockGuard lg(mMtx);
+				if (mShouldStop && (mNumInFlight == 0))
+				{
+					return;
+				}
+				continue;
+			}
+
+			// Retry the interrupted and short writes:
+			if ((res == -EINTR) || (res == -EAGAIN))
+			{
+				resubmit(req);
+				continue;
+			}
+			std::error_code err;
+			if (res < 0)
+			{
+				err = std::error_code(-res, std::generic_category());
+			}
+			else if (res == 0)
+			{
+				err = std::make_error_code(std::errc::io_error);
+			}
+			else if (static_cast<size_t>(res) < req->mSize)
+			{
+				req->mData += res;
+				req->mSize -= static_cast<size_t>(res);
+				req->mOffset += static_cast<uint64_t>(res);
+				resubmit(req);
+				continue;
+			}
+			std::unique_ptr<Request> done(req);
+			done->mOnWritten(err);
+
+			LockGuard lg(mMtx);
+			mNumInFlight -= 1;
+			while (!mOverflow.empty() && queueLocked(mOverflow.front()))
+			{
+				mOverflow.pop_front();
+			}
+			if (mShouldStop && (mNumInFlight == 0))
+			{
+				return;
+			}
+		}
+	}
+};
+
+#endif  // NETSURVEILLANCEPP_HAS_IO_URING
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DiskIo:
+
+DiskIo::DiskIo(const Options & aOptions):
+	mBufferSize((std::max<size_t>(aOptions.mBufferSize, 1) + Alignment - 1) / Alignment * Alignment),
+	mNumFixedBuffers(0),
+	mBuffers(std::max(aOptions.mMaxNumBuffers, aOptions.mNumBuffers), nullptr),
+	mNumAllocated(0),
+	mNumOpenSinks(0)
+{
+	for (size_t i = 0; i < aOptions.mNumBuffers; ++i)
+	{
+		auto buf = alignedAlloc(mBufferSize);
+		if (buf == nullptr)
+		{
+			break;
+		}
+		mFreeBuffers.push_back(static_cast<int>(i));
+		mBuffers[i] = buf;
+		mNumFixedBuffers += 1;
+	}
+	mNumAllocated = mNumFixedBuffers;
+	for (auto i = mBuffers.size(); i > mNumFixedBuffers; --i)
+	{
+		mEmptySlots.push_back(static_cast<int>(i - 1));
+	}
+	#ifdef NETSURVEILLANCEPP_HAS_IO_URING
+		if (aOptions.mShouldUseIoUring)
+		{
+			std::vector<char *> fixedBuffers(mBuffers.begin(), mBuffers.begin() + static_cast<std::ptrdiff_t>(mNumFixedBuffers));
+			mBackend = IoUringBackend::create(fixedBuffers, mBufferSize, mBuffers.size());
+		}
+	#endif
+	if (mBackend == nullptr)
+	{
+		mBackend.reset(new ThreadBackend(aOptions.mNumThreads));
+	}
+}
+
+
+
+
+
+DiskIo::~DiskIo()
+{
+	mBackend.reset();
+	for (auto buf: mBuffers)
+	{
+		if (buf != nullptr)
+		{
+			alignedFree(buf);
+		}
+	}
+}
+
+
+
+
+
+bool DiskIo::init(const Options & aOptions)
+{
+	LockGuard lg(gDiskIoMtx);
+	if (gDiskIo != nullptr)
+	{
+		return false;
+	}
+	gDiskIo.reset(new DiskIo(aOptions));
+	return true;
+}
+
+
+
+
+
+DiskIo & DiskIo::instance()
+{
+	LockGuard lg(gDiskIoMtx);
+	if (gDiskIo == nullptr)
+	{
+		gDiskIo.reset(new DiskIo(Options()));
+	}
+	return *gDiskIo;
+}
+
+
+
+
+
+int DiskIo::allocateBuffer()
+{
+	LockGuard lg(mMtx);
+	if (!mFreeBuffers.empty())
+	{
+		auto res = mFreeBuffers.back();
+		mFreeBuffers.pop_back();
+		return res;
+	}
+
+	// Grow the pool, if the open sinks need more buffers:
+	if (mEmptySlots.empty() || (mNumAllocated >= targetNumBuffersLocked()))
+	{
+		return -1;
+	}
+	auto buf = alignedAlloc(mBufferSize);
+	if (buf == nullptr)
+	{
+		return -1;
+	}
+	auto res = mEmptySlots.back();
+	mEmptySlots.pop_back();
+	mBuffers[static_cast<size_t>(res)] = buf;
+	mNumAllocated += 1;
+	return res;
+}
+
+
+
+
+
+void DiskIo::releaseBuffer(int aBufferIndex)
+{
+	LockGuard lg(mMtx);
+	auto idx = static_cast<size_t>(aBufferIndex);
+	if ((idx >= mNumFixedBuffers) && (mNumAllocated > targetNumBuffersLocked()))
+	{
+		// The pool has shrunk since (the sinks were closed), free the surplus buffer:
+		alignedFree(mBuffers[idx]);
+		mBuffers[idx] = nullptr;
+		mEmptySlots.push_back(aBufferIndex);
+		mNumAllocated -= 1;
+		return;
+	}
+	mFreeBuffers.push_back(aBufferIndex);
+}
+
+
+
+
+
+void DiskIo::addSink()
+{
+	LockGuard lg(mMtx);
+	mNumOpenSinks += 1;
+}
+
+
+
+
+
+void DiskIo::removeSink()
+{
+	LockGuard lg(mMtx);
+	if (mNumOpenSinks > 0)
+	{
+		mNumOpenSinks -= 1;
+	}
+
+	// Free the surplus unused buffers; those in use are freed once released:
+	auto target = targetNumBuffersLocked();
+	for (size_t i = mFreeBuffers.size(); (i > 0) && (mNumAllocated > target); --i)
+	{
+		auto idx = static_cast<size_t>(mFreeBuffers[i - 1]);
+		if (idx < mNumFixedBuffers)
+		{
+			continue;
+		}
+		alignedFree(mBuffers[idx]);
+		mBuffers[idx] = nullptr;
+		mEmptySlots.push_back(mFreeBuffers[i - 1]);
+		mFreeBuffers.erase(mFreeBuffers.begin() + static_cast<std::ptrdiff_t>(i - 1));
+		mNumAllocated -= 1;
+	}
+}
+
+
+
+
+
+size_t DiskIo::targetNumBuffersLocked() const
+{
+	return std::max(mNumFixedBuffers, std::min(mBuffers.size(), mNumOpenSinks * BuffersPerSink));
+}
+
+
+
+
+
+void DiskIo::write(int aFile, int aBufferIndex, size_t aSize, uint64_t aOffset, WriteCallback aOnWritten)
+{
+	std::unique_ptr<Request> req(new Request{aFile, aBufferIndex, bufferData(aBufferIndex), aSize, aOffset, std::move(aOnWritten)});
+	mBackend->submit(std::move(req));
+}
+
+
+
+
+
+void DiskIo::writeData(int aFile, const char * aData, size_t aSize, uint64_t aOffset, WriteCallback aOnWritten)
+{
+	std::unique_ptr<Request> req(new Request{aFile, -1, aData, aSize, aOffset, std::move(aOnWritten)});
+	mBackend->submit(std::move(req));
+}
+
+
+
+
+
+const char * DiskIo::backendName() const
+{
+	return mBackend->name();
+}
+
+
+
+
+
+std::error_code DiskIo::writeAll(const Request & aRequest)
+{
+	auto data = aRequest.mData;
+	auto size = aRequest.mSize;
+	auto offset = aRequest.mOffset;
+	while (size > 0)
+	{
+		#ifdef _WIN32
+			// A synchronous positioned write, the file position is not used:
+			OVERLAPPED ov = {};
+			ov.Offset = static_cast<DWORD>(offset & 0xffffffff);
+			ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+			DWORD numWritten = 0;
+			auto toWrite = static_cast<DWORD>(std::min<size_t>(size, 0x40000000));
+			if (!WriteFile(reinterpret_cast<HANDLE>(_get_osfhandle(aRequest.mFile)), data, toWrite, &numWritten, &ov))
+			{
+				return std::error_code(static_cast<int>(GetLastError()), std::system_category());
+			}
+		#else
+			auto numWritten = ::pwrite(aRequest.mFile, data, size, static_cast<off_t>(offset));
+			if (numWritten < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return std::error_code(errno, std::generic_category());
+			}
+		#endif
+		if (numWritten == 0)
+		{
+			return std::make_error_code(std::errc::io_error);
+		}
+		data += numWritten;
+		size -= static_cast<size_t>(numWritten);
+		offset += static_cast<uint64_t>(numWritten);
+	}
+	return {};
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AsyncFileSink:
+
+AsyncFileSink::AsyncFileSink(int aFile, bool aIsDirectIo, const Options & aOptions):
+	mOptions(aOptions),
+	mFile(aFile),
+	mIsDirectIo(aIsDirectIo),
+	mBuffer(-1),
+	mPrivateBuffer(nullptr),
+	mBufferSize(
+		(aOptions.mPrivateBufferSize > 0) ?
+		((aOptions.mPrivateBufferSize + DiskIo::Alignment - 1) / DiskIo::Alignment * DiskIo::Alignment) :
+		DiskIo::instance().bufferSize()
+	),
+	mBufferFill(0),
+	mBufferOffset(0),
+	mSize(0),
+	mNumInFlight(0)
+{
+	if (!usesPrivateBuffers())
+	{
+		DiskIo::instance().addSink();
+	}
+}
+
+
+
+
+
+std::shared_ptr<AsyncFileSink> AsyncFileSink::create(const std::string & aFileName, const Options & aOptions, std::error_code & aError)
+{
+	bool isDirectIo = false;
+	#ifdef _WIN32
+		// Direct I/O is not supported on Windows, the writes go through the cache
+		auto file = _open(aFileName.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+	#else
+		int file = -1;
+		#ifdef O_DIRECT
+			if (aOptions.mShouldUseDirectIo)
+			{
+				file = ::open(aFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+				isDirectIo = (file >= 0);
+
+				// Some filesystems (tmpfs) refuse O_DIRECT, fall back to the cached writes:
+				if ((file < 0) && (errno != EINVAL))
+				{
+					aError = std::error_code(errno, std::generic_category());
+					return nullptr;
+				}
+			}
+		#endif
+		if (file < 0)
+		{
+			file = ::open(aFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		}
+		#ifdef F_NOCACHE
+			if ((file >= 0) && aOptions.mShouldUseDirectIo)
+			{
+				isDirectIo = (fcntl(file, F_NOCACHE, 1) == 0);
+			}
+		#endif
+	#endif
+	if (file < 0)
+	{
+		aError = std::error_code(errno, std::generic_category());
+		return nullptr;
+	}
+	aError.clear();
+	return std::shared_ptr<AsyncFileSink>(new AsyncFileSink(file, isDirectIo, aOptions));
+}
+
+
+
+
+
+AsyncFileSink::~AsyncFileSink()
+{
+	// The writes in flight hold a reference, so only an unclosed sink can get here with the file still open:
+	releaseBufferLocked();
+	if (mFile >= 0)
+	{
+		closeFile(mFile);
+		if (!usesPrivateBuffers())
+		{
+			DiskIo::instance().removeSink();
+		}
+	}
+}
+
+
+
+
+
+std::error_code AsyncFileSink::write(const char * aData, size_t aSize)
+{
+	LockGuard lg(mMtx);
+	if (mError)
+	{
+		return mError;
+	}
+	if ((mFile < 0) || mOnClosed)
+	{
+		return std::make_error_code(std::errc::bad_file_descriptor);
+	}
+	auto & io = DiskIo::instance();
+	while (aSize > 0)
+	{
+		if (!hasBufferLocked())
+		{
+			if (mNumInFlight + 1 > std::max<size_t>(mOptions.mMaxBuffers, 2))
+			{
+				return std::make_error_code(std::errc::no_buffer_space);
+			}
+			if (usesPrivateBuffers())
+			{
+				mPrivateBuffer = alignedAlloc(mBufferSize);
+			}
+			else
+			{
+				mBuffer = io.allocateBuffer();
+			}
+			if (!hasBufferLocked())
+			{
+				return std::make_error_code(std::errc::no_buffer_space);
+			}
+			mBufferFill = 0;
+		}
+		auto numBytes = std::min(aSize, mBufferSize - mBufferFill);
+		std::memcpy(bufferDataLocked() + mBufferFill, aData, numBytes);
+		mBufferFill += numBytes;
+		mSize += numBytes;
+		aData += numBytes;
+		aSize -= numBytes;
+		if (mBufferFill == mBufferSize)
+		{
+			submitLocked(mBufferFill);
+		}
+	}
+	return {};
+}
+
+
+
+
+
+void AsyncFileSink::close(CloseCallback aOnClosed)
+{
+	bool shouldFinish;
+	{
+		LockGuard lg(mMtx);
+		if (mOnClosed || (mFile < 0))
+		{
+			return;
+		}
+		if (aOnClosed)
+		{
+			mOnClosed = std::move(aOnClosed);
+		}
+		else
+		{
+			mOnClosed = [](const std::error_code & aError, uint64_t aSize) {};
+		}
+		if (hasBufferLocked())
+		{
+			if ((mBufferFill > 0) && !mError)
+			{
+				// Direct I/O only writes whole blocks, pad the last one; the file is truncated once closed:
+				auto writeSize = mBufferFill;
+				if (mIsDirectIo)
+				{
+					writeSize = (mBufferFill + DiskIo::Alignment - 1) / DiskIo::Alignment * DiskIo::Alignment;
+					std::memset(bufferDataLocked() + mBufferFill, 0, writeSize - mBufferFill);
+				}
+				submitLocked(writeSize);
+			}
+			else
+			{
+				releaseBufferLocked();
+			}
+		}
+		shouldFinish = (mNumInFlight == 0);
+	}
+	if (shouldFinish)
+	{
+		finishClose();
+	}
+}
+
+
+
+
+
+uint64_t AsyncFileSink::size() const
+{
+	LockGuard lg(mMtx);
+	return mSize;
+}
+
+
+
+
+
+char * AsyncFileSink::bufferDataLocked()
+{
+	return (mPrivateBuffer != nullptr) ? mPrivateBuffer : DiskIo::instance().bufferData(mBuffer);
+}
+
+
+
+
+
+void AsyncFileSink::releaseBufferLocked()
+{
+	if (mBuffer >= 0)
+	{
+		DiskIo::instance().releaseBuffer(mBuffer);
+		mBuffer = -1;
+	}
+	if (mPrivateBuffer != nullptr)
+	{
+		alignedFree(mPrivateBuffer);
+		mPrivateBuffer = nullptr;
+	}
+}
+
+
+
+
+
+void AsyncFileSink::submitLocked(size_t aWriteSize)
+{
+	auto buffer = mBuffer;
+	auto privateBuffer = mPrivateBuffer;
+	auto offset = mBufferOffset;
+	mBuffer = -1;
+	mPrivateBuffer = nullptr;
+	mBufferOffset += mBufferFill;
+	mBufferFill = 0;
+	mNumInFlight += 1;
+	auto onWritten = [self = shared_from_this(), buffer, privateBuffer](const std::error_code & aError)
+	{
+		self->onWritten(buffer, privateBuffer, aError);
+	};
+	if (privateBuffer != nullptr)
+	{
+		DiskIo::instance().writeData(mFile, privateBuffer, aWriteSize, offset, std::move(onWritten));
+	}
+	else
+	{
+		DiskIo::instance().write(mFile, buffer, aWriteSize, offset, std::move(onWritten));
+	}
+}
+
+
+
+
+
+void AsyncFileSink::onWritten(int aBuffer, char * aPrivateBuffer, const std::error_code & aError)
+{
+	if (aBuffer >= 0)
+	{
+		DiskIo::instance().releaseBuffer(aBuffer);
+	}
+	else
+	{
+		alignedFree(aPrivateBuffer);
+	}
+	bool shouldFinish;
+	{
+		LockGuard lg(mMtx);
+		mNumInFlight -= 1;
+		if (aError && !mError)
+		{
+			mError = aError;
+		}
+		shouldFinish = (mOnClosed && (mNumInFlight == 0));
+	}
+	if (shouldFinish)
+	{
+		finishClose();
+	}
+}
+
+
+
+
+
+void AsyncFileSink::finishClose()
+{
+	int file;
+	CloseCallback onClosed;
+	uint64_t size;
+	std::error_code err;
+	{
+		LockGuard lg(mMtx);
+		file = mFile;
+		mFile = -1;
+		std::swap(onClosed, mOnClosed);
+		size = mSize;
+		err = mError;
+	}
+	if (file < 0)
+	{
+		return;
+	}
+	if (!usesPrivateBuffers())
+	{
+		DiskIo::instance().removeSink();
+	}
+	#ifndef _WIN32
+		if (mIsDirectIo && (::ftruncate(file, static_cast<off_t>(size)) != 0) && !err)
+		{
+			err = std::error_code(errno, std::generic_category());
+		}
+	#endif
+	closeFile(file);
+	if (onClosed)
+	{
+		onClosed(err, size);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** The process-wide engine for the asynchronous disk writes, used by AsyncFileSink.
+Owns a fixed pool of page-aligned buffers, and writes them to the disk off the asio threads: through io_uring (with
+the buffers registered with the kernel, so that they aren't mapped for each write) where available, otherwise by
+a small pool of threads doing the positioned writes.
+io_uring is used if the library is built with liburing (NETSURVEILLANCEPP_HAS_IO_URING, see CMakeLists.txt) and the
+kernel allows it; otherwise the threads are used silently.
+Thread-safe. */
+class DiskIo
+{
+public:
+
+	/** The tunables of the engine. */
+	struct Options
+	{
+		/** The size of a single buffer; rounded up to a multiple of Alignment. */
+		size_t mBufferSize = 512 * 1024;
+
+		/** The number of buffers in the pool, allocated upfront (and registered with io_uring). */
+		size_t mNumBuffers = 64;
+
+		/** The maximum number of buffers. The pool grows beyond mNumBuffers as more sinks are open, so that each open
+		sink has BuffersPerSink buffers available; bounds the memory used for the data waiting to be written. */
+		size_t mMaxNumBuffers = 1024;
+
+		/** The number of writer threads, if io_uring is not used. */
+		size_t mNumThreads = 2;
+
+		/** If false, io_uring is not used even if available. */
+		bool mShouldUseIoUring = true;
+	};
+
+	/** The callback called once a write finishes; called from the engine's thread. */
+	using WriteCallback = std::function<void(const std::error_code & aError)>;
+
+	/** The alignment of the buffers, and of the direct I/O writes. */
+	static const size_t Alignment = 4096;
+
+	/** The number of pool buffers provisioned for each open sink (the one being filled, and the one being written). */
+	static const size_t BuffersPerSink = 2;
+
+
+	/** Initializes the single instance with the specified options.
+	Returns false if the instance has already been initialized (the options are then ignored). */
+	static bool init(const Options & aOptions);
+
+	/** Returns the single instance of this class, initializing it with the default options if not initialized yet. */
+	static DiskIo & instance();
+
+	/** Waits for the pending writes to finish, then stops the engine's threads. */
+	~DiskIo();
+
+	/** Takes a free buffer from the pool; returns its index, or -1 if all the buffers are in use. */
+	int allocateBuffer();
+
+	/** Returns the buffer into the pool. The buffers above the current need of the open sinks are freed. */
+	void releaseBuffer(int aBufferIndex);
+
+	/** Registers / unregisters an open sink using the pool buffers; the pool size follows the number of open sinks. */
+	void addSink();
+	void removeSink();
+
+	/** Returns the data of the specified buffer. */
+	char * bufferData(int aBufferIndex) { return mBuffers[static_cast<size_t>(aBufferIndex)]; }
+
+	/** Returns the size of each buffer. */
+	size_t bufferSize() const { return mBufferSize; }
+
+	/** Asynchronously writes the first aSize bytes of the buffer into the file at the specified offset.
+	The buffer must not be modified until the callback is called; the buffer stays allocated (release it from the
+	callback, or reuse it). Short writes are retried, the callback is called once all the data is written.
+	The callback is never called from within this call. */
+	void write(int aFile, int aBufferIndex, size_t aSize, uint64_t aOffset, WriteCallback aOnWritten);
+
+	/** Asynchronously writes the data, which is not a pool buffer, into the file at the specified offset.
+	The data must stay valid and unmodified until the callback is called. Otherwise the same as write(). */
+	void writeData(int aFile, const char * aData, size_t aSize, uint64_t aOffset, WriteCallback aOnWritten);
+
+	/** Returns the name of the backend in use ("io_uring" or "threads"), for diagnostics. */
+	const char * backendName() const;
+
+
+protected:
+
+	class Backend;
+	class ThreadBackend;
+	class IoUringBackend;
+
+	/** A single write in progress. */
+	struct Request
+	{
+		int mFile;
+
+		/** The pool buffer being written; -1 for the data outside the pool (writeData()). */
+		int mBufferIndex;
+
+		/** The data remaining to be written, and the file offset where it goes. */
+		const char * mData;
+		size_t mSize;
+		uint64_t mOffset;
+
+		WriteCallback mOnWritten;
+	};
+
+
+	/** The mutex protecting the pool bookkeeping against multithreaded access.
+	The mBuffers items are only written under it, while their buffer is not in use. */
+	std::mutex mMtx;
+
+	const size_t mBufferSize;
+
+	/** The number of buffers allocated upfront; these are never freed (they may be registered with io_uring). */
+	size_t mNumFixedBuffers;
+
+	/** The aligned buffers of the pool, indexed by the buffer index; nullptr for the slots not currently allocated.
+	Sized to the maximum number of buffers upfront, so that it never reallocates while the buffers are in use. */
+	std::vector<char *> mBuffers;
+
+	/** The indices of the allocated buffers not in use. */
+	std::vector<int> mFreeBuffers;
+
+	/** The indices of the slots in mBuffers not currently allocated. */
+	std::vector<int> mEmptySlots;
+
+	/** The number of buffers currently allocated. */
+	size_t mNumAllocated;
+
+	/** The number of open sinks using the pool buffers. */
+	size_t mNumOpenSinks;
+
+	/** The backend doing the writes. */
+	std::unique_ptr<Backend> mBackend;
+
+
+	explicit DiskIo(const Options & aOptions);
+
+	/** Returns the number of buffers the pool should have for the current number of open sinks.
+	Assumes mMtx is locked. */
+	size_t targetNumBuffersLocked() const;
+
+	/** Writes the whole request synchronously, using positioned writes. Used by the threads backend. */
+	static std::error_code writeAll(const Request & aRequest);
+};
+
+
+
+
+
+/** A file written asynchronously, without blocking the calling thread on the disk.
+The data written is copied into the DiskIo buffers; each full buffer is written out in the background, while the
+next one is being filled. If the disk can't keep up and the sink's buffers run out, write() fails instead of waiting,
+so a slow disk never stalls the asio threads (and with them the network processing of all the devices).
+Optionally, the file is opened for direct I/O (O_DIRECT on Linux, F_NOCACHE on macOS), bypassing the page cache, so
+that recording many streams doesn't evict everything else from the cache. The last partial buffer is then padded to
+DiskIo::Alignment and the file is truncated to the written size once closed.
+Call close() to write out the last buffer; destroying a sink that hasn't been closed discards the data not yet written.
+Thread-safe. */
+class AsyncFileSink:
+	public std::enable_shared_from_this<AsyncFileSink>
+{
+public:
+
+	/** The tunables of the sink. */
+	struct Options
+	{
+		/** If true, the file is opened for direct I/O, if supported by the OS and the filesystem. */
+		bool mShouldUseDirectIo = false;
+
+		/** The maximum number of buffers used by the sink at a time (the one being filled, and those being written). */
+		size_t mMaxBuffers = 8;
+
+		/** If non-zero, the sink uses its own buffers of this size (rounded up to DiskIo::Alignment) instead of the
+		DiskIo pool's. For the small, rarely written files (such as the segment indices), so that they don't hold
+		a large pool buffer for as long as they're open. */
+		size_t mPrivateBufferSize = 0;
+	};
+
+	/** The callback called once the file is closed, with the first error encountered (if any) and the file size. */
+	using CloseCallback = std::function<void(const std::error_code & aError, uint64_t aSize)>;
+
+
+	/** Creates (truncates) the specified file for writing.
+	Returns nullptr and sets aError on failure. */
+	static std::shared_ptr<AsyncFileSink> create(const std::string & aFileName, const Options & aOptions, std::error_code & aError);
+
+	~AsyncFileSink();
+
+	/** Queues the data to be written at the end of the file.
+	Returns the error of an earlier background write, if any, or std::errc::no_buffer_space if the disk doesn't keep
+	up; the data is not (completely) written then, and the sink should be closed. */
+	std::error_code write(const char * aData, size_t aSize);
+
+	/** Writes out the remaining data and closes the file; aOnClosed is called once done (from the DiskIo thread, or
+	from within this call if there is nothing left to write). No more data may be written.
+	Only the first call has any effect. */
+	void close(CloseCallback aOnClosed);
+
+	/** Returns the number of bytes written into the file (queued with write()) so far. */
+	uint64_t size() const;
+
+	/** Returns true if the file was opened for direct I/O. */
+	bool isDirectIo() const { return mIsDirectIo; }
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	const Options mOptions;
+
+	/** The file descriptor; -1 once closed. */
+	int mFile;
+
+	const bool mIsDirectIo;
+
+	/** The pool buffer being filled; -1 if none. */
+	int mBuffer;
+
+	/** The private buffer being filled (Options::mPrivateBufferSize); nullptr if none. */
+	char * mPrivateBuffer;
+
+	/** The size of each buffer: the pool's buffer size, or the private buffer size. */
+	const size_t mBufferSize;
+
+	/** The number of bytes in mBuffer. */
+	size_t mBufferFill;
+
+	/** The file offset where mBuffer goes. */
+	uint64_t mBufferOffset;
+
+	/** The number of bytes written into the file (queued with write()) so far. */
+	uint64_t mSize;
+
+	/** The number of buffers being written. */
+	size_t mNumInFlight;
+
+	/** The first error of the background writes. */
+	std::error_code mError;
+
+	/** The callback for close(); set once close() is called. */
+	CloseCallback mOnClosed;
+
+
+	AsyncFileSink(int aFile, bool aIsDirectIo, const Options & aOptions);
+
+	/** Returns true if the sink is using the private buffers rather than the pool's. */
+	bool usesPrivateBuffers() const { return (mOptions.mPrivateBufferSize > 0); }
+
+	/** Returns true if there is a buffer being filled. Assumes mMtx is locked. */
+	bool hasBufferLocked() const { return (mBuffer >= 0) || (mPrivateBuffer != nullptr); }
+
+	/** Returns the data of the buffer being filled. Assumes mMtx is locked and there is a buffer. */
+	char * bufferDataLocked();
+
+	/** Releases the buffer being filled, without writing it. Assumes mMtx is locked. */
+	void releaseBufferLocked();
+
+	/** Starts writing the buffer being filled, of the specified size (padded for direct I/O), and moves on to a new
+	buffer. Assumes mMtx is locked. */
+	void submitLocked(size_t aWriteSize);
+
+	/** Called once a buffer has been written; aBuffer is the pool buffer index, or -1 for aPrivateBuffer. */
+	void onWritten(int aBuffer, char * aPrivateBuffer, const std::error_code & aError);
+
+	/** Truncates the file to its size (if padded), closes it and calls the close callback.
+	Must be called with mMtx unlocked, after the last write finishes. */
+	void finishClose();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,162 @@
+#include "BandwidthLimiter.hpp"
+
+#include <algorithm>
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+using Clock = std::chrono::steady_clock;
+
+
+
+
+
+BandwidthLimiter::BandwidthLimiter(uint64_t aBytesPerSecond):
+	mBytesPerSecond(aBytesPerSecond),
+	mTokens(static_cast<double>(aBytesPerSecond)),
+	mLastRefill(Clock::now()),
+	mTimer(Root::instance().ioContext()),
+	mIsTimerScheduled(false)
+{
+}
+
+
+
+
+
+std::shared_ptr<BandwidthLimiter> BandwidthLimiter::create(uint64_t aBytesPerSecond)
+{
+	return std::shared_ptr<BandwidthLimiter>(new BandwidthLimiter(aBytesPerSecond));
+}
+
+
+
+
+
+void BandwidthLimiter::acquire(size_t aNumBytes, std::function<void()> aOnGranted)
+{
+	std::vector<std::function<void()>> granted;
+	{
+		LockGuard lg(mMtx);
+		mWaiting.emplace_back(aNumBytes, std::move(aOnGranted));
+		granted = grantWaiting();
+	}
+
+	// Call the granted callbacks asynchronously, so that the callers may call acquire() from within the callback:
+	for (auto & callback: granted)
+	{
+		asio::post(Root::instance().ioContext(), std::move(callback));
+	}
+}
+
+
+
+
+
+void BandwidthLimiter::setRate(uint64_t aBytesPerSecond)
+{
+	std::vector<std::function<void()>> granted;
+	{
+		LockGuard lg(mMtx);
+		refill();
+		mBytesPerSecond = aBytesPerSecond;
+		granted = grantWaiting();
+	}
+	for (auto & callback: granted)
+	{
+		asio::post(Root::instance().ioContext(), std::move(callback));
+	}
+}
+
+
+
+
+
+void BandwidthLimiter::refill()
+{
+	auto now = Clock::now();
+	auto elapsed = std::chrono::duration<double>(now - mLastRefill).count();
+	mLastRefill = now;
+	auto bucketSize = static_cast<double>(mBytesPerSecond);
+	mTokens = std::min(bucketSize, mTokens + elapsed * bucketSize);
+}
+
+
+
+
+
+std::vector<std::function<void()>> BandwidthLimiter::grantWaiting()
+{
+	std::vector<std::function<void()>> res;
+	if (mBytesPerSecond == 0)
+	{
+		// Unlimited, grant everything:
+		for (auto & w: mWaiting)
+		{
+			res.push_back(std::move(w.second));
+		}
+		mWaiting.clear();
+		return res;
+	}
+
+	// Grant the requests while there are tokens available (a request larger than the bucket drives tokens negative):
+	refill();
+	while (!mWaiting.empty() && (mTokens > 0))
+	{
+		mTokens -= static_cast<double>(mWaiting.front().first);
+		res.push_back(std::move(mWaiting.front().second));
+		mWaiting.pop_front();
+	}
+
+	// If there are requests left, wake up when the tokens get positive again:
+	if (!mWaiting.empty() && !mIsTimerScheduled)
+	{
+		auto secondsToWait = std::max(-mTokens, 1.0) / static_cast<double>(mBytesPerSecond);
+		mIsTimerScheduled = true;
+		mTimer.expires_after(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(secondsToWait)));
+		mTimer.async_wait(
+			[self = shared_from_this()](const std::error_code & aError)
+			{
+				if (!aError)
+				{
+					self->onTimer();
+				}
+			}
+		);
+	}
+	return res;
+}
+
+
+
+
+
+void BandwidthLimiter::onTimer()
+{
+	std::vector<std::function<void()>> granted;
+	{
+		LockGuard lg(mMtx);
+		mIsTimerScheduled = false;
+		granted = grantWaiting();
+	}
+	for (auto & callback: granted)
+	{
+		callback();
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <asio.hpp>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Limits the combined data rate of any number of transfers (token bucket).
+Transfers call acquire() before sending each chunk of data; the callback is called (from an ASIO worker thread)
+once the chunk fits into the rate limit. The waiting transfers are served in FIFO order.
+Thread-safe. */
+class BandwidthLimiter:
+	public std::enable_shared_from_this<BandwidthLimiter>
+{
+public:
+
+	/** Creates a new limiter with the specified rate, in bytes per second.
+	A rate of 0 means unlimited. */
+	static std::shared_ptr<BandwidthLimiter> create(uint64_t aBytesPerSecond);
+
+	/** Requests sending the specified number of bytes.
+	Calls the callback once the bytes fit into the rate limit; never calls it synchronously from within this call. */
+	void acquire(size_t aNumBytes, std::function<void()> aOnGranted);
+
+	/** Changes the rate limit, in bytes per second; 0 means unlimited. */
+	void setRate(uint64_t aBytesPerSecond);
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	/** The rate limit, in bytes per second. 0 means unlimited. */
+	uint64_t mBytesPerSecond;
+
+	/** The number of bytes that may currently be sent.
+	May go negative, when a chunk larger than the bucket was granted. */
+	double mTokens;
+
+	/** The time when mTokens was last updated. */
+	std::chrono::steady_clock::time_point mLastRefill;
+
+	/** The requests waiting for their bytes to be granted. */
+	std::deque<std::pair<size_t, std::function<void()>>> mWaiting;
+
+	/** The timer used for waking up when the next waiting request can be granted. */
+	asio::steady_timer mTimer;
+
+	/** Set to true while mTimer is scheduled. */
+	bool mIsTimerScheduled;
+
+
+	explicit BandwidthLimiter(uint64_t aBytesPerSecond);
+
+	/** Adds the tokens accumulated since the last refill, up to the bucket size (one second worth of data).
+	Assumes mMtx is held by the caller. */
+	void refill();
+
+	/** Grants as many waiting requests as currently possible, schedules the timer for the rest.
+	Assumes mMtx is held by the caller; returns the granted callbacks, to be called after unlocking. */
+	std::vector<std::function<void()>> grantWaiting();
+
+	/** Called by ASIO when mTimer fires; grants the waiting requests. */
+	void onTimer();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
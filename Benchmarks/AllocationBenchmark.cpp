@@ -0,0 +1,265 @@
+// AllocationBenchmark.cpp
+
+// Counts the heap allocations per request / response round trip over a Connection, in the steady state.
+// The global operator new / delete are replaced by counting versions; a local stand-in device (a blocking socket on
+// its own thread, not allocating once connected) answers each request. The round trips use the raw command path
+// (queueCommandRaw() with a small callable), which is expected not to allocate at all once warmed up: the handlers
+// are stored inline (InplaceFunction), the ASIO handlers use the per-connection memory (HandlerAllocator), and the
+// send queue and receive buffers are reused. The JSON-based commands are not covered, encoding and decoding the JSON
+// allocates by design.
+// Exits with a non-zero code if any allocation is counted in the measured round trips.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <asio.hpp>
+#include "Connection.hpp"
+#include "Root.hpp"
+
+
+
+
+
+/** The number of the heap allocations made so far, by any thread. */
+static std::atomic<uint64_t> gNumAllocations(0);
+
+
+
+
+
+void * operator new(size_t aSize)
+{
+	gNumAllocations.fetch_add(1, std::memory_order_relaxed);
+	auto res = std::malloc((aSize > 0) ? aSize : 1);
+	if (res == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return res;
+}
+
+void * operator new[](size_t aSize)
+{
+	return ::operator new(aSize);
+}
+
+void operator delete(void * aPointer) noexcept
+{
+	std::free(aPointer);
+}
+
+void operator delete[](void * aPointer) noexcept
+{
+	std::free(aPointer);
+}
+
+void operator delete(void * aPointer, size_t /* aSize */) noexcept
+{
+	std::free(aPointer);
+}
+
+void operator delete[](void * aPointer, size_t /* aSize */) noexcept
+{
+	std::free(aPointer);
+}
+
+
+
+
+
+namespace
+{
+
+using namespace NetSurveillancePp;
+
+/** The number of the round trips made before measuring, to let all the buffers and queues grow to their size. */
+static const uint64_t NumWarmupRoundTrips = 1000;
+
+/** The number of the measured round trips. */
+static const uint64_t NumMeasuredRoundTrips = 10000;
+
+
+
+
+
+/** Exposes the raw command path of the Connection to the benchmark. */
+class BenchConnection:
+	public Connection
+{
+public:
+
+	static std::shared_ptr<BenchConnection> create()
+	{
+		return std::shared_ptr<BenchConnection>(new BenchConnection);
+	}
+
+	/** Sends a SysInfo_Req; increments aNumResponses once its response arrives, or aNumErrors on error. */
+	void sendRequest(std::atomic<uint64_t> & aNumResponses, std::atomic<uint64_t> & aNumErrors)
+	{
+		static const char payload[] = "{ \"Name\" : \"SystemInfo\", \"SessionID\" : \"0x00000001\" }";
+		queueCommandRaw(CommandType::SysInfo_Req, CommandType::SysInfo_Resp, payload, sizeof(payload) - 1,
+			[&aNumResponses, &aNumErrors](const std::error_code & aError, const BufferSlice & /* aData */)
+			{
+				(aError ? aNumErrors : aNumResponses).fetch_add(1);
+			}
+		);
+	}
+};
+
+
+
+
+
+/** The stand-in device: accepts a single connection and answers each request with a fixed response. */
+class FakeDevice
+{
+public:
+
+	FakeDevice():
+		mAcceptor(mIoContext, asio::ip::tcp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 0)),
+		mSocket(mIoContext)
+	{
+	}
+
+	uint16_t port() const
+	{
+		return mAcceptor.local_endpoint().port();
+	}
+
+	/** Serves the requests until the client disconnects. */
+	void run()
+	{
+		static const char responsePayload[] = "{ \"Name\" : \"SystemInfo\", \"Ret\" : 100, \"SessionID\" : \"0x00000001\" }\n";
+		char header[Protocol::HeaderLength];
+		char payload[4096];
+		char response[Protocol::HeaderLength + sizeof(responsePayload) - 1];
+		std::error_code err;
+		mAcceptor.accept(mSocket, err);
+		while (!err)
+		{
+			asio::read(mSocket, asio::buffer(header), err);
+			if (err)
+			{
+				break;
+			}
+			uint32_t payloadSize;
+			std::memcpy(&payloadSize, header + 16, sizeof(payloadSize));
+			if (payloadSize > sizeof(payload))
+			{
+				break;
+			}
+			asio::read(mSocket, asio::buffer(payload, payloadSize), err);
+			if (err)
+			{
+				break;
+			}
+
+			// Respond with the same header, except for the type and size:
+			uint16_t type;
+			std::memcpy(&type, header + 14, sizeof(type));
+			type += 1;
+			uint32_t responseSize = sizeof(responsePayload) - 1;
+			std::memcpy(response, header, Protocol::HeaderLength);
+			std::memcpy(response + 14, &type, sizeof(type));
+			std::memcpy(response + 16, &responseSize, sizeof(responseSize));
+			std::memcpy(response + Protocol::HeaderLength, responsePayload, responseSize);
+			asio::write(mSocket, asio::buffer(response), err);
+		}
+	}
+
+
+protected:
+
+	asio::io_context mIoContext;
+	asio::ip::tcp::acceptor mAcceptor;
+	asio::ip::tcp::socket mSocket;
+};
+
+
+
+
+
+/** Makes the specified number of round trips, one at a time. Returns false on error. */
+static bool roundTrips(
+	BenchConnection & aConnection,
+	uint64_t aCount,
+	std::atomic<uint64_t> & aNumResponses,
+	std::atomic<uint64_t> & aNumErrors
+)
+{
+	for (uint64_t i = 0; i < aCount; ++i)
+	{
+		auto expected = aNumResponses.load() + 1;
+		aConnection.sendRequest(aNumResponses, aNumErrors);
+		while ((aNumResponses.load() < expected) && (aNumErrors.load() == 0))
+		{
+			std::this_thread::yield();
+		}
+		if (aNumErrors.load() != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+}  // anonymous namespace
+
+
+
+
+
+int main()
+{
+	Root::instance();
+	FakeDevice device;
+	std::thread deviceThread([&device]() { device.run(); });
+
+	// Connect:
+	auto conn = BenchConnection::create();
+	std::atomic<int> connectResult(-1);
+	conn->connect("127.0.0.1", device.port(),
+		[&connectResult](const std::error_code & aError)
+		{
+			connectResult = aError ? 1 : 0;
+		}
+	);
+	while (connectResult.load() < 0)
+	{
+		std::this_thread::yield();
+	}
+	if (connectResult.load() != 0)
+	{
+		std::fprintf(stderr, "Cannot connect to the stand-in device\n");
+		return 2;
+	}
+
+	// Warm up, then measure:
+	std::atomic<uint64_t> numResponses(0);
+	std::atomic<uint64_t> numErrors(0);
+	if (!roundTrips(*conn, NumWarmupRoundTrips, numResponses, numErrors))
+	{
+		std::fprintf(stderr, "The warm-up round trips failed\n");
+		return 2;
+	}
+	auto numAllocationsBefore = gNumAllocations.load();
+	auto isSuccess = roundTrips(*conn, NumMeasuredRoundTrips, numResponses, numErrors);
+	auto numAllocations = gNumAllocations.load() - numAllocationsBefore;
+
+	conn->disconnect();
+	deviceThread.join();
+	if (!isSuccess)
+	{
+		std::fprintf(stderr, "The measured round trips failed\n");
+		return 2;
+	}
+	std::printf("%llu allocations in %llu round trips (%.3f per round trip)\n",
+		static_cast<unsigned long long>(numAllocations),
+		static_cast<unsigned long long>(NumMeasuredRoundTrips),
+		static_cast<double>(numAllocations) / static_cast<double>(NumMeasuredRoundTrips)
+	);
+	return (numAllocations == 0) ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+#include "Buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BufferBlock:
+
+void BufferBlock::release()
+{
+	if (mRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		BufferPool::instance().recycle(this);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BufferSlice:
+
+BufferSlice BufferSlice::compacted() const
+{
+	// A block from the pool is at most twice the requested size, a copy wouldn't save anything:
+	if (!mBlock || (mBlock->capacity() < 2 * std::max(mSize, BufferPool::MinBlockSize)))
+	{
+		return *this;
+	}
+	auto block = BufferPool::instance().allocate(mSize);
+	std::memcpy(block->data(), mData, mSize);
+	return BufferSlice(std::move(block), 0, mSize);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BufferPool:
+
+constexpr size_t BufferPool::MinBlockSize;
+
+
+
+
+
+BufferPool::BufferPool():
+	mRetainedBytes(0),
+	mMaxRetainedBytes(16 * 1024 * 1024)
+{
+}
+
+
+
+
+
+BufferPool & BufferPool::instance()
+{
+	// The instance is intentionally leaked, blocks may still be released during the static destruction
+	static BufferPool * theInstance = new BufferPool;
+	return *theInstance;
+}
+
+
+
+
+
+BufferBlockPtr BufferPool::allocate(size_t aMinCapacity)
+{
+	auto sc = sizeClass(aMinCapacity);
+	{
+		LockGuard lg(mMtx);
+		if ((sc < mFreeBlocks.size()) && !mFreeBlocks[sc].empty())
+		{
+			auto block = mFreeBlocks[sc].back();
+			mFreeBlocks[sc].pop_back();
+			mRetainedBytes -= block->capacity();
+			return BufferBlockPtr(block);
+		}
+	}
+
+	// No block available for reuse, allocate a new one:
+	auto capacity = MinBlockSize << sc;
+	auto mem = ::operator new(sizeof(BufferBlock) + capacity);
+	return BufferBlockPtr(new (mem) BufferBlock(capacity));
+}
+
+
+
+
+
+void BufferPool::setMaxRetainedBytes(size_t aMaxRetainedBytes)
+{
+	LockGuard lg(mMtx);
+	mMaxRetainedBytes = aMaxRetainedBytes;
+}
+
+
+
+
+
+void BufferPool::recycle(BufferBlock * aBlock)
+{
+	{
+		LockGuard lg(mMtx);
+		if (mRetainedBytes + aBlock->capacity() <= mMaxRetainedBytes)
+		{
+			auto sc = sizeClass(aBlock->capacity());
+			if (sc >= mFreeBlocks.size())
+			{
+				mFreeBlocks.resize(sc + 1);
+			}
+			mFreeBlocks[sc].push_back(aBlock);
+			mRetainedBytes += aBlock->capacity();
+			return;
+		}
+	}
+
+	// The pool is full, free the block:
+	aBlock->~BufferBlock();
+	::operator delete(aBlock);
+}
+
+
+
+
+
+size_t BufferPool::sizeClass(size_t aCapacity)
+{
+	size_t res = 0;
+	while ((MinBlockSize << res) < aCapacity)
+	{
+		res += 1;
+	}
+	return res;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
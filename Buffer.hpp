@@ -0,0 +1,239 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** A single reference-counted block of memory, allocated from the BufferPool.
+The header and the data are allocated in one piece; when the last reference is released, the block is returned to
+the pool for reuse, instead of being freed. */
+class alignas(16) BufferBlock
+{
+public:
+
+	/** Returns the pointer to the data area of the block. */
+	char * data() { return reinterpret_cast<char *>(this + 1); }
+	const char * data() const { return reinterpret_cast<const char *>(this + 1); }
+
+	/** Returns the number of bytes available in the data area. */
+	size_t capacity() const { return mCapacity; }
+
+	/** Returns true if there's more than one reference to this block. */
+	bool isShared() const { return (mRefCount.load(std::memory_order_acquire) > 1); }
+
+	void addRef() { mRefCount.fetch_add(1, std::memory_order_relaxed); }
+
+	/** Releases a reference; if it was the last one, returns the block to the pool. */
+	void release();
+
+
+protected:
+
+	friend class BufferPool;
+
+	/** The number of references held to this block. */
+	std::atomic<size_t> mRefCount;
+
+	/** The number of bytes available in the data area. */
+	size_t mCapacity;
+
+
+	explicit BufferBlock(size_t aCapacity):
+		mRefCount(0),
+		mCapacity(aCapacity)
+	{
+	}
+};
+
+
+
+
+
+/** An owning handle to a BufferBlock (an intrusive shared pointer). */
+class BufferBlockPtr
+{
+public:
+
+	BufferBlockPtr():
+		mBlock(nullptr)
+	{
+	}
+
+	/** Takes a new reference to the specified block. */
+	explicit BufferBlockPtr(BufferBlock * aBlock):
+		mBlock(aBlock)
+	{
+		if (mBlock != nullptr)
+		{
+			mBlock->addRef();
+		}
+	}
+
+	BufferBlockPtr(const BufferBlockPtr & aOther):
+		BufferBlockPtr(aOther.mBlock)
+	{
+	}
+
+	BufferBlockPtr(BufferBlockPtr && aOther) noexcept:
+		mBlock(aOther.mBlock)
+	{
+		aOther.mBlock = nullptr;
+	}
+
+	BufferBlockPtr & operator =(BufferBlockPtr aOther) noexcept
+	{
+		std::swap(mBlock, aOther.mBlock);
+		return *this;
+	}
+
+	~BufferBlockPtr()
+	{
+		if (mBlock != nullptr)
+		{
+			mBlock->release();
+		}
+	}
+
+	BufferBlock * get() const { return mBlock; }
+	BufferBlock * operator ->() const { return mBlock; }
+	BufferBlock & operator *() const { return *mBlock; }
+	explicit operator bool() const { return (mBlock != nullptr); }
+
+
+protected:
+
+	BufferBlock * mBlock;
+};
+
+
+
+
+
+/** An immutable view into a part of a BufferBlock.
+Keeps the underlying block alive for as long as the slice exists, so the data can be retained, queued or handed
+over to other threads without copying. Copying a slice only copies the reference, never the data. */
+class BufferSlice
+{
+public:
+
+	/** Creates an empty slice. */
+	BufferSlice():
+		mData(nullptr),
+		mSize(0)
+	{
+	}
+
+	/** Creates a slice of aSize bytes at aOffset within the specified block. */
+	BufferSlice(BufferBlockPtr aBlock, size_t aOffset, size_t aSize):
+		mBlock(std::move(aBlock)),
+		mData(mBlock->data() + aOffset),
+		mSize(aSize)
+	{
+	}
+
+	const char * data() const { return mData; }
+	size_t size() const { return mSize; }
+	bool empty() const { return (mSize == 0); }
+	const char * begin() const { return mData; }
+	const char * end() const { return mData + mSize; }
+
+	/** Returns the capacity of the block that this slice keeps alive; 0 for an empty slice. */
+	size_t blockCapacity() const { return mBlock ? mBlock->capacity() : 0; }
+
+	/** Returns a slice with the same data that doesn't keep a block much larger than the data alive.
+	If the slice takes up most of its block, returns the slice itself; otherwise copies the data into a right-sized
+	block from the BufferPool. To be used before retaining a slice of a (large) receive block for long. */
+	BufferSlice compacted() const;
+
+	/** Returns a slice of aSize bytes starting at aOffset within this slice, sharing the same block. */
+	BufferSlice subSlice(size_t aOffset, size_t aSize) const
+	{
+		BufferSlice res(*this);
+		res.mData += aOffset;
+		res.mSize = aSize;
+		return res;
+	}
+
+
+protected:
+
+	/** The block that holds the data. */
+	BufferBlockPtr mBlock;
+
+	/** The start of the data represented by this slice. */
+	const char * mData;
+
+	/** The number of bytes in this slice. */
+	size_t mSize;
+};
+
+
+
+
+
+/** The process-wide pool of memory blocks, used for the incoming data.
+Blocks are kept in power-of-two size classes; released blocks are retained for reuse, up to a configurable limit,
+so that in the steady state no memory is allocated for receiving. Thread-safe. */
+class BufferPool
+{
+public:
+
+	/** The size of the smallest block handed out by the pool. */
+	static constexpr size_t MinBlockSize = 4 * 1024;
+
+	/** Returns the single instance of this class. */
+	static BufferPool & instance();
+
+	/** Returns a block with at least the specified capacity, either reused or newly allocated. */
+	BufferBlockPtr allocate(size_t aMinCapacity);
+
+	/** Sets the maximum number of bytes that the pool retains in released blocks.
+	Blocks released over this limit are freed. */
+	void setMaxRetainedBytes(size_t aMaxRetainedBytes);
+
+
+protected:
+
+	friend class BufferBlock;
+
+	/** The mutex protecting mFreeBlocks and mRetainedBytes against multithreaded access. */
+	std::mutex mMtx;
+
+	/** The released blocks available for reuse, indexed by the size class. */
+	std::vector<std::vector<BufferBlock *>> mFreeBlocks;
+
+	/** The total capacity of the blocks in mFreeBlocks. */
+	size_t mRetainedBytes;
+
+	/** The maximum total capacity of the blocks that may be kept in mFreeBlocks. */
+	size_t mMaxRetainedBytes;
+
+
+	BufferPool();
+
+	/** Returns the block into the pool, or frees it if the pool is full.
+	Called by BufferBlock when its last reference is released. */
+	void recycle(BufferBlock * aBlock);
+
+	/** Returns the index of the size class for the specified capacity. */
+	static size_t sizeClass(size_t aCapacity);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
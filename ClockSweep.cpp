@@ -0,0 +1,164 @@
+#include "ClockSweep.hpp"
+
+#include <atomic>
+#include <asio.hpp>
+#include "Error.hpp"
+#include "ParallelRunner.hpp"
+#include "Recorder.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+ClockSweep::ClockSweep(const DeviceClock::Policy & aPolicy, size_t aMaxParallel, std::chrono::milliseconds aTimeout):
+	mPolicy(aPolicy),
+	mTimeout(aTimeout),
+	mRunner(ParallelRunner::create(aMaxParallel))
+{
+}
+
+
+
+
+
+std::shared_ptr<ClockSweep> ClockSweep::create(
+	const DeviceClock::Policy & aPolicy,
+	size_t aMaxParallel,
+	std::chrono::milliseconds aTimeout
+)
+{
+	return std::shared_ptr<ClockSweep>(new ClockSweep(aPolicy, aMaxParallel, aTimeout));
+}
+
+
+
+
+
+void ClockSweep::addRecorder(std::shared_ptr<Recorder> aRecorder)
+{
+	mResults.push_back({std::move(aRecorder), {}, {}});
+}
+
+
+
+
+
+void ClockSweep::start(DeviceCallback aOnDeviceDone, FinishCallback aOnFinished)
+{
+	std::vector<ParallelRunner::Task> tasks;
+	tasks.reserve(mResults.size());
+	for (size_t i = 0; i < mResults.size(); ++i)
+	{
+		tasks.push_back(
+			[self = shared_from_this(), i, aOnDeviceDone](std::function<void()> aOnTaskFinished)
+			{
+				self->check(i, aOnDeviceDone, std::move(aOnTaskFinished));
+			}
+		);
+	}
+	mRunner->run(std::move(tasks),
+		[self = shared_from_this(), aOnFinished]()
+		{
+			if (aOnFinished)
+			{
+				aOnFinished(self->summarize());
+			}
+		}
+	);
+}
+
+
+
+
+
+void ClockSweep::check(size_t aIndex, DeviceCallback aOnDeviceDone, std::function<void()> aOnTaskFinished)
+{
+	// Whichever comes first, the result or the timeout, finishes the check; the other one is ignored:
+	auto isFinished = std::make_shared<std::atomic<bool>>(false);
+	auto timer = std::make_shared<asio::steady_timer>(Root::instance().ioContext(), mTimeout);
+	timer->async_wait(
+		[self = shared_from_this(), isFinished, aIndex, aOnDeviceDone, aOnTaskFinished](const std::error_code & aTimerError)
+		{
+			if (aTimerError || isFinished->exchange(true))
+			{
+				return;
+			}
+			self->onChecked(aIndex, make_error_code(Error::Timeout), {}, aOnDeviceDone, aOnTaskFinished);
+		}
+	);
+	mResults[aIndex].mRecorder->clock()->check(mPolicy,
+		[self = shared_from_this(), isFinished, timer, aIndex, aOnDeviceDone, aOnTaskFinished](
+			const std::error_code & aError,
+			const DeviceClock::CheckResult & aCheck
+		)
+		{
+			if (isFinished->exchange(true))
+			{
+				return;
+			}
+			timer->cancel();
+			self->onChecked(aIndex, aError, aCheck, aOnDeviceDone, aOnTaskFinished);
+		}
+	);
+}
+
+
+
+
+
+void ClockSweep::onChecked(
+	size_t aIndex,
+	const std::error_code & aError,
+	const DeviceClock::CheckResult & aCheck,
+	DeviceCallback aOnDeviceDone,
+	std::function<void()> aOnTaskFinished
+)
+{
+	auto & result = mResults[aIndex];
+	result.mError = aError;
+	result.mCheck = aCheck;
+	if (aOnDeviceDone)
+	{
+		aOnDeviceDone(result);
+	}
+	aOnTaskFinished();
+}
+
+
+
+
+
+ClockSweep::Summary ClockSweep::summarize() const
+{
+	Summary res{0, 0, 0, mResults};
+	for (const auto & result: mResults)
+	{
+		if (result.mError)
+		{
+			res.mNumFailed += 1;
+		}
+		else if (result.mCheck.mWasSynced)
+		{
+			res.mNumSynced += 1;
+		}
+		else
+		{
+			res.mNumInSync += 1;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include "DeviceClock.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class ParallelRunner;
+class Recorder;
+
+
+
+
+
+/** Checks the clocks of many devices in a single batched sweep, with a bounded number of devices being queried at
+the same time. Each device's clock is measured and resynced only if its offset is over the policy threshold (see
+DeviceClock::check()); the devices' drift histories are kept in their Recorder, so repeated sweeps over the same
+recorders improve the drift estimates. A device that doesn't finish within the timeout fails with Error::Timeout. */
+class ClockSweep:
+	public std::enable_shared_from_this<ClockSweep>
+{
+public:
+
+	/** The result of the check of a single device. */
+	struct Result
+	{
+		std::shared_ptr<Recorder> mRecorder;
+
+		/** The error of the check, or of the resync. */
+		std::error_code mError;
+
+		/** The measurement and the resync status; valid only if mError is success (or the resync failed). */
+		DeviceClock::CheckResult mCheck;
+	};
+
+	/** The summary of the whole sweep. */
+	struct Summary
+	{
+		/** The number of devices whose clock was within the threshold. */
+		size_t mNumInSync;
+
+		/** The number of devices whose clock was resynced. */
+		size_t mNumSynced;
+
+		/** The number of devices that failed (couldn't be queried or resynced). */
+		size_t mNumFailed;
+
+		/** The individual results, in the order the recorders were added. */
+		std::vector<Result> mResults;
+	};
+
+	/** The callback called whenever a single device is done. */
+	using DeviceCallback = std::function<void(const Result & aResult)>;
+
+	/** The callback called once all the devices are done. */
+	using FinishCallback = std::function<void(const Summary & aSummary)>;
+
+
+	/** Creates a new sweep with the specified policy, checking at most aMaxParallel devices at the same time.
+	aTimeout is the time in which each device's check (including the resync) must finish; the connection has no
+	request timeouts, so a device that stops responding would otherwise hold its slot forever. */
+	static std::shared_ptr<ClockSweep> create(
+		const DeviceClock::Policy & aPolicy,
+		size_t aMaxParallel,
+		std::chrono::milliseconds aTimeout = std::chrono::seconds(30)
+	);
+
+	/** Adds a recorder to be checked. The recorder needs to be connected and logged in.
+	Must be called before start(). */
+	void addRecorder(std::shared_ptr<Recorder> aRecorder);
+
+	/** Starts checking all the added recorders.
+	aOnDeviceDone may be nullptr. */
+	void start(DeviceCallback aOnDeviceDone, FinishCallback aOnFinished);
+
+
+protected:
+
+	const DeviceClock::Policy mPolicy;
+
+	/** The time in which each device's check must finish. */
+	const std::chrono::milliseconds mTimeout;
+
+	/** The runner limiting the number of devices being checked at the same time. */
+	std::shared_ptr<ParallelRunner> mRunner;
+
+	/** The recorders to check and their results. */
+	std::vector<Result> mResults;
+
+
+	ClockSweep(const DeviceClock::Policy & aPolicy, size_t aMaxParallel, std::chrono::milliseconds aTimeout);
+
+	/** Checks the device at the specified index, then reports it and finishes the task. */
+	void check(size_t aIndex, DeviceCallback aOnDeviceDone, std::function<void()> aOnTaskFinished);
+
+	/** Stores the outcome of the check (the result, or the timeout), reports the device and finishes the task. */
+	void onChecked(
+		size_t aIndex,
+		const std::error_code & aError,
+		const DeviceClock::CheckResult & aCheck,
+		DeviceCallback aOnDeviceDone,
+		std::function<void()> aOnTaskFinished
+	);
+
+	/** Builds the summary from mResults. */
+	Summary summarize() const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,194 @@
+#include "ConfigPush.hpp"
+
+#include <atomic>
+#include <asio.hpp>
+#include "Error.hpp"
+#include "ParallelRunner.hpp"
+#include "Recorder.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+ConfigPush::ConfigPush(const std::string & aConfigName, const nlohmann::json & aChanges, const Options & aOptions):
+	mConfigName(aConfigName),
+	mChanges(aChanges),
+	mOptions(aOptions),
+	mRunner(ParallelRunner::create(aOptions.mMaxParallel))
+{
+}
+
+
+
+
+
+std::shared_ptr<ConfigPush> ConfigPush::create(
+	const std::string & aConfigName,
+	const nlohmann::json & aChanges,
+	const Options & aOptions
+)
+{
+	return std::shared_ptr<ConfigPush>(new ConfigPush(aConfigName, aChanges, aOptions));
+}
+
+
+
+
+
+void ConfigPush::addRecorder(std::shared_ptr<Recorder> aRecorder, const nlohmann::json & aCachedCurrent)
+{
+	mResults.push_back({std::move(aRecorder), {}, 0, 0, {}});
+	mCachedCurrent.push_back(aCachedCurrent);
+}
+
+
+
+
+
+void ConfigPush::start(DeviceCallback aOnDeviceDone, FinishCallback aOnFinished)
+{
+	std::vector<ParallelRunner::Task> tasks;
+	tasks.reserve(mResults.size());
+	for (size_t i = 0; i < mResults.size(); ++i)
+	{
+		tasks.push_back(
+			[self = shared_from_this(), i, aOnDeviceDone](std::function<void()> aOnTaskFinished)
+			{
+				self->attempt(i, aOnDeviceDone, std::move(aOnTaskFinished));
+			}
+		);
+	}
+	mRunner->run(std::move(tasks),
+		[self = shared_from_this(), aOnFinished]()
+		{
+			if (aOnFinished)
+			{
+				aOnFinished(self->summarize());
+			}
+		}
+	);
+}
+
+
+
+
+
+void ConfigPush::attempt(size_t aIndex, DeviceCallback aOnDeviceDone, std::function<void()> aOnTaskFinished)
+{
+	auto & result = mResults[aIndex];
+	result.mNumAttempts += 1;
+
+	// Only the first attempt may use the cached config, the retries re-query it in case it was partially applied:
+	nlohmann::json current;
+	if (result.mNumAttempts == 1)
+	{
+		current = mCachedCurrent[aIndex];
+	}
+
+	// Whichever comes first, the response or the timeout, finishes the attempt; the other one is ignored:
+	auto isFinished = std::make_shared<std::atomic<bool>>(false);
+	auto timer = std::make_shared<asio::steady_timer>(Root::instance().ioContext(), mOptions.mAttemptTimeout);
+	timer->async_wait(
+		[self = shared_from_this(), isFinished, aIndex, aOnDeviceDone, aOnTaskFinished](const std::error_code & aTimerError)
+		{
+			if (aTimerError || isFinished->exchange(true))
+			{
+				return;
+			}
+			self->onAttemptFinished(aIndex, make_error_code(Error::Timeout), 0, {}, aOnDeviceDone, aOnTaskFinished);
+		}
+	);
+	result.mRecorder->updateConfig(mConfigName, mChanges, current,
+		[self = shared_from_this(), isFinished, timer, aIndex, aOnDeviceDone, aOnTaskFinished](
+			const std::error_code & aError,
+			size_t aNumSectionsSent,
+			const nlohmann::json & aNewConfig
+		)
+		{
+			if (isFinished->exchange(true))
+			{
+				return;
+			}
+			timer->cancel();
+			self->onAttemptFinished(aIndex, aError, aNumSectionsSent, aNewConfig, aOnDeviceDone, aOnTaskFinished);
+		}
+	);
+}
+
+
+
+
+
+void ConfigPush::onAttemptFinished(
+	size_t aIndex,
+	const std::error_code & aError,
+	size_t aNumSectionsSent,
+	const nlohmann::json & aNewConfig,
+	DeviceCallback aOnDeviceDone,
+	std::function<void()> aOnTaskFinished
+)
+{
+	auto & result = mResults[aIndex];
+	result.mError = aError;
+	if (aError && (result.mNumAttempts < mOptions.mMaxAttempts))
+	{
+		// Retry after a delay, still occupying the parallelism slot:
+		auto timer = std::make_shared<asio::steady_timer>(Root::instance().ioContext(), mOptions.mRetryDelay);
+		timer->async_wait(
+			[self = shared_from_this(), timer, aIndex, aOnDeviceDone, aOnTaskFinished](const std::error_code & aTimerError)
+			{
+				self->attempt(aIndex, aOnDeviceDone, aOnTaskFinished);
+			}
+		);
+		return;
+	}
+	if (!aError)
+	{
+		result.mNumSectionsSent = aNumSectionsSent;
+		result.mNewConfig = aNewConfig;
+	}
+	if (aOnDeviceDone)
+	{
+		aOnDeviceDone(result);
+	}
+	aOnTaskFinished();
+}
+
+
+
+
+
+ConfigPush::Summary ConfigPush::summarize() const
+{
+	Summary res{0, 0, 0, mResults};
+	for (const auto & result: mResults)
+	{
+		if (result.mError)
+		{
+			res.mNumFailed += 1;
+		}
+		else if (result.mNumSectionsSent > 0)
+		{
+			res.mNumChanged += 1;
+		}
+		else
+		{
+			res.mNumUnchanged += 1;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class ParallelRunner;
+class Recorder;
+
+
+
+
+
+/** Pushes a config change to many devices in parallel.
+Each device gets only the config sections that actually change (see Recorder::updateConfig()), at most the
+specified number of devices is updated at the same time, and failed devices (including those that don't respond
+within the attempt timeout) are retried after a delay.
+Once all the devices are done, a summary is reported. */
+class ConfigPush:
+	public std::enable_shared_from_this<ConfigPush>
+{
+public:
+
+	/** The tunables of the push. */
+	struct Options
+	{
+		/** The maximum number of devices being updated at the same time. */
+		size_t mMaxParallel = 32;
+
+		/** The maximum number of attempts per device (including the first one). */
+		unsigned mMaxAttempts = 3;
+
+		/** The delay before retrying a failed device. */
+		std::chrono::milliseconds mRetryDelay = std::chrono::seconds(5);
+
+		/** The time in which a single attempt must finish; the connection has no request timeouts, so a device that
+		stops responding would otherwise hold its slot forever. The attempt then fails with Error::Timeout. */
+		std::chrono::milliseconds mAttemptTimeout = std::chrono::seconds(30);
+	};
+
+	/** The result of the push to a single device. */
+	struct Result
+	{
+		std::shared_ptr<Recorder> mRecorder;
+
+		/** The error of the last attempt; success if the device was updated (or needed no update). */
+		std::error_code mError;
+
+		/** The number of attempts made. */
+		unsigned mNumAttempts;
+
+		/** The number of config sections sent in the successful attempt; 0 if the device already had the config. */
+		size_t mNumSectionsSent;
+
+		/** The resulting config of the device, if successful; may be cached for the next push. */
+		nlohmann::json mNewConfig;
+	};
+
+	/** The summary of the whole push. */
+	struct Summary
+	{
+		/** The number of devices whose config was changed. */
+		size_t mNumChanged;
+
+		/** The number of devices that already had the config. */
+		size_t mNumUnchanged;
+
+		/** The number of devices that failed in all the attempts. */
+		size_t mNumFailed;
+
+		/** The individual results, in the order the recorders were added. */
+		std::vector<Result> mResults;
+	};
+
+	/** The callback called whenever a single device is done (successfully or not). */
+	using DeviceCallback = std::function<void(const Result & aResult)>;
+
+	/** The callback called once all the devices are done. */
+	using FinishCallback = std::function<void(const Summary & aSummary)>;
+
+
+	/** Creates a new push of the specified changes to the specified config (see Recorder::updateConfig()). */
+	static std::shared_ptr<ConfigPush> create(
+		const std::string & aConfigName,
+		const nlohmann::json & aChanges,
+		const Options & aOptions
+	);
+
+	/** Adds a recorder to be updated. The recorder needs to be connected and logged in.
+	aCachedCurrent is the device's current config, if known (null to query it from the device).
+	Must be called before start(). */
+	void addRecorder(std::shared_ptr<Recorder> aRecorder, const nlohmann::json & aCachedCurrent = nullptr);
+
+	/** Starts updating all the added recorders.
+	aOnDeviceDone may be nullptr. */
+	void start(DeviceCallback aOnDeviceDone, FinishCallback aOnFinished);
+
+
+protected:
+
+	const std::string mConfigName;
+
+	const nlohmann::json mChanges;
+
+	const Options mOptions;
+
+	/** The runner limiting the number of devices being updated at the same time. */
+	std::shared_ptr<ParallelRunner> mRunner;
+
+	/** The recorders to update and their results. */
+	std::vector<Result> mResults;
+
+	/** The cached current configs, indexed the same as mResults (null if not cached). */
+	std::vector<nlohmann::json> mCachedCurrent;
+
+
+	ConfigPush(const std::string & aConfigName, const nlohmann::json & aChanges, const Options & aOptions);
+
+	/** Makes a single attempt at updating the device at the specified index; retries on failure. */
+	void attempt(size_t aIndex, DeviceCallback aOnDeviceDone, std::function<void()> aOnTaskFinished);
+
+	/** Processes the outcome of an attempt (the device's response, or the timeout): retries or reports the device. */
+	void onAttemptFinished(
+		size_t aIndex,
+		const std::error_code & aError,
+		size_t aNumSectionsSent,
+		const nlohmann::json & aNewConfig,
+		DeviceCallback aOnDeviceDone,
+		std::function<void()> aOnTaskFinished
+	);
+
+	/** Builds the summary from mResults. */
+	Summary summarize() const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
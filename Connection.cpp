@@ -1,5 +1,7 @@
 #include "Connection.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <fmt/format.h>
 
 #include "Root.hpp"
@@ -26,24 +28,24 @@ using LockGuard = std::lock_guard<std::recursive_mutex>;
 ////////////////////////////////////////////////////////////////////////////////
 // Globals:
 
-/** Adds 2 bytes into the output, containing the specified 16-bit value (Little-endian). */
-static void writeUint16(std::vector<char> & aOutput, uint16_t aValue)
+/** Writes 2 bytes into the output, containing the specified 16-bit value (Little-endian). */
+static void writeUint16(char * aOutput, uint16_t aValue)
 {
-	aOutput.push_back(static_cast<char>(aValue        & 0xff));
-	aOutput.push_back(static_cast<char>((aValue >> 8) & 0xff));
+	aOutput[0] = static_cast<char>(aValue        & 0xff);
+	aOutput[1] = static_cast<char>((aValue >> 8) & 0xff);
 }
 
 
 
 
 
-/** Adds 4 bytes into the output, containing the specified 32-bit value (Little-endian). */
-static void writeUint32(std::vector<char> & aOutput, uint32_t aValue)
+/** Writes 4 bytes into the output, containing the specified 32-bit value (Little-endian). */
+static void writeUint32(char * aOutput, uint32_t aValue)
 {
-	aOutput.push_back(static_cast<char>(aValue         & 0xff));
-	aOutput.push_back(static_cast<char>((aValue >> 8)  & 0xff));
-	aOutput.push_back(static_cast<char>((aValue >> 16) & 0xff));
-	aOutput.push_back(static_cast<char>((aValue >> 24) & 0xff));
+	aOutput[0] = static_cast<char>(aValue         & 0xff);
+	aOutput[1] = static_cast<char>((aValue >> 8)  & 0xff);
+	aOutput[2] = static_cast<char>((aValue >> 16) & 0xff);
+	aOutput[3] = static_cast<char>((aValue >> 24) & 0xff);
 }
 
 
@@ -72,6 +74,287 @@ static uint32_t parseUint32(const char * aInput)
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// CommandTable:
+
+/** The function processing a pushed message. */
+using PushMethod = void (Connection::*)(const BufferSlice & aPayload);
+
+/** A single message type in the CommandTable. */
+struct CommandEntry
+{
+	Connection::CommandInfo mInfo;
+
+	/** The function processing the message, if pushed with a dedicated notify*() function; nullptr otherwise. */
+	PushMethod mOnPush;
+};
+
+using CT = Connection::CommandType;
+using PK = Connection::PayloadKind;
+
+
+
+
+
+/** A request that gets the specified response. */
+static constexpr CommandEntry req(CT aType, const char * aName, CT aResponseType, PK aPayloadKind)
+{
+	return {{aType, aName, aResponseType, false, aPayloadKind}, nullptr};
+}
+
+
+
+
+
+/** A message that gets no response (a response, a one-way data message). */
+static constexpr CommandEntry msg(CT aType, const char * aName, PK aPayloadKind)
+{
+	return {{aType, aName, aType, false, aPayloadKind}, nullptr};
+}
+
+
+
+
+
+/** A message pushed by the device; aOnPush is nullptr for the pushes handled through Connection::setPushHandler(). */
+static constexpr CommandEntry push(CT aType, const char * aName, PK aPayloadKind, PushMethod aOnPush)
+{
+	return {{aType, aName, aType, true, aPayloadKind}, aOnPush};
+}
+
+
+
+
+
+/** The compile-time table describing all the message types.
+A friend of Connection, so that the pushed messages can be bound to the protected notify*() functions. */
+class CommandTable
+{
+public:
+
+	/** All the message types, in the CommandType order. */
+	static constexpr CommandEntry Entries[] =
+	{
+		req(CT::Login_Req, "Login_Req", CT::Login_Resp, PK::Json),
+		msg(CT::Login_Resp, "Login_Resp", PK::Json),
+		req(CT::Logout_Req, "Logout_Req", CT::Logout_Resp, PK::Json),
+		msg(CT::Logout_Resp, "Logout_Resp", PK::Json),
+		req(CT::ForceLogout_Req, "ForceLogout_Req", CT::ForceLogout_Resp, PK::Json),
+		msg(CT::ForceLogout_Resp, "ForceLogout_Resp", PK::Json),
+		req(CT::KeepAlive_Req, "KeepAlive_Req", CT::KeepAlive_Resp, PK::Json),
+		msg(CT::KeepAlive_Resp, "KeepAlive_Resp", PK::Json),
+		req(CT::SysInfo_Req, "SysInfo_Req", CT::SysInfo_Resp, PK::Json),
+		msg(CT::SysInfo_Resp, "SysInfo_Resp", PK::Json),
+		req(CT::ConfigSet_Req, "ConfigSet_Req", CT::ConfigSet_Resp, PK::Json),
+		msg(CT::ConfigSet_Resp, "ConfigSet_Resp", PK::Json),
+		req(CT::ConfigGet_Req, "ConfigGet_Req", CT::ConfigGet_Resp, PK::Json),
+		msg(CT::ConfigGet_Resp, "ConfigGet_Resp", PK::Json),
+		req(CT::DefaultConfigGet_Req, "DefaultConfigGet_Req", CT::DefaultConfigGet_Resp, PK::Json),
+		msg(CT::DefaultConfigGet_Resp, "DefaultConfigGet_Resp", PK::Json),
+		req(CT::ConfigChannelTitleSet_Req, "ConfigChannelTitleSet_Req", CT::ConfigChannelTitleSet_Resp, PK::Json),
+		msg(CT::ConfigChannelTitleSet_Resp, "ConfigChannelTitleSet_Resp", PK::Json),
+		req(CT::ConfigChannelTitleGet_Req, "ConfigChannelTitleGet_Req", CT::ConfigChannelTitleGet_Resp, PK::Json),
+		msg(CT::ConfigChannelTitleGet_Resp, "ConfigChannelTitleGet_Resp", PK::Json),
+		req(CT::ConfigChannelTileDotSet_Req, "ConfigChannelTileDotSet_Req", CT::ConfigChannelTileDotSet_Resp, PK::Json),
+		msg(CT::ConfigChannelTileDotSet_Resp, "ConfigChannelTileDotSet_Resp", PK::Json),
+		req(CT::SystemDebug_Req, "SystemDebug_Req", CT::SystemDebug_Resp, PK::Json),
+		msg(CT::SystemDebug_Resp, "SystemDebug_Resp", PK::Json),
+		req(CT::AbilityGet_Req, "AbilityGet_Req", CT::AbilityGet_Resp, PK::Json),
+		msg(CT::AbilityGet_Resp, "AbilityGet_Resp", PK::Json),
+		req(CT::Ptz_Req, "Ptz_Req", CT::Ptz_Resp, PK::Json),
+		msg(CT::Ptz_Resp, "Ptz_Resp", PK::Json),
+		req(CT::Monitor_Req, "Monitor_Req", CT::Monitor_Resp, PK::Json),
+		msg(CT::Monitor_Resp, "Monitor_Resp", PK::Json),
+		push(CT::Monitor_Data, "Monitor_Data", PK::Binary, &Connection::notifyMediaData),
+		req(CT::MonitorClaim_Req, "MonitorClaim_Req", CT::MonitorClaim_Resp, PK::Json),
+		msg(CT::MonitorClaim_Resp, "MonitorClaim_Resp", PK::Json),
+		req(CT::Play_Req, "Play_Req", CT::Play_Resp, PK::Json),
+		msg(CT::Play_Resp, "Play_Resp", PK::Json),
+		push(CT::Play_Data, "Play_Data", PK::Binary, nullptr),
+		push(CT::Play_Eof, "Play_Eof", PK::Json, nullptr),
+		req(CT::PlayClaim_Req, "PlayClaim_Req", CT::PlayClaim_Resp, PK::Json),
+		msg(CT::PlayClaim_Resp, "PlayClaim_Resp", PK::Json),
+		push(CT::DownloadData, "DownloadData", PK::Binary, nullptr),
+		req(CT::Talk_Req, "Talk_Req", CT::Talk_Resp, PK::Json),
+		msg(CT::Talk_Resp, "Talk_Resp", PK::Json),
+		msg(CT::TalkToNvr_Data, "TalkToNvr_Data", PK::Binary),
+		push(CT::TalkFromNvr_Data, "TalkFromNvr_Data", PK::Binary, &Connection::notifyTalkData),
+		req(CT::TalkClaim_Req, "TalkClaim_Req", CT::TalkClaim_Resp, PK::Json),
+		msg(CT::TalkClaim_Resp, "TalkClaim_Resp", PK::Json),
+		req(CT::FileSearch_Req, "FileSearch_Req", CT::FileSearch_Resp, PK::Json),
+		msg(CT::FileSearch_Resp, "FileSearch_Resp", PK::Json),
+		req(CT::LogSearch_Req, "LogSearch_Req", CT::LogSearch_Resp, PK::Json),
+		msg(CT::LogSearch_Resp, "LogSearch_Resp", PK::Json),
+		req(CT::FileSearchByTime_Req, "FileSearchByTime_Req", CT::FileSearchByTime_Resp, PK::Json),
+		msg(CT::FileSearchByTime_Resp, "FileSearchByTime_Resp", PK::Json),
+		req(CT::SysMgr_Req, "SysMgr_Req", CT::SysMgr_Resp, PK::Json),
+		msg(CT::SysMgr_Resp, "SysMgr_Resp", PK::Json),
+		req(CT::TimeQuery_Req, "TimeQuery_Req", CT::TimeQuery_Resp, PK::Json),
+		msg(CT::TimeQuery_Resp, "TimeQuery_Resp", PK::Json),
+		req(CT::DiskMgr_Req, "DiskMgr_Req", CT::DiskMgr_Resp, PK::Json),
+		msg(CT::DiskMgr_Resp, "DiskMgr_Resp", PK::Json),
+		req(CT::FullAuthorityListGet_Req, "FullAuthorityListGet_Req", CT::FullAuthorityListGet_Resp, PK::Json),
+		msg(CT::FullAuthorityListGet_Resp, "FullAuthorityListGet_Resp", PK::Json),
+		req(CT::UsersGet_Req, "UsersGet_Req", CT::UsersGet_Resp, PK::Json),
+		msg(CT::UsersGet_Resp, "UsersGet_Resp", PK::Json),
+		req(CT::GroupsGet_Req, "GroupsGet_Req", CT::GroupsGet_Resp, PK::Json),
+		msg(CT::GroupsGet_Resp, "GroupsGet_Resp", PK::Json),
+		req(CT::AddGroup_Req, "AddGroup_Req", CT::AddGroup_Resp, PK::Json),
+		msg(CT::AddGroup_Resp, "AddGroup_Resp", PK::Json),
+		req(CT::ModifyGroup_Req, "ModifyGroup_Req", CT::ModifyGroup_Resp, PK::Json),
+		msg(CT::ModifyGroup_Resp, "ModifyGroup_Resp", PK::Json),
+		req(CT::DeleteGroup_Req, "DeleteGroup_Req", CT::DeleteGroup_Resp, PK::Json),
+		msg(CT::DeleteGroup_Resp, "DeleteGroup_Resp", PK::Json),
+		req(CT::AddUser_Req, "AddUser_Req", CT::AddUser_Resp, PK::Json),
+		msg(CT::AddUser_Resp, "AddUser_Resp", PK::Json),
+		req(CT::ModifyUser_Req, "ModifyUser_Req", CT::ModifyUser_Resp, PK::Json),
+		msg(CT::ModifyUser_Resp, "ModifyUser_Resp", PK::Json),
+		req(CT::DeleteUser_Req, "DeleteUser_Req", CT::DeleteUser_Resp, PK::Json),
+		msg(CT::DeleteUser_Resp, "DeleteUser_Resp", PK::Json),
+		req(CT::ModifyPassword_Req, "ModifyPassword_Req", CT::ModifyPassword_Resp, PK::Json),
+		msg(CT::ModifyPassword_Resp, "ModifyPassword_Resp", PK::Json),
+		req(CT::Guard_Req, "Guard_Req", CT::Guard_Resp, PK::Json),
+		msg(CT::Guard_Resp, "Guard_Resp", PK::Json),
+		req(CT::Unguard_Req, "Unguard_Req", CT::Unguard_Resp, PK::Json),
+		msg(CT::Unguard_Resp, "Unguard_Resp", PK::Json),
+		push(CT::Alarm_Req, "Alarm_Req", PK::Json, &Connection::notifyAlarm),
+		msg(CT::Alarm_Resp, "Alarm_Resp", PK::Json),
+		req(CT::NetAlarm_Req, "NetAlarm_Req", CT::NetAlarm_Resp, PK::Json),
+		msg(CT::NetAlarm_Resp, "NetAlarm_Resp", PK::Json),
+		push(CT::AlarmCenterMsg_Req, "AlarmCenterMsg_Req", PK::Json, nullptr),
+		req(CT::SysUpgrade_Req, "SysUpgrade_Req", CT::SysUpgrade_Resp, PK::Json),
+		msg(CT::SysUpgrade_Resp, "SysUpgrade_Resp", PK::Json),
+		req(CT::SysUpgradeData_Req, "SysUpgradeData_Req", CT::SysUpgradeData_Resp, PK::Binary),
+		msg(CT::SysUpgradeData_Resp, "SysUpgradeData_Resp", PK::Json),
+		push(CT::SysUpgradeProgress, "SysUpgradeProgress", PK::Json, &Connection::notifyUpgradeProgress),
+		req(CT::SysUpgradeInfo_Req, "SysUpgradeInfo_Req", CT::SysUpgradeInfo_Resp, PK::Json),
+		msg(CT::SysUpgradeInfo_Resp, "SysUpgradeInfo_Resp", PK::Json),
+		req(CT::IPSearch_Req, "IPSearch_Req", CT::IPSearch_Resp, PK::Json),
+		msg(CT::IPSearch_Resp, "IPSearch_Resp", PK::Json),
+		req(CT::NetSnap_Req, "NetSnap_Req", CT::NetSnap_Resp, PK::Json),
+		msg(CT::NetSnap_Resp, "NetSnap_Resp", PK::Binary),
+		req(CT::SetIFrame_Req, "SetIFrame_Req", CT::SetIFrame_Resp, PK::Json),
+		msg(CT::SetIFrame_Resp, "SetIFrame_Resp", PK::Json),
+		req(CT::SyncTime_Req, "SyncTime_Req", CT::SyncTime_Resp, PK::Json),
+		msg(CT::SyncTime_Resp, "SyncTime_Resp", PK::Json),
+	};
+};
+
+constexpr CommandEntry CommandTable::Entries[];
+
+static constexpr size_t NumCommandEntries = sizeof(CommandTable::Entries) / sizeof(CommandTable::Entries[0]);
+
+/** The range of the message type values, the bounds of the dense index. */
+static constexpr uint16_t MinCommandType = 1000;
+static constexpr uint16_t MaxCommandType = 1591;
+static constexpr size_t NumCommandTypes = MaxCommandType - MinCommandType + 1;
+
+
+
+
+
+/** The dense index over CommandTable: for each message type value, its entry and its push slot (-1 if none).
+The pushes without a dedicated notify*() function get consecutive slots in Connection::mPushHandlers, in the table
+order, so that dispatching any push is a single array lookup, no matter how many push types there are. */
+struct CommandIndex
+{
+	int16_t mEntry[NumCommandTypes];
+	int8_t mPushSlot[NumCommandTypes];
+	size_t mNumPushSlots;
+
+	constexpr CommandIndex():
+		mEntry{},
+		mPushSlot{},
+		mNumPushSlots(0)
+	{
+		for (size_t i = 0; i < NumCommandTypes; ++i)
+		{
+			mEntry[i] = -1;
+			mPushSlot[i] = -1;
+		}
+		for (size_t i = 0; i < NumCommandEntries; ++i)
+		{
+			const auto & entry = CommandTable::Entries[i];
+			auto idx = static_cast<size_t>(entry.mInfo.mType) - MinCommandType;
+			mEntry[idx] = static_cast<int16_t>(i);
+			if (entry.mInfo.mIsPushed && (entry.mOnPush == nullptr))
+			{
+				mPushSlot[idx] = static_cast<int8_t>(mNumPushSlots);
+				mNumPushSlots += 1;
+			}
+		}
+	}
+};
+
+static constexpr CommandIndex TheCommandIndex{};
+
+
+
+
+
+/** Returns true if the CommandTable entries are sorted by the type, within the index bounds, and each request is
+paired either with itself (no response) or with the message type directly following it. */
+static constexpr bool isCommandTableValid()
+{
+	for (size_t i = 0; i < NumCommandEntries; ++i)
+	{
+		auto type = static_cast<size_t>(CommandTable::Entries[i].mInfo.mType);
+		if ((type < MinCommandType) || (type > MaxCommandType))
+		{
+			return false;
+		}
+		if ((i > 0) && (type <= static_cast<size_t>(CommandTable::Entries[i - 1].mInfo.mType)))
+		{
+			return false;
+		}
+		auto responseType = static_cast<size_t>(CommandTable::Entries[i].mInfo.mResponseType);
+		if ((responseType != type) && (responseType != type + 1))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(isCommandTableValid(), "The command table is not sorted, or pairs a request with an unexpected response");
+static_assert(
+	TheCommandIndex.mNumPushSlots == Connection::NumGenericPushTypes,
+	"Connection::NumGenericPushTypes doesn't match the command table"
+);
+
+
+
+
+
+/** Returns the CommandTable entry for the specified message type, nullptr if not known. */
+static const CommandEntry * findCommand(uint16_t aMessageType)
+{
+	if ((aMessageType < MinCommandType) || (aMessageType > MaxCommandType))
+	{
+		return nullptr;
+	}
+	auto idx = TheCommandIndex.mEntry[aMessageType - MinCommandType];
+	return (idx < 0) ? nullptr : &CommandTable::Entries[idx];
+}
+
+
+
+
+
+/** Returns the push slot of the specified message type (see Connection::setPushHandler()), -1 if none. */
+static int commandPushSlot(uint16_t aMessageType)
+{
+	if ((aMessageType < MinCommandType) || (aMessageType > MaxCommandType))
+	{
+		return -1;
+	}
+	return TheCommandIndex.mPushSlot[aMessageType - MinCommandType];
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Connection:
 
@@ -79,7 +362,16 @@ Connection::Connection():
 	mSessionID(0),
 	mSequence(0),
 	mAliveInterval(0),
-	mKeepAliveTimer(Root::instance().ioContext())
+	mKeepAliveTimer(Root::instance().ioContext()),
+	mMaxOutgoingPacketPayload(Protocol::DefaultMaxOutgoingPacketPayload),
+	mMaxIncomingMessageSize(Protocol::DefaultMaxIncomingMessageSize),
+	mMaxResyncBytes(0),
+	mNumResyncBytes(0),
+	mNumResyncs(0),
+	mNumBytesSkipped(0),
+	mAlarmSubscribers(std::make_shared<AlarmSubscribers>()),
+	mNextAlarmSubscriptionId(1),
+	mMonitorAlarmsSubscriptionId(0)
 {
 }
 
@@ -160,7 +452,7 @@ void Connection::getSysInfo(NamedJsonCallback aOnFinish, const std::string & aIn
 		{"SessionID", sessionIDHexStr()},
 		{"Name",      aInfoName},
 	};
-	queueCommand(CommandType::SysInfo_Req, CommandType::SysInfo_Resp, js.dump(),
+	queueCommandJson(CommandType::SysInfo_Req, CommandType::SysInfo_Resp, js.dump(),
 		[aOnFinish, aInfoName](const std::error_code & aError, const nlohmann::json & aResponse)
 		{
 			aOnFinish(aError, aInfoName, aResponse);
@@ -179,7 +471,7 @@ void Connection::getAbility(NamedJsonCallback aOnFinish, const std::string & aAb
 		{"SessionID", sessionIDHexStr()},
 		{"Name",      aAbilityName},
 	};
-	queueCommand(CommandType::AbilityGet_Req, CommandType::AbilityGet_Resp, js.dump(),
+	queueCommandJson(CommandType::AbilityGet_Req, CommandType::AbilityGet_Resp, js.dump(),
 		[aOnFinish, aAbilityName](const std::error_code & aError, const nlohmann::json & aResponse)
 		{
 			aOnFinish(aError, aAbilityName, aResponse);
@@ -198,7 +490,7 @@ void Connection::getConfig(NamedJsonCallback aOnFinish, const std::string & aCon
 		{"SessionID", sessionIDHexStr()},
 		{"Name",      aConfigName},
 	};
-	queueCommand(CommandType::ConfigGet_Req, CommandType::ConfigGet_Resp, js.dump(),
+	queueCommandJson(CommandType::ConfigGet_Req, CommandType::ConfigGet_Resp, js.dump(),
 		[aOnFinish, aConfigName](const std::error_code & aError, const nlohmann::json & aResponse)
 		{
 			aOnFinish(aError, aConfigName, aResponse);
@@ -210,13 +502,74 @@ void Connection::getConfig(NamedJsonCallback aOnFinish, const std::string & aCon
 
 
 
+void Connection::setConfig(const std::string & aConfigName, const nlohmann::json & aConfig, JsonCallback aOnFinish)
+{
+	nlohmann::json js =
+	{
+		{"Name",      aConfigName},
+		{"SessionID", sessionIDHexStr()},
+		{aConfigName, aConfig},
+	};
+	queueCommandJson(CommandType::ConfigSet_Req, CommandType::ConfigSet_Resp, js.dump(), std::move(aOnFinish));
+}
+
+
+
+
+
 void Connection::monitorAlarms(Connection::AlarmCallback aOnAlarm)
 {
-	std::swap(aOnAlarm, mOnAlarm);
+	// Subscribe the new monitor first, so that replacing a monitor doesn't ask the device to start reporting again:
+	AlarmSubscriptionId newId = 0;
 	if (aOnAlarm != nullptr)
+	{
+		newId = subscribeAlarms({}, std::move(aOnAlarm));
+	}
+	AlarmSubscriptionId oldId;
+	{
+		LockGuard lg(mMtxTransfer);
+		oldId = mMonitorAlarmsSubscriptionId;
+		mMonitorAlarmsSubscriptionId = newId;
+	}
+	if (oldId != 0)
+	{
+		unsubscribeAlarms(oldId);
+	}
+}
+
+
+
+
+
+Connection::AlarmSubscriptionId Connection::subscribeAlarms(const AlarmFilter & aFilter, AlarmCallback aOnAlarm)
+{
+	auto subscriber = std::make_shared<AlarmSubscriber>();
+	subscriber->mChannelMask = aFilter.mChannelMask;
+	subscriber->mEventTypes.reserve(aFilter.mEventTypes.size());
+	for (const auto & eventType: aFilter.mEventTypes)
+	{
+		subscriber->mEventTypes.push_back(mAlarmEventTypes.intern(eventType));
+	}
+	std::sort(subscriber->mEventTypes.begin(), subscriber->mEventTypes.end());
+	subscriber->mEventTypes.erase(
+		std::unique(subscriber->mEventTypes.begin(), subscriber->mEventTypes.end()),
+		subscriber->mEventTypes.end()
+	);
+	subscriber->mOnAlarm = std::move(aOnAlarm);
+
+	AlarmSubscriptionId id;
+	bool wasMonitoring;
+	{
+		LockGuard lg(mMtxTransfer);
+		wasMonitoring = !mAlarmSubscriptions.empty();
+		id = mNextAlarmSubscriptionId++;
+		mAlarmSubscriptions[id] = std::move(subscriber);
+		rebuildAlarmSubscribersLocked();
+	}
+	if (wasMonitoring)
 	{
 		// The device was already monitoring for alarms, no need to ask it to start
-		return;
+		return id;
 	}
 
 	// The alarms were not monitored from the device before, start monitoring:
@@ -226,57 +579,54 @@ void Connection::monitorAlarms(Connection::AlarmCallback aOnAlarm)
 		{"SessionID", sessionIDHexStr()},
 	};
 	queueCommand(CommandType::Guard_Req, CommandType::Guard_Resp, js.dump(),
-		[aOnAlarm](const std::error_code & aError, const nlohmann::json & aResponse)
+		[self = selfPtr()](const std::error_code & aError, const nlohmann::json & aResponse)
 		{
-			// If there was an error subscribing to notifications, notify the callback:
+			// If there was an error subscribing to notifications, notify the subscribers:
 			if (aError)
 			{
-				return aOnAlarm(aError, -1, false, {}, {});
+				self->notifyAlarmError(aError, {});
 			}
 		}
 	);
+	return id;
 }
 
 
 
 
 
-void Connection::capturePicture(int aChannel, PictureCallback aOnFinish)
+bool Connection::unsubscribeAlarms(AlarmSubscriptionId aSubscriptionId)
 {
-	nlohmann::json js =
+	LockGuard lg(mMtxTransfer);
+	if (mAlarmSubscriptions.erase(aSubscriptionId) == 0)
 	{
-		{"Name", "OPSNAP"},
-		{"OPSNAP",
-			{
-				{ "Channel", aChannel },
-			},
-		},
-	};
-	queueCommandRaw(CommandType::NetSnap_Req, CommandType::NetSnap_Resp, js.dump(),
-		[aOnFinish](const std::error_code & aError, const char * aData, size_t aSize)
+		return false;
+	}
+	rebuildAlarmSubscribersLocked();
+	return true;
+}
+
+
+
+
+
+void Connection::capturePicture(int aChannel, PictureCallback aOnFinish)
+{
+	queueCommandRaw(CommandType::NetSnap_Req, CommandType::NetSnap_Resp, capturePictureRequest(aChannel),
+		[aOnFinish](const std::error_code & aError, const BufferSlice & aData)
 		{
 			if (aError)
 			{
-				return aOnFinish(aError, aData, aSize);
+				return aOnFinish(aError, nullptr, 0);
 			}
-
-			// Some firmwares return JSON error, others return raw binary data. Try to parse to see if there's an error:
-			if (aSize < 500)
+			auto err = checkPictureResponse(aData.data(), aData.size());
+			if (err)
 			{
-				auto j = nlohmann::json::parse(aData, aData + aSize, nullptr, false);
-				if (!j.is_discarded())
-				{
-					auto itr = j.find("Ret");
-					if ((itr != j.end()) && (itr->is_number()))
-					{
-						// An error was found, report it:
-						return aOnFinish(make_error_code(static_cast<Error>(*itr)), nullptr, 0);
-					}
-				}
+				return aOnFinish(err, nullptr, 0);
 			}
 
 			// Probably a binary blob representing the picture, call the callback:
-			aOnFinish(aError, aData, aSize);
+			aOnFinish(aError, aData.data(), aData.size());
 		}
 	);
 }
@@ -285,95 +635,66 @@ void Connection::capturePicture(int aChannel, PictureCallback aOnFinish)
 
 
 
-void Connection::onLoginResp(const std::error_code & aError, const nlohmann::json & aResponse, JsonCallback aOnFinish)
+void Connection::capturePictureSlice(int aChannel, SliceCallback aOnFinish)
 {
-	if (aError)
-	{
-		return aOnFinish(aError, aResponse);
-	}
-
-	// Login was successful
-	// Set the session ID from the response:
-	auto itr = aResponse.find("SessionID");
-	if (itr == aResponse.end())
-	{
-		return aOnFinish(Error::ResponseMissingExpectedField, aResponse);
-	}
-	mSessionID = std::stoi(std::string(*itr), nullptr, 0);
-
-	// Schedule a keepalive packet according to the response:
-	itr = aResponse.find("AliveInterval");
-	if (itr == aResponse.end())
-	{
-		return aOnFinish(Error::ResponseMissingExpectedField, aResponse);
-	}
-	mAliveInterval = *itr;
-	if (mAliveInterval > 0)
-	{
-		mKeepAliveTimer.expires_from_now(std::chrono::seconds(mAliveInterval / 2));
-		mKeepAliveTimer.async_wait(
-			[self = selfPtr()](const std::error_code & aError)
+	queueCommandRaw(CommandType::NetSnap_Req, CommandType::NetSnap_Resp, capturePictureRequest(aChannel),
+		[aOnFinish](const std::error_code & aError, const BufferSlice & aData)
+		{
+			if (aError)
 			{
-				self->onKeepAliveTimer(aError);
+				return aOnFinish(aError, {});
 			}
-		);
-	}
-
-	// Report the success to the callback:
-	return aOnFinish(aError, aResponse);
+			auto err = checkPictureResponse(aData.data(), aData.size());
+			if (err)
+			{
+				return aOnFinish(err, {});
+			}
+			aOnFinish(aError, aData);
+		}
+	);
 }
 
 
 
 
 
-void Connection::onGetChannelNamesResp(const std::error_code & aError, const nlohmann::json & aResponse, ChannelNamesCallback aOnFinish)
+void Connection::getConfigSlice(NamedSliceCallback aOnFinish, const std::string & aConfigName)
 {
-	if (aError)
-	{
-		return aOnFinish(aError, {});
-	}
-
-	// Parse the channel names from the Json:
-	auto itr = aResponse.find("ChannelTitle");
-	if (itr == aResponse.end())
-	{
-		return aOnFinish(make_error_code(Error::ResponseMissingExpectedField), {});
-	}
-	std::vector<std::string> channelTitles;
-	for (const auto & cht: *itr)
+	nlohmann::json js =
 	{
-		channelTitles.push_back(cht);
-	}
-	return aOnFinish({}, channelTitles);
+		{"SessionID", sessionIDHexStr()},
+		{"Name",      aConfigName},
+	};
+	queueCommandRaw(CommandType::ConfigGet_Req, CommandType::ConfigGet_Resp, js.dump(),
+		[self = selfPtr(), aOnFinish, aConfigName](const std::error_code & aError, const BufferSlice & aData)
+		{
+			nlohmann::json j;
+			auto err = self->processJsonResponse(aError, aData, j);
+			if (err == Error::MalformedResponse)
+			{
+				// The connection has been dropped, don't report anything
+				return;
+			}
+			aOnFinish(err, aConfigName, aData);
+		}
+	);
 }
 
 
 
 
 
-void Connection::onKeepAliveTimer(const std::error_code & aError)
+void Connection::getConfigRaw(const std::string & aConfigName, SliceCallback aOnFinish)
 {
-	if (aError)
-	{
-		// Silently ignore all scheduling errors
-		return;
-	}
 	nlohmann::json js =
 	{
-		{"Name", "KeepAlive"},
 		{"SessionID", sessionIDHexStr()},
+		{"Name",      aConfigName},
 	};
-	queueCommand(CommandType::KeepAlive_Req, CommandType::KeepAlive_Resp, js.dump(),
-		[](const std::error_code & aError, const nlohmann::json & aResponse)
+	queueCommandRaw(CommandType::ConfigGet_Req, CommandType::ConfigGet_Resp, js.dump(),
+		[aOnFinish](const std::error_code & aError, const BufferSlice & aData)
 		{
-		}
-	);
-	mKeepAliveTimer.expires_from_now(std::chrono::seconds(mAliveInterval / 2));
-	mKeepAliveTimer.async_wait(
-		[self = selfPtr()](const std::error_code & aError)
-		{
-			self->onKeepAliveTimer(aError);
+			aOnFinish(aError, aError ? BufferSlice() : aData);
 		}
 	);
 }
@@ -381,83 +702,56 @@ void Connection::onKeepAliveTimer(const std::error_code & aError)
 
 
 
-std::string Connection::sessionIDHexStr() const
+
+void Connection::setConfigRaw(const std::string & aConfigName, const std::string & aConfigJson, JsonCallback aOnFinish)
 {
-	return fmt::format("{:#08x}", mSessionID.load());
+	std::string payload;
+	payload.reserve(aConfigJson.size() + 2 * aConfigName.size() + 64);
+	payload.append("{\"Name\":\"").append(aConfigName);
+	payload.append("\",\"SessionID\":\"").append(sessionIDHexStr());
+	payload.append("\",\"").append(aConfigName).append("\":");
+	payload.append(aConfigJson);
+	payload.push_back('}');
+	queueCommandJson(CommandType::ConfigSet_Req, CommandType::ConfigSet_Resp, payload, std::move(aOnFinish));
 }
 
 
 
 
 
-void Connection::queueCommandRaw(
-	CommandType aCommandType,
-	CommandType aExpectedResponseType,
-	const std::string & aPayload,
-	RawDataCallback aOnFinish
-)
+void Connection::startUpgrade(JsonCallback aOnFinish)
 {
-	// Put the expected response type and handler to the incoming queue:
+	nlohmann::json js =
 	{
-		LockGuard lg(mMtxTransfer);
-		mIncomingQueue.emplace_back(aExpectedResponseType, aOnFinish);
-	}
-
-	// Send the command:
-	auto rawCmd = serializeCommand(aCommandType, aPayload);
-	send(rawCmd);
+		{"Name", "OPSystemUpgrade"},
+		{"SessionID", sessionIDHexStr()},
+		{"OPSystemUpgrade",
+			{
+				{"Action", "Start"},
+				{"Type", "System"},
+			},
+		},
+	};
+	queueCommandJson(CommandType::SysUpgrade_Req, CommandType::SysUpgrade_Resp, js.dump(), std::move(aOnFinish));
 }
 
 
 
 
 
-void Connection::queueCommand(
-	CommandType aCommandType,
-	CommandType aExpectedResponseType,
-	const std::string & aPayload,
-	JsonCallback aOnFinish
-)
+void Connection::sendUpgradeData(const char * aData, size_t aSize, JsonCallback aOnFinish)
 {
-	return queueCommandRaw(aCommandType, aExpectedResponseType, aPayload,
-		[self = selfPtr(), aOnFinish](const std::error_code & aErr, const char * aData, size_t aSize)
+	queueCommandRaw(CommandType::SysUpgradeData_Req, CommandType::SysUpgradeData_Resp, aData, aSize,
+		[self = selfPtr(), aOnFinish](const std::error_code & aError, const BufferSlice & aResponse)
 		{
-			if (aErr)
-			{
-				return aOnFinish(aErr, {});
-			}
-
-			// Parse the JSON from the response:
-			auto j = nlohmann::json::parse(aData, aData + aSize, nullptr, false);
-			if (j.is_discarded())
-			{
-				return self->disconnected();
-			}
-
-			// Remember the session ID:
-			auto itr = j.find("SessionID");
-			if ((itr != j.end()) && (itr->is_number()))
-			{
-				self->mSessionID = itr->get<uint32_t>();
-			}
-
-			// Call the callback, with error based on the "Ret" field:
-			itr = j.find("Ret");
-			if ((itr == j.end()) || (!itr->is_number()))
-			{
-				return aOnFinish(make_error_code(Error::ResponseMissingExpectedField), j);
-			}
-			else
+			nlohmann::json j;
+			auto err = self->processJsonResponse(aError, aResponse, j);
+			if (err == Error::MalformedResponse)
 			{
-				if (*itr == Error::Success)
-				{
-					return aOnFinish({}, j);
-				}
-				else
-				{
-					return aOnFinish(make_error_code(static_cast<Error>(*itr)), j);
-				}
+				// The connection has been dropped, don't report anything
+				return;
 			}
+			aOnFinish(err, j);
 		}
 	);
 }
@@ -466,41 +760,636 @@ void Connection::queueCommand(
 
 
 
-std::vector<char> Connection::serializeCommand(CommandType aCommandType, const std::string & aPayload)
+void Connection::finishUpgradeData()
 {
+	std::array<char, Protocol::HeaderLength> header;
+	serializeHeader(header.data(), CommandType::SysUpgradeData_Req, mSequence.fetch_add(1), 0, 1, 0);
+	send({asio::buffer(header)});
+}
+
+
+
+
+
+void Connection::monitorUpgradeProgress(JsonCallback aOnProgress)
+{
+	LockGuard lg(mMtxTransfer);
+	mOnUpgradeProgress = std::move(aOnProgress);
+}
+
+
+
+
+
+void Connection::ptzControl(int aChannel, const std::string & aCommand, int aStep, int aPreset, JsonCallback aOnFinish)
+{
+	nlohmann::json js =
+	{
+		{"Name", "OPPTZControl"},
+		{"SessionID", sessionIDHexStr()},
+		{"OPPTZControl",
+			{
+				{"Command", aCommand},
+				{"Parameter",
+					{
+						{"AUX", {{"Number", 0}, {"Status", "On"}}},
+						{"Channel", aChannel},
+						{"MenuOpts", "Enter"},
+						{"POINT", {{"bottom", 0}, {"left", 0}, {"right", 0}, {"top", 0}}},
+						{"Pattern", "SetBegin"},
+						{"Preset", aPreset},
+						{"Step", aStep},
+						{"Tour", 0},
+					},
+				},
+			},
+		},
+	};
+	queueCommandJson(CommandType::Ptz_Req, CommandType::Ptz_Resp, js.dump(), std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::startTalk(JsonCallback aOnFinish)
+{
+	talkAction("Start", std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::stopTalk(JsonCallback aOnFinish)
+{
+	talkAction("Stop", std::move(aOnFinish));
+}
+
+
+
+
+
+std::error_code Connection::sendTalkData(const char * aData, size_t aSize)
+{
+	return sendCommand(CommandType::TalkToNvr_Data, aData, aSize);
+}
+
+
+
+
+
+void Connection::monitorTalkData(SliceCallback aOnData)
+{
+	LockGuard lg(mMtxTransfer);
+	mOnTalkData = std::move(aOnData);
+}
+
+
+
+
+
+std::string Connection::monitorRequest(const char * aAction, int aChannel, const std::string & aStreamType) const
+{
+	nlohmann::json js =
+	{
+		{"Name", "OPMonitor"},
+		{"SessionID", sessionIDHexStr()},
+		{"OPMonitor",
+			{
+				{"Action", aAction},
+				{"Parameter",
+					{
+						{"Channel",    aChannel},
+						{"CombinMode", "NONE"},
+						{"StreamType", aStreamType},
+						{"TransMode",  "TCP"},
+					}
+				},
+			}
+		},
+	};
+	return js.dump();
+}
+
+
+
+
+
+void Connection::talkAction(const char * aAction, JsonCallback aOnFinish)
+{
+	nlohmann::json js =
+	{
+		{"Name", "OPTalk"},
+		{"SessionID", sessionIDHexStr()},
+		{"OPTalk",
+			{
+				{"Action", aAction},
+				{"AudioFormat",
+					{
+						{"BitRate", 128},
+						{"EncodeType", "G711_ALAW"},
+						{"SampleBit", 8},
+						{"SampleRate", 8000},
+					},
+				},
+			},
+		},
+	};
+	queueCommandJson(CommandType::Talk_Req, CommandType::Talk_Resp, js.dump(), std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::claimMonitor(uint32_t aSessionID, int aChannel, const std::string & aStreamType, JsonCallback aOnFinish)
+{
+	// The claimed connection is not logged in, it uses the main connection's session:
+	mSessionID = aSessionID;
+	queueCommandJson(CommandType::MonitorClaim_Req, CommandType::MonitorClaim_Resp,
+		monitorRequest("Claim", aChannel, aStreamType), std::move(aOnFinish)
+	);
+}
+
+
+
+
+
+void Connection::monitorAction(const char * aAction, int aChannel, const std::string & aStreamType, JsonCallback aOnFinish)
+{
+	queueCommandJson(CommandType::Monitor_Req, CommandType::Monitor_Resp,
+		monitorRequest(aAction, aChannel, aStreamType), std::move(aOnFinish)
+	);
+}
+
+
+
+
+
+void Connection::monitorMediaData(SliceCallback aOnData)
+{
+	LockGuard lg(mMtxTransfer);
+	mOnMediaData = std::move(aOnData);
+}
+
+
+
+
+
+void Connection::monitorDisconnect(std::function<void()> aOnDisconnected)
+{
+	LockGuard lg(mMtxTransfer);
+	mOnDisconnected = std::move(aOnDisconnected);
+}
+
+
+
+
+
+void Connection::queryTime(JsonCallback aOnFinish)
+{
+	nlohmann::json js =
+	{
+		{"Name",      "OPTimeQuery"},
+		{"SessionID", sessionIDHexStr()},
+	};
+	queueCommandJson(CommandType::TimeQuery_Req, CommandType::TimeQuery_Resp, js.dump(), std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::syncTime(const std::string & aDeviceTime, JsonCallback aOnFinish)
+{
+	nlohmann::json js =
+	{
+		{"Name",          "OPTimeSetting"},
+		{"OPTimeSetting", aDeviceTime},
+		{"SessionID",     sessionIDHexStr()},
+	};
+	queueCommandJson(CommandType::SyncTime_Req, CommandType::SyncTime_Resp, js.dump(), std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::searchLogPage(
+	const std::string & aBeginTime,
+	const std::string & aEndTime,
+	const std::string & aType,
+	uint32_t aPosition,
+	SliceCallback aOnFinish
+)
+{
+	nlohmann::json js =
+	{
+		{"Name", "OPLogQuery"},
+		{"SessionID", sessionIDHexStr()},
+		{"OPLogQuery",
+			{
+				{"BeginTime",   aBeginTime},
+				{"EndTime",     aEndTime},
+				{"LogPosition", aPosition},
+				{"Type",        aType},
+			}
+		},
+	};
+	queueCommandRaw(CommandType::LogSearch_Req, CommandType::LogSearch_Resp, js.dump(),
+		[aOnFinish](const std::error_code & aError, const BufferSlice & aData)
+		{
+			aOnFinish(aError, aError ? BufferSlice() : aData);
+		}
+	);
+}
+
+
+
+
+
+void Connection::setPacketLimits(uint32_t aMaxOutgoingPacketPayload, uint32_t aMaxIncomingMessageSize)
+{
+	mMaxOutgoingPacketPayload = std::max<uint32_t>(aMaxOutgoingPacketPayload, 1);
+	mMaxIncomingMessageSize = aMaxIncomingMessageSize;
+}
+
+
+
+
+
+const Connection::CommandInfo * Connection::commandInfo(uint16_t aMessageType)
+{
+	auto entry = findCommand(aMessageType);
+	return (entry == nullptr) ? nullptr : &entry->mInfo;
+}
+
+
+
+
+
+bool Connection::setPushHandler(CommandType aType, SliceCallback aHandler)
+{
+	auto slot = commandPushSlot(static_cast<uint16_t>(aType));
+	if (slot < 0)
+	{
+		return false;
+	}
+	LockGuard lg(mMtxTransfer);
+	mPushHandlers[static_cast<size_t>(slot)] = std::move(aHandler);
+	return true;
+}
+
+
+
+
+
+void Connection::setResync(uint32_t aMaxSkippedBytes)
+{
+	mMaxResyncBytes = aMaxSkippedBytes;
+}
+
+
+
+
+
+Connection::FramingStats Connection::framingStats() const
+{
+	return {mNumResyncs.load(), mNumBytesSkipped.load()};
+}
+
+
+
+
+
+void Connection::onLoginResp(const std::error_code & aError, const nlohmann::json & aResponse, JsonCallback aOnFinish)
+{
+	if (aError)
+	{
+		return aOnFinish(aError, aResponse);
+	}
+
+	// Login was successful
+	// Set the session ID from the response:
+	auto itr = aResponse.find("SessionID");
+	if (itr == aResponse.end())
+	{
+		return aOnFinish(Error::ResponseMissingExpectedField, aResponse);
+	}
+	mSessionID = std::stoi(std::string(*itr), nullptr, 0);
+
+	// Schedule a keepalive packet according to the response:
+	itr = aResponse.find("AliveInterval");
+	if (itr == aResponse.end())
+	{
+		return aOnFinish(Error::ResponseMissingExpectedField, aResponse);
+	}
+	mAliveInterval = *itr;
+	if (mAliveInterval > 0)
+	{
+		scheduleKeepAlive();
+	}
+
+	// Report the success to the callback:
+	return aOnFinish(aError, aResponse);
+}
+
+
+
+
+
+void Connection::onGetChannelNamesResp(const std::error_code & aError, const nlohmann::json & aResponse, ChannelNamesCallback aOnFinish)
+{
+	if (aError)
+	{
+		return aOnFinish(aError, {});
+	}
+	std::vector<std::string> channelTitles;
+	auto err = parseChannelNames(aResponse, channelTitles);
+	if (err)
+	{
+		return aOnFinish(err, {});
+	}
+	return aOnFinish({}, channelTitles);
+}
+
+
+
+
+
+std::error_code Connection::parseChannelNames(const nlohmann::json & aResponse, std::vector<std::string> & aChannelNames)
+{
+	auto itr = aResponse.find("ChannelTitle");
+	if (itr == aResponse.end())
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	for (const auto & cht: *itr)
+	{
+		aChannelNames.push_back(cht);
+	}
+	return {};
+}
+
+
+
+
+
+std::string Connection::capturePictureRequest(int aChannel)
+{
+	nlohmann::json js =
+	{
+		{"Name", "OPSNAP"},
+		{"OPSNAP",
+			{
+				{ "Channel", aChannel },
+			},
+		},
+	};
+	return js.dump();
+}
+
+
+
+
+
+std::error_code Connection::checkPictureResponse(const char * aData, size_t aSize)
+{
+	// Some firmwares return JSON error, others return raw binary data. Try to parse to see if there's an error:
+	if (aSize < 500)
+	{
+		auto j = nlohmann::json::parse(aData, aData + aSize, nullptr, false);
+		if (!j.is_discarded())
+		{
+			auto itr = j.find("Ret");
+			if ((itr != j.end()) && (itr->is_number()))
+			{
+				// An error was found, report it:
+				return make_error_code(static_cast<Error>(*itr));
+			}
+		}
+	}
+	return {};
+}
+
+
+
+
+
+void Connection::onKeepAliveTimer(const std::error_code & aError)
+{
+	if (aError)
+	{
+		// Silently ignore all scheduling errors
+		return;
+	}
+	nlohmann::json js =
+	{
+		{"Name", "KeepAlive"},
+		{"SessionID", sessionIDHexStr()},
+	};
+	queueCommandJson(CommandType::KeepAlive_Req, CommandType::KeepAlive_Resp, js.dump(),
+		[](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+		}
+	);
+	scheduleKeepAlive();
+}
+
+
+
+
+void Connection::scheduleKeepAlive()
+{
+	mKeepAliveTimer.expires_from_now(std::chrono::seconds(mAliveInterval / 2));
+	mKeepAliveTimer.async_wait(
+		makeAllocHandler(mKeepAliveHandlerMemory,
+			[self = selfPtr()](const std::error_code & aError)
+			{
+				self->onKeepAliveTimer(aError);
+			}
+		)
+	);
+}
+
+
+
+
+
+std::string Connection::sessionIDHexStr() const
+{
+	return fmt::format("{:#08x}", mSessionID.load());
+}
+
+
+
+
+
+void Connection::queueCommandRaw(
+	CommandType aCommandType,
+	CommandType aExpectedResponseType,
+	const std::string & aPayload,
+	CompletionHandler aOnFinish
+)
+{
+	queueCommandRaw(aCommandType, aExpectedResponseType, aPayload.data(), aPayload.size(), std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::queueCommandRaw(
+	CommandType aCommandType,
+	CommandType aExpectedResponseType,
+	const char * aPayload,
+	size_t aPayloadSize,
+	CompletionHandler aOnFinish
+)
+{
+	// Put the expected response type and handler to the incoming queue, send the command:
+	LockGuard lg(mMtxTransfer);
+	auto err = sendCommand(aCommandType, aPayload, aPayloadSize);
+	if (err)
+	{
+		return aOnFinish(err, {});
+	}
+	mIncomingQueue.emplace_back(aExpectedResponseType, std::move(aOnFinish));
+}
+
+
+
+
+
+void Connection::queueCommand(
+	CommandType aCommandType,
+	CommandType aExpectedResponseType,
+	const std::string & aPayload,
+	JsonCallback aOnFinish
+)
+{
+	queueCommandJson(aCommandType, aExpectedResponseType, aPayload, std::move(aOnFinish));
+}
+
+
+
+
+
+std::error_code Connection::processJsonResponse(const std::error_code & aError, const BufferSlice & aData, nlohmann::json & aOut)
+{
+	if (aError)
+	{
+		return aError;
+	}
+
+	// Parse the JSON from the response:
+	aOut = nlohmann::json::parse(aData.begin(), aData.end(), nullptr, false);
+	if (aOut.is_discarded())
+	{
+		disconnected();
+		return make_error_code(Error::MalformedResponse);
+	}
+
+	// Remember the session ID:
+	auto itr = aOut.find("SessionID");
+	if ((itr != aOut.end()) && (itr->is_number()))
+	{
+		mSessionID = itr->get<uint32_t>();
+	}
+
+	// Return the error based on the "Ret" field:
+	itr = aOut.find("Ret");
+	if ((itr == aOut.end()) || (!itr->is_number()))
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	if (*itr == Error::Success)
+	{
+		return {};
+	}
+	return make_error_code(static_cast<Error>(*itr));
+}
+
+
+
+
+
+void Connection::serializeHeader(
+	char * aOutput,
+	CommandType aCommandType,
+	uint32_t aSequence,
+	uint8_t aTotalPackets,
+	uint8_t aCurrentPacket,
+	size_t aPayloadSize
+)
+{
+	aOutput[0] = Protocol::IDENTIFICATION;
+	aOutput[1] = Protocol::VERSION;
+	aOutput[2] = Protocol::RESERVED1;
+	aOutput[3] = Protocol::RESERVED2;
+	writeUint32(aOutput + 4, mSessionID);
+	writeUint32(aOutput + 8, aSequence);
+	aOutput[12] = static_cast<char>(aTotalPackets);
+	aOutput[13] = static_cast<char>(aCurrentPacket);
+	writeUint16(aOutput + 14, static_cast<uint16_t>(aCommandType));
+	writeUint32(aOutput + 16, static_cast<uint32_t>(aPayloadSize));
+}
+
+
+
+
+
+std::error_code Connection::sendCommand(CommandType aCommandType, const char * aPayload, size_t aPayloadSize)
+{
+	std::array<char, Protocol::HeaderLength> header;
+	size_t maxPacketPayload = mMaxOutgoingPacketPayload;
+	if (aPayloadSize <= maxPacketPayload)
+	{
+		// Single-packet message:
+		serializeHeader(header.data(), aCommandType, mSequence.fetch_add(1), Protocol::TOTALPKT, Protocol::CURRPKT, aPayloadSize);
+		send({asio::buffer(header), asio::buffer(aPayload, aPayloadSize)});
+		return {};
+	}
+
+	// Multi-packet message, all packets share the sequence number:
+	auto numPackets = (aPayloadSize + maxPacketPayload - 1) / maxPacketPayload;
+	if (numPackets > Protocol::MaxPacketsPerMessage)
+	{
+		return make_error_code(Error::MessageTooLarge);
+	}
+	LockGuard lg(mMtxTransfer);
 	auto seq = mSequence.fetch_add(1);
-	std::vector<char> res;
-	res.reserve(Protocol::HeaderLength + aPayload.size());
-	res.push_back(Protocol::IDENTIFICATION);
-	res.push_back(Protocol::VERSION);
-	res.push_back(Protocol::RESERVED1);
-	res.push_back(Protocol::RESERVED2);
-	writeUint32(res, mSessionID);
-	writeUint32(res, seq);
-	res.push_back(Protocol::TOTALPKT);
-	res.push_back(Protocol::CURRPKT);
-	writeUint16(res, static_cast<uint16_t>(aCommandType));
-	writeUint32(res, static_cast<uint32_t>(aPayload.size()));
-	std::copy(aPayload.begin(), aPayload.end(), std::back_inserter(res));
-	return res;
+	for (size_t i = 0; i < numPackets; ++i)
+	{
+		auto offset = i * maxPacketPayload;
+		auto size = std::min(maxPacketPayload, aPayloadSize - offset);
+		serializeHeader(header.data(), aCommandType, seq, static_cast<uint8_t>(numPackets), static_cast<uint8_t>(i), size);
+		send({asio::buffer(header), asio::buffer(aPayload + offset, size)});
+	}
+	return {};
 }
 
 
 
 
 
-void Connection::notifyAlarm(const char * aData, size_t aSize)
+void Connection::notifyAlarm(const BufferSlice & aPayload)
 {
 	// Typical alarm data:
 	// { "AlarmInfo" : { "Channel" : 0, "Event" : "VideoMotion", "StartTime" : "2023-03-02 23:54:59", "Status" : "Stop" }, "Name" : "AlarmInfo", "SessionID" : "0x13" }
-	auto onAlarm = mOnAlarm;
-	if (!onAlarm)
+	std::shared_ptr<const AlarmSubscribers> subscribers;
+	{
+		LockGuard lg(mMtxTransfer);
+		subscribers = mAlarmSubscribers;
+	}
+	if (subscribers->mAll.empty())
 	{
 		return;
 	}
 
 	// Parse the JSON from the response:
-	auto j = nlohmann::json::parse(aData, aData + aSize, nullptr, false);
+	auto j = nlohmann::json::parse(aPayload.begin(), aPayload.end(), nullptr, false);
 	if (j.is_discarded())
 	{
 		return;
@@ -517,7 +1406,7 @@ void Connection::notifyAlarm(const char * aData, size_t aSize)
 	itr = j.find("AlarmInfo");
 	if ((itr == j.end()) || (!itr->is_object()))
 	{
-		return onAlarm(make_error_code(Error::ResponseMissingExpectedField), -1, false, {}, j);
+		return notifyAlarmError(make_error_code(Error::ResponseMissingExpectedField), j);
 	}
 	const auto & ai = *itr;
 	auto itrCh = ai.find("Channel");
@@ -529,10 +1418,160 @@ void Connection::notifyAlarm(const char * aData, size_t aSize)
 		(itrS == ai.end())   || !itrS->is_string()
 	)
 	{
-		return onAlarm(make_error_code(Error::ResponseMissingExpectedField), -1, false, {}, j);
+		return notifyAlarmError(make_error_code(Error::ResponseMissingExpectedField), j);
+	}
+	int channel = *itrCh;
+	bool isStart = (*itrS == "Start");
+	const auto & eventType = itrEvt->get_ref<const std::string &>();
+
+	// The channel's bit in the subscription masks; the channels not representable only match AllAlarmChannels:
+	auto channelBit = ((channel >= 0) && (channel < 64)) ? (static_cast<uint64_t>(1) << channel) : AllAlarmChannels;
+	auto matchesChannel = [channelBit](const AlarmSubscriber & aSubscriber)
+	{
+		return ((aSubscriber.mChannelMask & channelBit) == channelBit);
+	};
+
+	// Only visit the subscriptions to this event type (if anyone ever asked for it) and those to all event types:
+	for (const auto & subscriber: subscribers->mAnyEventType)
+	{
+		if (matchesChannel(*subscriber))
+		{
+			subscriber->mOnAlarm({}, channel, isStart, eventType, j);
+		}
+	}
+	auto interned = mAlarmEventTypes.find(eventType);
+	if (interned == nullptr)
+	{
+		return;
+	}
+	auto itrType = subscribers->mByEventType.find(interned);
+	if (itrType == subscribers->mByEventType.end())
+	{
+		return;
+	}
+	for (const auto & subscriber: itrType->second)
+	{
+		if (matchesChannel(*subscriber))
+		{
+			subscriber->mOnAlarm({}, channel, isStart, eventType, j);
+		}
+	}
+}
+
+
+
+
+
+void Connection::notifyAlarmError(const std::error_code & aError, const nlohmann::json & aWholeJson)
+{
+	std::shared_ptr<const AlarmSubscribers> subscribers;
+	{
+		LockGuard lg(mMtxTransfer);
+		subscribers = mAlarmSubscribers;
+	}
+	for (const auto & subscriber: subscribers->mAll)
+	{
+		subscriber->mOnAlarm(aError, -1, false, {}, aWholeJson);
 	}
+}
+
+
+
+
+
+void Connection::rebuildAlarmSubscribersLocked()
+{
+	auto subscribers = std::make_shared<AlarmSubscribers>();
+	subscribers->mAll.reserve(mAlarmSubscriptions.size());
+	for (const auto & sub: mAlarmSubscriptions)
+	{
+		subscribers->mAll.push_back(sub.second);
+		if (sub.second->mEventTypes.empty())
+		{
+			subscribers->mAnyEventType.push_back(sub.second);
+			continue;
+		}
+		for (auto eventType: sub.second->mEventTypes)
+		{
+			subscribers->mByEventType[eventType].push_back(sub.second);
+		}
+	}
+	mAlarmSubscribers = std::move(subscribers);
+}
+
+
+
+
+
+void Connection::notifyPush(int aPushSlot, const BufferSlice & aPayload)
+{
+	SliceCallback onPush;
+	{
+		LockGuard lg(mMtxTransfer);
+		onPush = mPushHandlers[static_cast<size_t>(aPushSlot)];
+	}
+	if (onPush)
+	{
+		onPush({}, aPayload);
+	}
+}
+
+
+
+
+
+void Connection::notifyUpgradeProgress(const BufferSlice & aPayload)
+{
+	JsonCallback onProgress;
+	{
+		LockGuard lg(mMtxTransfer);
+		onProgress = mOnUpgradeProgress;
+	}
+	if (!onProgress)
+	{
+		return;
+	}
+	auto j = nlohmann::json::parse(aPayload.begin(), aPayload.end(), nullptr, false);
+	if (j.is_discarded())
+	{
+		return;
+	}
+	onProgress({}, j);
+}
+
+
+
+
+
+void Connection::notifyTalkData(const BufferSlice & aPayload)
+{
+	SliceCallback onData;
+	{
+		LockGuard lg(mMtxTransfer);
+		onData = mOnTalkData;
+	}
+	if (onData)
+	{
+		onData({}, aPayload);
+	}
+}
+
 
-	return onAlarm({}, *itrCh, *itrS == "Start", *itrEvt, j);
+
+
+
+
+void Connection::notifyMediaData(const BufferSlice & aPayload)
+{
+	SliceCallback onData;
+	{
+		LockGuard lg(mMtxTransfer);
+		onData = mOnMediaData;
+	}
+	if (onData)
+	{
+		onData({}, aPayload);
+	}
 }
 
 
@@ -542,58 +1581,279 @@ void Connection::notifyAlarm(const char * aData, size_t aSize)
 
 void Connection::parseIncomingPackets()
 {
+	if (!mReassemblies.empty())
+	{
+		expireReassemblies();
+	}
+
 	size_t start = 0;
-	while (mIncomingDataSize - start >= 20)
+	while (mIncomingDataSize - start >= Protocol::HeaderLength)
 	{
 		// Check if an entire packet is in the queue:
-		if (mIncomingData[start] != Protocol::IDENTIFICATION)
+		auto packet = mIncomingData->data() + start;
+		auto payloadLength = parseUint32(packet + 16);
+		bool isValid = (mNumResyncBytes > 0) ?
+			isPlausibleHeader(packet) :
+			((packet[0] == Protocol::IDENTIFICATION) && (payloadLength <= mMaxIncomingMessageSize));
+		if (!isValid)
 		{
-			return disconnected();
+			// Framing error, skip to the next plausible header, if allowed:
+			uint32_t maxResyncBytes = mMaxResyncBytes;
+			if (maxResyncBytes == 0)
+			{
+				return disconnected();
+			}
+			if (mNumResyncBytes == 0)
+			{
+				mNumResyncs += 1;
+			}
+			auto next = findPlausibleHeader(start + 1);
+			mNumResyncBytes += next - start;
+			mNumBytesSkipped += next - start;
+			if (mNumResyncBytes > maxResyncBytes)
+			{
+				return disconnected();
+			}
+			start = next;
+			continue;
 		}
-		auto payloadLength = parseUint32(mIncomingData.data() + start + 16);
-		if (mIncomingDataSize < payloadLength + Protocol::HeaderLength)
+		if (mIncomingDataSize - start < payloadLength + Protocol::HeaderLength)
 		{
 			break;
 		}
 
-		// Find the corresponding callback that is waiting in the queue:
-		auto messageType = parseUint16(mIncomingData.data() + start + 14);
-		if (messageType == static_cast<uint16_t>(CommandType::Alarm_Req))
+		// Process the packet, either as a whole message or as a part of a multi-packet message:
+		auto messageType = parseUint16(packet + 14);
+		auto totalPackets = static_cast<uint8_t>(packet[12]);
+		if (totalPackets > 1)
 		{
-			// Special handling for Alarm packets, they have no callback in mIncomingQueue
-			notifyAlarm(mIncomingData.data() + start + 20, payloadLength);
+			addToReassembly(
+				messageType, parseUint32(packet + 8), totalPackets, static_cast<uint8_t>(packet[13]),
+				packet + Protocol::HeaderLength, payloadLength
+			);
 		}
 		else
 		{
-			RawDataCallback callback = nullptr;
-			{
-				LockGuard lg(mMtxTransfer);
-				for (auto itr = mIncomingQueue.begin(), end = mIncomingQueue.end(); itr != end; ++itr)
-				{
-					if (static_cast<uint16_t>(itr->first) == messageType)
-					{
-						callback = itr->second;
-						mIncomingQueue.erase(itr);
-						break;
-					}
-				}
-			}
-			if (callback != nullptr)
-			{
-				callback({}, mIncomingData.data() + start + 20, payloadLength);
-			}
+			processMessage(messageType, incomingSlice(start + Protocol::HeaderLength, payloadLength));
 		}
 
 		// Continue parsing:
 		start += payloadLength + Protocol::HeaderLength;
+		mNumResyncBytes = 0;
 	}
 
 	// Remove the processed packets from the buffer:
-	if ((start > 0) && (mIncomingDataSize > start))
+	consumeIncomingData(start);
+
+	// If the next packet is larger than the receive buffer, make room for it:
+	if (mIncomingDataSize >= Protocol::HeaderLength)
+	{
+		reserveIncomingData(parseUint32(mIncomingData->data() + 16) + Protocol::HeaderLength);
+	}
+}
+
+
+
+
+
+bool Connection::isPlausibleHeader(const char * aPacket) const
+{
+	if (
+		(aPacket[0] != Protocol::IDENTIFICATION) ||
+		((aPacket[1] != Protocol::VERSION) && (aPacket[1] != Protocol::VERSION_DEVICE))
+	)
+	{
+		return false;
+	}
+	uint32_t sessionID = mSessionID;
+	if ((sessionID != 0) && (parseUint32(aPacket + 4) != sessionID))
+	{
+		return false;
+	}
+	return (parseUint32(aPacket + 16) <= mMaxIncomingMessageSize);
+}
+
+
+
+
+
+size_t Connection::findPlausibleHeader(size_t aFrom) const
+{
+	auto data = mIncomingData->data();
+	auto pos = aFrom;
+	while (pos < mIncomingDataSize)
+	{
+		auto candidate = static_cast<const char *>(std::memchr(data + pos, Protocol::IDENTIFICATION, mIncomingDataSize - pos));
+		if (candidate == nullptr)
+		{
+			return mIncomingDataSize;
+		}
+		pos = static_cast<size_t>(candidate - data);
+		if ((mIncomingDataSize - pos < Protocol::HeaderLength) || isPlausibleHeader(candidate))
+		{
+			// Either plausible, or can't tell until more data arrives (then it's checked again):
+			return pos;
+		}
+		pos += 1;
+	}
+	return mIncomingDataSize;
+}
+
+
+
+
+
+void Connection::addToReassembly(
+	uint16_t aMessageType,
+	uint32_t aSequence,
+	uint8_t aTotalPackets,
+	uint8_t aCurrentPacket,
+	const char * aPayload,
+	size_t aPayloadSize
+)
+{
+	// Find the reassembly in progress for the message type:
+	auto itr = std::find_if(mReassemblies.begin(), mReassemblies.end(),
+		[aMessageType](const Reassembly & aReassembly)
+		{
+			return (aReassembly.mMessageType == aMessageType);
+		}
+	);
+	if (
+		(itr != mReassemblies.end()) &&
+		(
+			(itr->mSequence != aSequence) ||
+			(itr->mTotalPackets != aTotalPackets) ||
+			(itr->mNumReceived != aCurrentPacket)
+		)
+	)
+	{
+		// A packet of the message was lost, duplicated or skipped (resync), the message can't be completed:
+		failReassembly(static_cast<size_t>(itr - mReassemblies.begin()), make_error_code(Error::IncompleteMessage));
+		itr = mReassemblies.end();
+	}
+	if (itr == mReassemblies.end())
+	{
+		if (aCurrentPacket != 0)
+		{
+			// The rest of a message whose start was lost (its handler has been notified above, if it was known)
+			return;
+		}
+		auto expectedSize = std::min<size_t>(aPayloadSize * aTotalPackets, mMaxIncomingMessageSize);
+		mReassemblies.push_back({
+			aMessageType, aSequence, aTotalPackets, 0, std::chrono::steady_clock::now(),
+			BufferPool::instance().allocate(expectedSize), 0
+		});
+		itr = mReassemblies.end() - 1;
+	}
+
+	// Check the size limit:
+	auto & r = *itr;
+	auto newSize = r.mSize + aPayloadSize;
+	if (newSize > mMaxIncomingMessageSize)
+	{
+		failReassembly(static_cast<size_t>(itr - mReassemblies.begin()), make_error_code(Error::MessageTooLarge));
+		return;
+	}
+
+	// Append the payload, growing the block if needed:
+	if (newSize > r.mBlock->capacity())
+	{
+		auto block = BufferPool::instance().allocate(std::max(newSize, 2 * r.mBlock->capacity()));
+		std::memcpy(block->data(), r.mBlock->data(), r.mSize);
+		r.mBlock = std::move(block);
+	}
+	std::memcpy(r.mBlock->data() + r.mSize, aPayload, aPayloadSize);
+	r.mSize = newSize;
+	r.mNumReceived += 1;
+	if (r.mNumReceived < r.mTotalPackets)
+	{
+		return;
+	}
+
+	// The message is complete, process it:
+	BufferSlice message(std::move(r.mBlock), 0, r.mSize);
+	mReassemblies.erase(itr);
+	processMessage(aMessageType, message);
+}
+
+
+
+
+
+void Connection::failReassembly(size_t aIndex, const std::error_code & aError)
+{
+	auto messageType = mReassemblies[aIndex].mMessageType;
+	mReassemblies.erase(mReassemblies.begin() + static_cast<std::ptrdiff_t>(aIndex));
+	auto handler = takeIncomingHandler(messageType);
+	if (handler != nullptr)
+	{
+		handler(aError, {});
+	}
+}
+
+
+
+
+
+void Connection::expireReassemblies()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (size_t i = mReassemblies.size(); i > 0; --i)
+	{
+		if (now - mReassemblies[i - 1].mStartTime > Protocol::ReassemblyTimeout)
+		{
+			failReassembly(i - 1, make_error_code(Error::IncompleteMessage));
+		}
+	}
+}
+
+
+
+
+
+void Connection::processMessage(uint16_t aMessageType, const BufferSlice & aPayload)
+{
+	// The messages pushed by the device have no callback in mIncomingQueue, dispatch them through the table:
+	auto entry = findCommand(aMessageType);
+	if ((entry != nullptr) && entry->mInfo.mIsPushed)
+	{
+		if (entry->mOnPush != nullptr)
+		{
+			(this->*(entry->mOnPush))(aPayload);
+		}
+		else
+		{
+			notifyPush(commandPushSlot(aMessageType), aPayload);
+		}
+		return;
+	}
+
+	// Find the corresponding callback that is waiting in the queue:
+	auto callback = takeIncomingHandler(aMessageType);
+	if (callback != nullptr)
 	{
-		std::memmove(mIncomingData.data(), mIncomingData.data() + start, mIncomingDataSize - start);
+		callback({}, aPayload);
 	}
-	mIncomingDataSize -= start;
+}
+
+
+
+
+
+Connection::CompletionHandler Connection::takeIncomingHandler(uint16_t aMessageType)
+{
+	LockGuard lg(mMtxTransfer);
+	for (auto itr = mIncomingQueue.begin(), end = mIncomingQueue.end(); itr != end; ++itr)
+	{
+		if (static_cast<uint16_t>(itr->first) == aMessageType)
+		{
+			auto res = std::move(itr->second);
+			mIncomingQueue.erase(itr);
+			return res;
+		}
+	}
+	return {};
 }
 
 
@@ -602,17 +1862,31 @@ void Connection::parseIncomingPackets()
 
 void Connection::disconnected()
 {
+	mIsConnected = false;
+
 	// Get a current copy of the incoming queue:
 	decltype(mIncomingQueue) incomingQueue;
+	SliceCallback onMediaData;
+	std::function<void()> onDisconnected;
 	{
 		LockGuard lg(mMtxTransfer);
 		std::swap(incomingQueue, mIncomingQueue);
+		std::swap(onMediaData, mOnMediaData);
+		std::swap(onDisconnected, mOnDisconnected);
 	}
 
 	// Notify all of the handlers that there was a disconnect:
-	for (const auto & item: incomingQueue)
+	for (auto & item: incomingQueue)
+	{
+		item.second(asio::error::eof, {});
+	}
+	if (onMediaData)
+	{
+		onMediaData(asio::error::eof, {});
+	}
+	if (onDisconnected)
 	{
-		std::get<1>(item)(asio::error::eof, nullptr, 0);
+		onDisconnected();
 	}
 }
 
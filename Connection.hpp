@@ -1,7 +1,15 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <map>
+#include <unordered_map>
 #include "TcpConnection.hpp"
 #include <nlohmann/json.hpp>
+#include "InplaceFunction.hpp"
+#include "StringInterner.hpp"
+#include "Error.hpp"
+#include "Root.hpp"
 
 
 
@@ -19,16 +27,56 @@ namespace Protocol
 	constexpr uint32_t HeaderLength = 20;  // Number of bytes in the header
 	constexpr char IDENTIFICATION = static_cast<char>(0xff);
 	constexpr char VERSION        = 0x00;  // Doc says 0x01, device sends 0x01, VMS and CMS send 0x00. Probably not important.
+	constexpr char VERSION_DEVICE = 0x01;  // The version sent by the devices, accepted when resyncing
 	constexpr char RESERVED1      = 0x00;
 	constexpr char RESERVED2      = 0x00;
-	constexpr char TOTALPKT       = 0x00;  // Never saw this packetization at work
-	constexpr char CURRPKT        = 0x00;
+	constexpr char TOTALPKT       = 0x00;  // Single-packet message; multi-packet messages specify the packet count here
+	constexpr char CURRPKT        = 0x00;  // Single-packet message; multi-packet messages specify the packet index here
+	constexpr uint32_t MaxPacketsPerMessage = 255;  // TOTALPKT is a single byte
+
+	/** The default limit on the payload of a single outgoing packet; larger payloads are split into multiple packets. */
+	constexpr uint32_t DefaultMaxOutgoingPacketPayload = 64 * 1024;
+
+	/** The default limit on the total size of a reassembled incoming multi-packet message. */
+	constexpr uint32_t DefaultMaxIncomingMessageSize = 16 * 1024 * 1024;
+
+	/** The time within which all the packets of an incoming multi-packet message must arrive. */
+	constexpr std::chrono::seconds ReassemblyTimeout{30};
 };
 
 
 
 
 
+/** Calls the handler with the error code and the values in the tuple as the params. */
+template <typename Handler, typename Tuple, size_t... Indices>
+void invokeWithTuple(Handler && aHandler, const std::error_code & aError, Tuple && aArgs, std::index_sequence<Indices...>)
+{
+	std::move(aHandler)(aError, std::get<Indices>(std::move(aArgs))...);
+}
+
+
+
+
+
+/** Invokes the asio-style completion handler with the specified args through the handler's associated executor.
+If the handler has no associated executor, it is invoked directly (we're already on an ASIO worker thread). */
+template <typename Handler, typename... Args>
+void dispatchCompletion(Handler && aHandler, const std::error_code & aError, Args &&... aResult)
+{
+	auto executor = asio::get_associated_executor(aHandler, Root::instance().ioContext().get_executor());
+	asio::dispatch(executor,
+		[handler = std::move(aHandler), aError, result = std::make_tuple(std::forward<Args>(aResult)...)]() mutable
+		{
+			invokeWithTuple(std::move(handler), aError, std::move(result), std::index_sequence_for<Args...>());
+		}
+	);
+}
+
+
+
+
+
 /** Represents a single TCP connection to the device.
 Provides the protocol serializing and parsing. */
 class Connection:
@@ -69,6 +117,48 @@ public:
 	The first param is the error code; if successful, the next two params contain the raw picture data. */
 	using PictureCallback = std::function<void(const std::error_code &, const char * aData, size_t aSize)>;
 
+	/** The callback for incoming data delivered as a reference-counted slice of the receive buffer.
+	The slice may be kept (queued, handed to other threads) after the callback returns, without copying the data.
+	If the error code specifies an error, the slice is empty. */
+	using SliceCallback = std::function<void(const std::error_code & aErr, BufferSlice aData)>;
+
+	/** The callback for incoming data requested using a single string name (Config), delivered as a slice.
+	Gets passed the error code, the requested name and the raw JSON data received from the device. */
+	using NamedSliceCallback = std::function<void(const std::error_code & aErr, const std::string & aName, BufferSlice aData)>;
+
+	/** The move-only completion handler stored in the incoming queue, waiting for the response.
+	Stores the typical handlers (including ASIO's coroutine handlers) inline, without a heap allocation.
+	If the error code specifies an error, the slice is empty. */
+	using CompletionHandler = InplaceFunction<void(const std::error_code & aErr, const BufferSlice & aData)>;
+
+	/** The identification of an alarm subscription, used for unsubscribing (see subscribeAlarms()).
+	0 is never used for a valid subscription. */
+	using AlarmSubscriptionId = uint64_t;
+
+	/** The channel mask in AlarmFilter matching all the channels, including those beyond the mask's 64 bits. */
+	static const uint64_t AllAlarmChannels = ~static_cast<uint64_t>(0);
+
+	/** Selects the alarms delivered to a subscription (see subscribeAlarms()). */
+	struct AlarmFilter
+	{
+		/** The channels to report, bit N for channel N. The alarms on channels 64 and above (and on no channel) are
+		only reported with AllAlarmChannels. */
+		uint64_t mChannelMask = AllAlarmChannels;
+
+		/** The event types to report ("VideoMotion", "LocalAlarm", ...); empty to report all of them. */
+		std::vector<std::string> mEventTypes;
+	};
+
+	/** The counters of the incoming framing errors recovered from (see setResync()). */
+	struct FramingStats
+	{
+		/** The number of framing errors (data at a packet boundary not being a valid header) resynced from. */
+		uint64_t mNumResyncs;
+
+		/** The total number of bytes skipped while resyncing. */
+		uint64_t mNumBytesSkipped;
+	};
+
 	enum class CommandType: uint16_t
 	{
 		// Note: The following values are off-by-one from the official docs, but are what was seen on wire on a real device
@@ -193,6 +283,10 @@ public:
 		SysUpgradeInfo_Req  = 1525,
 		SysUpgradeInfo_Resp = 1526,
 
+		// LAN device discovery (UDP broadcast, see Discovery):
+		IPSearch_Req  = 1530,
+		IPSearch_Resp = 1531,
+
 		// Capture control:
 		NetSnap_Req    = 1560,
 		NetSnap_Resp   = 1561,
@@ -204,6 +298,33 @@ public:
 		SyncTime_Resp = 1591,
 	};
 
+	/** The kind of the payload carried by a message type. */
+	enum class PayloadKind
+	{
+		Json,
+		Binary,
+	};
+
+	/** The static description of a message type, see commandInfo(). */
+	struct CommandInfo
+	{
+		CommandType mType;
+
+		/** The name of the type, same as in CommandType ("Login_Req"). */
+		const char * mName;
+
+		/** The type of the response to this request; equal to mType if the message gets no response. */
+		CommandType mResponseType;
+
+		/** True if the device pushes the message unsolicited (alarms, media data, ...), without a request waiting. */
+		bool mIsPushed;
+
+		PayloadKind mPayloadKind;
+	};
+
+	/** The number of the pushed message types without a dedicated monitor, see setPushHandler(). */
+	static const size_t NumGenericPushTypes = 4;
+
 
 	/** Creates a new instance of this class.
 	Because of lifetime management, this class can only ever exist owned by a shared_ptr, therefore clients need to use
@@ -248,14 +369,250 @@ public:
 	On error, calls the callback with an error code and empty config. */
 	void getConfig(NamedJsonCallback aOnFinish, const std::string & aConfigName);
 
+	/** Asynchronously sets the specified device config (ConfigSet_Req).
+	aConfigName may name a whole config ("Simplify.Encode") or its single section ("General.General"); aConfig is
+	the complete new value for it. The callback receives the device's response. */
+	void setConfig(const std::string & aConfigName, const nlohmann::json & aConfig, JsonCallback aOnFinish);
+
 	/** Installs an async alarm monitor.
 	The callback is called whenever the device reports an alarm start or stop event.
-	Only one monitor can be installed at a time, setting another one overwrites the previous one. */
+	Only one monitor can be installed at a time, setting another one overwrites the previous one.
+	The monitor is a subscription with an unrestricted filter (see subscribeAlarms()), independent of the other
+	subscriptions; nullptr removes it. */
 	void monitorAlarms(AlarmCallback aOnAlarm);
 
+	/** Adds an alarm subscription: the callback is called for each alarm start or stop event matching the filter.
+	Any number of subscriptions may be active at a time; the device is asked to start reporting the alarms with the
+	first one. The errors (failing to start the reporting, a malformed alarm) are reported to all the subscriptions.
+	The filters are matched against the parsed alarm before any callback is called; the subscriptions are indexed by
+	their event types, so that an alarm only visits the subscriptions that may match it.
+	Returns the ID to pass to unsubscribeAlarms(). */
+	AlarmSubscriptionId subscribeAlarms(const AlarmFilter & aFilter, AlarmCallback aOnAlarm);
+
+	/** Removes the alarm subscription. The callback may still be called once more, if an alarm is being delivered
+	concurrently. Returns false if there is no such subscription. */
+	bool unsubscribeAlarms(AlarmSubscriptionId aSubscriptionId);
+
 	/** Asynchronously captures a picture from the specified channel. */
 	void capturePicture(int aChannel, PictureCallback aOnFinish);
 
+	/** Asynchronously starts the firmware upgrade on the device (SysUpgrade_Req).
+	Once the device confirms, the image data is to be sent using sendUpgradeData() and finishUpgradeData().
+	Use FirmwareUpgrade (through Recorder::upgradeFirmware()) rather than calling these directly. */
+	void startUpgrade(JsonCallback aOnFinish);
+
+	/** Asynchronously sends a single chunk of the firmware image (SysUpgradeData_Req).
+	The data is copied into the outgoing queue, it needn't stay valid after this call returns.
+	The callback is called once the device acknowledges the chunk. */
+	void sendUpgradeData(const char * aData, size_t aSize, JsonCallback aOnFinish);
+
+	/** Sends the end-of-image marker (an empty SysUpgradeData_Req with CURRPKT set to 1).
+	The device then flashes the image, reporting the progress through SysUpgradeProgress messages. */
+	void finishUpgradeData();
+
+	/** Installs the callback for the SysUpgradeProgress messages that the device pushes during the upgrade.
+	Only one callback can be installed at a time, setting another one overwrites the previous one; nullptr removes it. */
+	void monitorUpgradeProgress(JsonCallback aOnProgress);
+
+	/** Asynchronously sends a single PTZ control command (Ptz_Req) for the specified channel.
+	aCommand is the device's command name, such as "DirectionUp" or "ZoomTile"; aPreset is 65535 to start the movement
+	and -1 to stop it. The commands are sent in order, without any coalescing; use PtzController (through
+	Recorder::ptz()) for the latest-wins joystick control. */
+	void ptzControl(int aChannel, const std::string & aCommand, int aStep, int aPreset, JsonCallback aOnFinish);
+
+	/** Asynchronously asks the device to start a two-way talk (intercom) session (Talk_Req, G.711 A-law, 8 kHz).
+	Once the device confirms, the audio is exchanged using sendTalkData() and monitorTalkData().
+	Use TalkSession (through Recorder::startTalk()) rather than calling these directly. */
+	void startTalk(JsonCallback aOnFinish);
+
+	/** Asynchronously asks the device to stop the talk session. */
+	void stopTalk(JsonCallback aOnFinish);
+
+	/** Sends a single audio packet to the device (TalkToNvr_Data); the device doesn't respond to these.
+	The data is copied into the outgoing queue, it needn't stay valid after this call returns. */
+	std::error_code sendTalkData(const char * aData, size_t aSize);
+
+	/** Installs the callback for the TalkFromNvr_Data audio packets that the device pushes during a talk session.
+	The packet payload is delivered as a slice of the receive buffer, which may be retained without copying.
+	Only one callback can be installed at a time, setting another one overwrites the previous one; nullptr removes it. */
+	void monitorTalkData(SliceCallback aOnData);
+
+	/** Asynchronously queries the device's current wall-clock time (TimeQuery_Req, OPTimeQuery).
+	The response contains the time as a device time string (DeviceTime), with a 1-second resolution.
+	Use DeviceClock (through Recorder::clock()) for the RTT-compensated offset measurement. */
+	void queryTime(JsonCallback aOnFinish);
+
+	/** Asynchronously sets the device's wall-clock time (SyncTime_Req, OPTimeSetting).
+	aDeviceTime is the new time as a device time string (DeviceTime). */
+	void syncTime(const std::string & aDeviceTime, JsonCallback aOnFinish);
+
+	/** Returns the session ID assigned by the device at login; zero if not logged in. */
+	uint32_t sessionID() const { return mSessionID; }
+
+	/** Asynchronously claims this (connected, not logged in) connection for the live media of the specified channel
+	(MonitorClaim_Req), on behalf of the logged-in session aSessionID of the main connection.
+	aStreamType is "Main" or "Extra". Once claimed, the media is started and stopped using monitorAction() on the main
+	connection, and is received on this connection through monitorMediaData().
+	Use LiveStream (through Recorder::startLiveStream()) rather than calling these directly. */
+	void claimMonitor(uint32_t aSessionID, int aChannel, const std::string & aStreamType, JsonCallback aOnFinish);
+
+	/** Asynchronously starts or stops the live media of the specified channel (Monitor_Req, "Start" / "Stop").
+	The media is sent by the device to the connection claimed for it (claimMonitor()). */
+	void monitorAction(const char * aAction, int aChannel, const std::string & aStreamType, JsonCallback aOnFinish);
+
+	/** Installs the callback for the Monitor_Data media packets that the device pushes to a claimed connection.
+	The packet payload is delivered as a slice of the receive buffer, which may be retained without copying.
+	When the connection is closed, the callback is called once more with asio::error::eof.
+	Only one callback can be installed at a time, setting another one overwrites the previous one; nullptr removes it. */
+	void monitorMediaData(SliceCallback aOnData);
+
+	/** Installs the callback called (once) when the connection is closed, either locally or by the device.
+	Only one callback can be installed at a time, setting another one overwrites the previous one; nullptr removes it.
+	Used by MediaConnectionPool to drop its idle connections as soon as they die. */
+	void monitorDisconnect(std::function<void()> aOnDisconnected);
+
+	/** Asynchronously queries a single page of the device log (LogSearch_Req, OPLogQuery).
+	aBeginTime and aEndTime are the device time strings (DeviceTime), both inclusive; aType selects the log entries
+	("LogAll", "System", "Config", ...); aPosition is the position of the first entry to return, for paging.
+	The raw JSON response is delivered as a slice of the receive buffer, without any parsing or checking.
+	Use LogSearch (through Recorder::searchLog()) rather than calling this directly. */
+	void searchLogPage(
+		const std::string & aBeginTime,
+		const std::string & aEndTime,
+		const std::string & aType,
+		uint32_t aPosition,
+		SliceCallback aOnFinish
+	);
+
+	/** Sets the size limits for the multi-packet messages.
+	Outgoing payloads larger than aMaxOutgoingPacketPayload are split into multiple packets (TOTALPKT / CURRPKT).
+	Incoming multi-packet messages larger than aMaxIncomingMessageSize are dropped, their handler is notified
+	with Error::MessageTooLarge. */
+	void setPacketLimits(uint32_t aMaxOutgoingPacketPayload, uint32_t aMaxIncomingMessageSize);
+
+	/** Enables resynchronizing on the incoming framing errors, instead of disconnecting right away.
+	When the data at a packet boundary isn't a valid header, the data is scanned forward for the next plausible header
+	(the identification byte, a known version, this connection's session ID once logged in, and a payload length within
+	the limit), and the parsing continues from there; the skipped bytes are counted in framingStats(). The connection is
+	still dropped if a single resync needs to skip more than aMaxSkippedBytes.
+	0 disables resyncing (default): any framing error disconnects. */
+	void setResync(uint32_t aMaxSkippedBytes);
+
+	/** Returns the counters of the framing errors resynced from. */
+	FramingStats framingStats() const;
+
+	/** Returns the description of the specified message type, nullptr if the type is not known.
+	The descriptions are a compile-time table, the lookup is a single array index. */
+	static const CommandInfo * commandInfo(uint16_t aMessageType);
+
+	/** Installs the handler for a message type that the device pushes, and that has no dedicated monitor
+	(AlarmCenterMsg_Req, Play_Data, Play_Eof, DownloadData); nullptr removes the handler.
+	The payload is delivered as a slice of the receive buffer, which may be retained without copying.
+	Returns false if the type is not such a push; the pushes with a dedicated monitor are installed using that monitor
+	(monitorAlarms(), monitorMediaData(), ...). */
+	bool setPushHandler(CommandType aType, SliceCallback aHandler);
+
+	/** Asynchronously captures a picture from the specified channel.
+	The picture data is delivered as a slice of the receive buffer, which may be retained without copying. */
+	void capturePictureSlice(int aChannel, SliceCallback aOnFinish);
+
+	/** Asynchronously queries the specified device config.
+	If successful, calls the callback with the config name and the raw JSON response, as a slice of the receive buffer
+	which may be retained without copying.
+	On error, calls the callback with an error code and the raw response (empty slice on transport errors). */
+	void getConfigSlice(NamedSliceCallback aOnFinish, const std::string & aConfigName);
+
+	/** Asynchronously queries the specified device config, without parsing or checking the response at all.
+	The raw JSON response is delivered as a slice of the receive buffer; the "Ret" field is left for the caller to check.
+	Used by the typed config parsers (TypedConfig), which process the response in a single pass. */
+	void getConfigRaw(const std::string & aConfigName, SliceCallback aOnFinish);
+
+	/** Asynchronously sets the specified device config (ConfigSet_Req) from its JSON text.
+	Same as setConfig(), but the config value is already serialized (TypedConfig::serialize()); aConfigName is inserted
+	into the request verbatim, it must not need any JSON escaping. */
+	void setConfigRaw(const std::string & aConfigName, const std::string & aConfigJson, JsonCallback aOnFinish);
+
+
+	// Completion-token (asio-style) variants of the above.
+	// These work with any ASIO completion token, such as a plain callback, asio::use_future or asio::use_awaitable
+	// (to co_await the result in a C++20 coroutine). The handler is stored in the incoming queue without being wrapped
+	// in a std::function, and is invoked through its associated executor.
+
+	/** Asynchronously queries the channel names.
+	The completion signature is void(std::error_code, std::vector<std::string>). */
+	template <typename CompletionToken>
+	auto asyncGetChannelNames(CompletionToken && aToken)
+	{
+		nlohmann::json js =
+		{
+			{"SessionID", sessionIDHexStr()},
+			{"Name",      "ChannelTitle"},
+		};
+		return asio::async_initiate<CompletionToken, void(std::error_code, std::vector<std::string>)>(
+			[self = selfPtr()](auto aHandler, const std::string & aPayload)
+			{
+				self->queueCommandRaw(CommandType::ConfigChannelTitleGet_Req, CommandType::ConfigChannelTitleGet_Resp, aPayload,
+					[self, handler = std::move(aHandler)](const std::error_code & aError, const BufferSlice & aData) mutable
+					{
+						nlohmann::json j;
+						auto err = self->processJsonResponse(aError, aData, j);
+						std::vector<std::string> channelNames;
+						if (!err)
+						{
+							err = parseChannelNames(j, channelNames);
+						}
+						dispatchCompletion(std::move(handler), err, std::move(channelNames));
+					}
+				);
+			},
+			aToken, js.dump()
+		);
+	}
+
+	/** Asynchronously queries the specified SysInfo from the device.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetSysInfo(const std::string & aInfoName, CompletionToken && aToken)
+	{
+		return asyncNamedQuery(CommandType::SysInfo_Req, CommandType::SysInfo_Resp, aInfoName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously queries the specified Ability from the device.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetAbility(const std::string & aAbilityName, CompletionToken && aToken)
+	{
+		return asyncNamedQuery(CommandType::AbilityGet_Req, CommandType::AbilityGet_Resp, aAbilityName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously queries the specified device config.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetConfig(const std::string & aConfigName, CompletionToken && aToken)
+	{
+		return asyncNamedQuery(CommandType::ConfigGet_Req, CommandType::ConfigGet_Resp, aConfigName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously captures a picture from the specified channel.
+	The completion signature is void(std::error_code, BufferSlice), the slice contains the raw picture data. */
+	template <typename CompletionToken>
+	auto asyncCapturePicture(int aChannel, CompletionToken && aToken)
+	{
+		return asio::async_initiate<CompletionToken, void(std::error_code, BufferSlice)>(
+			[self = selfPtr()](auto aHandler, const std::string & aPayload)
+			{
+				self->queueCommandRaw(CommandType::NetSnap_Req, CommandType::NetSnap_Resp, aPayload,
+					[handler = std::move(aHandler)](const std::error_code & aError, const BufferSlice & aData) mutable
+					{
+						auto err = aError ? aError : checkPictureResponse(aData.data(), aData.size());
+						dispatchCompletion(std::move(handler), err, err ? BufferSlice() : aData);
+					}
+				);
+			},
+			aToken, capturePictureRequest(aChannel)
+		);
+	}
+
 
 protected:
 
@@ -265,7 +622,7 @@ protected:
 
 	/** The queue of expected response types and their completion handlers waiting for received data.
 	Protected against multithreaded access by mMtxTransfer. */
-	std::vector<std::pair<CommandType, RawDataCallback>> mIncomingQueue;
+	std::vector<std::pair<CommandType, CompletionHandler>> mIncomingQueue;
 
 	/** The sequence counter for outgoing packets. */
 	std::atomic<uint32_t> mSequence;
@@ -277,9 +634,130 @@ protected:
 	/** The ASIO timer used for seinding KeepAlive requests. */
 	asio::steady_timer mKeepAliveTimer;
 
-	/** The callbacks to call upon receiving an alarm.
-	May be nullptr (-> don't call anything, default). */
-	AlarmCallback mOnAlarm;
+	/** The recycled memory for the mKeepAliveTimer's handler. */
+	HandlerMemory mKeepAliveHandlerMemory;
+
+	/** The limit on the payload of a single outgoing packet, larger payloads are sent as multiple packets. */
+	std::atomic<uint32_t> mMaxOutgoingPacketPayload;
+
+	/** The limit on the total size of a reassembled incoming multi-packet message. */
+	std::atomic<uint32_t> mMaxIncomingMessageSize;
+
+	/** The maximum number of bytes a single resync may skip; 0 if resyncing is disabled (see setResync()). */
+	std::atomic<uint32_t> mMaxResyncBytes;
+
+	/** The number of bytes skipped by the resync in progress; 0 if not resyncing.
+	Only accessed from within parseIncomingPackets(), so needs no locking. */
+	size_t mNumResyncBytes;
+
+	/** The counters reported by framingStats(). */
+	std::atomic<uint64_t> mNumResyncs;
+	std::atomic<uint64_t> mNumBytesSkipped;
+
+	/** A multi-packet incoming message that is being reassembled. */
+	struct Reassembly
+	{
+		/** The message type, as received in the packet header. */
+		uint16_t mMessageType;
+
+		/** The sequence number shared by all the packets of the message. */
+		uint32_t mSequence;
+
+		/** The total number of packets in the message (TOTALPKT). */
+		uint8_t mTotalPackets;
+
+		/** The number of packets received so far; also the index (CURRPKT) expected of the next packet. */
+		uint8_t mNumReceived;
+
+		/** When the first packet was received, for expiring the reassemblies whose packets were lost. */
+		std::chrono::steady_clock::time_point mStartTime;
+
+		/** The pooled block into which the payloads are concatenated. */
+		BufferBlockPtr mBlock;
+
+		/** The number of valid bytes in mBlock. */
+		size_t mSize;
+	};
+
+	/** The multi-packet messages currently being reassembled, at most one per message type, identified by the message
+	type and the sequence number. Single-packet messages are processed normally while the reassembly is in progress.
+	Only accessed from within parseIncomingPackets(), so needs no locking. */
+	std::vector<Reassembly> mReassemblies;
+
+	/** A single alarm subscription. */
+	struct AlarmSubscriber
+	{
+		uint64_t mChannelMask;
+
+		/** The event types to report, interned in mAlarmEventTypes; empty to report all of them. */
+		std::vector<const std::string *> mEventTypes;
+
+		AlarmCallback mOnAlarm;
+	};
+
+	using AlarmSubscriberPtr = std::shared_ptr<const AlarmSubscriber>;
+
+	/** The alarm subscriptions, indexed for the dispatch. */
+	struct AlarmSubscribers
+	{
+		/** All the subscriptions, for reporting the errors. */
+		std::vector<AlarmSubscriberPtr> mAll;
+
+		/** The subscriptions to the specific event types, by the interned event type. */
+		std::unordered_map<const std::string *, std::vector<AlarmSubscriberPtr>> mByEventType;
+
+		/** The subscriptions to all the event types. */
+		std::vector<AlarmSubscriberPtr> mAnyEventType;
+	};
+
+	/** The alarm subscriptions, by their ID.
+	Protected against multithreaded access by mMtxTransfer. */
+	std::map<AlarmSubscriptionId, AlarmSubscriberPtr> mAlarmSubscriptions;
+
+	/** The index of mAlarmSubscriptions used by notifyAlarm(); replaced as a whole (copy-on-write) on each change, so
+	that the alarms can be dispatched without holding mMtxTransfer.
+	Protected against multithreaded access by mMtxTransfer. */
+	std::shared_ptr<const AlarmSubscribers> mAlarmSubscribers;
+
+	/** The ID to assign to the next alarm subscription.
+	Protected against multithreaded access by mMtxTransfer. */
+	AlarmSubscriptionId mNextAlarmSubscriptionId;
+
+	/** The subscription installed through monitorAlarms(); 0 if none.
+	Protected against multithreaded access by mMtxTransfer. */
+	AlarmSubscriptionId mMonitorAlarmsSubscriptionId;
+
+	/** The event types named by the alarm filters; the subscriptions are matched by the pointers. */
+	StringInterner mAlarmEventTypes;
+
+	/** The callback to call upon receiving a SysUpgradeProgress message.
+	May be nullptr (-> don't call anything, default).
+	Protected against multithreaded access by mMtxTransfer. */
+	JsonCallback mOnUpgradeProgress;
+
+	/** The callback to call upon receiving a TalkFromNvr_Data message.
+	May be nullptr (-> don't call anything, default).
+	Protected against multithreaded access by mMtxTransfer. */
+	SliceCallback mOnTalkData;
+
+	/** The callback to call for the Monitor_Data media packets.
+	May be nullptr (-> don't call anything, default).
+	Protected against multithreaded access by mMtxTransfer. */
+	SliceCallback mOnMediaData;
+
+	/** The callback to call once the connection is closed.
+	May be nullptr (-> don't call anything, default).
+	Protected against multithreaded access by mMtxTransfer. */
+	std::function<void()> mOnDisconnected;
+
+	/** The handlers of the pushed message types without a dedicated monitor, indexed by the push slot assigned by the
+	command table. Any may be nullptr (-> don't call anything, default).
+	Protected against multithreaded access by mMtxTransfer. */
+	std::array<SliceCallback, NumGenericPushTypes> mPushHandlers;
+
+
+	// The compile-time command table, binding the pushed message types to their notify*() functions:
+	friend class CommandTable;
 
 
 	/** Protected constructor, we want the clients to use std::shared_ptr for owning this object.
@@ -297,10 +775,24 @@ protected:
 
 	void onGetChannelNamesResp(const std::error_code & aError, const nlohmann::json & aResponse, ChannelNamesCallback aOnFinish);
 
+	/** Extracts the channel names from the ConfigChannelTitleGet response JSON into aChannelNames.
+	Returns Error::ResponseMissingExpectedField if the names are not present. */
+	static std::error_code parseChannelNames(const nlohmann::json & aResponse, std::vector<std::string> & aChannelNames);
+
+	/** Returns the JSON payload for the NetSnap request capturing a picture on the specified channel. */
+	static std::string capturePictureRequest(int aChannel);
+
+	/** Checks the NetSnap response for a JSON-reported error.
+	Some firmwares return JSON error, others return raw binary data. Returns the error parsed from the JSON, if any. */
+	static std::error_code checkPictureResponse(const char * aData, size_t aSize);
+
 	/** Queues a KeepAlive request and re-schedules the timer again.
 	Called by ASIO periodically (through mKeepAliveTimer). */
 	void onKeepAliveTimer(const std::error_code & aError);
 
+	/** Schedules mKeepAliveTimer to fire after half of the device's AliveInterval. */
+	void scheduleKeepAlive();
+
 	/** Returns the session ID formatted as a hex number, with "0x" prefix (as is often used in the protocol). */
 	std::string sessionIDHexStr() const;
 
@@ -311,7 +803,18 @@ protected:
 		CommandType aCommandType,
 		CommandType aExpectedResponseType,
 		const std::string & aPayload,
-		RawDataCallback aOnFinish
+		CompletionHandler aOnFinish
+	);
+
+	/** Puts the specified command with a binary payload to the send queue to be sent async.
+	The payload is copied into the send queue, it needn't stay valid after this call returns.
+	Once the reply for the command is received, calls the callback from an ASIO worker thread. */
+	void queueCommandRaw(
+		CommandType aCommandType,
+		CommandType aExpectedResponseType,
+		const char * aPayload,
+		size_t aPayloadSize,
+		CompletionHandler aOnFinish
 	);
 
 	/** Puts the specified command to the send queue to be sent async.
@@ -325,12 +828,147 @@ protected:
 		JsonCallback aOnFinish
 	);
 
-	/** Serializes the specified command into the on-wire format. */
-	std::vector<char> serializeCommand(CommandType aCommandType, const std::string & aPayload);
+	/** Puts the specified command to the send queue to be sent async.
+	Same as queueCommand(), but takes any callable with the JsonCallback signature; the callable is stored in the
+	incoming queue directly, without being wrapped into a std::function first. */
+	template <typename Handler>
+	void queueCommandJson(
+		CommandType aCommandType,
+		CommandType aExpectedResponseType,
+		const std::string & aPayload,
+		Handler && aOnFinish
+	)
+	{
+		queueCommandRaw(aCommandType, aExpectedResponseType, aPayload,
+			[self = selfPtr(), onFinish = std::forward<Handler>(aOnFinish)](const std::error_code & aErr, const BufferSlice & aData) mutable
+			{
+				nlohmann::json j;
+				auto err = self->processJsonResponse(aErr, aData, j);
+				if (err == Error::MalformedResponse)
+				{
+					// The connection has been dropped, don't report anything
+					return;
+				}
+				onFinish(err, j);
+			}
+		);
+	}
+
+	/** Processes the raw response data into a JSON structure, the same way that queueCommand() does.
+	If aError specifies an error, returns it as-is.
+	Stores the SessionID from the response, returns the error from the "Ret" field.
+	If the data cannot be parsed, disconnects and returns Error::MalformedResponse. */
+	std::error_code processJsonResponse(const std::error_code & aError, const BufferSlice & aData, nlohmann::json & aOut);
+
+	/** Implements the completion-token variants of the single-name queries (SysInfo, Ability, Config). */
+	template <typename CompletionToken>
+	auto asyncNamedQuery(CommandType aCommandType, CommandType aExpectedResponseType, const std::string & aName, CompletionToken && aToken)
+	{
+		nlohmann::json js =
+		{
+			{"SessionID", sessionIDHexStr()},
+			{"Name",      aName},
+		};
+		return asio::async_initiate<CompletionToken, void(std::error_code, nlohmann::json)>(
+			[self = selfPtr()](auto aHandler, CommandType aCmd, CommandType aResp, const std::string & aPayload)
+			{
+				self->queueCommandRaw(aCmd, aResp, aPayload,
+					[self, handler = std::move(aHandler)](const std::error_code & aError, const BufferSlice & aData) mutable
+					{
+						nlohmann::json j;
+						auto err = self->processJsonResponse(aError, aData, j);
+						dispatchCompletion(std::move(handler), err, std::move(j));
+					}
+				);
+			},
+			aToken, aCommandType, aExpectedResponseType, js.dump()
+		);
+	}
+
+	/** Serializes the packet header for the specified command into aOutput (Protocol::HeaderLength bytes). */
+	void serializeHeader(
+		char * aOutput,
+		CommandType aCommandType,
+		uint32_t aSequence,
+		uint8_t aTotalPackets,
+		uint8_t aCurrentPacket,
+		size_t aPayloadSize
+	);
+
+	/** Sends the specified command, splitting the payload into multiple packets if it is over the size limit.
+	All the packets of the message are queued at once, so that they're not interleaved with other messages.
+	Returns Error::MessageTooLarge if the payload would need more than Protocol::MaxPacketsPerMessage packets. */
+	std::error_code sendCommand(CommandType aCommandType, const char * aPayload, size_t aPayloadSize);
+
+	/** Adds the payload of a single packet of a multi-packet message to its reassembly.
+	Once all the packets are received, processes the whole message using processMessage().
+	The packets must arrive in order (CURRPKT 0 .. TOTALPKT - 1), sharing the sequence number; on a mismatch (a lost,
+	duplicated or skipped packet) the reassembly is discarded and its handler notified with Error::IncompleteMessage. */
+	void addToReassembly(
+		uint16_t aMessageType,
+		uint32_t aSequence,
+		uint8_t aTotalPackets,
+		uint8_t aCurrentPacket,
+		const char * aPayload,
+		size_t aPayloadSize
+	);
+
+	/** Discards the reassembly (by its index in mReassemblies) and notifies the handler waiting for it. */
+	void failReassembly(size_t aIndex, const std::error_code & aError);
+
+	/** Discards the reassemblies that haven't completed within ReassemblyTimeout. */
+	void expireReassemblies();
+
+	/** If a handler is installed for the push slot (see setPushHandler()), calls it with the payload.
+	Silently ignored if no handler is installed. */
+	void notifyPush(int aPushSlot, const BufferSlice & aPayload);
+
+	/** If an upgrade progress monitor is installed, calls its callback with the parsed data.
+	Silently ignored if no monitor is installed. */
+	void notifyUpgradeProgress(const BufferSlice & aPayload);
+
+	/** If a talk data monitor is installed, calls its callback with the payload.
+	Silently ignored if no monitor is installed. */
+	void notifyTalkData(const BufferSlice & aPayload);
+
+	/** If a media data monitor is installed, calls its callback with the payload.
+	Silently ignored if no monitor is installed. */
+	void notifyMediaData(const BufferSlice & aPayload);
+
+	/** Returns the OPMonitor request with the specified action, channel and stream type. */
+	std::string monitorRequest(const char * aAction, int aChannel, const std::string & aStreamType) const;
+
+	/** Sends the Talk_Req with the specified action ("Start" / "Stop"). */
+	void talkAction(const char * aAction, JsonCallback aOnFinish);
+
+	/** Processes a single complete incoming message:
+	Pushed (unsolicited) messages are dispatched through the command table to their notify*() function, responses are
+	handed to the handler waiting in mIncomingQueue. */
+	void processMessage(uint16_t aMessageType, const BufferSlice & aPayload);
+
+	/** Removes the first handler waiting for the specified message type from mIncomingQueue and returns it.
+	Returns an empty handler if there's none. */
+	CompletionHandler takeIncomingHandler(uint16_t aMessageType);
+
+	/** Parses the alarm and calls the callbacks of the alarm subscriptions matching it.
+	Silently ignored if there are no alarm subscriptions. */
+	void notifyAlarm(const BufferSlice & aPayload);
+
+	/** Reports the error to all the alarm subscriptions. */
+	void notifyAlarmError(const std::error_code & aError, const nlohmann::json & aWholeJson);
+
+	/** Rebuilds mAlarmSubscribers from mAlarmSubscriptions.
+	Assumes mMtxTransfer is locked. */
+	void rebuildAlarmSubscribersLocked();
+
+	/** Returns true if the Protocol::HeaderLength bytes at aPacket look like a valid packet header.
+	Stricter than the check of the regular parsing, used to find the next header when resyncing. */
+	bool isPlausibleHeader(const char * aPacket) const;
 
-	/** If an alarm monitor is installed, calls its callback with the parsed data.
-	Silently ignored if no alarm monitor is installed. */
-	void notifyAlarm(const char * aData, size_t aSize);
+	/** Returns the offset of the first plausible header in mIncomingData at or after aFrom, or of a candidate too close
+	to the end of the data to be checked yet; mIncomingDataSize if there's none.
+	The candidates are found using memchr(), which the C libraries vectorize (SSE2 / AVX2 / NEON). */
+	size_t findPlausibleHeader(size_t aFrom) const;
 
 	/** Parses mIncomingData for any incoming packets, processes them and removes them from mIncomingData / mIncomingDataSize.
 	Implements the functionality used by the underlying TcpConnection. */
@@ -0,0 +1,249 @@
+#include "DeviceClock.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include "Connection.hpp"
+#include "DeviceTime.hpp"
+#include "Error.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+const size_t DeviceClock::MaxHistory;
+const int DeviceClock::MinDriftSpanMinutes;
+
+
+
+
+
+DeviceClock::DeviceClock(std::shared_ptr<Connection> aConnection):
+	mConnection(std::move(aConnection))
+{
+}
+
+
+
+
+
+std::shared_ptr<DeviceClock> DeviceClock::create(std::shared_ptr<Connection> aConnection)
+{
+	return std::shared_ptr<DeviceClock>(new DeviceClock(std::move(aConnection)));
+}
+
+
+
+
+
+std::chrono::seconds DeviceClock::hostUtcOffset()
+{
+	auto now = std::time(nullptr);
+	std::tm local, utc;
+	#ifdef _WIN32
+		localtime_s(&local, &now);
+		gmtime_s(&utc, &now);
+	#else
+		localtime_r(&now, &local);
+		gmtime_r(&now, &utc);
+	#endif
+
+	// Interpret both broken-down times the same way, the difference is the offset:
+	utc.tm_isdst = local.tm_isdst;
+	return std::chrono::seconds(static_cast<int64_t>(std::difftime(std::mktime(&local), std::mktime(&utc))));
+}
+
+
+
+
+
+void DeviceClock::measure(std::chrono::seconds aDeviceUtcOffset, unsigned aNumSamples, MeasureCallback aOnFinish)
+{
+	takeSample(aDeviceUtcOffset, std::max(aNumSamples, 1u), nullptr, std::move(aOnFinish));
+}
+
+
+
+
+
+void DeviceClock::sync(std::chrono::seconds aDeviceUtcOffset, std::chrono::milliseconds aRoundTrip, SyncCallback aOnFinish)
+{
+	// The device truncates to whole seconds, round to the nearest one instead:
+	auto deviceTime = SystemClock::now() + aDeviceUtcOffset + aRoundTrip / 2 + std::chrono::milliseconds(500);
+	mConnection->syncTime(DeviceTime::format(deviceTime),
+		[self = shared_from_this(), aOnFinish](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			if (!aError)
+			{
+				// The drift is measured from the last resync:
+				LockGuard lg(self->mMtx);
+				self->mHistory.clear();
+			}
+			aOnFinish(aError);
+		}
+	);
+}
+
+
+
+
+
+void DeviceClock::check(const Policy & aPolicy, CheckCallback aOnFinish)
+{
+	measure(aPolicy.mDeviceUtcOffset, aPolicy.mNumSamples,
+		[self = shared_from_this(), aPolicy, aOnFinish](const std::error_code & aError, const Measurement & aMeasurement)
+		{
+			CheckResult res{aMeasurement, 0, false, false};
+			if (aError)
+			{
+				return aOnFinish(aError, res);
+			}
+			res.mHasDriftRate = self->driftRate(res.mDriftPpm);
+
+			// Resync if the offset is over the limit now, or will be by the next check:
+			auto offset = std::abs(aMeasurement.mOffset.count());
+			bool shouldSync = (offset > aPolicy.mMaxOffset.count());
+			if (!shouldSync && res.mHasDriftRate && (aPolicy.mCheckInterval.count() > 0))
+			{
+				auto predictedMs = static_cast<double>(aMeasurement.mOffset.count()) +
+					res.mDriftPpm * 1e-3 * static_cast<double>(aPolicy.mCheckInterval.count());
+				shouldSync = (std::abs(predictedMs) > static_cast<double>(aPolicy.mMaxOffset.count()));
+			}
+			if (!shouldSync)
+			{
+				return aOnFinish({}, res);
+			}
+			self->sync(aPolicy.mDeviceUtcOffset, aMeasurement.mRoundTrip,
+				[res, aOnFinish](const std::error_code & aSyncError) mutable
+				{
+					res.mWasSynced = !aSyncError;
+					aOnFinish(aSyncError, res);
+				}
+			);
+		}
+	);
+}
+
+
+
+
+
+bool DeviceClock::driftRate(double & aDriftPpm) const
+{
+	LockGuard lg(mMtx);
+	if (mHistory.size() < 2)
+	{
+		return false;
+	}
+	auto span = mHistory.back().mHostTime - mHistory.front().mHostTime;
+	if (span < std::chrono::minutes(MinDriftSpanMinutes))
+	{
+		return false;
+	}
+
+	// Least-squares slope of the offset (ms) over the host time (s), relative to the first measurement:
+	auto start = mHistory.front().mHostTime;
+	double sumT = 0, sumO = 0, sumTT = 0, sumTO = 0;
+	for (const auto & m: mHistory)
+	{
+		auto t = std::chrono::duration<double>(m.mHostTime - start).count();
+		auto o = static_cast<double>(m.mOffset.count());
+		sumT += t;
+		sumO += o;
+		sumTT += t * t;
+		sumTO += t * o;
+	}
+	auto n = static_cast<double>(mHistory.size());
+	auto denom = n * sumTT - sumT * sumT;
+	if (denom <= 0)
+	{
+		return false;
+	}
+	// ms per s = 1000 ppm
+	aDriftPpm = (n * sumTO - sumT * sumO) / denom * 1000;
+	return true;
+}
+
+
+
+
+
+void DeviceClock::takeSample(
+	std::chrono::seconds aDeviceUtcOffset,
+	unsigned aNumRemaining,
+	std::shared_ptr<Measurement> aBest,
+	MeasureCallback aOnFinish
+)
+{
+	auto sentAt = SystemClock::now();
+	mConnection->queryTime(
+		[self = shared_from_this(), aDeviceUtcOffset, aNumRemaining, aBest, aOnFinish, sentAt](
+			const std::error_code & aError,
+			const nlohmann::json & aResponse
+		) mutable
+		{
+			auto receivedAt = SystemClock::now();
+			if (aError)
+			{
+				return aOnFinish(aError, {});
+			}
+			auto itr = aResponse.find("OPTimeQuery");
+			if ((itr == aResponse.end()) || !itr->is_string())
+			{
+				return aOnFinish(make_error_code(Error::ResponseMissingExpectedField), {});
+			}
+			const auto & timeStr = itr->get_ref<const std::string &>();
+			SystemClock::time_point deviceTime;
+			if (!DeviceTime::parse(timeStr.data(), timeStr.size(), deviceTime))
+			{
+				return aOnFinish(make_error_code(Error::ResponseMissingExpectedField), {});
+			}
+
+			// The device time was taken halfway through the exchange, somewhere within the reported second:
+			auto roundTrip = std::chrono::duration_cast<std::chrono::milliseconds>(receivedAt - sentAt);
+			auto hostTime = sentAt + (receivedAt - sentAt) / 2;
+			auto deviceUtc = deviceTime - aDeviceUtcOffset + std::chrono::milliseconds(500);
+			Measurement m
+			{
+				hostTime,
+				std::chrono::duration_cast<std::chrono::milliseconds>(deviceUtc - hostTime),
+				roundTrip,
+				roundTrip / 2 + std::chrono::milliseconds(500),
+			};
+			if ((aBest == nullptr) || (m.mRoundTrip < aBest->mRoundTrip))
+			{
+				aBest = std::make_shared<Measurement>(m);
+			}
+			if (aNumRemaining > 1)
+			{
+				return self->takeSample(aDeviceUtcOffset, aNumRemaining - 1, aBest, aOnFinish);
+			}
+
+			// Done, remember the best sample for the drift estimation:
+			{
+				LockGuard lg(self->mMtx);
+				self->mHistory.push_back(*aBest);
+				if (self->mHistory.size() > MaxHistory)
+				{
+					self->mHistory.pop_front();
+				}
+			}
+			aOnFinish({}, *aBest);
+		}
+	);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
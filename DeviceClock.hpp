@@ -0,0 +1,152 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+
+
+
+
+
+/** Measures and corrects the clock of a single device.
+The offset is measured using TimeQuery_Req, compensating for the round trip: the device time is assumed to be taken
+halfway through the exchange. Several samples are taken and the one with the shortest round trip is used.
+The measurements since the last resync are kept, to estimate the rate at which the device clock drifts.
+check() resyncs the clock (SyncTime_Req) only when the offset exceeds the policy threshold, or is predicted to exceed
+it before the next check.
+The devices report their wall-clock time without the timezone; the device's UTC offset needs to be provided. */
+class DeviceClock:
+	public std::enable_shared_from_this<DeviceClock>
+{
+public:
+
+	using SystemClock = std::chrono::system_clock;
+
+	/** A single offset measurement. */
+	struct Measurement
+	{
+		/** The host time when the device time was (presumably) taken. */
+		SystemClock::time_point mHostTime;
+
+		/** The device clock offset from the host clock (positive when the device is ahead). */
+		std::chrono::milliseconds mOffset;
+
+		/** The round trip of the TimeQuery_Req exchange. */
+		std::chrono::milliseconds mRoundTrip;
+
+		/** The maximum error of mOffset: half the round trip plus half the device's 1-second resolution. */
+		std::chrono::milliseconds mUncertainty;
+	};
+
+	/** When to resync the device clock. */
+	struct Policy
+	{
+		/** The device's timezone (the offset of its wall clock from UTC). Defaults to the host's. */
+		std::chrono::seconds mDeviceUtcOffset = hostUtcOffset();
+
+		/** The clock is resynced if the measured offset is larger than this. */
+		std::chrono::milliseconds mMaxOffset = std::chrono::seconds(2);
+
+		/** The expected time until the next check; if non-zero, the clock is also resynced if the offset is predicted
+		(from the drift rate) to exceed mMaxOffset by then. */
+		std::chrono::seconds mCheckInterval = std::chrono::seconds(0);
+
+		/** The number of TimeQuery_Req samples per measurement. */
+		unsigned mNumSamples = 3;
+	};
+
+	/** The result of check(). */
+	struct CheckResult
+	{
+		/** The offset measured before the resync (if any). */
+		Measurement mMeasurement;
+
+		/** The estimated drift rate, in parts per million (positive when the device clock runs fast).
+		Only valid if mHasDriftRate is true. */
+		double mDriftPpm;
+
+		/** True if there were enough measurements since the last resync to estimate the drift rate. */
+		bool mHasDriftRate;
+
+		/** True if the clock was resynced. */
+		bool mWasSynced;
+	};
+
+	using MeasureCallback = std::function<void(const std::error_code & aError, const Measurement & aMeasurement)>;
+	using CheckCallback = std::function<void(const std::error_code & aError, const CheckResult & aResult)>;
+	using SyncCallback = std::function<void(const std::error_code & aError)>;
+
+
+	/** Creates a new instance measuring the clock of the device on the specified connection. */
+	static std::shared_ptr<DeviceClock> create(std::shared_ptr<Connection> aConnection);
+
+	/** Returns the host's current UTC offset (of its local timezone). */
+	static std::chrono::seconds hostUtcOffset();
+
+	/** Measures the device clock offset using the specified number of samples; adds the result to the drift history. */
+	void measure(std::chrono::seconds aDeviceUtcOffset, unsigned aNumSamples, MeasureCallback aOnFinish);
+
+	/** Sets the device clock to the host time. aRoundTrip is the expected round trip, half of which is added to the time
+	sent, so that it is correct at the moment the device receives it. Clears the drift history. */
+	void sync(std::chrono::seconds aDeviceUtcOffset, std::chrono::milliseconds aRoundTrip, SyncCallback aOnFinish);
+
+	/** Measures the offset and resyncs the clock if required by the policy. */
+	void check(const Policy & aPolicy, CheckCallback aOnFinish);
+
+	/** Returns the drift rate estimated from the measurements since the last resync, in ppm, into aDriftPpm.
+	Returns false (and leaves aDriftPpm untouched) if there are not enough measurements, spanning a long enough time. */
+	bool driftRate(double & aDriftPpm) const;
+
+
+protected:
+
+	/** The maximum number of measurements kept for the drift estimation. */
+	static const size_t MaxHistory = 32;
+
+	/** The minimum time span of the measurements for the drift to be estimated; with the 1-second resolution of the
+	device time, shorter spans would be mostly noise. */
+	static const int MinDriftSpanMinutes = 30;
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::shared_ptr<Connection> mConnection;
+
+	/** The measurements since the last resync, oldest first. */
+	std::deque<Measurement> mHistory;
+
+
+	explicit DeviceClock(std::shared_ptr<Connection> aConnection);
+
+	/** Takes a single sample; once aNumRemaining reaches zero, reports the best one (the shortest round trip). */
+	void takeSample(
+		std::chrono::seconds aDeviceUtcOffset,
+		unsigned aNumRemaining,
+		std::shared_ptr<Measurement> aBest,
+		MeasureCallback aOnFinish
+	);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
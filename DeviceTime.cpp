@@ -0,0 +1,142 @@
+#include "DeviceTime.hpp"
+
+#include <cstdint>
+#include <cstdio>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Returns the number of days since 1970-01-01 of the specified civil date (proleptic Gregorian calendar). */
+static int64_t daysFromCivil(int64_t aYear, unsigned aMonth, unsigned aDay)
+{
+	aYear -= (aMonth <= 2) ? 1 : 0;
+	auto era = ((aYear >= 0) ? aYear : aYear - 399) / 400;
+	auto yearOfEra = static_cast<unsigned>(aYear - era * 400);
+	auto dayOfYear = (153 * ((aMonth > 2) ? aMonth - 3 : aMonth + 9) + 2) / 5 + aDay - 1;
+	auto dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+	return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+
+
+
+
+/** Converts the number of days since 1970-01-01 into the civil date (proleptic Gregorian calendar). */
+static void civilFromDays(int64_t aDays, int64_t & aYear, unsigned & aMonth, unsigned & aDay)
+{
+	aDays += 719468;
+	auto era = ((aDays >= 0) ? aDays : aDays - 146096) / 146097;
+	auto dayOfEra = static_cast<unsigned>(aDays - era * 146097);
+	auto yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	auto dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+	auto mp = (5 * dayOfYear + 2) / 153;
+	aDay = dayOfYear - (153 * mp + 2) / 5 + 1;
+	aMonth = (mp < 10) ? mp + 3 : mp - 9;
+	aYear = static_cast<int64_t>(yearOfEra) + era * 400 + ((aMonth <= 2) ? 1 : 0);
+}
+
+
+
+
+
+/** Parses the fixed-width decimal number at the specified position.
+Returns false if any of the characters is not a digit. */
+static bool parseDigits(const char * aText, size_t aNumDigits, unsigned & aValue)
+{
+	aValue = 0;
+	for (size_t i = 0; i < aNumDigits; ++i)
+	{
+		if ((aText[i] < '0') || (aText[i] > '9'))
+		{
+			return false;
+		}
+		aValue = aValue * 10 + static_cast<unsigned>(aText[i] - '0');
+	}
+	return true;
+}
+
+
+
+
+
+std::string DeviceTime::format(SystemClock::time_point aTime)
+{
+	auto secs = std::chrono::duration_cast<std::chrono::seconds>(aTime.time_since_epoch()).count();
+	auto days = ((secs >= 0) ? secs : secs - 86399) / 86400;
+	auto secsOfDay = static_cast<unsigned>(secs - days * 86400);
+	int64_t year;
+	unsigned month, day;
+	civilFromDays(days, year, month, day);
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%04lld-%02u-%02u %02u:%02u:%02u",
+		static_cast<long long>(year), month, day,
+		secsOfDay / 3600, (secsOfDay / 60) % 60, secsOfDay % 60
+	);
+	return buf;
+}
+
+
+
+
+
+bool DeviceTime::parse(const char * aText, size_t aLength, SystemClock::time_point & aTime)
+{
+	// "YYYY-MM-DD HH:MM:SS"
+	if (
+		(aLength != 19) ||
+		(aText[4] != '-') || (aText[7] != '-') || (aText[10] != ' ') ||
+		(aText[13] != ':') || (aText[16] != ':')
+	)
+	{
+		return false;
+	}
+	unsigned year, month, day, hour, minute, second;
+	if (
+		!parseDigits(aText, 4, year) ||
+		!parseDigits(aText + 5, 2, month) ||
+		!parseDigits(aText + 8, 2, day) ||
+		!parseDigits(aText + 11, 2, hour) ||
+		!parseDigits(aText + 14, 2, minute) ||
+		!parseDigits(aText + 17, 2, second)
+	)
+	{
+		return false;
+	}
+	return fromFields(year, month, day, hour, minute, second, aTime);
+}
+
+
+
+
+
+bool DeviceTime::fromFields(
+	unsigned aYear, unsigned aMonth, unsigned aDay,
+	unsigned aHour, unsigned aMinute, unsigned aSecond,
+	SystemClock::time_point & aTime
+)
+{
+	if (
+		(aMonth < 1) || (aMonth > 12) || (aDay < 1) || (aDay > 31) ||
+		(aHour > 23) || (aMinute > 59) || (aSecond > 60)
+	)
+	{
+		return false;
+	}
+	auto secs = daysFromCivil(aYear, aMonth, aDay) * 86400 + aHour * 3600 + aMinute * 60 + aSecond;
+	aTime = SystemClock::time_point(std::chrono::duration_cast<SystemClock::duration>(std::chrono::seconds(secs)));
+	return true;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
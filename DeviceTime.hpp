@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Converts between the devices' wall-clock time strings ("2023-03-02 23:54:59") and the system_clock time points.
+The devices don't report their timezone, so the time points represent the device's wall clock as if it were UTC;
+they compare and subtract fine, but need the device's UTC offset applied before comparing with the local clock. */
+class DeviceTime
+{
+public:
+
+	using SystemClock = std::chrono::system_clock;
+
+
+	/** Returns the device time string representing the specified time point (the sub-second part is dropped). */
+	static std::string format(SystemClock::time_point aTime);
+
+	/** Parses the device time string into aTime.
+	Returns false (and leaves aTime untouched) if the string is not in the "YYYY-MM-DD HH:MM:SS" format. */
+	static bool parse(const char * aText, size_t aLength, SystemClock::time_point & aTime);
+
+	/** Converts the individual date and time fields into aTime.
+	Returns false (and leaves aTime untouched) if any of the fields is out of range. */
+	static bool fromFields(
+		unsigned aYear, unsigned aMonth, unsigned aDay,
+		unsigned aHour, unsigned aMinute, unsigned aSecond,
+		SystemClock::time_point & aTime
+	);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
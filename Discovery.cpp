@@ -0,0 +1,435 @@
+#include "Discovery.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "Connection.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::recursive_mutex>;
+
+const uint16_t Discovery::DefaultPort;
+const size_t Discovery::ReceiveBufferSize;
+
+
+
+
+
+/** Returns the little-endian 16-bit value stored at the specified address. */
+static uint16_t readLE16(const char * aData)
+{
+	auto d = reinterpret_cast<const unsigned char *>(aData);
+	return static_cast<uint16_t>(d[0] | (d[1] << 8));
+}
+
+
+
+
+
+/** Returns the little-endian 32-bit value stored at the specified address. */
+static uint32_t readLE32(const char * aData)
+{
+	auto d = reinterpret_cast<const unsigned char *>(aData);
+	return static_cast<uint32_t>(d[0]) | (static_cast<uint32_t>(d[1]) << 8) | (static_cast<uint32_t>(d[2]) << 16) | (static_cast<uint32_t>(d[3]) << 24);
+}
+
+
+
+
+
+/** Returns the string value of the specified field in the JSON object, or empty string if not present.
+Numbers are converted to their string representation. */
+static std::string stringField(const nlohmann::json & aObject, const char * aName)
+{
+	auto itr = aObject.find(aName);
+	if (itr == aObject.end())
+	{
+		return {};
+	}
+	if (itr->is_string())
+	{
+		return itr->get<std::string>();
+	}
+	if (itr->is_number())
+	{
+		return itr->dump();
+	}
+	return {};
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Discovery::Socket:
+
+Discovery::Socket::Socket(asio::io_context & aIoContext, const Target & aTarget, bool aIsSending):
+	mTarget(aTarget),
+	mSocket(aIoContext),
+	mReceiveBuffer(ReceiveBufferSize),
+	mIsSending(aIsSending)
+{
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Discovery:
+
+Discovery::Discovery(std::vector<Target> aTargets, const Options & aOptions):
+	mOptions(aOptions),
+	mTargets(std::move(aTargets)),
+	mTimer(Root::instance().ioContext()),
+	mNumProbesSent(0)
+{
+}
+
+
+
+
+
+std::shared_ptr<Discovery> Discovery::create(std::vector<Target> aTargets, const Options & aOptions)
+{
+	return std::shared_ptr<Discovery>(new Discovery(std::move(aTargets), aOptions));
+}
+
+
+
+
+
+Discovery::Target Discovery::broadcastTarget(const std::string & aLocalAddress)
+{
+	return Target{aLocalAddress, DefaultPort, "255.255.255.255", DefaultPort};
+}
+
+
+
+
+
+void Discovery::start(DeviceCallback aOnDevice, FinishCallback aOnFinished)
+{
+	LockGuard lg(mMtx);
+	mOnDevice = std::move(aOnDevice);
+	mOnFinished = std::move(aOnFinished);
+
+	// Open a socket for each target, skip those that fail.
+	// The broadcast replies to DefaultPort don't reach a socket bound to a specific address, such targets send from
+	// an ephemeral port and a single wildcard socket receives the replies for all of them:
+	std::error_code lastError;
+	bool needsReceiver = false;
+	bool hasWildcardReceiver = false;
+	for (const auto & target: mTargets)
+	{
+		auto localPort = target.mLocalPort;
+		if (localPort == DefaultPort)
+		{
+			std::error_code err;
+			auto localAddress = asio::ip::make_address_v4(target.mLocalAddress, err);
+			if (!err && !localAddress.is_unspecified())
+			{
+				localPort = 0;
+				needsReceiver = true;
+			}
+			else if (!err)
+			{
+				hasWildcardReceiver = true;
+			}
+		}
+		auto err = openSocket(target, localPort, true);
+		if (err)
+		{
+			lastError = err;
+		}
+	}
+	if (needsReceiver && !hasWildcardReceiver)
+	{
+		auto err = openSocket(Target{"0.0.0.0", DefaultPort, "0.0.0.0", 0}, DefaultPort, false);
+		if (err)
+		{
+			lastError = err;
+		}
+	}
+	mTargets.clear();
+	auto hasSendingSocket = std::any_of(mSockets.begin(), mSockets.end(),
+		[](const std::unique_ptr<Socket> & aSocket)
+		{
+			return aSocket->mIsSending;
+		}
+	);
+	if (!hasSendingSocket)
+	{
+		mSockets.clear();
+		if (!lastError)
+		{
+			lastError = std::make_error_code(std::errc::invalid_argument);
+		}
+		asio::post(Root::instance().ioContext(),
+			[self = shared_from_this(), lastError]()
+			{
+				FinishCallback onFinished;
+				{
+					LockGuard lg(self->mMtx);
+					std::swap(onFinished, self->mOnFinished);
+				}
+				if (onFinished)
+				{
+					onFinished(lastError, {});
+				}
+			}
+		);
+		return;
+	}
+
+	for (auto & sock: mSockets)
+	{
+		receive(*sock);
+	}
+	mDeadline = std::chrono::steady_clock::now() + mOptions.mTimeout;
+	sendProbes();
+}
+
+
+
+
+
+std::vector<char> Discovery::probeDatagram()
+{
+	std::vector<char> res(Protocol::HeaderLength, 0);
+	res[0] = Protocol::IDENTIFICATION;
+	res[1] = Protocol::VERSION;
+	auto type = static_cast<uint16_t>(Connection::CommandType::IPSearch_Req);
+	res[14] = static_cast<char>(type & 0xff);
+	res[15] = static_cast<char>(type >> 8);
+	return res;
+}
+
+
+
+
+
+bool Discovery::parseReply(const char * aData, size_t aSize, const std::string & aSenderAddress, Device & aDevice)
+{
+	// Check the header:
+	if (
+		(aSize < Protocol::HeaderLength) ||
+		(aData[0] != Protocol::IDENTIFICATION) ||
+		(readLE16(aData + 14) != static_cast<uint16_t>(Connection::CommandType::IPSearch_Resp))
+	)
+	{
+		return false;
+	}
+	size_t payloadSize = readLE32(aData + 16);
+	if (payloadSize > aSize - Protocol::HeaderLength)
+	{
+		return false;
+	}
+
+	// Parse the JSON, the devices terminate it with a NUL and / or a newline:
+	auto payload = aData + Protocol::HeaderLength;
+	while ((payloadSize > 0) && ((payload[payloadSize - 1] == '\0') || (payload[payloadSize - 1] == '\n')))
+	{
+		payloadSize -= 1;
+	}
+	auto j = nlohmann::json::parse(payload, payload + payloadSize, nullptr, false);
+	if (j.is_discarded() || !j.is_object())
+	{
+		return false;
+	}
+	auto itr = j.find("NetWork.NetCommon");
+	if ((itr == j.end()) || !itr->is_object())
+	{
+		return false;
+	}
+	const auto & info = *itr;
+
+	// The HostIP is a hex string of the address in the little-endian byte order ("0x0A01A8C0" = 192.168.1.10):
+	aDevice.mIpAddress = aSenderAddress;
+	auto hostIP = stringField(info, "HostIP");
+	if (!hostIP.empty())
+	{
+		auto ip = static_cast<uint32_t>(std::strtoul(hostIP.c_str(), nullptr, 16));
+		if (ip != 0)
+		{
+			char buf[16];
+			snprintf(buf, sizeof(buf), "%u.%u.%u.%u", ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, (ip >> 24) & 0xff);
+			aDevice.mIpAddress = buf;
+		}
+	}
+	auto tcpPort = info.find("TCPPort");
+	aDevice.mTcpPort = ((tcpPort != info.end()) && tcpPort->is_number()) ? tcpPort->get<uint16_t>() : 34567;
+	aDevice.mMac = stringField(info, "MAC");
+	aDevice.mSerialNumber = stringField(info, "SN");
+	aDevice.mModel = stringField(info, "DeviceType");
+	aDevice.mHostName = stringField(info, "HostName");
+	aDevice.mInfo = info;
+	return true;
+}
+
+
+
+
+
+std::error_code Discovery::openSocket(const Target & aTarget, uint16_t aLocalPort, bool aIsSending)
+{
+	std::unique_ptr<Socket> sock(new Socket(Root::instance().ioContext(), aTarget, aIsSending));
+	std::error_code err;
+	auto localAddress = asio::ip::make_address_v4(aTarget.mLocalAddress, err);
+	asio::ip::address_v4 destAddress;
+	if (!err)
+	{
+		destAddress = asio::ip::make_address_v4(aTarget.mDestinationAddress, err);
+	}
+	if (!err)
+	{
+		sock->mSocket.open(asio::ip::udp::v4(), err);
+	}
+	if (!err)
+	{
+		// Multiple discoveries (and other tools) may listen on the well-known port at the same time:
+		sock->mSocket.set_option(asio::socket_base::reuse_address(true), err);
+		sock->mSocket.set_option(asio::socket_base::broadcast(true), err);
+		sock->mSocket.bind(asio::ip::udp::endpoint(localAddress, aLocalPort), err);
+	}
+	if (err)
+	{
+		return err;
+	}
+	sock->mDestination = asio::ip::udp::endpoint(destAddress, aTarget.mDestinationPort);
+	mSockets.push_back(std::move(sock));
+	return {};
+}
+
+
+
+
+
+void Discovery::receive(Socket & aSocket)
+{
+	aSocket.mSocket.async_receive_from(
+		asio::buffer(aSocket.mReceiveBuffer), aSocket.mSender,
+		[self = shared_from_this(), &aSocket](const std::error_code & aError, size_t aNumBytes)
+		{
+			if (aError)
+			{
+				// The socket was closed by finish()
+				return;
+			}
+			Device device;
+			if (parseReply(aSocket.mReceiveBuffer.data(), aNumBytes, aSocket.mSender.address().to_string(), device))
+			{
+				bool isNew = false;
+				DeviceCallback onDevice;
+				{
+					LockGuard lg(self->mMtx);
+					auto key = device.mMac.empty() ? device.mIpAddress : device.mMac;
+					isNew = self->mDevices.insert(std::make_pair(key, device)).second;
+					onDevice = self->mOnDevice;
+				}
+				if (isNew && onDevice)
+				{
+					onDevice(device);
+				}
+			}
+			self->receive(aSocket);
+		}
+	);
+}
+
+
+
+
+
+void Discovery::sendProbes()
+{
+	LockGuard lg(mMtx);
+	if (!mOnFinished)
+	{
+		// Already finished
+		return;
+	}
+	auto probe = std::make_shared<std::vector<char>>(probeDatagram());
+	for (auto & sock: mSockets)
+	{
+		if (!sock->mIsSending)
+		{
+			continue;
+		}
+		sock->mSocket.async_send_to(asio::buffer(*probe), sock->mDestination,
+			[probe](const std::error_code & aError, size_t aNumBytes)
+			{
+				// Send errors are ignored, the other probes may still get through
+			}
+		);
+	}
+	mNumProbesSent += 1;
+
+	// Schedule the next probe, or the final timeout:
+	auto nextProbe = std::chrono::steady_clock::now() + mOptions.mProbeInterval;
+	bool isLastProbe = (mNumProbesSent >= mOptions.mNumProbes) || (nextProbe >= mDeadline);
+	mTimer.expires_at(isLastProbe ? mDeadline : nextProbe);
+	mTimer.async_wait(
+		[self = shared_from_this(), isLastProbe](const std::error_code & aError)
+		{
+			if (aError)
+			{
+				return;
+			}
+			if (isLastProbe)
+			{
+				self->finish();
+			}
+			else
+			{
+				self->sendProbes();
+			}
+		}
+	);
+}
+
+
+
+
+
+void Discovery::finish()
+{
+	FinishCallback onFinished;
+	std::vector<Device> devices;
+	{
+		LockGuard lg(mMtx);
+		std::swap(onFinished, mOnFinished);
+		for (auto & sock: mSockets)
+		{
+			std::error_code err;
+			sock->mSocket.close(err);
+		}
+		devices.reserve(mDevices.size());
+		for (const auto & d: mDevices)
+		{
+			devices.push_back(d.second);
+		}
+	}
+	if (onFinished)
+	{
+		onFinished({}, devices);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
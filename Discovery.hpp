@@ -0,0 +1,194 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Discovers the NetSurveillance devices on the LAN, using the vendor's UDP search broadcast.
+Sends the IPSearch_Req probe on each of the configured targets (typically one per network interface) concurrently,
+repeating it a few times to cover for lost datagrams, and collects the IPSearch_Resp replies until the timeout.
+The devices broadcast their replies to 255.255.255.255:DefaultPort, which a socket bound to a specific interface
+address doesn't receive (on Linux); such targets only send the probes from their interface, the replies are received
+by a single shared socket bound to the wildcard address on DefaultPort.
+The replies are deduplicated by the device's MAC address.
+Runs on the Root's io_context. */
+class Discovery:
+	public std::enable_shared_from_this<Discovery>
+{
+public:
+
+	/** The default UDP port on which the devices listen for the search probes (and send the replies to). */
+	static const uint16_t DefaultPort = 34569;
+
+	/** A single discovered device. */
+	struct Device
+	{
+		/** The MAC address, as reported by the device ("00:12:34:56:78:9a"). */
+		std::string mMac;
+
+		/** The IPv4 address of the device, in the dotted form. */
+		std::string mIpAddress;
+
+		/** The TCP port on which the device accepts the control connections. */
+		uint16_t mTcpPort;
+
+		/** The serial number of the device. */
+		std::string mSerialNumber;
+
+		/** The device model, as reported in the DeviceType field. */
+		std::string mModel;
+
+		/** The host name configured in the device. */
+		std::string mHostName;
+
+		/** The whole NetWork.NetCommon object from the reply, for any other details. */
+		nlohmann::json mInfo;
+	};
+
+	/** A single place where to send the probes and receive the replies (typically one per network interface). */
+	struct Target
+	{
+		/** The local address to bind to, selecting the network interface from which the probes are sent;
+		"0.0.0.0" for the default interface. */
+		std::string mLocalAddress;
+
+		/** The local port to bind to. The devices reply to DefaultPort; with a specific mLocalAddress, the target's
+		socket is bound to an ephemeral port instead and the replies are received by the shared wildcard socket.
+		0 binds to an ephemeral port, which is only suitable for the responders that reply to the sender's port (such
+		as test stand-ins). */
+		uint16_t mLocalPort;
+
+		/** The address to send the probes to; typically the broadcast address ("255.255.255.255", or a subnet
+		broadcast such as "192.168.1.255"), or a unicast address of a test responder. */
+		std::string mDestinationAddress;
+
+		/** The port to send the probes to. */
+		uint16_t mDestinationPort;
+	};
+
+	/** The tunables of the discovery. */
+	struct Options
+	{
+		/** How long to wait for the replies, since the first probe. */
+		std::chrono::milliseconds mTimeout = std::chrono::seconds(3);
+
+		/** The number of probes sent on each target. */
+		unsigned mNumProbes = 3;
+
+		/** The interval between the probes. */
+		std::chrono::milliseconds mProbeInterval = std::chrono::milliseconds(500);
+	};
+
+	/** The callback called for each newly discovered device, as soon as its first reply arrives. */
+	using DeviceCallback = std::function<void(const Device & aDevice)>;
+
+	/** The callback called once the discovery finishes, with all the discovered devices.
+	aError is set only if none of the targets could be used. */
+	using FinishCallback = std::function<void(const std::error_code & aError, const std::vector<Device> & aDevices)>;
+
+
+	/** Creates a new discovery on the specified targets; doesn't start it yet. */
+	static std::shared_ptr<Discovery> create(std::vector<Target> aTargets, const Options & aOptions);
+
+	/** Returns the target for broadcasting on the default interface. */
+	static Target broadcastTarget(const std::string & aLocalAddress = "0.0.0.0");
+
+	/** Starts the discovery. aOnDevice may be nullptr. */
+	void start(DeviceCallback aOnDevice, FinishCallback aOnFinished);
+
+	/** Returns the IPSearch_Req probe datagram. */
+	static std::vector<char> probeDatagram();
+
+	/** Parses a single reply datagram into aDevice.
+	aSenderAddress is used if the reply doesn't contain a usable IP address.
+	Returns false if the datagram is not a valid IPSearch_Resp. */
+	static bool parseReply(const char * aData, size_t aSize, const std::string & aSenderAddress, Device & aDevice);
+
+
+protected:
+
+	/** The receive buffer size; the replies are well below 2 KiB. */
+	static const size_t ReceiveBufferSize = 4096;
+
+	/** A single target with its socket. */
+	struct Socket
+	{
+		Target mTarget;
+		asio::ip::udp::socket mSocket;
+		asio::ip::udp::endpoint mDestination;
+		asio::ip::udp::endpoint mSender;
+		std::vector<char> mReceiveBuffer;
+
+		/** True if the probes are sent from this socket; false for the shared receive-only socket. */
+		bool mIsSending;
+
+		Socket(asio::io_context & aIoContext, const Target & aTarget, bool aIsSending);
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::recursive_mutex mMtx;
+
+	const Options mOptions;
+
+	/** The sockets for the individual targets, and the shared receive-only socket, if needed; only those that were
+	opened successfully. */
+	std::vector<std::unique_ptr<Socket>> mSockets;
+
+	/** The targets, until start() opens their sockets. */
+	std::vector<Target> mTargets;
+
+	/** The discovered devices, keyed by their MAC address (or IP address, if the MAC is not reported). */
+	std::map<std::string, Device> mDevices;
+
+	/** The timer for sending the repeated probes and for the final timeout. */
+	asio::steady_timer mTimer;
+
+	/** The number of probes sent so far on each target. */
+	unsigned mNumProbesSent;
+
+	/** The time when the discovery finishes. */
+	std::chrono::steady_clock::time_point mDeadline;
+
+	DeviceCallback mOnDevice;
+	FinishCallback mOnFinished;
+
+
+	Discovery(std::vector<Target> aTargets, const Options & aOptions);
+
+	/** Opens a socket for the specified target, bound to aLocalPort, and adds it to mSockets. */
+	std::error_code openSocket(const Target & aTarget, uint16_t aLocalPort, bool aIsSending);
+
+	/** Starts receiving on the specified socket. */
+	void receive(Socket & aSocket);
+
+	/** Sends a probe on all the sockets and schedules the next one, or the final timeout. */
+	void sendProbes();
+
+	/** Closes all the sockets and reports the discovered devices. */
+	void finish();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
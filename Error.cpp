@@ -29,6 +29,9 @@ std::string ErrorCategoryImpl::message(int aErrorValue) const
 		// Synthetic error codes:
 		case Error::NoConnection: return "No connection to the device";
 		case Error::ResponseMissingExpectedField: return "The response is missing a required field";
+		case Error::MalformedResponse: return "The response could not be parsed";
+		case Error::MessageTooLarge: return "The message is too large";
+		case Error::IncompleteMessage: return "The multi-packet message is incomplete";
 
 		// Error codes reported by the device:
 		case Error::Success:
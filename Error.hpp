@@ -18,6 +18,9 @@ enum class Error
 	// Synthetic error codes:
 	NoConnection = 1,  // The socket to the device is not connected (probably missing a connectAndLogin() call)
 	ResponseMissingExpectedField = 2,  // The response was missing an expected field, required for further communication
+	MalformedResponse = 3,  // The response could not be parsed at all (invalid JSON); the connection is dropped
+	MessageTooLarge = 4,  // The message is over the configured size limits (Connection::setPacketLimits())
+	IncompleteMessage = 5,  // A multi-packet message lost some of its packets (or got them out of order), or timed out
 
 	// Error codes reported by the device ("Ret" code in the json):
 	Success = 100,  // Not an error, this is the expected Success state
@@ -0,0 +1,431 @@
+#include "FirmwareUpgrade.hpp"
+
+#include <algorithm>
+#include "BandwidthLimiter.hpp"
+#include "Connection.hpp"
+#include "Error.hpp"
+#include "MemoryMappedFile.hpp"
+#include "ParallelRunner.hpp"
+#include "Recorder.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::recursive_mutex>;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FirmwareUpgrade:
+
+FirmwareUpgrade::FirmwareUpgrade(
+	std::shared_ptr<Connection> aConnection,
+	std::shared_ptr<const MemoryMappedFile> aImage,
+	std::shared_ptr<BandwidthLimiter> aLimiter,
+	const Options & aOptions,
+	ProgressCallback aOnProgress
+):
+	mConnection(std::move(aConnection)),
+	mImage(std::move(aImage)),
+	mLimiter(std::move(aLimiter)),
+	mOptions(aOptions),
+	mOnProgress(std::move(aOnProgress)),
+	mProgress{Stage::Starting, 0, mImage->size(), -1, {}},
+	mNextOffset(0),
+	mNumInFlight(0),
+	mNumUnacked(0),
+	mTimeoutTimer(Root::instance().ioContext())
+{
+	mOptions.mChunkSize = std::max<size_t>(mOptions.mChunkSize, 1);
+	mOptions.mMaxChunksInFlight = std::max<size_t>(mOptions.mMaxChunksInFlight, 1);
+}
+
+
+
+
+
+std::shared_ptr<FirmwareUpgrade> FirmwareUpgrade::create(
+	std::shared_ptr<Connection> aConnection,
+	std::shared_ptr<const MemoryMappedFile> aImage,
+	std::shared_ptr<BandwidthLimiter> aLimiter,
+	const Options & aOptions,
+	ProgressCallback aOnProgress
+)
+{
+	return std::shared_ptr<FirmwareUpgrade>(new FirmwareUpgrade(
+		std::move(aConnection), std::move(aImage), std::move(aLimiter), aOptions, std::move(aOnProgress)
+	));
+}
+
+
+
+
+
+void FirmwareUpgrade::start()
+{
+	if (mImage->size() == 0)
+	{
+		return finish(std::make_error_code(std::errc::invalid_argument));
+	}
+	std::weak_ptr<FirmwareUpgrade> weakSelf = shared_from_this();
+	mConnection->monitorUpgradeProgress(
+		[weakSelf](const std::error_code & aError, const nlohmann::json & aMessage)
+		{
+			auto self = weakSelf.lock();
+			if (self != nullptr)
+			{
+				self->onDeviceProgress(aMessage);
+			}
+		}
+	);
+	mConnection->startUpgrade(
+		[self = shared_from_this()](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			self->onStartResp(aError);
+		}
+	);
+}
+
+
+
+
+
+void FirmwareUpgrade::abort()
+{
+	finish(asio::error::operation_aborted);
+}
+
+
+
+
+
+void FirmwareUpgrade::onStartResp(const std::error_code & aError)
+{
+	if (aError)
+	{
+		return finish(aError);
+	}
+	{
+		LockGuard lg(mMtx);
+		if (mProgress.mStage != Stage::Starting)
+		{
+			return;
+		}
+		mProgress.mStage = Stage::Uploading;
+	}
+	reportProgress();
+	fillWindow();
+}
+
+
+
+
+
+void FirmwareUpgrade::fillWindow()
+{
+	LockGuard lg(mMtx);
+	auto imageSize = mImage->size();
+	while (
+		(mProgress.mStage == Stage::Uploading) &&
+		(mNumInFlight < mOptions.mMaxChunksInFlight) &&
+		(mNextOffset < imageSize)
+	)
+	{
+		auto offset = mNextOffset;
+		auto size = std::min(mOptions.mChunkSize, imageSize - offset);
+		mNextOffset += size;
+		mNumInFlight += 1;
+		if (mLimiter != nullptr)
+		{
+			mLimiter->acquire(size,
+				[self = shared_from_this(), offset, size]()
+				{
+					self->sendChunk(offset, size);
+				}
+			);
+		}
+		else
+		{
+			sendChunk(offset, size);
+		}
+	}
+}
+
+
+
+
+
+void FirmwareUpgrade::sendChunk(size_t aOffset, size_t aSize)
+{
+	{
+		LockGuard lg(mMtx);
+		if (mProgress.mStage != Stage::Uploading)
+		{
+			return;
+		}
+		mNumUnacked += 1;
+		armAckTimeoutLocked();
+	}
+
+	// The data is copied straight from the mapped image into the outgoing queue:
+	mConnection->sendUpgradeData(mImage->data() + aOffset, aSize,
+		[self = shared_from_this(), aSize](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			self->onChunkAcked(aError, aSize);
+		}
+	);
+}
+
+
+
+
+
+void FirmwareUpgrade::onChunkAcked(const std::error_code & aError, size_t aSize)
+{
+	if (aError)
+	{
+		return finish(aError);
+	}
+	bool isAllSent;
+	{
+		LockGuard lg(mMtx);
+		if (mProgress.mStage != Stage::Uploading)
+		{
+			return;
+		}
+		mNumInFlight -= 1;
+		mNumUnacked -= 1;
+		armAckTimeoutLocked();
+		mProgress.mBytesSent += aSize;
+		isAllSent = (mProgress.mBytesSent >= mProgress.mTotalBytes);
+		if (isAllSent)
+		{
+			mProgress.mStage = Stage::Flashing;
+		}
+	}
+	reportProgress();
+	if (!isAllSent)
+	{
+		return fillWindow();
+	}
+
+	// All the data has been sent, let the device flash it:
+	mConnection->finishUpgradeData();
+	LockGuard lg(mMtx);
+	mTimeoutTimer.expires_after(mOptions.mFlashTimeout);
+	mTimeoutTimer.async_wait(
+		[self = shared_from_this()](const std::error_code & aError)
+		{
+			if (!aError)
+			{
+				self->finish(make_error_code(Error::Timeout));
+			}
+		}
+	);
+}
+
+
+
+
+
+void FirmwareUpgrade::armAckTimeoutLocked()
+{
+	if (mNumUnacked == 0)
+	{
+		// Nothing is expected from the device (the chunks may be waiting for bandwidth):
+		mTimeoutTimer.cancel();
+		return;
+	}
+	mTimeoutTimer.expires_after(mOptions.mAckTimeout);
+	mTimeoutTimer.async_wait(
+		[self = shared_from_this()](const std::error_code & aError)
+		{
+			if (!aError)
+			{
+				self->finish(make_error_code(Error::Timeout));
+			}
+		}
+	);
+}
+
+
+
+
+
+void FirmwareUpgrade::onDeviceProgress(const nlohmann::json & aMessage)
+{
+	auto itr = aMessage.find("Ret");
+	if ((itr == aMessage.end()) || !itr->is_number())
+	{
+		return;
+	}
+	int ret = *itr;
+	if (ret == DeviceRetSuccess)
+	{
+		return finish({});
+	}
+	if (ret == DeviceRetFailure)
+	{
+		return finish(make_error_code(Error::UnknownError));
+	}
+	if ((ret >= 0) && (ret <= 100))
+	{
+		{
+			LockGuard lg(mMtx);
+			if (mProgress.mStage == Stage::Finished)
+			{
+				return;
+			}
+			mProgress.mDevicePercent = ret;
+		}
+		reportProgress();
+	}
+}
+
+
+
+
+
+void FirmwareUpgrade::finish(const std::error_code & aError)
+{
+	{
+		LockGuard lg(mMtx);
+		if (mProgress.mStage == Stage::Finished)
+		{
+			return;
+		}
+		mProgress.mStage = Stage::Finished;
+		mProgress.mError = aError;
+		mTimeoutTimer.cancel();
+	}
+	mConnection->monitorUpgradeProgress(nullptr);
+	reportProgress();
+}
+
+
+
+
+
+void FirmwareUpgrade::reportProgress()
+{
+	Progress progress;
+	{
+		LockGuard lg(mMtx);
+		progress = mProgress;
+	}
+	if (mOnProgress)
+	{
+		mOnProgress(progress);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FirmwareRollout:
+
+FirmwareRollout::FirmwareRollout(
+	std::shared_ptr<const MemoryMappedFile> aImage,
+	size_t aMaxParallelDevices,
+	uint64_t aTotalBytesPerSecond,
+	const FirmwareUpgrade::Options & aOptions
+):
+	mImage(std::move(aImage)),
+	mLimiter(BandwidthLimiter::create(aTotalBytesPerSecond)),
+	mRunner(ParallelRunner::create(aMaxParallelDevices)),
+	mOptions(aOptions)
+{
+}
+
+
+
+
+
+std::shared_ptr<FirmwareRollout> FirmwareRollout::create(
+	std::shared_ptr<const MemoryMappedFile> aImage,
+	size_t aMaxParallelDevices,
+	uint64_t aTotalBytesPerSecond,
+	const FirmwareUpgrade::Options & aOptions
+)
+{
+	return std::shared_ptr<FirmwareRollout>(new FirmwareRollout(std::move(aImage), aMaxParallelDevices, aTotalBytesPerSecond, aOptions));
+}
+
+
+
+
+
+void FirmwareRollout::addRecorder(std::shared_ptr<Recorder> aRecorder)
+{
+	mResults.push_back({std::move(aRecorder), {}});
+}
+
+
+
+
+
+void FirmwareRollout::start(DeviceProgressCallback aOnDeviceProgress, FinishCallback aOnFinished)
+{
+	std::vector<ParallelRunner::Task> tasks;
+	tasks.reserve(mResults.size());
+	for (size_t i = 0; i < mResults.size(); ++i)
+	{
+		tasks.push_back(
+			[self = shared_from_this(), i, aOnDeviceProgress](std::function<void()> aOnTaskFinished)
+			{
+				auto recorder = self->mResults[i].mRecorder;
+				recorder->upgradeFirmware(self->mImage, self->mLimiter, self->mOptions,
+					[self, i, recorder, aOnDeviceProgress, aOnTaskFinished](const FirmwareUpgrade::Progress & aProgress)
+					{
+						if (aOnDeviceProgress)
+						{
+							aOnDeviceProgress(recorder, aProgress);
+						}
+						if (aProgress.mStage == FirmwareUpgrade::Stage::Finished)
+						{
+							self->mResults[i].mError = aProgress.mError;
+							aOnTaskFinished();
+						}
+					}
+				);
+			}
+		);
+	}
+	mRunner->run(std::move(tasks),
+		[self = shared_from_this(), aOnFinished]()
+		{
+			if (aOnFinished)
+			{
+				aOnFinished(self->mResults);
+			}
+		}
+	);
+}
+
+
+
+
+
+void FirmwareRollout::setBandwidth(uint64_t aTotalBytesPerSecond)
+{
+	mLimiter->setRate(aTotalBytesPerSecond);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
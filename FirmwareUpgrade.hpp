@@ -0,0 +1,264 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class BandwidthLimiter;
+class Connection;
+class MemoryMappedFile;
+class ParallelRunner;
+class Recorder;
+
+
+
+
+
+/** A single firmware upgrade of a single device.
+Streams the firmware image from a memory-mapped file (shared by any number of upgrades) in chunks, with only a
+bounded number of chunks in flight, optionally throttled by a (shared) BandwidthLimiter. Then waits for the device
+to flash the image, reporting the device's SysUpgradeProgress messages.
+Use Recorder::upgradeFirmware() to create and start an instance. */
+class FirmwareUpgrade:
+	public std::enable_shared_from_this<FirmwareUpgrade>
+{
+public:
+
+	/** The stage in which the upgrade is. */
+	enum class Stage
+	{
+		Starting,   // Waiting for the device to accept the SysUpgrade_Req
+		Uploading,  // Sending the image data
+		Flashing,   // All data was sent, the device is flashing the image
+		Finished,   // Finished, either successfully or with an error (see Progress::mError)
+	};
+
+	/** The progress report passed to the progress callback. */
+	struct Progress
+	{
+		Stage mStage;
+
+		/** The number of image bytes acknowledged by the device. */
+		size_t mBytesSent;
+
+		/** The total number of bytes in the image. */
+		size_t mTotalBytes;
+
+		/** The last progress percentage reported by the device while flashing; -1 if not reported yet. */
+		int mDevicePercent;
+
+		/** The error that finished the upgrade; only valid in the Finished stage. */
+		std::error_code mError;
+	};
+
+	/** The callback for reporting the progress.
+	Called from an ASIO worker thread whenever a chunk is acknowledged, a device progress message arrives, or the
+	upgrade finishes (always called exactly once with the Finished stage). */
+	using ProgressCallback = std::function<void(const Progress & aProgress)>;
+
+	/** The tunables of the upgrade. */
+	struct Options
+	{
+		/** The number of image bytes sent in a single SysUpgradeData_Req. */
+		size_t mChunkSize = 32 * 1024;
+
+		/** The maximum number of chunks sent but not yet acknowledged by the device. */
+		size_t mMaxChunksInFlight = 4;
+
+		/** How long to wait for the device to acknowledge a chunk during the upload (since the last chunk was sent or
+		acknowledged); the upgrade fails with Error::Timeout if the device stalls, or an acknowledgement is lost. */
+		std::chrono::seconds mAckTimeout = std::chrono::seconds(30);
+
+		/** How long to wait for the device to finish flashing, after all data has been sent. */
+		std::chrono::seconds mFlashTimeout = std::chrono::seconds(600);
+	};
+
+	/** The SysUpgradeProgress "Ret" value reported when the device finished the upgrade successfully. */
+	static constexpr int DeviceRetSuccess = 515;
+
+	/** The SysUpgradeProgress "Ret" value reported when the device failed the upgrade. */
+	static constexpr int DeviceRetFailure = 514;
+
+
+	/** Creates a new upgrade instance; doesn't start it yet.
+	aLimiter may be nullptr for no bandwidth limit. */
+	static std::shared_ptr<FirmwareUpgrade> create(
+		std::shared_ptr<Connection> aConnection,
+		std::shared_ptr<const MemoryMappedFile> aImage,
+		std::shared_ptr<BandwidthLimiter> aLimiter,
+		const Options & aOptions,
+		ProgressCallback aOnProgress
+	);
+
+	/** Starts the upgrade.
+	Returns immediately, reports the progress through the callback. */
+	void start();
+
+	/** Aborts the upgrade (the device may be left in an undefined state if it has already started flashing).
+	Reports the Finished stage with asio::error::operation_aborted, unless already finished. */
+	void abort();
+
+
+protected:
+
+	/** The mutex protecting the member variables against multithreaded access. */
+	std::recursive_mutex mMtx;
+
+	/** The connection to the device being upgraded. */
+	std::shared_ptr<Connection> mConnection;
+
+	/** The firmware image. */
+	std::shared_ptr<const MemoryMappedFile> mImage;
+
+	/** The bandwidth limiter shared among the upgrades; nullptr if unlimited. */
+	std::shared_ptr<BandwidthLimiter> mLimiter;
+
+	Options mOptions;
+
+	ProgressCallback mOnProgress;
+
+	/** The current progress. */
+	Progress mProgress;
+
+	/** The offset in the image of the next chunk to be sent. */
+	size_t mNextOffset;
+
+	/** The number of chunks sent (or waiting for bandwidth) but not yet acknowledged. */
+	size_t mNumInFlight;
+
+	/** The number of chunks sent to the device but not yet acknowledged (unlike mNumInFlight, without the ones
+	waiting for bandwidth). */
+	size_t mNumUnacked;
+
+	/** The timer guarding the acknowledgements during the upload, and the flashing stage. */
+	asio::steady_timer mTimeoutTimer;
+
+
+	FirmwareUpgrade(
+		std::shared_ptr<Connection> aConnection,
+		std::shared_ptr<const MemoryMappedFile> aImage,
+		std::shared_ptr<BandwidthLimiter> aLimiter,
+		const Options & aOptions,
+		ProgressCallback aOnProgress
+	);
+
+	/** Called when the device responds to the SysUpgrade_Req. */
+	void onStartResp(const std::error_code & aError);
+
+	/** Queues more chunks to be sent, while there's room in the in-flight window. */
+	void fillWindow();
+
+	/** Sends the chunk at the specified offset. */
+	void sendChunk(size_t aOffset, size_t aSize);
+
+	/** Called when the device acknowledges a chunk. */
+	void onChunkAcked(const std::error_code & aError, size_t aSize);
+
+	/** (Re-)arms mTimeoutTimer to fail the upgrade if no chunk is acknowledged within mAckTimeout, or cancels it
+	if there are no chunks awaiting the acknowledgement. Assumes mMtx is locked. */
+	void armAckTimeoutLocked();
+
+	/** Called when the device reports the flashing progress. */
+	void onDeviceProgress(const nlohmann::json & aMessage);
+
+	/** Finishes the upgrade with the specified result, reports it to the callback.
+	Ignored if already finished. */
+	void finish(const std::error_code & aError);
+
+	/** Reports the current progress to the callback. */
+	void reportProgress();
+};
+
+
+
+
+
+/** Upgrades the firmware on many devices in parallel.
+All the upgrades share a single memory-mapped image and a global bandwidth cap; at most the specified number of
+devices is upgraded at the same time. */
+class FirmwareRollout:
+	public std::enable_shared_from_this<FirmwareRollout>
+{
+public:
+
+	/** The result of the upgrade on a single device. */
+	struct Result
+	{
+		std::shared_ptr<Recorder> mRecorder;
+		std::error_code mError;
+	};
+
+	/** The callback for the progress of a single device's upgrade. */
+	using DeviceProgressCallback = std::function<void(const std::shared_ptr<Recorder> & aRecorder, const FirmwareUpgrade::Progress & aProgress)>;
+
+	/** The callback called once all the upgrades have finished, with the results (in the order the recorders were added). */
+	using FinishCallback = std::function<void(const std::vector<Result> & aResults)>;
+
+	/** Creates a new rollout of the specified image.
+	aTotalBytesPerSecond limits the combined upload rate of all the upgrades (0 = unlimited). */
+	static std::shared_ptr<FirmwareRollout> create(
+		std::shared_ptr<const MemoryMappedFile> aImage,
+		size_t aMaxParallelDevices,
+		uint64_t aTotalBytesPerSecond,
+		const FirmwareUpgrade::Options & aOptions = FirmwareUpgrade::Options()
+	);
+
+	/** Adds a recorder to be upgraded. The recorder needs to be connected and logged in.
+	Must be called before start(). */
+	void addRecorder(std::shared_ptr<Recorder> aRecorder);
+
+	/** Starts upgrading all the added recorders.
+	aOnDeviceProgress may be nullptr. */
+	void start(DeviceProgressCallback aOnDeviceProgress, FinishCallback aOnFinished);
+
+	/** Changes the combined upload rate limit, while the rollout is running (0 = unlimited). */
+	void setBandwidth(uint64_t aTotalBytesPerSecond);
+
+
+protected:
+
+	/** The firmware image shared by all the upgrades. */
+	std::shared_ptr<const MemoryMappedFile> mImage;
+
+	/** The limiter of the combined upload rate. */
+	std::shared_ptr<BandwidthLimiter> mLimiter;
+
+	/** The runner limiting the number of devices being upgraded at the same time. */
+	std::shared_ptr<ParallelRunner> mRunner;
+
+	FirmwareUpgrade::Options mOptions;
+
+	/** The recorders to upgrade and their results. */
+	std::vector<Result> mResults;
+
+
+	FirmwareRollout(
+		std::shared_ptr<const MemoryMappedFile> aImage,
+		size_t aMaxParallelDevices,
+		uint64_t aTotalBytesPerSecond,
+		const FirmwareUpgrade::Options & aOptions
+	);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,644 @@
+#include "Fmp4Muxer.hpp"
+
+#include <cstring>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+const uint32_t Fmp4Muxer::Timescale;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Box writing helpers (all MP4 values are big-endian):
+
+static void put8(std::vector<char> & aOut, uint8_t aValue)
+{
+	aOut.push_back(static_cast<char>(aValue));
+}
+
+
+
+
+
+static void put16(std::vector<char> & aOut, uint16_t aValue)
+{
+	put8(aOut, static_cast<uint8_t>(aValue >> 8));
+	put8(aOut, static_cast<uint8_t>(aValue));
+}
+
+
+
+
+
+static void put32(std::vector<char> & aOut, uint32_t aValue)
+{
+	put16(aOut, static_cast<uint16_t>(aValue >> 16));
+	put16(aOut, static_cast<uint16_t>(aValue));
+}
+
+
+
+
+
+static void put64(std::vector<char> & aOut, uint64_t aValue)
+{
+	put32(aOut, static_cast<uint32_t>(aValue >> 32));
+	put32(aOut, static_cast<uint32_t>(aValue));
+}
+
+
+
+
+
+static void putBytes(std::vector<char> & aOut, const char * aData, size_t aSize)
+{
+	aOut.insert(aOut.end(), aData, aData + aSize);
+}
+
+
+
+
+
+static void putZeros(std::vector<char> & aOut, size_t aCount)
+{
+	aOut.insert(aOut.end(), aCount, 0);
+}
+
+
+
+
+
+/** Writes the box header with a placeholder size; returns the box start, to be passed to endBox(). */
+static size_t beginBox(std::vector<char> & aOut, const char * aType)
+{
+	auto start = aOut.size();
+	put32(aOut, 0);
+	putBytes(aOut, aType, 4);
+	return start;
+}
+
+
+
+
+
+/** Writes the full box header (with the version and flags). */
+static size_t beginFullBox(std::vector<char> & aOut, const char * aType, uint8_t aVersion, uint32_t aFlags)
+{
+	auto start = beginBox(aOut, aType);
+	put32(aOut, (static_cast<uint32_t>(aVersion) << 24) | (aFlags & 0xffffff));
+	return start;
+}
+
+
+
+
+
+/** Patches the size of the box started at aStart, now that its contents are written. */
+static void endBox(std::vector<char> & aOut, size_t aStart)
+{
+	auto size = static_cast<uint32_t>(aOut.size() - aStart);
+	aOut[aStart]     = static_cast<char>(size >> 24);
+	aOut[aStart + 1] = static_cast<char>(size >> 16);
+	aOut[aStart + 2] = static_cast<char>(size >> 8);
+	aOut[aStart + 3] = static_cast<char>(size);
+}
+
+
+
+
+
+/** Writes the unity transformation matrix used by mvhd and tkhd. */
+static void putMatrix(std::vector<char> & aOut)
+{
+	static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+	for (auto v: matrix)
+	{
+		put32(aOut, v);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Annex-B parsing helpers:
+
+/** Returns the start of the first start code (00 00 01) in the range, or aEnd if there's none. */
+static const char * findStartCode(const char * aBegin, const char * aEnd)
+{
+	auto p = aBegin + 2;
+	while (p < aEnd)
+	{
+		auto q = static_cast<const char *>(memchr(p, 1, static_cast<size_t>(aEnd - p)));
+		if (q == nullptr)
+		{
+			return aEnd;
+		}
+		if ((q[-1] == 0) && (q[-2] == 0))
+		{
+			return q - 2;
+		}
+		p = q + 1;
+	}
+	return aEnd;
+}
+
+
+
+
+
+/** Calls aCallback(nalData, nalSize) for each NAL unit in the Annex-B data, while it returns true. */
+template <typename Callback>
+static void forEachNal(const char * aData, size_t aSize, Callback && aCallback)
+{
+	auto end = aData + aSize;
+	auto p = findStartCode(aData, end);
+	while (p != end)
+	{
+		auto nalStart = p + 3;
+		auto next = findStartCode(nalStart, end);
+
+		// Strip the trailing zeros (the first byte of a 4-byte start code, or the trailing_zero_8bits):
+		auto nalEnd = next;
+		while ((nalEnd > nalStart) && (nalEnd[-1] == 0))
+		{
+			--nalEnd;
+		}
+		if ((nalEnd > nalStart) && !aCallback(nalStart, static_cast<size_t>(nalEnd - nalStart)))
+		{
+			return;
+		}
+		p = next;
+	}
+}
+
+
+
+
+
+/** Returns true if the NAL unit is an access unit delimiter, which has no place in the MP4 samples. */
+static bool isAccessUnitDelimiter(MediaFrame::VideoCodec aCodec, const char * aNal)
+{
+	auto b = static_cast<uint8_t>(aNal[0]);
+	if (aCodec == MediaFrame::VideoCodec::H265)
+	{
+		return (((b >> 1) & 0x3f) == 35);
+	}
+	return ((b & 0x1f) == 9);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fmp4Muxer::Output:
+
+size_t Fmp4Muxer::Output::size() const
+{
+	size_t res = 0;
+	for (const auto & piece: mPieces)
+	{
+		res += piece.mSize;
+	}
+	return res;
+}
+
+
+
+
+
+void Fmp4Muxer::Output::clear()
+{
+	mOwned.clear();
+	mPieces.clear();
+	mSlices.clear();
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fmp4Muxer:
+
+Fmp4Muxer::Fmp4Muxer():
+	mCodec(MediaFrame::VideoCodec::Unknown),
+	mWidth(0),
+	mHeight(0),
+	mSequenceNumber(1)
+{
+}
+
+
+
+
+
+bool Fmp4Muxer::configure(const MediaFrame & aIFrame)
+{
+	if (aIFrame.mKind != MediaFrame::Kind::IFrame)
+	{
+		return false;
+	}
+	if (!extractParameterSets(aIFrame.mCodec, aIFrame.mData, mVps, mSps, mPps))
+	{
+		return false;
+	}
+	mCodec = aIFrame.mCodec;
+	mWidth = aIFrame.mWidth;
+	mHeight = aIFrame.mHeight;
+	mSequenceNumber = 1;
+	return true;
+}
+
+
+
+
+
+bool Fmp4Muxer::hasSameConfig(const MediaFrame & aIFrame) const
+{
+	if ((aIFrame.mCodec != mCodec) || (aIFrame.mWidth != mWidth) || (aIFrame.mHeight != mHeight))
+	{
+		return false;
+	}
+	std::string vps, sps, pps;
+	if (!extractParameterSets(aIFrame.mCodec, aIFrame.mData, vps, sps, pps))
+	{
+		// The I-frame doesn't repeat the parameter sets, assume they didn't change
+		return true;
+	}
+	return ((vps == mVps) && (sps == mSps) && (pps == mPps));
+}
+
+
+
+
+
+void Fmp4Muxer::writeInitSegment(Output & aOutput) const
+{
+	auto & out = aOutput.mOwned;
+	auto start = out.size();
+
+	auto ftyp = beginBox(out, "ftyp");
+	putBytes(out, "iso6", 4);
+	put32(out, 0);
+	putBytes(out, "iso6", 4);
+	putBytes(out, "iso5", 4);
+	putBytes(out, "mp41", 4);
+	endBox(out, ftyp);
+
+	auto moov = beginBox(out, "moov");
+	{
+		auto mvhd = beginFullBox(out, "mvhd", 0, 0);
+		put32(out, 0);  // creation_time
+		put32(out, 0);  // modification_time
+		put32(out, 1000);  // timescale
+		put32(out, 0);  // duration, unknown (fragmented)
+		put32(out, 0x00010000);  // rate
+		put16(out, 0x0100);  // volume
+		putZeros(out, 10);
+		putMatrix(out);
+		putZeros(out, 24);  // pre_defined
+		put32(out, 2);  // next_track_ID
+		endBox(out, mvhd);
+
+		auto trak = beginBox(out, "trak");
+		{
+			auto tkhd = beginFullBox(out, "tkhd", 0, 3);  // enabled, in movie
+			put32(out, 0);  // creation_time
+			put32(out, 0);  // modification_time
+			put32(out, 1);  // track_ID
+			put32(out, 0);
+			put32(out, 0);  // duration
+			putZeros(out, 8);
+			put16(out, 0);  // layer
+			put16(out, 0);  // alternate_group
+			put16(out, 0);  // volume
+			put16(out, 0);
+			putMatrix(out);
+			put32(out, mWidth << 16);
+			put32(out, mHeight << 16);
+			endBox(out, tkhd);
+
+			auto mdia = beginBox(out, "mdia");
+			{
+				auto mdhd = beginFullBox(out, "mdhd", 0, 0);
+				put32(out, 0);  // creation_time
+				put32(out, 0);  // modification_time
+				put32(out, Timescale);
+				put32(out, 0);  // duration
+				put16(out, 0x55c4);  // language "und"
+				put16(out, 0);
+				endBox(out, mdhd);
+
+				auto hdlr = beginFullBox(out, "hdlr", 0, 0);
+				put32(out, 0);
+				putBytes(out, "vide", 4);
+				putZeros(out, 12);
+				putBytes(out, "VideoHandler", 13);  // including the terminating zero
+				endBox(out, hdlr);
+
+				auto minf = beginBox(out, "minf");
+				{
+					auto vmhd = beginFullBox(out, "vmhd", 0, 1);
+					putZeros(out, 8);  // graphicsmode, opcolor
+					endBox(out, vmhd);
+
+					auto dinf = beginBox(out, "dinf");
+					auto dref = beginFullBox(out, "dref", 0, 0);
+					put32(out, 1);
+					auto url = beginFullBox(out, "url ", 0, 1);  // the data is in this file
+					endBox(out, url);
+					endBox(out, dref);
+					endBox(out, dinf);
+
+					auto stbl = beginBox(out, "stbl");
+					{
+						auto stsd = beginFullBox(out, "stsd", 0, 0);
+						put32(out, 1);
+						auto entry = beginBox(out, (mCodec == MediaFrame::VideoCodec::H265) ? "hvc1" : "avc1");
+						putZeros(out, 6);
+						put16(out, 1);  // data_reference_index
+						putZeros(out, 16);
+						put16(out, static_cast<uint16_t>(mWidth));
+						put16(out, static_cast<uint16_t>(mHeight));
+						put32(out, 0x00480000);  // 72 dpi
+						put32(out, 0x00480000);
+						put32(out, 0);
+						put16(out, 1);  // frame_count
+						putZeros(out, 32);  // compressorname
+						put16(out, 0x0018);  // depth
+						put16(out, 0xffff);  // pre_defined = -1
+						writeCodecConfig(out);
+						endBox(out, entry);
+						endBox(out, stsd);
+
+						// The sample tables are empty, the samples are in the fragments:
+						auto stts = beginFullBox(out, "stts", 0, 0);
+						put32(out, 0);
+						endBox(out, stts);
+						auto stsc = beginFullBox(out, "stsc", 0, 0);
+						put32(out, 0);
+						endBox(out, stsc);
+						auto stsz = beginFullBox(out, "stsz", 0, 0);
+						put32(out, 0);
+						put32(out, 0);
+						endBox(out, stsz);
+						auto stco = beginFullBox(out, "stco", 0, 0);
+						put32(out, 0);
+						endBox(out, stco);
+					}
+					endBox(out, stbl);
+				}
+				endBox(out, minf);
+			}
+			endBox(out, mdia);
+		}
+		endBox(out, trak);
+
+		auto mvex = beginBox(out, "mvex");
+		auto trex = beginFullBox(out, "trex", 0, 0);
+		put32(out, 1);  // track_ID
+		put32(out, 1);  // default_sample_description_index
+		put32(out, 0);  // default_sample_duration
+		put32(out, 0);  // default_sample_size
+		put32(out, 0);  // default_sample_flags
+		endBox(out, trex);
+		endBox(out, mvex);
+	}
+	endBox(out, moov);
+
+	aOutput.mPieces.push_back({nullptr, start, out.size() - start});
+}
+
+
+
+
+
+void Fmp4Muxer::writeFragment(const std::vector<Sample> & aSamples, uint64_t aBaseTime, Output & aOutput)
+{
+	// Split the samples into NAL units, to know the sample sizes:
+	struct Nal
+	{
+		const char * mData;
+		size_t mSize;
+	};
+	std::vector<Nal> nals;
+	std::vector<size_t> numNals;  // per sample
+	std::vector<uint32_t> sampleSizes;
+	numNals.reserve(aSamples.size());
+	sampleSizes.reserve(aSamples.size());
+	size_t mdatSize = 8;
+	for (const auto & sample: aSamples)
+	{
+		auto numBefore = nals.size();
+		uint32_t sampleSize = 0;
+		forEachNal(sample.mData.data(), sample.mData.size(),
+			[this, &nals, &sampleSize](const char * aNal, size_t aNalSize)
+			{
+				if (!isAccessUnitDelimiter(mCodec, aNal))
+				{
+					nals.push_back({aNal, aNalSize});
+					sampleSize += static_cast<uint32_t>(4 + aNalSize);
+				}
+				return true;
+			}
+		);
+		numNals.push_back(nals.size() - numBefore);
+		sampleSizes.push_back(sampleSize);
+		mdatSize += sampleSize;
+	}
+
+	// moof:
+	auto & out = aOutput.mOwned;
+	auto moof = beginBox(out, "moof");
+	auto mfhd = beginFullBox(out, "mfhd", 0, 0);
+	put32(out, mSequenceNumber++);
+	endBox(out, mfhd);
+	auto traf = beginBox(out, "traf");
+	auto tfhd = beginFullBox(out, "tfhd", 0, 0x020000);  // default-base-is-moof
+	put32(out, 1);  // track_ID
+	endBox(out, tfhd);
+	auto tfdt = beginFullBox(out, "tfdt", 1, 0);
+	put64(out, aBaseTime);
+	endBox(out, tfdt);
+	auto trun = beginFullBox(out, "trun", 0, 0x000701);  // data offset, sample duration, size and flags
+	put32(out, static_cast<uint32_t>(aSamples.size()));
+	auto dataOffsetPos = out.size();
+	put32(out, 0);
+	for (size_t i = 0; i < aSamples.size(); ++i)
+	{
+		put32(out, aSamples[i].mDuration);
+		put32(out, sampleSizes[i]);
+		put32(out, aSamples[i].mIsKeyFrame ? 0x02000000 : 0x01010000);
+	}
+	endBox(out, trun);
+	endBox(out, traf);
+	endBox(out, moof);
+
+	// Patch the data offset, relative to the moof start, pointing past the mdat header:
+	auto dataOffset = static_cast<uint32_t>(out.size() - moof + 8);
+	out[dataOffsetPos]     = static_cast<char>(dataOffset >> 24);
+	out[dataOffsetPos + 1] = static_cast<char>(dataOffset >> 16);
+	out[dataOffsetPos + 2] = static_cast<char>(dataOffset >> 8);
+	out[dataOffsetPos + 3] = static_cast<char>(dataOffset);
+
+	// mdat header, then the length-prefixed NAL units, referencing the receive buffers:
+	put32(out, static_cast<uint32_t>(mdatSize));
+	putBytes(out, "mdat", 4);
+	aOutput.mPieces.push_back({nullptr, moof, out.size() - moof});
+	for (const auto & nal: nals)
+	{
+		auto prefix = out.size();
+		put32(out, static_cast<uint32_t>(nal.mSize));
+		aOutput.mPieces.push_back({nullptr, prefix, 4});
+		aOutput.mPieces.push_back({nal.mData, 0, nal.mSize});
+	}
+	for (const auto & sample: aSamples)
+	{
+		aOutput.mSlices.push_back(sample.mData);
+	}
+}
+
+
+
+
+
+bool Fmp4Muxer::extractParameterSets(
+	MediaFrame::VideoCodec aCodec,
+	const BufferSlice & aPayload,
+	std::string & aVps,
+	std::string & aSps,
+	std::string & aPps
+)
+{
+	if ((aCodec != MediaFrame::VideoCodec::H264) && (aCodec != MediaFrame::VideoCodec::H265))
+	{
+		return false;
+	}
+	bool isH265 = (aCodec == MediaFrame::VideoCodec::H265);
+	std::string vps, sps, pps;
+	forEachNal(aPayload.data(), aPayload.size(),
+		[&](const char * aNal, size_t aNalSize)
+		{
+			auto b = static_cast<uint8_t>(aNal[0]);
+			auto type = isH265 ? ((b >> 1) & 0x3f) : (b & 0x1f);
+			if (isH265)
+			{
+				switch (type)
+				{
+					case 32: vps.assign(aNal, aNalSize); break;
+					case 33: sps.assign(aNal, aNalSize); break;
+					case 34: pps.assign(aNal, aNalSize); break;
+				}
+				// The parameter sets precede the slices, stop at the first slice:
+				return (type >= 32);
+			}
+			switch (type)
+			{
+				case 7: sps.assign(aNal, aNalSize); break;
+				case 8: pps.assign(aNal, aNalSize); break;
+			}
+			return ((type < 1) || (type > 5));
+		}
+	);
+	if (sps.size() < (isH265 ? 15u : 4u) || pps.empty() || (isH265 && vps.empty()))
+	{
+		return false;
+	}
+	aVps = std::move(vps);
+	aSps = std::move(sps);
+	aPps = std::move(pps);
+	return true;
+}
+
+
+
+
+
+void Fmp4Muxer::writeCodecConfig(std::vector<char> & aOut) const
+{
+	if (mCodec != MediaFrame::VideoCodec::H265)
+	{
+		auto avcC = beginBox(aOut, "avcC");
+		put8(aOut, 1);  // configurationVersion
+		put8(aOut, static_cast<uint8_t>(mSps[1]));  // AVCProfileIndication
+		put8(aOut, static_cast<uint8_t>(mSps[2]));  // profile_compatibility
+		put8(aOut, static_cast<uint8_t>(mSps[3]));  // AVCLevelIndication
+		put8(aOut, 0xff);  // lengthSizeMinusOne = 3
+		put8(aOut, 0xe1);  // numOfSequenceParameterSets = 1
+		put16(aOut, static_cast<uint16_t>(mSps.size()));
+		putBytes(aOut, mSps.data(), mSps.size());
+		put8(aOut, 1);  // numOfPictureParameterSets
+		put16(aOut, static_cast<uint16_t>(mPps.size()));
+		putBytes(aOut, mPps.data(), mPps.size());
+		endBox(aOut, avcC);
+		return;
+	}
+
+	// The general profile_tier_level is copied from the SPS, with the emulation prevention bytes removed:
+	uint8_t ptl[13];  // sps_video_parameter_set_id etc. + 12 bytes of the general profile_tier_level
+	size_t numPtl = 0;
+	int numZeros = 0;
+	for (size_t i = 2; (i < mSps.size()) && (numPtl < sizeof(ptl)); ++i)
+	{
+		auto b = static_cast<uint8_t>(mSps[i]);
+		if ((numZeros >= 2) && (b == 3))
+		{
+			numZeros = 0;
+			continue;
+		}
+		numZeros = (b == 0) ? numZeros + 1 : 0;
+		ptl[numPtl++] = b;
+	}
+	if (numPtl < sizeof(ptl))
+	{
+		memset(ptl + numPtl, 0, sizeof(ptl) - numPtl);
+	}
+	auto numTemporalLayers = static_cast<uint8_t>(((ptl[0] >> 1) & 0x07) + 1);
+	auto isTemporalIdNested = static_cast<uint8_t>(ptl[0] & 0x01);
+
+	auto hvcC = beginBox(aOut, "hvcC");
+	put8(aOut, 1);  // configurationVersion
+	putBytes(aOut, reinterpret_cast<const char *>(ptl + 1), 12);  // profile, compatibility, constraints, level
+	put16(aOut, 0xf000);  // min_spatial_segmentation_idc
+	put8(aOut, 0xfc);  // parallelismType
+	put8(aOut, 0xfd);  // chromaFormat 4:2:0
+	put8(aOut, 0xf8);  // bitDepthLumaMinus8
+	put8(aOut, 0xf8);  // bitDepthChromaMinus8
+	put16(aOut, 0);  // avgFrameRate
+	put8(aOut, static_cast<uint8_t>((numTemporalLayers << 3) | (isTemporalIdNested << 2) | 0x03));
+	put8(aOut, 3);  // numOfArrays
+	const std::pair<uint8_t, const std::string *> arrays[] =
+	{
+		{32, &mVps},
+		{33, &mSps},
+		{34, &mPps},
+	};
+	for (const auto & arr: arrays)
+	{
+		put8(aOut, 0x80 | arr.first);  // array_completeness, NAL_unit_type
+		put16(aOut, 1);
+		put16(aOut, static_cast<uint16_t>(arr.second->size()));
+		putBytes(aOut, arr.second->data(), arr.second->size());
+	}
+	endBox(aOut, hvcC);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Buffer.hpp"
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Packs the H.264 / H.265 video frames of a single stream into fragmented MP4 (ISO BMFF).
+The frames' Annex-B payload (start-code delimited NAL units) is converted to the length-prefixed MP4 form without
+copying: the output is a list of pieces, the box headers and NAL length prefixes are generated into a small owned
+buffer, while the NAL units themselves are referenced in the receive buffers (the slices are kept alive by the
+output), ready to be written out piece by piece (SegmentRecorder copies them into its AsyncFileSink's buffers).
+The parameter sets (SPS / PPS, and VPS for H.265) are taken from the I-frames into the init segment; they are also
+left in-band, so that a parameter change mid-segment still decodes. */
+class Fmp4Muxer
+{
+public:
+
+	/** The timescale of the video track (ticks per second). */
+	static const uint32_t Timescale = 90000;
+
+	/** A single video frame to be packed. */
+	struct Sample
+	{
+		/** The Annex-B payload of the frame (MediaFrame::mData). */
+		BufferSlice mData;
+
+		/** The duration of the frame, in Timescale ticks. */
+		uint32_t mDuration;
+
+		bool mIsKeyFrame;
+	};
+
+	/** The generated output, to be written out in the order of mPieces. */
+	struct Output
+	{
+		/** A single contiguous piece of the output; either in mOwned (mExternal == nullptr), or external. */
+		struct Piece
+		{
+			const char * mExternal;
+			size_t mOwnedOffset;
+			size_t mSize;
+		};
+
+		/** The generated data (the box headers and NAL length prefixes). */
+		std::vector<char> mOwned;
+
+		std::vector<Piece> mPieces;
+
+		/** The receive buffers referenced by the external pieces, kept alive until the output is written. */
+		std::vector<BufferSlice> mSlices;
+
+
+		/** Returns the pointer to the piece's data. Valid until mOwned is modified. */
+		const char * pieceData(const Piece & aPiece) const
+		{
+			return (aPiece.mExternal != nullptr) ? aPiece.mExternal : mOwned.data() + aPiece.mOwnedOffset;
+		}
+
+		/** Returns the total number of bytes of all the pieces. */
+		size_t size() const;
+
+		void clear();
+	};
+
+
+	Fmp4Muxer();
+
+	/** Takes the codec parameters from the I-frame (codec, dimensions and the parameter sets in the payload).
+	Returns false if the frame is not an H.264 / H.265 I-frame, or is missing any of the parameter sets. */
+	bool configure(const MediaFrame & aIFrame);
+
+	/** Returns true if the I-frame has the same codec parameters as those of the last configure(),
+	so that it can continue in the same segment. */
+	bool hasSameConfig(const MediaFrame & aIFrame) const;
+
+	/** Appends the init segment (ftyp + moov) for the configured parameters into aOutput. */
+	void writeInitSegment(Output & aOutput) const;
+
+	/** Appends a single fragment (moof + mdat) with the specified samples into aOutput.
+	aBaseTime is the decode time of the first sample, in Timescale ticks from the start of the segment. */
+	void writeFragment(const std::vector<Sample> & aSamples, uint64_t aBaseTime, Output & aOutput);
+
+	/** Extracts the parameter sets (without the start codes) from the Annex-B payload into the output params.
+	Only the NAL units before the first slice are examined. aVps is only set for H.265.
+	Returns false if the codec is not supported, or any of the required sets is missing. */
+	static bool extractParameterSets(
+		MediaFrame::VideoCodec aCodec,
+		const BufferSlice & aPayload,
+		std::string & aVps,
+		std::string & aSps,
+		std::string & aPps
+	);
+
+
+protected:
+
+	/** The parameters of the configured stream. */
+	MediaFrame::VideoCodec mCodec;
+	unsigned mWidth;
+	unsigned mHeight;
+
+	/** The parameter sets, without the start codes. */
+	std::string mVps;
+	std::string mSps;
+	std::string mPps;
+
+	/** The sequence number of the next fragment. */
+	uint32_t mSequenceNumber;
+
+
+	/** Appends the codec configuration box (avcC or hvcC). */
+	void writeCodecConfig(std::vector<char> & aOut) const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** A small, reusable memory area for ASIO's handler allocations.
+Each long-lived object keeps one of these per kind of async operation that it runs repeatedly (read, write, timer),
+so that in the steady state ASIO doesn't need to allocate any memory for the handlers.
+Only one operation may use the memory at a time (ASIO releases the memory before invoking the handler, so an
+operation may be re-queued from its own handler); if it is already in use, or the request is too large, falls back
+to the regular heap allocation. The memory is claimed atomically, so it is safe even if the operations sharing it
+are started from multiple threads (such as the writes queued by any thread sending a command). */
+class HandlerMemory
+{
+public:
+
+	HandlerMemory():
+		mIsInUse(false)
+	{
+	}
+
+	HandlerMemory(const HandlerMemory &) = delete;
+	HandlerMemory & operator =(const HandlerMemory &) = delete;
+
+	void * allocate(size_t aSize)
+	{
+		if ((aSize <= sizeof(mStorage)) && !mIsInUse.exchange(true, std::memory_order_acquire))
+		{
+			return &mStorage;
+		}
+		return ::operator new(aSize);
+	}
+
+	void deallocate(void * aPointer)
+	{
+		if (aPointer == &mStorage)
+		{
+			mIsInUse.store(false, std::memory_order_release);
+		}
+		else
+		{
+			::operator delete(aPointer);
+		}
+	}
+
+
+protected:
+
+	/** The memory used for the handler. */
+	typename std::aligned_storage<1024, alignof(std::max_align_t)>::type mStorage;
+
+	/** Whether the memory is currently used by a handler. */
+	std::atomic<bool> mIsInUse;
+};
+
+
+
+
+
+/** The standard-conforming allocator that allocates from a HandlerMemory.
+ASIO picks it up as the handler's associated allocator (see AllocHandler). */
+template <typename T>
+class HandlerAllocator
+{
+public:
+
+	using value_type = T;
+
+	explicit HandlerAllocator(HandlerMemory & aMemory):
+		mMemory(&aMemory)
+	{
+	}
+
+	template <typename U>
+	HandlerAllocator(const HandlerAllocator<U> & aOther) noexcept:
+		mMemory(aOther.mMemory)
+	{
+	}
+
+	T * allocate(size_t aCount)
+	{
+		return static_cast<T *>(mMemory->allocate(sizeof(T) * aCount));
+	}
+
+	void deallocate(T * aPointer, size_t /* aCount */)
+	{
+		mMemory->deallocate(aPointer);
+	}
+
+	template <typename U>
+	bool operator ==(const HandlerAllocator<U> & aOther) const noexcept { return (mMemory == aOther.mMemory); }
+
+	template <typename U>
+	bool operator !=(const HandlerAllocator<U> & aOther) const noexcept { return (mMemory != aOther.mMemory); }
+
+
+protected:
+
+	template <typename> friend class HandlerAllocator;
+
+	/** The memory from which to allocate. */
+	HandlerMemory * mMemory;
+};
+
+
+
+
+
+/** Wraps an ASIO handler, associating it with a HandlerAllocator. */
+template <typename Handler>
+class AllocHandler
+{
+public:
+
+	using allocator_type = HandlerAllocator<Handler>;
+
+	AllocHandler(HandlerMemory & aMemory, Handler aHandler):
+		mMemory(aMemory),
+		mHandler(std::move(aHandler))
+	{
+	}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(mMemory);
+	}
+
+	template <typename... Args>
+	void operator ()(Args &&... aArgs)
+	{
+		mHandler(std::forward<Args>(aArgs)...);
+	}
+
+
+protected:
+
+	HandlerMemory & mMemory;
+	Handler mHandler;
+};
+
+
+
+
+
+/** Creates the AllocHandler wrapping the specified handler and using the specified memory. */
+template <typename Handler>
+inline AllocHandler<typename std::decay<Handler>::type> makeAllocHandler(HandlerMemory & aMemory, Handler && aHandler)
+{
+	return AllocHandler<typename std::decay<Handler>::type>(aMemory, std::forward<Handler>(aHandler));
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
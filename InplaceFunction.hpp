@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+template <typename Signature, size_t Capacity = 96>
+class InplaceFunction;
+
+
+
+
+
+/** A move-only, type-erased callable wrapper, similar to std::function, but storing callables up to Capacity
+bytes inline, without any heap allocation.
+Larger callables are still accepted, they are stored on the heap (as std::function would do).
+Being move-only, it can hold move-only callables, such as ASIO completion handlers. */
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity>
+{
+public:
+
+	InplaceFunction() noexcept:
+		mOps(nullptr)
+	{
+	}
+
+	InplaceFunction(std::nullptr_t) noexcept:
+		mOps(nullptr)
+	{
+	}
+
+	/** Wraps the specified callable. */
+	template <
+		typename Fn,
+		typename = typename std::enable_if<!std::is_same<typename std::decay<Fn>::type, InplaceFunction>::value>::type
+	>
+	InplaceFunction(Fn && aFn):
+		mOps(nullptr)
+	{
+		using Stored = typename std::decay<Fn>::type;
+		if (isEmpty(aFn))
+		{
+			return;
+		}
+		construct<Stored>(std::forward<Fn>(aFn), IsInline<Stored>());
+		mOps = OpsFor<Stored>::ops();
+	}
+
+	InplaceFunction(InplaceFunction && aOther) noexcept:
+		mOps(aOther.mOps)
+	{
+		if (mOps != nullptr)
+		{
+			mOps->mMove(&mStorage, &aOther.mStorage);
+			aOther.mOps = nullptr;
+		}
+	}
+
+	InplaceFunction(const InplaceFunction &) = delete;
+	InplaceFunction & operator =(const InplaceFunction &) = delete;
+
+	InplaceFunction & operator =(InplaceFunction && aOther) noexcept
+	{
+		if (this != &aOther)
+		{
+			reset();
+			if (aOther.mOps != nullptr)
+			{
+				aOther.mOps->mMove(&mStorage, &aOther.mStorage);
+				mOps = aOther.mOps;
+				aOther.mOps = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	InplaceFunction & operator =(std::nullptr_t) noexcept
+	{
+		reset();
+		return *this;
+	}
+
+	~InplaceFunction()
+	{
+		reset();
+	}
+
+	/** Calls the wrapped callable.
+	Undefined behavior if empty. */
+	R operator ()(Args... aArgs)
+	{
+		return mOps->mInvoke(&mStorage, std::forward<Args>(aArgs)...);
+	}
+
+	explicit operator bool() const noexcept { return (mOps != nullptr); }
+	bool operator ==(std::nullptr_t) const noexcept { return (mOps == nullptr); }
+	bool operator !=(std::nullptr_t) const noexcept { return (mOps != nullptr); }
+
+
+private:
+
+	using Storage = typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type;
+
+	/** The operations needed for a specific stored callable type. */
+	struct Ops
+	{
+		R (*mInvoke)(void * aStorage, Args &&... aArgs);
+		void (*mMove)(void * aDst, void * aSrc);
+		void (*mDestroy)(void * aStorage);
+	};
+
+	/** Whether the specified callable type can be stored inline. */
+	template <typename Fn>
+	struct IsInline:
+		public std::integral_constant<bool,
+			(sizeof(Fn) <= Capacity) &&
+			(alignof(std::max_align_t) % alignof(Fn) == 0) &&
+			std::is_nothrow_move_constructible<Fn>::value
+		>
+	{
+	};
+
+	/** Implements the Ops for both the inline- and the heap-stored callables. */
+	template <typename Fn, bool Inline = IsInline<Fn>::value>
+	struct OpsFor
+	{
+		static Fn & get(void * aStorage) { return *static_cast<Fn *>(aStorage); }
+		static R invoke(void * aStorage, Args &&... aArgs) { return get(aStorage)(std::forward<Args>(aArgs)...); }
+		static void move(void * aDst, void * aSrc)
+		{
+			new (aDst) Fn(std::move(get(aSrc)));
+			get(aSrc).~Fn();
+		}
+		static void destroy(void * aStorage) { get(aStorage).~Fn(); }
+		static const Ops * ops()
+		{
+			static const Ops theOps = {&invoke, &move, &destroy};
+			return &theOps;
+		}
+	};
+
+	template <typename Fn>
+	struct OpsFor<Fn, false>
+	{
+		static Fn *& get(void * aStorage) { return *static_cast<Fn **>(aStorage); }
+		static R invoke(void * aStorage, Args &&... aArgs) { return (*get(aStorage))(std::forward<Args>(aArgs)...); }
+		static void move(void * aDst, void * aSrc) { new (aDst) Fn *(get(aSrc)); }
+		static void destroy(void * aStorage) { delete get(aStorage); }
+		static const Ops * ops()
+		{
+			static const Ops theOps = {&invoke, &move, &destroy};
+			return &theOps;
+		}
+	};
+
+
+	/** The storage for the wrapped callable (or a pointer to it, if it is heap-allocated). */
+	Storage mStorage;
+
+	/** The operations on the currently stored callable.
+	nullptr if empty. */
+	const Ops * mOps;
+
+
+	/** Destroys the currently stored callable, if any. */
+	void reset() noexcept
+	{
+		if (mOps != nullptr)
+		{
+			mOps->mDestroy(&mStorage);
+			mOps = nullptr;
+		}
+	}
+
+	/** Constructs the callable inline in mStorage. */
+	template <typename Stored, typename Fn>
+	void construct(Fn && aFn, std::true_type)
+	{
+		new (&mStorage) Stored(std::forward<Fn>(aFn));
+	}
+
+	/** Constructs the callable on the heap, stores the pointer in mStorage. */
+	template <typename Stored, typename Fn>
+	void construct(Fn && aFn, std::false_type)
+	{
+		new (&mStorage) Stored *(new Stored(std::forward<Fn>(aFn)));
+	}
+
+	/** Returns true if the callable is an empty function pointer / std::function. */
+	template <typename Fn>
+	static bool isEmpty(const Fn & aFn) { return isEmptyImpl(aFn, 0); }
+
+	template <typename Fn>
+	static auto isEmptyImpl(const Fn & aFn, int) -> decltype(static_cast<bool>(aFn == nullptr)) { return (aFn == nullptr); }
+
+	template <typename Fn>
+	static bool isEmptyImpl(const Fn &, long) { return false; }
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
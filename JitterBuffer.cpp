@@ -0,0 +1,159 @@
+#include "JitterBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+/** The weight of a new sample in the smoothed jitter estimate (the same smoothing as the RFC 3550 interarrival jitter). */
+static const double JITTER_SMOOTHING = 1.0 / 16;
+
+/** The target delay, as a multiple of the measured jitter. */
+static const double JITTER_DELAY_FACTOR = 4;
+
+
+
+
+
+JitterBuffer::JitterBuffer(
+	std::chrono::milliseconds aFrameDuration,
+	std::chrono::milliseconds aMinDelay,
+	std::chrono::milliseconds aMaxDelay
+):
+	mFrameDuration(std::max(aFrameDuration, std::chrono::milliseconds(1))),
+	mMinDelay(aMinDelay),
+	mMaxDelay(std::max(aMinDelay, aMaxDelay)),
+	mJitterUsec(0),
+	mIsPlaying(false),
+	mNumDropped(0),
+	mNumUnderruns(0)
+{
+}
+
+
+
+
+
+void JitterBuffer::push(BufferSlice aFrame, Clock::time_point aArrivalTime)
+{
+	LockGuard lg(mMtx);
+
+	// Update the jitter estimate from the deviation of the arrival interval:
+	if (mLastArrival != Clock::time_point())
+	{
+		auto interval = std::chrono::duration_cast<std::chrono::microseconds>(aArrivalTime - mLastArrival);
+		auto deviation = std::abs(static_cast<double>((interval - mFrameDuration).count()));
+		mJitterUsec += (deviation - mJitterUsec) * JITTER_SMOOTHING;
+	}
+	mLastArrival = aArrivalTime;
+
+	// Store the frame, drop the oldest ones if over the maximum delay:
+	mFrames.push_back(std::move(aFrame));
+	auto maxFrames = framesForDelay(mMaxDelay);
+	while (mFrames.size() > maxFrames)
+	{
+		mFrames.pop_front();
+		mNumDropped += 1;
+	}
+}
+
+
+
+
+
+BufferSlice JitterBuffer::pop()
+{
+	LockGuard lg(mMtx);
+	auto targetFrames = framesForDelay(targetDelay());
+	if (!mIsPlaying)
+	{
+		if (mFrames.size() < targetFrames)
+		{
+			return {};
+		}
+		mIsPlaying = true;
+	}
+	if (mFrames.empty())
+	{
+		// Underrun, re-fill up to the target delay before playing again:
+		mIsPlaying = false;
+		mNumUnderruns += 1;
+		return {};
+	}
+
+	// If the jitter has decreased, shrink the latency gradually by skipping a frame:
+	if (mFrames.size() > targetFrames + 2)
+	{
+		mFrames.pop_front();
+		mNumDropped += 1;
+	}
+	auto res = std::move(mFrames.front());
+	mFrames.pop_front();
+	return res;
+}
+
+
+
+
+
+void JitterBuffer::clear()
+{
+	LockGuard lg(mMtx);
+	mFrames.clear();
+	mIsPlaying = false;
+	mLastArrival = Clock::time_point();
+}
+
+
+
+
+
+JitterBuffer::Stats JitterBuffer::stats() const
+{
+	LockGuard lg(mMtx);
+	return Stats
+	{
+		targetDelay(),
+		std::chrono::microseconds(static_cast<int64_t>(mJitterUsec)),
+		mFrames.size(),
+		mNumDropped,
+		mNumUnderruns,
+	};
+}
+
+
+
+
+
+std::chrono::milliseconds JitterBuffer::targetDelay() const
+{
+	auto delay = std::chrono::milliseconds(static_cast<int64_t>(std::ceil(mJitterUsec * JITTER_DELAY_FACTOR / 1000)));
+	return std::min(std::max(delay, mMinDelay), mMaxDelay);
+}
+
+
+
+
+
+size_t JitterBuffer::framesForDelay(std::chrono::milliseconds aDelay) const
+{
+	auto numFrames = (aDelay.count() + mFrameDuration.count() - 1) / mFrameDuration.count();
+	return std::max<size_t>(static_cast<size_t>(numFrames), 1);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
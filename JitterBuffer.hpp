@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include "Buffer.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** An adaptive jitter buffer for incoming audio frames.
+The network thread push()-es the frames as they arrive, the playback thread pop()-s them at its own pace.
+The playout delay adapts to the measured jitter of the arrival times, between the configured minimum and maximum;
+frames that would make the latency exceed the maximum are dropped, so the latency stays bounded.
+The frames are kept as BufferSlice-s of the receive buffers, no data is copied.
+Thread-safe (the lock is only held for a few instructions on either side). */
+class JitterBuffer
+{
+public:
+
+	using Clock = std::chrono::steady_clock;
+
+	/** The statistics of the buffer. */
+	struct Stats
+	{
+		/** The current adaptive playout delay. */
+		std::chrono::milliseconds mTargetDelay;
+
+		/** The smoothed arrival jitter estimate. */
+		std::chrono::microseconds mJitter;
+
+		/** The number of frames currently buffered. */
+		size_t mNumBuffered;
+
+		/** The number of frames dropped because the buffer exceeded its maximum delay. */
+		uint64_t mNumDropped;
+
+		/** The number of times pop() found the buffer empty while playing out. */
+		uint64_t mNumUnderruns;
+	};
+
+
+	/** Creates a buffer for frames of the specified nominal duration. */
+	JitterBuffer(
+		std::chrono::milliseconds aFrameDuration,
+		std::chrono::milliseconds aMinDelay,
+		std::chrono::milliseconds aMaxDelay
+	);
+
+	/** Adds a newly received frame. */
+	void push(BufferSlice aFrame, Clock::time_point aArrivalTime = Clock::now());
+
+	/** Returns the next frame due for playback, or an empty slice if there's none (the caller should play silence).
+	Doesn't return anything until the buffer has been filled up to the target delay. */
+	BufferSlice pop();
+
+	/** Drops all the buffered frames and restarts the filling. */
+	void clear();
+
+	Stats stats() const;
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	/** The nominal duration of a single frame. */
+	const std::chrono::milliseconds mFrameDuration;
+
+	/** The bounds of the adaptive delay. */
+	const std::chrono::milliseconds mMinDelay;
+	const std::chrono::milliseconds mMaxDelay;
+
+	/** The buffered frames, oldest first. */
+	std::deque<BufferSlice> mFrames;
+
+	/** The arrival time of the previous frame, used for measuring the jitter. */
+	Clock::time_point mLastArrival;
+
+	/** The smoothed absolute deviation of the arrival interval from the nominal frame duration, in microseconds. */
+	double mJitterUsec;
+
+	/** True while playing out; false while (re-)filling up to the target delay. */
+	bool mIsPlaying;
+
+	uint64_t mNumDropped;
+	uint64_t mNumUnderruns;
+
+
+	/** Returns the current target delay, based on the measured jitter.
+	Assumes mMtx is held by the caller. */
+	std::chrono::milliseconds targetDelay() const;
+
+	/** Returns the number of frames corresponding to the specified delay (at least 1). */
+	size_t framesForDelay(std::chrono::milliseconds aDelay) const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
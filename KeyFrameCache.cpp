@@ -0,0 +1,122 @@
+#include "KeyFrameCache.hpp"
+
+#include "Fmp4Muxer.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+/** Appends the NAL unit with its start code. */
+static void appendNal(std::string & aOut, const std::string & aNal)
+{
+	if (!aNal.empty())
+	{
+		aOut.append("\x00\x00\x00\x01", 4);
+		aOut.append(aNal);
+	}
+}
+
+
+
+
+
+void KeyFrameCache::update(int aChannel, LiveStream::StreamType aStreamType, const MediaFrame & aFrame)
+{
+	if (aFrame.mKind != MediaFrame::Kind::IFrame)
+	{
+		return;
+	}
+
+	// Extract the parameter sets outside the lock, it scans the frame's first NAL units:
+	std::string vps, sps, pps, parameterSets;
+	if (Fmp4Muxer::extractParameterSets(aFrame.mCodec, aFrame.mData, vps, sps, pps))
+	{
+		appendNal(parameterSets, vps);
+		appendNal(parameterSets, sps);
+		appendNal(parameterSets, pps);
+	}
+
+	LockGuard lg(mMtx);
+	auto res = mEntries.emplace(Key(aChannel, aStreamType), Entry());
+	auto & entry = res.first->second;
+	if (!parameterSets.empty())
+	{
+		entry.mParameterSets = std::move(parameterSets);
+	}
+	else if (!res.second && (entry.mKeyFrame.mCodec != aFrame.mCodec))
+	{
+		// The codec changed and the frame doesn't carry the new parameters, the old ones are of no use:
+		entry.mParameterSets.clear();
+	}
+	entry.mKeyFrame = aFrame;
+}
+
+
+
+
+
+bool KeyFrameCache::find(
+	int aChannel,
+	LiveStream::StreamType aPreferredStreamType,
+	std::chrono::milliseconds aMaxAge,
+	Snapshot & aSnapshot
+) const
+{
+	auto minTime = SteadyClock::now() - aMaxAge;
+	auto otherStreamType = (aPreferredStreamType == LiveStream::StreamType::Main) ?
+		LiveStream::StreamType::Extra :
+		LiveStream::StreamType::Main;
+	LockGuard lg(mMtx);
+	return (
+		findLocked(Key(aChannel, aPreferredStreamType), minTime, aSnapshot) ||
+		findLocked(Key(aChannel, otherStreamType), minTime, aSnapshot)
+	);
+}
+
+
+
+
+
+void KeyFrameCache::clear()
+{
+	LockGuard lg(mMtx);
+	mEntries.clear();
+}
+
+
+
+
+
+bool KeyFrameCache::findLocked(const Key & aKey, SteadyClock::time_point aMinTime, Snapshot & aSnapshot) const
+{
+	auto itr = mEntries.find(aKey);
+	if ((itr == mEntries.end()) || (itr->second.mKeyFrame.mReceivedAt < aMinTime))
+	{
+		return false;
+	}
+	aSnapshot.mSource = Source::StreamCache;
+	aSnapshot.mStreamType = aKey.second;
+	aSnapshot.mKeyFrame = itr->second.mKeyFrame;
+	aSnapshot.mParameterSets = itr->second.mParameterSets;
+	aSnapshot.mJpeg = BufferSlice();
+	return true;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
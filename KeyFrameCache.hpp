@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "Buffer.hpp"
+#include "LiveStream.hpp"
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Keeps the most recent I-frame of each streamed channel, to serve the snapshots from memory.
+The cache is fed by StreamHub with every I-frame of every stream it runs; both the main and the extra stream of a
+channel are cached, the snapshot prefers the requested one. The codec parameter sets are kept along with the frame
+(from the last I-frame that carried them), so that the snapshot is decodable on its own.
+The cached frame shares the receive buffer, caching doesn't copy the frame data. Thread-safe. */
+class KeyFrameCache
+{
+public:
+
+	using SteadyClock = std::chrono::steady_clock;
+
+	/** Where the snapshot came from. */
+	enum class Source
+	{
+		StreamCache,  // The latest I-frame of a running stream (no device round trip)
+		NetSnap,      // A JPEG freshly captured by the device (NetSnap_Req)
+	};
+
+	/** A single snapshot of a channel. */
+	struct Snapshot
+	{
+		Source mSource;
+
+		/** The stream the I-frame came from; only valid for Source::StreamCache. */
+		LiveStream::StreamType mStreamType;
+
+		/** The I-frame (codec, dimensions, device time, Annex-B payload); only valid for Source::StreamCache. */
+		MediaFrame mKeyFrame;
+
+		/** The codec parameter sets, in Annex-B (start codes included), to be fed to the decoder before mKeyFrame.
+		Only valid for Source::StreamCache. */
+		std::string mParameterSets;
+
+		/** The JPEG picture; only valid for Source::NetSnap. */
+		BufferSlice mJpeg;
+	};
+
+
+	/** Stores the frame as the latest of the channel's stream, if it is an I-frame. */
+	void update(int aChannel, LiveStream::StreamType aStreamType, const MediaFrame & aFrame);
+
+	/** Returns the latest I-frame of the channel in aSnapshot, preferring the specified stream.
+	Returns false if there's no I-frame received within aMaxAge. */
+	bool find(
+		int aChannel,
+		LiveStream::StreamType aPreferredStreamType,
+		std::chrono::milliseconds aMaxAge,
+		Snapshot & aSnapshot
+	) const;
+
+	/** Drops all the cached frames. */
+	void clear();
+
+
+protected:
+
+	using Key = std::pair<int, LiveStream::StreamType>;
+
+	/** The cached data of a single stream. */
+	struct Entry
+	{
+		MediaFrame mKeyFrame;
+		std::string mParameterSets;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::map<Key, Entry> mEntries;
+
+
+	/** Fills aSnapshot from the entry, if it exists and is recent enough. Assumes mMtx is locked. */
+	bool findLocked(const Key & aKey, SteadyClock::time_point aMinTime, Snapshot & aSnapshot) const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,286 @@
+#include "LiveStream.hpp"
+
+#include <asio.hpp>
+#include "MediaConnectionPool.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+LiveStream::LiveStream(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	int aChannel,
+	StreamType aStreamType
+):
+	mMainConnection(std::move(aMainConnection)),
+	mPool(std::move(aPool)),
+	mChannel(aChannel),
+	mStreamType(aStreamType),
+	mClaimKey("Monitor/" + std::to_string(aChannel) + "/" + streamTypeName(aStreamType)),
+	mIsRunning(false)
+{
+}
+
+
+
+
+
+std::shared_ptr<LiveStream> LiveStream::create(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	int aChannel,
+	StreamType aStreamType
+)
+{
+	return std::shared_ptr<LiveStream>(new LiveStream(std::move(aMainConnection), std::move(aPool), aChannel, aStreamType));
+}
+
+
+
+
+
+const char * LiveStream::streamTypeName(StreamType aStreamType)
+{
+	switch (aStreamType)
+	{
+		case StreamType::Main:  return "Main";
+		case StreamType::Extra: return "Extra";
+	}
+	return "Main";
+}
+
+
+
+
+
+std::shared_ptr<PreAlarmBuffer> LiveStream::enablePreAlarmBuffer(const PreAlarmBuffer::Options & aOptions)
+{
+	auto buffer = std::make_shared<PreAlarmBuffer>(aOptions);
+	LockGuard lg(mMtx);
+	mPreAlarmBuffer = buffer;
+	return buffer;
+}
+
+
+
+
+
+std::shared_ptr<PreAlarmBuffer> LiveStream::preAlarmBuffer() const
+{
+	LockGuard lg(mMtx);
+	return mPreAlarmBuffer;
+}
+
+
+
+
+
+void LiveStream::monitorFrames(MediaFrameParser::FrameCallback aOnFrame)
+{
+	LockGuard lg(mMtx);
+	mOnFrame = std::move(aOnFrame);
+}
+
+
+
+
+
+void LiveStream::start(DataCallback aOnData, StartCallback aOnStarted)
+{
+	bool wasRunning;
+	{
+		LockGuard lg(mMtx);
+		wasRunning = mIsRunning;
+		mIsRunning = true;
+	}
+	if (wasRunning)
+	{
+		return aOnStarted(asio::error::already_started);
+	}
+	mPool->acquire(mClaimKey,
+		[self = shared_from_this(), aOnData, aOnStarted](
+			const std::error_code & aError,
+			std::shared_ptr<Connection> aConnection,
+			bool aIsClaimed
+		)
+		{
+			if (aError)
+			{
+				{
+					LockGuard lg(self->mMtx);
+					self->mIsRunning = false;
+				}
+				return aOnStarted(aError);
+			}
+			if (aIsClaimed)
+			{
+				// Already claimed for this stream (restarted), skip the claim round trip:
+				return self->startMedia(std::move(aConnection), aOnData, aOnStarted);
+			}
+			aConnection->claimMonitor(
+				self->mMainConnection->sessionID(), self->mChannel, streamTypeName(self->mStreamType),
+				[self, aConnection, aOnData, aOnStarted](const std::error_code & aClaimError, const nlohmann::json & aResponse)
+				{
+					if (aClaimError)
+					{
+						self->releaseConnection(aConnection, false);
+						{
+							LockGuard lg(self->mMtx);
+							self->mIsRunning = false;
+						}
+						return aOnStarted(aClaimError);
+					}
+					self->startMedia(aConnection, aOnData, aOnStarted);
+				}
+			);
+		}
+	);
+}
+
+
+
+
+
+void LiveStream::stop()
+{
+	std::shared_ptr<Connection> conn;
+	{
+		LockGuard lg(mMtx);
+		mIsRunning = false;
+		std::swap(conn, mMediaConnection);
+	}
+	if (conn == nullptr)
+	{
+		// Not started yet, or still starting; the start callbacks return the connection
+		return;
+	}
+	mMainConnection->monitorAction("Stop", mChannel, streamTypeName(mStreamType),
+		[](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			// Ignore any errors
+		}
+	);
+	conn->monitorMediaData(nullptr);
+	mPool->release(std::move(conn), mClaimKey);
+}
+
+
+
+
+
+void LiveStream::startMedia(std::shared_ptr<Connection> aConnection, DataCallback aOnData, StartCallback aOnStarted)
+{
+	bool isRunning;
+	{
+		LockGuard lg(mMtx);
+		isRunning = mIsRunning;
+		if (isRunning)
+		{
+			mMediaConnection = aConnection;
+		}
+	}
+	if (!isRunning)
+	{
+		// Stopped while starting, the start is reported as aborted.
+		// Released outside mMtx, release() may run other acquire callbacks synchronously:
+		mPool->release(std::move(aConnection), mClaimKey);
+		return aOnStarted(asio::error::operation_aborted);
+	}
+	mParser.reset();
+	mMeter.reset();
+	std::weak_ptr<LiveStream> weakSelf = shared_from_this();
+	aConnection->monitorMediaData(
+		[weakSelf, aOnData](const std::error_code & aError, BufferSlice aData)
+		{
+			auto self = weakSelf.lock();
+			if ((self != nullptr) && !aError)
+			{
+				self->onMediaData(aData);
+			}
+			aOnData(aError, std::move(aData));
+		}
+	);
+	mMainConnection->monitorAction("Start", mChannel, streamTypeName(mStreamType),
+		[self = shared_from_this(), aConnection, aOnStarted](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			if (aError)
+			{
+				aConnection->monitorMediaData(nullptr);
+				bool isOwned = false;
+				{
+					LockGuard lg(self->mMtx);
+					if (self->mMediaConnection == aConnection)
+					{
+						self->mMediaConnection.reset();
+						self->mIsRunning = false;
+						isOwned = true;
+					}
+				}
+				if (isOwned)
+				{
+					self->releaseConnection(aConnection, true);
+				}
+			}
+			aOnStarted(aError);
+		}
+	);
+}
+
+
+
+
+
+void LiveStream::onMediaData(const BufferSlice & aData)
+{
+	std::shared_ptr<PreAlarmBuffer> buffer;
+	MediaFrameParser::FrameCallback onFrame;
+	{
+		LockGuard lg(mMtx);
+		buffer = mPreAlarmBuffer;
+		onFrame = mOnFrame;
+	}
+	mMeter.onData(aData.size(), std::chrono::steady_clock::now());
+	mParser.feed(aData,
+		[this, &buffer, &onFrame](const MediaFrame & aFrame)
+		{
+			mMeter.onFrame(aFrame);
+			if (buffer != nullptr)
+			{
+				buffer->push(aFrame);
+			}
+			if (onFrame)
+			{
+				onFrame(aFrame);
+			}
+		}
+	);
+}
+
+
+
+
+
+void LiveStream::releaseConnection(std::shared_ptr<Connection> aConnection, bool aIsClaimed)
+{
+	mPool->release(std::move(aConnection), aIsClaimed ? mClaimKey : std::string());
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
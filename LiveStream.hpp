@@ -0,0 +1,156 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include "Connection.hpp"
+#include "MediaFrame.hpp"
+#include "PreAlarmBuffer.hpp"
+#include "StreamMeter.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class MediaConnectionPool;
+
+
+
+
+
+/** A live video stream (monitor) of a single channel.
+The media is received on a sub-connection taken from the device's MediaConnectionPool, claimed for the channel and
+stream type (MonitorClaim_Req), while the stream is started and stopped through the main connection (Monitor_Req).
+A pooled connection that was last claimed for the same channel and stream is reused without claiming again, so that
+restarting a stream only costs the single Monitor_Req round trip.
+Optionally, the received frames are kept in a PreAlarmBuffer, so that the video from before an alarm is available
+right away (see enablePreAlarmBuffer()).
+Use Recorder::startLiveStream() to create and start an instance. */
+class LiveStream:
+	public std::enable_shared_from_this<LiveStream>
+{
+public:
+
+	/** The stream to receive. */
+	enum class StreamType
+	{
+		Main,
+		Extra,
+	};
+
+	/** The callback called for each media packet received from the device. */
+	using DataCallback = Connection::SliceCallback;
+
+	/** The callback called once the stream is started (or fails to start). */
+	using StartCallback = std::function<void(const std::error_code & aError)>;
+
+
+	/** Creates a new stream for the specified channel; doesn't start it yet. */
+	static std::shared_ptr<LiveStream> create(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		int aChannel,
+		StreamType aStreamType
+	);
+
+	/** Starts the stream: acquires a media connection from the pool, claims it (unless already claimed), then asks
+	the device to start sending the media. */
+	void start(DataCallback aOnData, StartCallback aOnStarted);
+
+	/** Stops the stream and returns its media connection to the pool (still claimed, for a later restart). */
+	void stop();
+
+	/** Starts keeping the most recent frames in a pre-alarm buffer with the specified options; returns the buffer.
+	To be called before start(); calling it again replaces the buffer. */
+	std::shared_ptr<PreAlarmBuffer> enablePreAlarmBuffer(const PreAlarmBuffer::Options & aOptions);
+
+	/** Returns the pre-alarm buffer, nullptr if not enabled. */
+	std::shared_ptr<PreAlarmBuffer> preAlarmBuffer() const;
+
+	/** Sets the callback to receive the individual media frames (such as for a SegmentRecorder); nullptr to stop.
+	The frames are parsed from the same data as delivered to the start() data callback. */
+	void monitorFrames(MediaFrameParser::FrameCallback aOnFrame);
+
+	/** Returns the delivery measurements (bitrate, lateness) of the stream since its start. */
+	StreamMeter::Stats stats() const { return mMeter.stats(); }
+
+	/** Returns the stream type being received. */
+	StreamType streamType() const { return mStreamType; }
+
+	/** Returns the channel being received. */
+	int channel() const { return mChannel; }
+
+	/** Returns the name of the stream type, as used by the device ("Main" or "Extra"). */
+	static const char * streamTypeName(StreamType aStreamType);
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::shared_ptr<Connection> mMainConnection;
+
+	std::shared_ptr<MediaConnectionPool> mPool;
+
+	const int mChannel;
+
+	const StreamType mStreamType;
+
+	/** The key under which the media connection is claimed, in the pool. */
+	const std::string mClaimKey;
+
+	/** The media connection, once acquired from the pool; nullptr when not streaming. */
+	std::shared_ptr<Connection> mMediaConnection;
+
+	/** True between start() and stop(). */
+	bool mIsRunning;
+
+	/** The buffer of the recent frames; nullptr if not enabled. */
+	std::shared_ptr<PreAlarmBuffer> mPreAlarmBuffer;
+
+	/** The callback for the parsed frames; nullptr if not set. */
+	MediaFrameParser::FrameCallback mOnFrame;
+
+	/** Measures the delivery of the stream. */
+	StreamMeter mMeter;
+
+	/** Splits the received media into frames, for mMeter, mPreAlarmBuffer and mOnFrame.
+	Not protected by mMtx, only used from the media connection's data callback, which is never called concurrently. */
+	MediaFrameParser mParser;
+
+
+	LiveStream(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		int aChannel,
+		StreamType aStreamType
+	);
+
+	/** Called once the media connection is acquired (and claimed); starts receiving and asks the device to send. */
+	void startMedia(std::shared_ptr<Connection> aConnection, DataCallback aOnData, StartCallback aOnStarted);
+
+	/** Called for each media packet received; measures the stream and passes the frames to the pre-alarm buffer and
+	the frame callback. */
+	void onMediaData(const BufferSlice & aData);
+
+	/** Returns the connection to the pool, unless the stream has been restarted meanwhile.
+	aIsClaimed is true if the connection is claimed for this stream. */
+	void releaseConnection(std::shared_ptr<Connection> aConnection, bool aIsClaimed);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
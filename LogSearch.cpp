@@ -0,0 +1,521 @@
+#include "LogSearch.hpp"
+
+#include <algorithm>
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+#include "Connection.hpp"
+#include "DeviceTime.hpp"
+#include "Error.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+/** The SAX handler that parses a LogSearch_Resp page directly into the log entries.
+Typical response:
+{ "Name" : "OPLogQuery", "OPLogQuery" : [ { "Data" : "192.168.1.5", "Position" : 12, "Time" : "2023-03-02 23:54:59",
+"Type" : "LogIn", "User" : "admin" }, ... ], "Ret" : 100, "SessionID" : "0x13" } */
+class LogPageSaxHandler
+{
+public:
+
+	using json = nlohmann::json;
+
+	/** The value of the "Ret" field, -1 if not present. */
+	int mRet;
+
+
+	LogPageSaxHandler(StringInterner & aInterner, std::vector<LogSearch::Entry> & aEntries):
+		mRet(-1),
+		mInterner(aInterner),
+		mEntries(aEntries),
+		mDepth(0),
+		mIsInEntries(false),
+		mIsInEntry(false),
+		mField(Field::None)
+	{
+	}
+
+	bool null()                                  { mField = Field::None; return true; }
+	bool boolean(bool aValue)                    { mField = Field::None; return true; }
+	bool number_integer(json::number_integer_t aValue)   { return number(aValue); }
+	bool number_unsigned(json::number_unsigned_t aValue) { return number(static_cast<int64_t>(aValue)); }
+	bool number_float(json::number_float_t aValue, const json::string_t & aText) { return number(static_cast<int64_t>(aValue)); }
+	bool binary(json::binary_t & aValue)         { mField = Field::None; return true; }
+
+	bool string(json::string_t & aValue)
+	{
+		auto entry = currentEntry();
+		if (entry != nullptr)
+		{
+			switch (mField)
+			{
+				case Field::Data: entry->mData.assign(aValue); break;
+				case Field::Type: entry->mType = mInterner.intern(aValue); break;
+				case Field::User: entry->mUser = mInterner.intern(aValue); break;
+				case Field::Time: DeviceTime::parse(aValue.data(), aValue.size(), entry->mTime); break;
+				default: break;
+			}
+		}
+		mField = Field::None;
+		return true;
+	}
+
+	bool start_object(size_t aNumElements)
+	{
+		mDepth += 1;
+		if ((mDepth == 3) && mIsInEntries)
+		{
+			mEntries.push_back({LogSearch::SystemClock::time_point(), 0, &empty(), &empty(), {}});
+			mIsInEntry = true;
+		}
+		mField = Field::None;
+		return true;
+	}
+
+	bool key(json::string_t & aKey)
+	{
+		mField = Field::None;
+		if (mDepth == 1)
+		{
+			if (aKey == "Ret")
+			{
+				mField = Field::Ret;
+			}
+			else if (aKey == "OPLogQuery")
+			{
+				mField = Field::Entries;
+			}
+		}
+		else if (currentEntry() != nullptr)
+		{
+			if (aKey == "Data")
+			{
+				mField = Field::Data;
+			}
+			else if (aKey == "Position")
+			{
+				mField = Field::Position;
+			}
+			else if (aKey == "Time")
+			{
+				mField = Field::Time;
+			}
+			else if (aKey == "Type")
+			{
+				mField = Field::Type;
+			}
+			else if (aKey == "User")
+			{
+				mField = Field::User;
+			}
+		}
+		return true;
+	}
+
+	bool end_object()
+	{
+		if (mDepth == 3)
+		{
+			mIsInEntry = false;
+		}
+		mDepth -= 1;
+		return true;
+	}
+
+	bool start_array(size_t aNumElements)
+	{
+		mDepth += 1;
+		if ((mDepth == 2) && (mField == Field::Entries))
+		{
+			mIsInEntries = true;
+		}
+		mField = Field::None;
+		return true;
+	}
+
+	bool end_array()
+	{
+		if (mDepth == 2)
+		{
+			mIsInEntries = false;
+		}
+		mDepth -= 1;
+		return true;
+	}
+
+	bool parse_error(size_t aPosition, const std::string & aLastToken, const nlohmann::detail::exception & aException)
+	{
+		return false;
+	}
+
+
+protected:
+
+	/** The field whose value is expected next. */
+	enum class Field
+	{
+		None,
+		Ret,
+		Entries,
+		Data,
+		Position,
+		Time,
+		Type,
+		User,
+	};
+
+	StringInterner & mInterner;
+
+	std::vector<LogSearch::Entry> & mEntries;
+
+	/** The nesting depth of the current container; 1 is the response envelope. */
+	size_t mDepth;
+
+	/** True while inside the OPLogQuery array. */
+	bool mIsInEntries;
+
+	/** True while inside an entry object within the OPLogQuery array (the last item in mEntries). */
+	bool mIsInEntry;
+
+	Field mField;
+
+
+	/** The string used for the entries' missing type or user. */
+	static const std::string & empty()
+	{
+		static const std::string res;
+		return res;
+	}
+
+	/** Returns the entry whose fields are being parsed, or nullptr if not directly inside an entry object
+	(a malformed response may have values at the entries' depth outside the OPLogQuery array, or directly in it). */
+	LogSearch::Entry * currentEntry()
+	{
+		if ((mDepth != 3) || !mIsInEntries || !mIsInEntry || mEntries.empty())
+		{
+			return nullptr;
+		}
+		return &mEntries.back();
+	}
+
+	bool number(int64_t aValue)
+	{
+		if ((mDepth == 1) && (mField == Field::Ret))
+		{
+			mRet = static_cast<int>(aValue);
+		}
+		else if (mField == Field::Position)
+		{
+			auto entry = currentEntry();
+			if (entry != nullptr)
+			{
+				entry->mPosition = static_cast<uint32_t>(aValue);
+			}
+		}
+		mField = Field::None;
+		return true;
+	}
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LogSearch:
+
+LogSearch::LogSearch(std::shared_ptr<Connection> aConnection, const Options & aOptions, std::shared_ptr<StringInterner> aInterner):
+	mConnection(std::move(aConnection)),
+	mOptions(aOptions),
+	mInterner(aInterner ? std::move(aInterner) : std::make_shared<StringInterner>()),
+	mNextWindowStart(aOptions.mFrom),
+	mNextWindowID(0),
+	mNumEntries(0)
+{
+	mPageEntries.reserve(aOptions.mPageSize);
+}
+
+
+
+
+
+std::shared_ptr<LogSearch> LogSearch::create(
+	std::shared_ptr<Connection> aConnection,
+	const Options & aOptions,
+	std::shared_ptr<StringInterner> aInterner
+)
+{
+	return std::shared_ptr<LogSearch>(new LogSearch(std::move(aConnection), aOptions, std::move(aInterner)));
+}
+
+
+
+
+
+void LogSearch::start(EntryCallback aOnEntry, FinishCallback aOnFinished)
+{
+	std::vector<Window> toRequest;
+	{
+		LockGuard lg(mMtx);
+		mOnEntry = std::move(aOnEntry);
+		mOnFinished = std::move(aOnFinished);
+		addWindows(toRequest);
+	}
+	if (toRequest.empty())
+	{
+		// Empty time range, nothing to search:
+		asio::post(Root::instance().ioContext(),
+			[self = shared_from_this()]()
+			{
+				self->finish({});
+			}
+		);
+		return;
+	}
+	for (const auto & window: toRequest)
+	{
+		requestPage(window);
+	}
+}
+
+
+
+
+
+void LogSearch::stop()
+{
+	finish(asio::error::operation_aborted);
+}
+
+
+
+
+
+std::error_code LogSearch::parsePage(
+	const char * aData,
+	size_t aSize,
+	StringInterner & aInterner,
+	std::vector<Entry> & aEntries
+)
+{
+	LogPageSaxHandler handler(aInterner, aEntries);
+	if (!nlohmann::json::sax_parse(aData, aData + aSize, &handler))
+	{
+		return make_error_code(Error::MalformedResponse);
+	}
+	if (handler.mRet < 0)
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	if (handler.mRet != static_cast<int>(Error::Success))
+	{
+		return make_error_code(static_cast<Error>(handler.mRet));
+	}
+	return {};
+}
+
+
+
+
+
+void LogSearch::addWindows(std::vector<Window> & aToRequest)
+{
+	while ((mWindows.size() < mOptions.mMaxWindowsInFlight) && (mNextWindowStart < mOptions.mTo))
+	{
+		auto windowEnd = std::min(mNextWindowStart + mOptions.mWindowLength, mOptions.mTo);
+		mWindows.push_back({mNextWindowID++, mNextWindowStart, windowEnd, 0, {}, false});
+		aToRequest.push_back(mWindows.back());
+		mNextWindowStart = windowEnd;
+	}
+}
+
+
+
+
+
+void LogSearch::requestPage(const Window & aWindow)
+{
+	// The device's EndTime is inclusive, the window's end is not:
+	auto lastSecond = std::max(aWindow.mFrom, aWindow.mTo - std::chrono::seconds(1));
+	mConnection->searchLogPage(
+		DeviceTime::format(aWindow.mFrom), DeviceTime::format(lastSecond), mOptions.mType, aWindow.mNextPosition,
+		[self = shared_from_this(), windowID = aWindow.mID](const std::error_code & aError, BufferSlice aData)
+		{
+			self->onPage(windowID, aError, std::move(aData));
+		}
+	);
+}
+
+
+
+
+
+void LogSearch::onPage(uint64_t aWindowID, const std::error_code & aError, BufferSlice aData)
+{
+	{
+		LockGuard lg(mMtx);
+		if (!mOnFinished)
+		{
+			// Already finished (stopped or failed), ignore
+			return;
+		}
+		if (!aError)
+		{
+			auto itr = std::find_if(mWindows.begin(), mWindows.end(),
+				[aWindowID](const Window & aWindow)
+				{
+					return (aWindow.mID == aWindowID);
+				}
+			);
+			if (itr == mWindows.end())
+			{
+				return;
+			}
+			if (itr != mWindows.begin())
+			{
+				// Not this window's turn yet, keep the page until it is:
+				itr->mWaitingPage = std::move(aData);
+				itr->mHasWaitingPage = true;
+				return;
+			}
+		}
+	}
+	if (aError)
+	{
+		return finish(aError);
+	}
+	deliver(std::move(aData));
+}
+
+
+
+
+
+void LogSearch::deliver(BufferSlice aData)
+{
+	for (;;)
+	{
+		mPageEntries.clear();
+		auto err = parsePage(aData.data(), aData.size(), *mInterner, mPageEntries);
+		if (err)
+		{
+			return finish(err);
+		}
+
+		// Deliver the entries:
+		EntryCallback onEntry;
+		{
+			LockGuard lg(mMtx);
+			onEntry = mOnEntry;
+		}
+		size_t numDelivered = 0;
+		bool shouldContinue = true;
+		uint32_t nextPosition = 0;
+		for (const auto & entry: mPageEntries)
+		{
+			nextPosition = std::max(nextPosition, entry.mPosition + 1);
+			numDelivered += 1;
+			if (!onEntry(entry))
+			{
+				shouldContinue = false;
+				break;
+			}
+		}
+
+		// Continue with the next page of this window, or with the next window:
+		std::vector<Window> toRequest;
+		bool isFinished = false;
+		bool hasWaitingPage = false;
+		{
+			LockGuard lg(mMtx);
+			mNumEntries += numDelivered;
+			if (!mOnFinished || mWindows.empty())
+			{
+				// Stopped while delivering
+				return;
+			}
+			auto & window = mWindows.front();
+			bool isWindowDone = (
+				(mPageEntries.size() < mOptions.mPageSize) ||
+				(nextPosition <= window.mNextPosition)  // The device doesn't page, bail out rather than loop forever
+			);
+			if (!shouldContinue)
+			{
+				isFinished = true;
+			}
+			else if (!isWindowDone)
+			{
+				window.mNextPosition = nextPosition;
+				toRequest.push_back(window);
+			}
+			else
+			{
+				mWindows.pop_front();
+				addWindows(toRequest);
+				if (mWindows.empty())
+				{
+					isFinished = true;
+				}
+				else if (mWindows.front().mHasWaitingPage)
+				{
+					aData = std::move(mWindows.front().mWaitingPage);
+					mWindows.front().mHasWaitingPage = false;
+					hasWaitingPage = true;
+				}
+			}
+		}
+		if (isFinished)
+		{
+			return finish({});
+		}
+		for (const auto & window: toRequest)
+		{
+			requestPage(window);
+		}
+		if (!hasWaitingPage)
+		{
+			return;
+		}
+	}
+}
+
+
+
+
+
+void LogSearch::finish(const std::error_code & aError)
+{
+	FinishCallback onFinished;
+	size_t numEntries;
+	{
+		LockGuard lg(mMtx);
+		std::swap(onFinished, mOnFinished);
+		mWindows.clear();
+		numEntries = mNumEntries;
+	}
+	if (onFinished)
+	{
+		onFinished(aError, numEntries);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "Buffer.hpp"
+#include "StringInterner.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+
+
+
+
+
+/** Iterates over the device log, streaming the entries to a callback without keeping the whole log in memory.
+The requested time range is split into windows, each of which is paged through separately (LogSearch_Req with an
+increasing LogPosition). Several windows are queried at the same time, so that their first pages are already on the
+way while the earlier windows are still being delivered; the entries are still delivered in the window order.
+At most a single raw page per window is held until its window's turn comes.
+The entry types and user names are interned (see StringInterner), the entries hold just pointers to them.
+The callback may stop the iteration early by returning false. */
+class LogSearch:
+	public std::enable_shared_from_this<LogSearch>
+{
+public:
+
+	using SystemClock = std::chrono::system_clock;
+
+	/** A single log entry. */
+	struct Entry
+	{
+		/** The device wall-clock time of the entry (see DeviceTime). */
+		SystemClock::time_point mTime;
+
+		/** The position of the entry in the device log. */
+		uint32_t mPosition;
+
+		/** The entry type ("LogIn", "SaveConfig", ...), interned. */
+		const std::string * mType;
+
+		/** The user who caused the entry, interned. */
+		const std::string * mUser;
+
+		/** The type-specific details (the client's address, the config name, ...). */
+		std::string mData;
+	};
+
+	/** The parameters of the search. */
+	struct Options
+	{
+		/** The start of the searched time range, in the device wall-clock time (see DeviceTime). */
+		SystemClock::time_point mFrom;
+
+		/** The end of the searched time range (exclusive). */
+		SystemClock::time_point mTo;
+
+		/** The log type to search for ("LogAll", "System", "Config", "Storage", "Alarm", "Record", "Account", ...). */
+		std::string mType = "LogAll";
+
+		/** The length of a single time window. */
+		std::chrono::seconds mWindowLength = std::chrono::hours(24);
+
+		/** The maximum number of windows being queried at the same time. */
+		size_t mMaxWindowsInFlight = 4;
+
+		/** The number of entries the device returns in a full page; a shorter page ends the window. */
+		size_t mPageSize = 128;
+	};
+
+	/** The callback called for each entry, in order. Return false to stop the search. */
+	using EntryCallback = std::function<bool(const Entry & aEntry)>;
+
+	/** The callback called once the search finishes, with the number of entries delivered.
+	Stopping the search from the EntryCallback is not an error. */
+	using FinishCallback = std::function<void(const std::error_code & aError, size_t aNumEntries)>;
+
+
+	/** Creates a new search over the specified connection; doesn't start it yet.
+	aInterner stores the entry types and user names; nullptr to use a new one for this search only. */
+	static std::shared_ptr<LogSearch> create(
+		std::shared_ptr<Connection> aConnection,
+		const Options & aOptions,
+		std::shared_ptr<StringInterner> aInterner
+	);
+
+	/** Starts the search. */
+	void start(EntryCallback aOnEntry, FinishCallback aOnFinished);
+
+	/** Stops the search, reports asio::error::operation_aborted to the finish callback (unless already finished).
+	The responses still on the way are ignored. */
+	void stop();
+
+	/** Returns the interner holding the entry types and user names. */
+	std::shared_ptr<StringInterner> interner() const { return mInterner; }
+
+	/** Parses a single LogSearch_Resp page, appending the entries to aEntries.
+	Returns the error from the "Ret" field, or Error::MalformedResponse if the data is not valid JSON. */
+	static std::error_code parsePage(
+		const char * aData,
+		size_t aSize,
+		StringInterner & aInterner,
+		std::vector<Entry> & aEntries
+	);
+
+
+protected:
+
+	/** A single time window of the search. */
+	struct Window
+	{
+		/** The unique ID, identifying the window in the responses. */
+		uint64_t mID;
+
+		SystemClock::time_point mFrom;
+		SystemClock::time_point mTo;
+
+		/** The LogPosition for the next page request. */
+		uint32_t mNextPosition;
+
+		/** The page received before it was the window's turn to be delivered. */
+		BufferSlice mWaitingPage;
+
+		/** True if mWaitingPage is valid. */
+		bool mHasWaitingPage;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	std::shared_ptr<Connection> mConnection;
+
+	const Options mOptions;
+
+	std::shared_ptr<StringInterner> mInterner;
+
+	/** The windows being queried, in order; the front one is being delivered. */
+	std::deque<Window> mWindows;
+
+	/** The start of the next window to add. */
+	SystemClock::time_point mNextWindowStart;
+
+	/** The ID to assign to the next window. */
+	uint64_t mNextWindowID;
+
+	/** The number of entries delivered so far. */
+	size_t mNumEntries;
+
+	/** The entries of the page being delivered; reused between the pages.
+	Not protected by mMtx, only deliver() uses it, and that never runs concurrently (only the front window's pages
+	are delivered, and each window has at most a single request in flight). */
+	std::vector<Entry> mPageEntries;
+
+	EntryCallback mOnEntry;
+
+	/** The finish callback; reset once the search finishes. */
+	FinishCallback mOnFinished;
+
+
+	LogSearch(std::shared_ptr<Connection> aConnection, const Options & aOptions, std::shared_ptr<StringInterner> aInterner);
+
+	/** Adds new windows up to the in-flight limit, appending them to aToRequest.
+	Assumes mMtx is locked. */
+	void addWindows(std::vector<Window> & aToRequest);
+
+	/** Sends the page request for the specified window. Must be called with mMtx unlocked. */
+	void requestPage(const Window & aWindow);
+
+	/** Called when the page for the specified window is received. */
+	void onPage(uint64_t aWindowID, const std::error_code & aError, BufferSlice aData);
+
+	/** Parses and delivers the page of the front window, then requests its next page, or moves on to the next window
+	(delivering its waiting page, if any). */
+	void deliver(BufferSlice aData);
+
+	/** Finishes the search, reporting the specified error. */
+	void finish(const std::error_code & aError);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
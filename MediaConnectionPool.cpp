@@ -0,0 +1,428 @@
+#include "MediaConnectionPool.hpp"
+
+#include <algorithm>
+#include <asio.hpp>
+#include "Connection.hpp"
+#include "Error.hpp"
+#include "TypedConfig.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+const size_t MediaConnectionPool::DefaultMaxConnections;
+
+
+
+
+
+MediaConnectionPool::MediaConnectionPool(std::shared_ptr<Connection> aMainConnection):
+	mMainConnection(std::move(aMainConnection)),
+	mPort(0),
+	mIsActive(false),
+	mDeviceMaxConnections(0),
+	mNumInUse(0),
+	mNumConnecting(0)
+{
+}
+
+
+
+
+
+std::shared_ptr<MediaConnectionPool> MediaConnectionPool::create(std::shared_ptr<Connection> aMainConnection)
+{
+	return std::shared_ptr<MediaConnectionPool>(new MediaConnectionPool(std::move(aMainConnection)));
+}
+
+
+
+
+
+void MediaConnectionPool::setOptions(const Options & aOptions)
+{
+	std::vector<std::function<void()>> toRun;
+	{
+		LockGuard lg(mMtx);
+		mOptions = aOptions;
+		if (mIsActive)
+		{
+			serveWaiters(true, toRun);
+		}
+	}
+	for (const auto & fn: toRun)
+	{
+		fn();
+	}
+}
+
+
+
+
+
+void MediaConnectionPool::setDevice(const std::string & aHostName, uint16_t aPort)
+{
+	{
+		LockGuard lg(mMtx);
+		mHostName = aHostName;
+		mPort = aPort;
+		mIsActive = true;
+	}
+
+	// Query the connection limit, then pre-warm:
+	mMainConnection->getConfigRaw(ConfigSection<NetCommonConfig>::name(),
+		[self = shared_from_this()](const std::error_code & aError, BufferSlice aData)
+		{
+			NetCommonConfig netCommon;
+			auto err = aError ? aError : TypedConfig::parse(aData.begin(), aData.end(), netCommon);
+			std::vector<std::function<void()>> toRun;
+			{
+				LockGuard lg(self->mMtx);
+				if ((err == std::error_code()) && (netCommon.mMaxConn > 1))
+				{
+					self->mDeviceMaxConnections = static_cast<size_t>(netCommon.mMaxConn - 1);
+				}
+				else
+				{
+					self->mDeviceMaxConnections = DefaultMaxConnections;
+				}
+				if (self->mIsActive)
+				{
+					self->serveWaiters(true, toRun);
+				}
+			}
+			for (const auto & fn: toRun)
+			{
+				fn();
+			}
+		}
+	);
+}
+
+
+
+
+
+void MediaConnectionPool::acquire(const std::string & aClaimKey, AcquireCallback aOnAcquired)
+{
+	std::vector<std::function<void()>> toRun;
+	{
+		LockGuard lg(mMtx);
+		if (!mIsActive)
+		{
+			toRun.push_back(
+				[aOnAcquired]()
+				{
+					aOnAcquired(make_error_code(Error::NoConnection), nullptr, false);
+				}
+			);
+		}
+		else
+		{
+			mWaiters.push_back({aClaimKey, std::move(aOnAcquired)});
+			serveWaiters(true, toRun);
+		}
+	}
+	for (const auto & fn: toRun)
+	{
+		fn();
+	}
+}
+
+
+
+
+
+void MediaConnectionPool::release(std::shared_ptr<Connection> aConnection, const std::string & aClaimKey)
+{
+	std::vector<std::function<void()>> toRun;
+	bool shouldDisconnect = false;
+	{
+		LockGuard lg(mMtx);
+		if (mNumInUse > 0)
+		{
+			mNumInUse -= 1;
+		}
+		if (!aConnection->isConnected())
+		{
+			// Dropped by the device, forget it
+		}
+		else if (!mIsActive)
+		{
+			shouldDisconnect = true;
+		}
+		else
+		{
+			mIdle.push_back({std::move(aConnection), aClaimKey});
+		}
+		if (mIsActive)
+		{
+			serveWaiters(true, toRun);
+		}
+	}
+	if (shouldDisconnect)
+	{
+		aConnection->disconnect();
+	}
+	for (const auto & fn: toRun)
+	{
+		fn();
+	}
+}
+
+
+
+
+
+void MediaConnectionPool::close()
+{
+	std::vector<IdleConnection> idle;
+	std::deque<Waiter> waiters;
+	{
+		LockGuard lg(mMtx);
+		mIsActive = false;
+		std::swap(idle, mIdle);
+		std::swap(waiters, mWaiters);
+	}
+	for (auto & conn: idle)
+	{
+		conn.mConnection->disconnect();
+	}
+	for (auto & waiter: waiters)
+	{
+		waiter.mOnAcquired(asio::error::operation_aborted, nullptr, false);
+	}
+}
+
+
+
+
+
+size_t MediaConnectionPool::maxConnections() const
+{
+	LockGuard lg(mMtx);
+	return effectiveMaxConnections();
+}
+
+
+
+
+
+size_t MediaConnectionPool::numIdle() const
+{
+	LockGuard lg(mMtx);
+	return mIdle.size();
+}
+
+
+
+
+
+size_t MediaConnectionPool::effectiveMaxConnections() const
+{
+	if (mOptions.mMaxConnections > 0)
+	{
+		return (mDeviceMaxConnections > 0) ? std::min(mOptions.mMaxConnections, mDeviceMaxConnections) : 0;
+	}
+	return mDeviceMaxConnections;
+}
+
+
+
+
+
+void MediaConnectionPool::serveWaiters(bool aShouldPrewarm, std::vector<std::function<void()>> & aToRun)
+{
+	// Drop the idle connections that the device has closed meanwhile:
+	mIdle.erase(
+		std::remove_if(mIdle.begin(), mIdle.end(),
+			[](const IdleConnection & aIdle)
+			{
+				return !aIdle.mConnection->isConnected();
+			}
+		),
+		mIdle.end()
+	);
+
+	// Serve the waiters from the idle connections, preferring the same claim, then an unclaimed one, then any:
+	while (!mWaiters.empty() && !mIdle.empty())
+	{
+		auto & waiter = mWaiters.front();
+		size_t best = 0;
+		int bestScore = -1;
+		for (size_t i = 0; i < mIdle.size(); ++i)
+		{
+			int score = 0;
+			if (!waiter.mClaimKey.empty() && (mIdle[i].mClaimKey == waiter.mClaimKey))
+			{
+				score = 2;
+			}
+			else if (mIdle[i].mClaimKey.empty())
+			{
+				score = 1;
+			}
+			if (score > bestScore)
+			{
+				best = i;
+				bestScore = score;
+			}
+		}
+		auto conn = std::move(mIdle[best].mConnection);
+		mIdle.erase(mIdle.begin() + static_cast<std::ptrdiff_t>(best));
+		mNumInUse += 1;
+		aToRun.push_back(
+			[onAcquired = std::move(waiter.mOnAcquired), conn, isClaimed = (bestScore == 2)]()
+			{
+				onAcquired({}, conn, isClaimed);
+			}
+		);
+		mWaiters.pop_front();
+	}
+
+	// Start new connections for the remaining waiters, and to top up the pre-warmed ones:
+	auto maxConnections = effectiveMaxConnections();
+	size_t numUnclaimed = 0;
+	for (const auto & idle: mIdle)
+	{
+		numUnclaimed += idle.mClaimKey.empty() ? 1 : 0;
+	}
+	size_t numWanted = mWaiters.size();
+	if (aShouldPrewarm && (numUnclaimed < mOptions.mNumPrewarmed))
+	{
+		numWanted += mOptions.mNumPrewarmed - numUnclaimed;
+	}
+	auto numTotal = mIdle.size() + mNumInUse + mNumConnecting;
+	while ((numWanted > mNumConnecting) && (numTotal < maxConnections))
+	{
+		mNumConnecting += 1;
+		numTotal += 1;
+		aToRun.push_back(
+			[self = shared_from_this()]()
+			{
+				self->connectNew();
+			}
+		);
+	}
+}
+
+
+
+
+
+void MediaConnectionPool::connectNew()
+{
+	std::string hostName;
+	uint16_t port;
+	uint32_t maxResyncBytes;
+	{
+		LockGuard lg(mMtx);
+		hostName = mHostName;
+		port = mPort;
+		maxResyncBytes = mOptions.mMaxResyncBytes;
+	}
+	auto conn = Connection::create();
+	conn->setResync(maxResyncBytes);
+	conn->monitorDisconnect(
+		[weakSelf = std::weak_ptr<MediaConnectionPool>(shared_from_this()), connPtr = conn.get()]()
+		{
+			auto self = weakSelf.lock();
+			if (self != nullptr)
+			{
+				self->onConnectionDied(connPtr);
+			}
+		}
+	);
+	conn->connect(hostName, port,
+		[self = shared_from_this(), conn](const std::error_code & aError)
+		{
+			std::vector<std::function<void()>> toRun;
+			bool shouldDisconnect = false;
+			{
+				LockGuard lg(self->mMtx);
+				self->mNumConnecting -= 1;
+				if (aError)
+				{
+					// Fail the first waiter, so that an unreachable device doesn't leave them all hanging:
+					if (!self->mWaiters.empty())
+					{
+						toRun.push_back(
+							[onAcquired = std::move(self->mWaiters.front().mOnAcquired), aError]()
+							{
+								onAcquired(aError, nullptr, false);
+							}
+						);
+						self->mWaiters.pop_front();
+					}
+				}
+				else if (!self->mIsActive)
+				{
+					shouldDisconnect = true;
+				}
+				else
+				{
+					self->mIdle.push_back({conn, {}});
+				}
+				if (self->mIsActive)
+				{
+					// Don't re-try the pre-warming after a failure, only connect for the waiters:
+					self->serveWaiters(!aError, toRun);
+				}
+			}
+			if (shouldDisconnect)
+			{
+				conn->disconnect();
+			}
+			for (const auto & fn: toRun)
+			{
+				fn();
+			}
+		}
+	);
+}
+
+
+
+
+
+void MediaConnectionPool::onConnectionDied(const Connection * aConnection)
+{
+	std::vector<std::function<void()>> toRun;
+	{
+		LockGuard lg(mMtx);
+		auto itr = std::find_if(mIdle.begin(), mIdle.end(),
+			[aConnection](const IdleConnection & aIdle)
+			{
+				return (aIdle.mConnection.get() == aConnection);
+			}
+		);
+		if (itr == mIdle.end())
+		{
+			// Not idle (in use, or already dropped), release() will take care of it
+			return;
+		}
+		mIdle.erase(itr);
+		if (mIsActive)
+		{
+			serveWaiters(true, toRun);
+		}
+	}
+	for (const auto & fn: toRun)
+	{
+		fn();
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
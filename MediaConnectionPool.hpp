@@ -0,0 +1,169 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+
+
+
+
+
+/** A pool of the media sub-connections of a single device.
+The live streams, playbacks and downloads each need their own TCP connection, claimed (MonitorClaim_Req etc.) on
+behalf of the main connection's session. The pool keeps a number of connections pre-connected, so that starting
+a stream doesn't need to wait for the TCP handshake, and takes back the connections once the streams are done.
+The returned connections remember their last claim (an opaque key chosen by the user, such as "Monitor/0/Main"), and
+a connection claimed with the same key is preferred, so that restarting the same stream doesn't need to claim again.
+The total number of media connections is limited by the device's MaxConn (NetWork.NetCommon), less the main one. */
+class MediaConnectionPool:
+	public std::enable_shared_from_this<MediaConnectionPool>
+{
+public:
+
+	/** The tunables of the pool. */
+	struct Options
+	{
+		/** The number of unclaimed connections to keep connected in advance. */
+		size_t mNumPrewarmed = 2;
+
+		/** The maximum number of media connections; 0 to use the device's MaxConn (less the main connection). */
+		size_t mMaxConnections = 0;
+
+		/** The resync limit of the media connections (see Connection::setResync()); 0 to disconnect on any framing error. */
+		uint32_t mMaxResyncBytes = 0;
+	};
+
+	/** The callback for acquire().
+	aConnection is the connected media connection; aIsClaimed is true if it is already claimed with the requested key
+	(otherwise it is unclaimed, or claimed with a different key, and the user needs to claim it). */
+	using AcquireCallback = std::function<void(
+		const std::error_code & aError,
+		std::shared_ptr<Connection> aConnection,
+		bool aIsClaimed
+	)>;
+
+	/** The number of media connections allowed if the device doesn't report its MaxConn. */
+	static const size_t DefaultMaxConnections = 4;
+
+
+	/** Creates a new pool for the device connected through the specified main connection.
+	The pool stays inactive until setDevice() is called. */
+	static std::shared_ptr<MediaConnectionPool> create(std::shared_ptr<Connection> aMainConnection);
+
+	/** Sets new options. Takes effect for the next connections; the existing ones are not closed. */
+	void setOptions(const Options & aOptions);
+
+	/** Activates the pool for the specified device, once the main connection is logged in.
+	Queries the device's MaxConn, then pre-warms the connections. */
+	void setDevice(const std::string & aHostName, uint16_t aPort);
+
+	/** Asynchronously acquires a media connection, preferring one last claimed with aClaimKey.
+	If there's no idle connection and the limit has been reached, waits until a connection is released. */
+	void acquire(const std::string & aClaimKey, AcquireCallback aOnAcquired);
+
+	/** Returns the connection to the pool, remembering it was last claimed with aClaimKey (empty if unclaimed).
+	Connections that have been disconnected are dropped. */
+	void release(std::shared_ptr<Connection> aConnection, const std::string & aClaimKey);
+
+	/** Disconnects all the idle connections, fails all the waiting acquires and deactivates the pool.
+	The connections in use are dropped once they are released. */
+	void close();
+
+	/** Returns the maximum number of media connections (0 if not yet known). */
+	size_t maxConnections() const;
+
+	/** Returns the number of connections currently idle in the pool. */
+	size_t numIdle() const;
+
+
+protected:
+
+	/** A connection waiting in the pool. */
+	struct IdleConnection
+	{
+		std::shared_ptr<Connection> mConnection;
+
+		/** The key of the last claim; empty if never claimed. */
+		std::string mClaimKey;
+	};
+
+	/** An acquire() waiting for a connection. */
+	struct Waiter
+	{
+		std::string mClaimKey;
+		AcquireCallback mOnAcquired;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::shared_ptr<Connection> mMainConnection;
+
+	Options mOptions;
+
+	std::string mHostName;
+	uint16_t mPort;
+
+	/** True between setDevice() and close(). */
+	bool mIsActive;
+
+	/** The maximum number of media connections allowed by the device (its MaxConn less the main connection);
+	0 until known. */
+	size_t mDeviceMaxConnections;
+
+	/** The connected connections waiting in the pool. */
+	std::vector<IdleConnection> mIdle;
+
+	/** The number of connections currently lent out. */
+	size_t mNumInUse;
+
+	/** The number of connections currently connecting. */
+	size_t mNumConnecting;
+
+	/** The acquires waiting for a connection, in order. */
+	std::deque<Waiter> mWaiters;
+
+
+	explicit MediaConnectionPool(std::shared_ptr<Connection> aMainConnection);
+
+	/** Returns the effective limit on the number of media connections (0 if not yet known).
+	Assumes mMtx is locked. */
+	size_t effectiveMaxConnections() const;
+
+	/** Serves the waiters from the idle connections, and starts new connections for the remaining waiters and, if
+	aShouldPrewarm is true, to keep the pre-warmed ones, within the limit. Assumes mMtx is locked; the acquire
+	callbacks and the connects to be started are collected into aToRun, to be run once mMtx is unlocked. */
+	void serveWaiters(bool aShouldPrewarm, std::vector<std::function<void()>> & aToRun);
+
+	/** Starts a new connection; once connected, puts it into the pool (where it is served to a waiter, if any). */
+	void connectNew();
+
+	/** Called when one of the pool's connections dies; drops it from mIdle (if idle) and tops up the pre-warmed ones.
+	The connections in use are dropped once they are released. */
+	void onConnectionDied(const Connection * aConnection);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,261 @@
+#include "MediaFrame.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "DeviceTime.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+const size_t MediaFrameParser::MaxHeaderSize;
+const size_t MediaFrameParser::MaxPayloadSize;
+
+
+
+
+
+/** Reads a little-endian 16-bit value. */
+static size_t readLE16(const char * aData)
+{
+	auto d = reinterpret_cast<const uint8_t *>(aData);
+	return static_cast<size_t>(d[0]) | (static_cast<size_t>(d[1]) << 8);
+}
+
+
+
+
+
+/** Reads a little-endian 32-bit value. */
+static uint32_t readLE32(const char * aData)
+{
+	auto d = reinterpret_cast<const uint8_t *>(aData);
+	return
+		static_cast<uint32_t>(d[0]) |
+		(static_cast<uint32_t>(d[1]) << 8) |
+		(static_cast<uint32_t>(d[2]) << 16) |
+		(static_cast<uint32_t>(d[3]) << 24);
+}
+
+
+
+
+
+MediaFrameParser::MediaFrameParser():
+	mHeaderSize(0),
+	mPartialSize(0),
+	mPartialReceived(0),
+	mNumBytesSkipped(0)
+{
+}
+
+
+
+
+
+void MediaFrameParser::feed(const BufferSlice & aPacket, const FrameCallback & aOnFrame)
+{
+	const char * data = aPacket.data();
+	size_t size = aPacket.size();
+	size_t pos = 0;
+	MediaFrame frame;
+	size_t payloadSize;
+	while (pos < size)
+	{
+		// Continue reassembling the frame spanning several packets:
+		if (mPartialBlock)
+		{
+			auto numBytes = std::min(mPartialSize - mPartialReceived, size - pos);
+			memcpy(mPartialBlock->data() + mPartialReceived, data + pos, numBytes);
+			pos += numBytes;
+			mPartialReceived += numBytes;
+			if (mPartialReceived == mPartialSize)
+			{
+				mPartialFrame.mData = BufferSlice(std::move(mPartialBlock), 0, mPartialSize);
+				mPartialBlock = BufferBlockPtr();
+				mPartialFrame.mReceivedAt = std::chrono::steady_clock::now();
+				aOnFrame(mPartialFrame);
+				mPartialFrame.mData = BufferSlice();
+			}
+			continue;
+		}
+
+		if (mHeaderSize > 0)
+		{
+			// The header started in the previous packet, complete it (without consuming the bytes yet):
+			char header[MaxHeaderSize];
+			memcpy(header, mHeader, mHeaderSize);
+			auto numAdded = std::min(MaxHeaderSize - mHeaderSize, size - pos);
+			memcpy(header + mHeaderSize, data + pos, numAdded);
+			auto available = mHeaderSize + numAdded;
+			auto hdrSize = (available >= 4) ? headerSize(header) : 0;
+			if ((available < 4) || ((hdrSize > 0) && (available < hdrSize)))
+			{
+				// Still incomplete, wait for the next packet:
+				memcpy(mHeader, header, available);
+				mHeaderSize = available;
+				return;
+			}
+			if ((hdrSize == 0) || !parseHeader(header, frame, payloadSize))
+			{
+				// Not a valid header, skip a single byte and try again:
+				memmove(mHeader, mHeader + 1, mHeaderSize - 1);
+				mHeaderSize -= 1;
+				mNumBytesSkipped += 1;
+				continue;
+			}
+			pos += hdrSize - mHeaderSize;
+			mHeaderSize = 0;
+		}
+		else
+		{
+			if (size - pos < 4)
+			{
+				// Too short to tell, keep for the next packet:
+				memcpy(mHeader, data + pos, size - pos);
+				mHeaderSize = size - pos;
+				return;
+			}
+			auto hdrSize = headerSize(data + pos);
+			if ((hdrSize > 0) && (size - pos < hdrSize))
+			{
+				memcpy(mHeader, data + pos, size - pos);
+				mHeaderSize = size - pos;
+				return;
+			}
+			if ((hdrSize == 0) || !parseHeader(data + pos, frame, payloadSize))
+			{
+				// Not a valid header, skip to the next zero byte, where the next header could start:
+				auto next = static_cast<const char *>(memchr(data + pos + 1, 0, size - pos - 1));
+				auto nextPos = (next == nullptr) ? size : static_cast<size_t>(next - data);
+				mNumBytesSkipped += nextPos - pos;
+				pos = nextPos;
+				continue;
+			}
+			pos += hdrSize;
+		}
+
+		// A valid header has been parsed, hand out the payload if it's all here, otherwise start reassembling it:
+		if (size - pos >= payloadSize)
+		{
+			frame.mData = aPacket.subSlice(pos, payloadSize);
+			frame.mReceivedAt = std::chrono::steady_clock::now();
+			pos += payloadSize;
+			aOnFrame(frame);
+			frame.mData = BufferSlice();
+		}
+		else
+		{
+			mPartialFrame = frame;
+			mPartialBlock = BufferPool::instance().allocate(payloadSize);
+			mPartialSize = payloadSize;
+			mPartialReceived = 0;
+		}
+	}
+}
+
+
+
+
+
+void MediaFrameParser::reset()
+{
+	mHeaderSize = 0;
+	mPartialBlock = BufferBlockPtr();
+	mPartialFrame.mData = BufferSlice();
+	mPartialSize = 0;
+	mPartialReceived = 0;
+}
+
+
+
+
+
+size_t MediaFrameParser::headerSize(const char * aSignature)
+{
+	if ((aSignature[0] != 0) || (aSignature[1] != 0) || (aSignature[2] != 1))
+	{
+		return 0;
+	}
+	switch (static_cast<uint8_t>(aSignature[3]))
+	{
+		case 0xfc: return 16;
+		case 0xfd: return 8;
+		case 0xfa: return 8;
+		case 0xf9: return 8;
+	}
+	return 0;
+}
+
+
+
+
+
+bool MediaFrameParser::parseHeader(const char * aHeader, MediaFrame & aFrame, size_t & aPayloadSize)
+{
+	auto hdr = reinterpret_cast<const uint8_t *>(aHeader);
+	aFrame.mCodec = MediaFrame::VideoCodec::Unknown;
+	aFrame.mFps = 0;
+	aFrame.mWidth = 0;
+	aFrame.mHeight = 0;
+	aFrame.mDeviceTime = std::chrono::system_clock::time_point();
+	switch (hdr[3])
+	{
+		case 0xfc:
+		{
+			// 00 00 01 FC, codec, fps, width / 8, height / 8, packed device time (4 bytes), payload size (4 bytes)
+			aFrame.mKind = MediaFrame::Kind::IFrame;
+			aFrame.mCodec = static_cast<MediaFrame::VideoCodec>(hdr[4]);
+			aFrame.mFps = hdr[5];
+			aFrame.mWidth = hdr[6] * 8u;
+			aFrame.mHeight = hdr[7] * 8u;
+			auto t = readLE32(aHeader + 8);
+			DeviceTime::fromFields(
+				2000 + (t >> 26), (t >> 22) & 0x0f, (t >> 17) & 0x1f,
+				(t >> 12) & 0x1f, (t >> 6) & 0x3f, t & 0x3f,
+				aFrame.mDeviceTime
+			);
+			aPayloadSize = readLE32(aHeader + 12);
+			break;
+		}
+		case 0xfd:
+		{
+			// 00 00 01 FD, payload size (4 bytes)
+			aFrame.mKind = MediaFrame::Kind::PFrame;
+			aPayloadSize = readLE32(aHeader + 4);
+			break;
+		}
+		case 0xfa:
+		{
+			// 00 00 01 FA, codec, sample rate, payload size (2 bytes)
+			aFrame.mKind = MediaFrame::Kind::Audio;
+			aPayloadSize = readLE16(aHeader + 6);
+			break;
+		}
+		case 0xf9:
+		{
+			// 00 00 01 F9, info type, reserved, payload size (2 bytes)
+			aFrame.mKind = MediaFrame::Kind::Info;
+			aPayloadSize = readLE16(aHeader + 6);
+			break;
+		}
+		default:
+		{
+			return false;
+		}
+	}
+	return (aPayloadSize <= MaxPayloadSize);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include "Buffer.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** A single frame of the device's media stream (the "private" framing used in Monitor_Data and the playback data). */
+struct MediaFrame
+{
+	/** The kind of the frame, from its header (00 00 01 Fx). */
+	enum class Kind
+	{
+		IFrame,  // 0x1FC, a video keyframe, with the video parameters and the device time
+		PFrame,  // 0x1FD, a video inter frame
+		Audio,   // 0x1FA
+		Info,    // 0x1F9, the auxiliary info (such as the motion-detection overlay), passed through as-is
+	};
+
+	/** The video codec, as reported in the I-frame header. */
+	enum class VideoCodec: uint8_t
+	{
+		Unknown = 0,
+		Mpeg4 = 1,
+		H264 = 2,
+		H265 = 3,
+	};
+
+	Kind mKind;
+
+	/** The video codec; only valid for the IFrame kind. */
+	VideoCodec mCodec;
+
+	/** The video parameters; only valid for the IFrame kind. */
+	unsigned mFps;
+	unsigned mWidth;
+	unsigned mHeight;
+
+	/** The device wall-clock time (see DeviceTime); only valid for the IFrame kind. */
+	std::chrono::system_clock::time_point mDeviceTime;
+
+	/** The host time when the frame was completely received. */
+	std::chrono::steady_clock::time_point mReceivedAt;
+
+	/** The frame payload (the video / audio elementary stream data), without the frame header.
+	A view into the receive buffer, unless the frame spanned several packets. */
+	BufferSlice mData;
+};
+
+
+
+
+
+/** Splits the media stream, as received in consecutive packets, into the individual frames.
+A frame that is completely contained in a single packet is handed out as a slice of that packet's buffer, without
+copying; only the frames spanning several packets are reassembled into a new buffer.
+Bytes that don't form a valid frame header are skipped until the next one is found.
+Not thread-safe, the packets of a single stream are expected to be fed in order from a single thread at a time. */
+class MediaFrameParser
+{
+public:
+
+	using FrameCallback = std::function<void(const MediaFrame & aFrame)>;
+
+
+	MediaFrameParser();
+
+	/** Parses the packet, calling the callback for each frame completed by it. */
+	void feed(const BufferSlice & aPacket, const FrameCallback & aOnFrame);
+
+	/** Drops any partially received frame; the next packet is expected to start a new frame. */
+	void reset();
+
+	/** Returns the number of bytes skipped so far, because they didn't form a valid frame header. */
+	uint64_t numBytesSkipped() const { return mNumBytesSkipped; }
+
+
+protected:
+
+	/** The maximum size of a frame header. */
+	static const size_t MaxHeaderSize = 16;
+
+	/** The maximum accepted payload size; anything larger is considered corrupted data. */
+	static const size_t MaxPayloadSize = 8 * 1024 * 1024;
+
+
+	/** The header of the frame currently being received, while incomplete. */
+	char mHeader[MaxHeaderSize];
+
+	/** The number of valid bytes in mHeader. */
+	size_t mHeaderSize;
+
+	/** The frame being reassembled from several packets, with the header already parsed. */
+	MediaFrame mPartialFrame;
+
+	/** The buffer into which mPartialFrame's payload is being reassembled; empty if no frame is being reassembled. */
+	BufferBlockPtr mPartialBlock;
+
+	/** The total payload size of mPartialFrame, and the number of bytes received so far. */
+	size_t mPartialSize;
+	size_t mPartialReceived;
+
+	uint64_t mNumBytesSkipped;
+
+
+	/** Returns the size of the header starting with the specified signature (00 00 01 Fx), 0 if not a frame header. */
+	static size_t headerSize(const char * aSignature);
+
+	/** Parses the complete header into aFrame (without the payload) and returns the payload size.
+	Returns false if the header is not valid. */
+	static bool parseHeader(const char * aHeader, MediaFrame & aFrame, size_t & aPayloadSize);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
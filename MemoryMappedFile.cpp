@@ -0,0 +1,243 @@
+#include "MemoryMappedFile.hpp"
+
+#include <algorithm>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+MemoryMappedFile::MemoryMappedFile():
+	mData(nullptr),
+	mSize(0),
+	mMappingHandle(nullptr),
+	mIsWritable(false)
+{
+}
+
+
+
+
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+	#ifdef _WIN32
+		if (mData != nullptr)
+		{
+			UnmapViewOfFile(mData);
+		}
+		if (mMappingHandle != nullptr)
+		{
+			CloseHandle(mMappingHandle);
+		}
+	#else
+		if ((mData != nullptr) && (mSize > 0))
+		{
+			munmap(const_cast<char *>(mData), mSize);
+		}
+	#endif
+}
+
+
+
+
+
+std::shared_ptr<MemoryMappedFile> MemoryMappedFile::open(const std::string & aFileName, std::error_code & aError)
+{
+	std::shared_ptr<MemoryMappedFile> res(new MemoryMappedFile);
+
+	#ifdef _WIN32
+		auto file = CreateFileA(aFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+			return nullptr;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+			CloseHandle(file);
+			return nullptr;
+		}
+		res->mSize = static_cast<size_t>(size.QuadPart);
+		if (res->mSize > 0)
+		{
+			res->mMappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (res->mMappingHandle == nullptr)
+			{
+				aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+				CloseHandle(file);
+				return nullptr;
+			}
+			res->mData = static_cast<const char *>(MapViewOfFile(res->mMappingHandle, FILE_MAP_READ, 0, 0, 0));
+			if (res->mData == nullptr)
+			{
+				aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+				CloseHandle(file);
+				return nullptr;
+			}
+		}
+		CloseHandle(file);
+	#else
+		auto fd = ::open(aFileName.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			aError = std::error_code(errno, std::generic_category());
+			return nullptr;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			aError = std::error_code(errno, std::generic_category());
+			close(fd);
+			return nullptr;
+		}
+		res->mSize = static_cast<size_t>(st.st_size);
+		if (res->mSize > 0)
+		{
+			auto data = mmap(nullptr, res->mSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (data == MAP_FAILED)
+			{
+				aError = std::error_code(errno, std::generic_category());
+				close(fd);
+				return nullptr;
+			}
+			res->mData = static_cast<const char *>(data);
+		}
+		close(fd);  // The mapping stays valid after closing the file
+	#endif
+
+	aError.clear();
+	return res;
+}
+
+
+
+
+
+std::shared_ptr<MemoryMappedFile> MemoryMappedFile::openWritable(const std::string & aFileName, size_t aSize, std::error_code & aError)
+{
+	std::shared_ptr<MemoryMappedFile> res(new MemoryMappedFile);
+	res->mIsWritable = true;
+
+	#ifdef _WIN32
+		auto file = CreateFileA(aFileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+			return nullptr;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+			CloseHandle(file);
+			return nullptr;
+		}
+		res->mSize = (std::max)(static_cast<size_t>(size.QuadPart), aSize);  // Parenthesized against the windows.h max macro
+		if (res->mSize > 0)
+		{
+			// Creating the mapping larger than the file extends the file:
+			auto mapSize = static_cast<uint64_t>(res->mSize);
+			res->mMappingHandle = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+				static_cast<DWORD>(mapSize >> 32), static_cast<DWORD>(mapSize & 0xffffffff), nullptr
+			);
+			if (res->mMappingHandle == nullptr)
+			{
+				aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+				CloseHandle(file);
+				return nullptr;
+			}
+			res->mData = static_cast<const char *>(MapViewOfFile(res->mMappingHandle, FILE_MAP_WRITE, 0, 0, 0));
+			if (res->mData == nullptr)
+			{
+				aError = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+				CloseHandle(file);
+				return nullptr;
+			}
+		}
+		CloseHandle(file);
+	#else
+		auto fd = ::open(aFileName.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+		{
+			aError = std::error_code(errno, std::generic_category());
+			return nullptr;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			aError = std::error_code(errno, std::generic_category());
+			close(fd);
+			return nullptr;
+		}
+		res->mSize = std::max(static_cast<size_t>(st.st_size), aSize);
+		if ((static_cast<size_t>(st.st_size) < res->mSize) && (ftruncate(fd, static_cast<off_t>(res->mSize)) != 0))
+		{
+			aError = std::error_code(errno, std::generic_category());
+			close(fd);
+			return nullptr;
+		}
+		if (res->mSize > 0)
+		{
+			auto data = mmap(nullptr, res->mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data == MAP_FAILED)
+			{
+				aError = std::error_code(errno, std::generic_category());
+				close(fd);
+				return nullptr;
+			}
+			res->mData = static_cast<const char *>(data);
+		}
+		close(fd);
+	#endif
+
+	aError.clear();
+	return res;
+}
+
+
+
+
+
+std::error_code MemoryMappedFile::flush()
+{
+	if (!mIsWritable || (mData == nullptr))
+	{
+		return {};
+	}
+	#ifdef _WIN32
+		if (!FlushViewOfFile(mData, 0))
+		{
+			return std::error_code(static_cast<int>(GetLastError()), std::system_category());
+		}
+	#else
+		if (msync(const_cast<char *>(mData), mSize, MS_ASYNC) != 0)
+		{
+			return std::error_code(errno, std::generic_category());
+		}
+	#endif
+	return {};
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <system_error>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** A file mapped into the memory, either read-only or writable.
+The OS pages the data in on demand, so even large files don't take up heap memory, and a single mapping can be
+shared by any number of readers (wrap it in a std::shared_ptr). */
+class MemoryMappedFile
+{
+public:
+
+	/** Maps the specified file into the memory.
+	Returns nullptr and sets aError on failure. */
+	static std::shared_ptr<MemoryMappedFile> open(const std::string & aFileName, std::error_code & aError);
+
+	/** Maps the specified file into the memory for both reading and writing.
+	The file is created if it doesn't exist, and extended to aSize bytes if it is smaller (never shrunk).
+	Returns nullptr and sets aError on failure. */
+	static std::shared_ptr<MemoryMappedFile> openWritable(const std::string & aFileName, size_t aSize, std::error_code & aError);
+
+	~MemoryMappedFile();
+
+	MemoryMappedFile(const MemoryMappedFile &) = delete;
+	MemoryMappedFile & operator =(const MemoryMappedFile &) = delete;
+
+	const char * data() const { return mData; }
+	size_t size() const { return mSize; }
+
+	/** Returns the mapped data for writing, or nullptr if the file was mapped read-only. */
+	char * writableData() { return mIsWritable ? const_cast<char *>(mData) : nullptr; }
+
+	/** Schedules the modified data to be written to the disk, without waiting for the write to finish.
+	The OS writes the data eventually even without calling this, this only shortens the window for losing data
+	on power failure. */
+	std::error_code flush();
+
+
+protected:
+
+	/** The mapped data. */
+	const char * mData;
+
+	/** The size of the mapped data. */
+	size_t mSize;
+
+	/** The OS-specific handle of the mapping (Windows only, unused elsewhere). */
+	void * mMappingHandle;
+
+	/** True if the file was mapped for writing. */
+	bool mIsWritable;
+
+
+	MemoryMappedFile();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
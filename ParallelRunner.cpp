@@ -0,0 +1,122 @@
+#include "ParallelRunner.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <asio.hpp>
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::recursive_mutex>;
+
+
+
+
+
+ParallelRunner::ParallelRunner(size_t aMaxParallel):
+	mMaxParallel(std::max<size_t>(aMaxParallel, 1)),
+	mNumRunning(0)
+{
+}
+
+
+
+
+
+std::shared_ptr<ParallelRunner> ParallelRunner::create(size_t aMaxParallel)
+{
+	return std::shared_ptr<ParallelRunner>(new ParallelRunner(aMaxParallel));
+}
+
+
+
+
+
+void ParallelRunner::run(std::vector<Task> aTasks, std::function<void()> aOnAllFinished)
+{
+	{
+		LockGuard lg(mMtx);
+		for (auto & task: aTasks)
+		{
+			mPending.push_back(std::move(task));
+		}
+		mOnAllFinished = std::move(aOnAllFinished);
+	}
+	startPending();
+}
+
+
+
+
+
+void ParallelRunner::startPending()
+{
+	std::vector<Task> toStart;
+	std::function<void()> onAllFinished;
+	{
+		LockGuard lg(mMtx);
+		while ((mNumRunning < mMaxParallel) && !mPending.empty())
+		{
+			toStart.push_back(std::move(mPending.front()));
+			mPending.pop_front();
+			mNumRunning += 1;
+		}
+		if ((mNumRunning == 0) && mPending.empty())
+		{
+			std::swap(onAllFinished, mOnAllFinished);
+		}
+	}
+
+	// Start the tasks outside the lock, they may finish synchronously:
+	for (auto & task: toStart)
+	{
+		auto isFinished = std::make_shared<std::atomic<bool>>(false);
+		task(
+			[self = shared_from_this(), isFinished]()
+			{
+				// Guard against tasks calling the finish callback more than once:
+				if (!isFinished->exchange(true))
+				{
+					asio::post(Root::instance().ioContext(),
+						[self]()
+						{
+							self->onTaskFinished();
+						}
+					);
+				}
+			}
+		);
+	}
+	if (onAllFinished)
+	{
+		onAllFinished();
+	}
+}
+
+
+
+
+
+void ParallelRunner::onTaskFinished()
+{
+	{
+		LockGuard lg(mMtx);
+		mNumRunning -= 1;
+	}
+	startPending();
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Runs asynchronous tasks, with at most a specified number of them running at the same time.
+Used for the fleet-wide operations (upgrades, config pushes, time sync sweeps), so that a fleet of thousands of
+devices is processed with a bounded number of concurrent connections.
+Thread-safe. */
+class ParallelRunner:
+	public std::enable_shared_from_this<ParallelRunner>
+{
+public:
+
+	/** The task to run.
+	The task starts its async operation and returns; once the operation is done, it must call aOnFinished exactly once. */
+	using Task = std::function<void(std::function<void()> aOnFinished)>;
+
+	/** Creates a new runner that runs at most aMaxParallel tasks at the same time. */
+	static std::shared_ptr<ParallelRunner> create(size_t aMaxParallel);
+
+	/** Runs all the specified tasks, calls aOnAllFinished once all of them have finished.
+	Only one run() may be in progress at a time. */
+	void run(std::vector<Task> aTasks, std::function<void()> aOnAllFinished);
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::recursive_mutex mMtx;
+
+	/** The maximum number of tasks running at the same time. */
+	size_t mMaxParallel;
+
+	/** The tasks that have not been started yet. */
+	std::deque<Task> mPending;
+
+	/** The number of tasks currently running. */
+	size_t mNumRunning;
+
+	/** The callback to call once all tasks finish. */
+	std::function<void()> mOnAllFinished;
+
+
+	explicit ParallelRunner(size_t aMaxParallel);
+
+	/** Starts pending tasks while there are free slots.
+	Calls mOnAllFinished if there are no more tasks, pending or running. */
+	void startPending();
+
+	/** Called when a task has finished; starts the next one.
+	Always called through the ASIO queue, so that tasks finishing synchronously don't recurse. */
+	void onTaskFinished();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,156 @@
+#include "PreAlarmBuffer.hpp"
+
+#include <algorithm>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+PreAlarmBuffer::PreAlarmBuffer(const Options & aOptions):
+	mOptions(aOptions),
+	mNumDropped(0),
+	mNumBytes(0)
+{
+}
+
+
+
+
+
+void PreAlarmBuffer::push(const MediaFrame & aFrame)
+{
+	// Don't keep the whole receive block alive for the (typically much smaller) frame:
+	auto frame = aFrame;
+	frame.mData = aFrame.mData.compacted();
+
+	LockGuard lg(mMtx);
+	if (frame.mKind == MediaFrame::Kind::IFrame)
+	{
+		mKeyFrames.push_back(mNumDropped + mFrames.size());
+	}
+	else if (mFrames.empty())
+	{
+		// Not decodable without the preceding I-frame
+		return;
+	}
+	mNumBytes += frame.mData.blockCapacity();
+	mFrames.push_back(std::move(frame));
+	trim();
+}
+
+
+
+
+
+std::vector<MediaFrame> PreAlarmBuffer::snapshot(SteadyClock::time_point aTime) const
+{
+	LockGuard lg(mMtx);
+	if (mFrames.empty())
+	{
+		return {};
+	}
+
+	// Binary-search the last I-frame at or before aTime (the I-frames are in the arrival order):
+	auto itr = std::upper_bound(mKeyFrames.begin(), mKeyFrames.end(), aTime,
+		[this](SteadyClock::time_point aTime, size_t aKeyFrame)
+		{
+			return (aTime < mFrames[aKeyFrame - mNumDropped].mReceivedAt);
+		}
+	);
+	auto first = (itr == mKeyFrames.begin()) ? mKeyFrames.front() : *(itr - 1);
+	return std::vector<MediaFrame>(mFrames.begin() + static_cast<std::ptrdiff_t>(first - mNumDropped), mFrames.end());
+}
+
+
+
+
+
+void PreAlarmBuffer::clear()
+{
+	LockGuard lg(mMtx);
+	mNumDropped += mFrames.size();
+	mFrames.clear();
+	mKeyFrames.clear();
+	mNumBytes = 0;
+}
+
+
+
+
+
+size_t PreAlarmBuffer::numBytes() const
+{
+	LockGuard lg(mMtx);
+	return mNumBytes;
+}
+
+
+
+
+
+PreAlarmBuffer::SteadyClock::duration PreAlarmBuffer::bufferedDuration() const
+{
+	LockGuard lg(mMtx);
+	if (mFrames.empty())
+	{
+		return {};
+	}
+	return mFrames.back().mReceivedAt - mFrames.front().mReceivedAt;
+}
+
+
+
+
+
+void PreAlarmBuffer::trim()
+{
+	auto newest = mFrames.back().mReceivedAt;
+	while (mKeyFrames.size() > 1)
+	{
+		// If the second GOP alone still reaches back far enough, the oldest one is not needed:
+		auto secondStart = mFrames[mKeyFrames[1] - mNumDropped].mReceivedAt;
+		if ((newest - secondStart >= mOptions.mDuration) || (mNumBytes > mOptions.mMaxBytes))
+		{
+			dropOldestGop();
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+
+
+
+
+void PreAlarmBuffer::dropOldestGop()
+{
+	auto numFrames = mKeyFrames[1] - mKeyFrames[0];
+	for (size_t i = 0; i < numFrames; ++i)
+	{
+		mNumBytes -= mFrames.front().mData.blockCapacity();
+		mFrames.pop_front();
+	}
+	mNumDropped += numFrames;
+	mKeyFrames.pop_front();
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
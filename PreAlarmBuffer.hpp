@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** An in-memory ring of the most recent frames of a single live stream, to retrieve the video from before an alarm.
+The frames are kept in whole GOPs (an I-frame and the frames following it), so that any retrieved video starts with
+a keyframe and is decodable. The oldest GOP is dropped once the remaining ones still cover the configured duration,
+or once the frames take more than the byte budget (in which case less than the duration may be kept).
+The frames hold slices of the receive buffers (see BufferSlice). A frame that is only a small part of its receive
+block is copied into a right-sized buffer when stored, so that the retained frames don't keep the whole receive
+blocks alive; the byte budget counts the capacity of the buffers held. Retrieving the frames never copies the data.
+Thread-safe; typically filled by LiveStream and read from the alarm callback. */
+class PreAlarmBuffer
+{
+public:
+
+	using SteadyClock = std::chrono::steady_clock;
+
+	/** The tunables of the buffer. */
+	struct Options
+	{
+		/** The duration of the video to keep. */
+		std::chrono::milliseconds mDuration = std::chrono::seconds(10);
+
+		/** The maximum number of bytes to keep, counted as the capacity of the buffers holding the frames. */
+		size_t mMaxBytes = 16 * 1024 * 1024;
+	};
+
+
+	explicit PreAlarmBuffer(const Options & aOptions);
+
+	/** Adds a frame to the buffer, dropping the old GOPs as needed.
+	Frames before the first I-frame are dropped, since they couldn't be decoded. */
+	void push(const MediaFrame & aFrame);
+
+	/** Returns the frames from the last I-frame received at or before aTime, up to the newest frame.
+	If aTime is older than the whole buffer, returns all the frames. The frames share the buffered data. */
+	std::vector<MediaFrame> snapshot(SteadyClock::time_point aTime) const;
+
+	/** Drops all the frames. */
+	void clear();
+
+	/** Returns the number of bytes currently held (the capacity of the buffers holding the frames). */
+	size_t numBytes() const;
+
+	/** Returns the time span of the buffered video (from the oldest I-frame to the newest frame). */
+	SteadyClock::duration bufferedDuration() const;
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	const Options mOptions;
+
+	/** The buffered frames, oldest first; always starts with an I-frame (unless empty). */
+	std::deque<MediaFrame> mFrames;
+
+	/** The indices into mFrames of the I-frames, oldest first; adjusted by mNumDropped. */
+	std::deque<size_t> mKeyFrames;
+
+	/** The number of frames dropped from the front of mFrames since the start, to adjust mKeyFrames. */
+	size_t mNumDropped;
+
+	/** The total capacity of the buffers holding mFrames. */
+	size_t mNumBytes;
+
+
+	/** Drops the oldest GOPs while the rest still covers the duration, or while over the byte budget.
+	Always keeps the newest GOP. Assumes mMtx is locked. */
+	void trim();
+
+	/** Drops the oldest GOP. Assumes mMtx is locked and there are at least two GOPs. */
+	void dropOldestGop();
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
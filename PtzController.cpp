@@ -0,0 +1,246 @@
+#include "PtzController.hpp"
+
+#include <algorithm>
+#include <asio.hpp>
+#include "Connection.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+/** The Preset value in the PTZ command that starts a continuous movement. */
+static const int PRESET_START = 65535;
+
+/** The Preset value in the PTZ command that stops the movement. */
+static const int PRESET_STOP = -1;
+
+
+
+
+
+const int PtzController::DefaultSpeed;
+
+
+
+
+
+PtzController::PtzController(std::shared_ptr<Connection> aConnection):
+	mConnection(std::move(aConnection))
+{
+}
+
+
+
+
+
+std::shared_ptr<PtzController> PtzController::create(std::shared_ptr<Connection> aConnection)
+{
+	return std::shared_ptr<PtzController>(new PtzController(std::move(aConnection)));
+}
+
+
+
+
+
+void PtzController::move(int aChannel, Movement aMovement, int aSpeed, ResultCallback aOnFinish)
+{
+	PendingMove move{aMovement, std::min(std::max(aSpeed, 1), 8), std::move(aOnFinish)};
+	ResultCallback replaced;
+	bool shouldSendNow = false;
+	{
+		LockGuard lg(mMtx);
+		auto & state = mChannels[aChannel];
+		if (state.mIsInFlight)
+		{
+			// Wait for the command in flight; replace the waiting move (if any) in place:
+			if (state.mIsMovePending)
+			{
+				replaced = std::move(state.mPendingMove.mOnFinish);
+			}
+			state.mPendingMove = std::move(move);
+			state.mIsMovePending = true;
+		}
+		else
+		{
+			state.mIsInFlight = true;
+			state.mLastMovement = aMovement;
+			shouldSendNow = true;
+		}
+	}
+	if (replaced)
+	{
+		replaced(asio::error::operation_aborted);
+	}
+	if (shouldSendNow)
+	{
+		sendMove(aChannel, move);
+	}
+}
+
+
+
+
+
+void PtzController::stop(int aChannel, ResultCallback aOnFinish)
+{
+	ResultCallback discarded;
+	Movement lastMovement;
+	bool shouldSendNow = false;
+	{
+		LockGuard lg(mMtx);
+		auto & state = mChannels[aChannel];
+		if (state.mIsMovePending)
+		{
+			// The stop supersedes the waiting move:
+			discarded = std::move(state.mPendingMove.mOnFinish);
+			state.mIsMovePending = false;
+		}
+		if (state.mIsInFlight)
+		{
+			// Wait for the command in flight; coalesce with an already waiting stop:
+			state.mIsStopPending = true;
+			state.mPendingStopCallbacks.push_back(std::move(aOnFinish));
+		}
+		else
+		{
+			state.mIsInFlight = true;
+			shouldSendNow = true;
+		}
+		lastMovement = state.mLastMovement;
+	}
+	if (discarded)
+	{
+		discarded(asio::error::operation_aborted);
+	}
+	if (shouldSendNow)
+	{
+		std::vector<ResultCallback> callbacks;
+		callbacks.push_back(std::move(aOnFinish));
+		sendStop(aChannel, lastMovement, std::move(callbacks));
+	}
+}
+
+
+
+
+
+const char * PtzController::commandName(Movement aMovement)
+{
+	switch (aMovement)
+	{
+		case Movement::Up:        return "DirectionUp";
+		case Movement::Down:      return "DirectionDown";
+		case Movement::Left:      return "DirectionLeft";
+		case Movement::Right:     return "DirectionRight";
+		case Movement::LeftUp:    return "DirectionLeftUp";
+		case Movement::LeftDown:  return "DirectionLeftDown";
+		case Movement::RightUp:   return "DirectionRightUp";
+		case Movement::RightDown: return "DirectionRightDown";
+		case Movement::ZoomIn:    return "ZoomTile";
+		case Movement::ZoomOut:   return "ZoomWide";
+		case Movement::FocusNear: return "FocusNear";
+		case Movement::FocusFar:  return "FocusFar";
+		case Movement::IrisOpen:  return "IrisLarge";
+		case Movement::IrisClose: return "IrisSmall";
+	}
+	return "DirectionUp";
+}
+
+
+
+
+
+void PtzController::sendMove(int aChannel, const PendingMove & aMove)
+{
+	auto onFinish = aMove.mOnFinish;
+	mConnection->ptzControl(aChannel, commandName(aMove.mMovement), aMove.mSpeed, PRESET_START,
+		[self = shared_from_this(), aChannel, onFinish](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			if (onFinish)
+			{
+				onFinish(aError);
+			}
+			self->onCommandFinished(aChannel);
+		}
+	);
+}
+
+
+
+
+
+void PtzController::sendStop(int aChannel, Movement aLastMovement, std::vector<ResultCallback> aCallbacks)
+{
+	mConnection->ptzControl(aChannel, commandName(aLastMovement), DefaultSpeed, PRESET_STOP,
+		[self = shared_from_this(), aChannel, aCallbacks](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			for (const auto & callback: aCallbacks)
+			{
+				if (callback)
+				{
+					callback(aError);
+				}
+			}
+			self->onCommandFinished(aChannel);
+		}
+	);
+}
+
+
+
+
+
+void PtzController::onCommandFinished(int aChannel)
+{
+	std::vector<ResultCallback> stopCallbacks;
+	PendingMove move;
+	Movement lastMovement;
+	bool shouldSendStop = false;
+	bool shouldSendMove = false;
+	{
+		LockGuard lg(mMtx);
+		auto & state = mChannels[aChannel];
+		if (state.mIsStopPending)
+		{
+			// The stop goes first, the move requested after it (if any) waits for the stop to finish:
+			state.mIsStopPending = false;
+			std::swap(stopCallbacks, state.mPendingStopCallbacks);
+			lastMovement = state.mLastMovement;
+			shouldSendStop = true;
+		}
+		else if (state.mIsMovePending)
+		{
+			state.mIsMovePending = false;
+			move = std::move(state.mPendingMove);
+			state.mLastMovement = move.mMovement;
+			shouldSendMove = true;
+		}
+		else
+		{
+			state.mIsInFlight = false;
+		}
+	}
+	if (shouldSendStop)
+	{
+		sendStop(aChannel, lastMovement, std::move(stopCallbacks));
+	}
+	else if (shouldSendMove)
+	{
+		sendMove(aChannel, move);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+
+
+
+
+
+/** Continuous-move PTZ control with latest-wins coalescing, suitable for driving from a joystick.
+At most one command per channel is in flight (sent and not yet confirmed by the device). A move requested while
+another command is in flight waits in a single per-channel slot; a newer move replaces the waiting one in place, so
+that the camera always heads for the latest requested direction and the control latency stays at about one RTT
+regardless of the input rate.
+Stops take priority: a stop discards the waiting move and is never replaced; a move requested after the stop is sent
+after the stop.
+Obtain the instance through Recorder::ptz(). Thread-safe. */
+class PtzController:
+	public std::enable_shared_from_this<PtzController>
+{
+public:
+
+	/** The continuous movements that the camera can make. */
+	enum class Movement
+	{
+		Up,
+		Down,
+		Left,
+		Right,
+		LeftUp,
+		LeftDown,
+		RightUp,
+		RightDown,
+		ZoomIn,
+		ZoomOut,
+		FocusNear,
+		FocusFar,
+		IrisOpen,
+		IrisClose,
+	};
+
+	/** The callback called once the device confirms the command.
+	Called with asio::error::operation_aborted if the command was replaced by a newer one before being sent. */
+	using ResultCallback = std::function<void(const std::error_code & aError)>;
+
+	/** The default speed of the movement (1 - 8). */
+	static const int DefaultSpeed = 5;
+
+
+	static std::shared_ptr<PtzController> create(std::shared_ptr<Connection> aConnection);
+
+	/** Starts moving the camera on the specified channel, until stopped or until another movement is requested.
+	aSpeed is 1 (slowest) to 8 (fastest). aOnFinish may be nullptr. */
+	void move(int aChannel, Movement aMovement, int aSpeed = DefaultSpeed, ResultCallback aOnFinish = nullptr);
+
+	/** Stops the movement of the camera on the specified channel. aOnFinish may be nullptr. */
+	void stop(int aChannel, ResultCallback aOnFinish = nullptr);
+
+	/** Returns the device's command name for the specified movement. */
+	static const char * commandName(Movement aMovement);
+
+
+protected:
+
+	/** A single move command waiting to be sent. */
+	struct PendingMove
+	{
+		Movement mMovement;
+		int mSpeed;
+		ResultCallback mOnFinish;
+	};
+
+	/** The control state of a single channel. */
+	struct ChannelState
+	{
+		/** True while a command is sent and not yet confirmed by the device. */
+		bool mIsInFlight = false;
+
+		/** The movement last sent to the device; the stop command needs to name it. */
+		Movement mLastMovement = Movement::Up;
+
+		/** True if a stop is waiting to be sent. */
+		bool mIsStopPending = false;
+
+		/** The callbacks of all the stop requests coalesced into the waiting stop. */
+		std::vector<ResultCallback> mPendingStopCallbacks;
+
+		/** True if mPendingMove is valid (waiting to be sent). */
+		bool mIsMovePending = false;
+
+		PendingMove mPendingMove;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	/** The connection to the device. */
+	std::shared_ptr<Connection> mConnection;
+
+	/** The state of the individual channels. */
+	std::map<int, ChannelState> mChannels;
+
+
+	explicit PtzController(std::shared_ptr<Connection> aConnection);
+
+	/** Sends the move command, calls onCommandFinished() once the device confirms it. */
+	void sendMove(int aChannel, const PendingMove & aMove);
+
+	/** Sends the stop command, calls onCommandFinished() once the device confirms it. */
+	void sendStop(int aChannel, Movement aLastMovement, std::vector<ResultCallback> aCallbacks);
+
+	/** Called when the device confirms a command on the specified channel; sends the next waiting command, if any. */
+	void onCommandFinished(int aChannel);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -1,5 +1,6 @@
 #include "Recorder.hpp"
 
+#include <mutex>
 #include <asio.hpp>
 #include "Root.hpp"
 #include "Error.hpp"
@@ -34,7 +35,12 @@ Recorder::~Recorder()
 
 
 Recorder::Recorder():
-	mMainConnection(Connection::create())
+	mMainConnection(Connection::create()),
+	mPtz(PtzController::create(mMainConnection)),
+	mClock(DeviceClock::create(mMainConnection)),
+	mMediaPool(MediaConnectionPool::create(mMainConnection)),
+	mKeyFrameCache(std::make_shared<KeyFrameCache>()),
+	mStreamHub(StreamHub::create(mMainConnection, mMediaPool, mKeyFrameCache))
 {
 }
 
@@ -51,14 +57,14 @@ void Recorder::connectAndLogin(
 )
 {
 	mMainConnection->connect(aHostName, aPort,
-		[self = shared_from_this(), aUserName, aPassword, aOnFinish](const std::error_code & aError)
+		[self = shared_from_this(), aHostName, aPort, aUserName, aPassword, aOnFinish](const std::error_code & aError)
 		{
 			if (aError)
 			{
 				return aOnFinish(aError);
 			}
 			self->mMainConnection->login(aUserName, aPassword,
-				[self, aOnFinish](const std::error_code & aError, const nlohmann::json & aResponse)
+				[self, aHostName, aPort, aOnFinish](const std::error_code & aError, const nlohmann::json & aResponse)
 				{
 					if (aError)
 					{
@@ -69,7 +75,8 @@ void Recorder::connectAndLogin(
 					{
 						return aOnFinish(static_cast<Error>(itr->get<int>()));
 					}
-					// Connected and logged into successfully
+					// Connected and logged into successfully, the media connections may now be claimed:
+					self->mMediaPool->setDevice(aHostName, aPort);
 					aOnFinish({});
 				}
 			);
@@ -83,6 +90,7 @@ void Recorder::connectAndLogin(
 
 void Recorder::disconnect()
 {
+	mMediaPool->close();
 	auto conn = mMainConnection;
 	if (conn)
 	{
@@ -100,6 +108,7 @@ void Recorder::getChannelNames(Connection::ChannelNamesCallback aOnFinish)
 	if (conn == nullptr)
 	{
 		aOnFinish(make_error_code(Error::NoConnection), {});
+		return;
 	}
 	conn->getChannelNames(aOnFinish);
 }
@@ -114,6 +123,7 @@ void Recorder::getSysInfo(Connection::NamedJsonCallback aOnFinish, const std::st
 	if (conn == nullptr)
 	{
 		aOnFinish(make_error_code(Error::NoConnection), {}, {});
+		return;
 	}
 	conn->getSysInfo(aOnFinish, aInfoName);
 }
@@ -128,6 +138,7 @@ void Recorder::getAbility(Connection::NamedJsonCallback aOnFinish, const std::st
 	if (conn == nullptr)
 	{
 		aOnFinish(make_error_code(Error::NoConnection), {}, {});
+		return;
 	}
 	conn->getAbility(aOnFinish, aAbilityName);
 }
@@ -142,6 +153,7 @@ void Recorder::getConfig(Connection::NamedJsonCallback aOnFinish, const std::str
 	if (conn == nullptr)
 	{
 		aOnFinish(make_error_code(Error::NoConnection), {}, {});
+		return;
 	}
 	conn->getConfig(aOnFinish, aConfigName);
 }
@@ -150,6 +162,175 @@ void Recorder::getConfig(Connection::NamedJsonCallback aOnFinish, const std::str
 
 
 
+void Recorder::setConfig(const std::string & aConfigName, const nlohmann::json & aConfig, Connection::JsonCallback aOnFinish)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		aOnFinish(make_error_code(Error::NoConnection), {});
+		return;
+	}
+	conn->setConfig(aConfigName, aConfig, std::move(aOnFinish));
+}
+
+
+
+
+
+void Recorder::updateConfig(
+	const std::string & aConfigName,
+	const nlohmann::json & aChanges,
+	const nlohmann::json & aCurrent,
+	ConfigUpdateCallback aOnFinish
+)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		aOnFinish(make_error_code(Error::NoConnection), 0, {});
+		return;
+	}
+	if (!aCurrent.is_null())
+	{
+		return sendChangedConfigSections(aConfigName, aCurrent, applyConfigChanges(aCurrent, aChanges), std::move(aOnFinish));
+	}
+
+	// Query the current config first:
+	conn->getConfig(
+		[self = shared_from_this(), aChanges, aOnFinish](
+			const std::error_code & aError,
+			const std::string & aName,
+			const nlohmann::json & aResponse
+		)
+		{
+			if (aError)
+			{
+				return aOnFinish(aError, 0, {});
+			}
+			auto itr = aResponse.find(aName);
+			if (itr == aResponse.end())
+			{
+				return aOnFinish(make_error_code(Error::ResponseMissingExpectedField), 0, {});
+			}
+			self->sendChangedConfigSections(aName, *itr, applyConfigChanges(*itr, aChanges), aOnFinish);
+		},
+		aConfigName
+	);
+}
+
+
+
+
+
+nlohmann::json Recorder::applyConfigChanges(const nlohmann::json & aCurrent, const nlohmann::json & aChanges)
+{
+	if (aCurrent.is_object() && aChanges.is_object())
+	{
+		auto res = aCurrent;
+		for (auto itr = aChanges.begin(), end = aChanges.end(); itr != end; ++itr)
+		{
+			auto cur = aCurrent.find(itr.key());
+			res[itr.key()] = (cur == aCurrent.end()) ? itr.value() : applyConfigChanges(*cur, itr.value());
+		}
+		return res;
+	}
+	if (aCurrent.is_array() && aChanges.is_array())
+	{
+		auto res = aCurrent;
+		for (size_t i = 0; i < aChanges.size(); ++i)
+		{
+			if (i >= res.size())
+			{
+				res.push_back(aChanges[i]);
+			}
+			else if (!aChanges[i].is_null())
+			{
+				res[i] = applyConfigChanges(aCurrent[i], aChanges[i]);
+			}
+		}
+		return res;
+	}
+	return aChanges;
+}
+
+
+
+
+
+void Recorder::sendChangedConfigSections(
+	const std::string & aConfigName,
+	const nlohmann::json & aCurrent,
+	const nlohmann::json & aNewConfig,
+	ConfigUpdateCallback aOnFinish
+)
+{
+	// Collect the changed sections; configs that aren't objects can only be sent as a whole:
+	std::vector<std::pair<std::string, const nlohmann::json *>> changed;
+	if (aCurrent.is_object() && aNewConfig.is_object())
+	{
+		for (auto itr = aNewConfig.begin(), end = aNewConfig.end(); itr != end; ++itr)
+		{
+			auto cur = aCurrent.find(itr.key());
+			if ((cur == aCurrent.end()) || (*cur != itr.value()))
+			{
+				changed.emplace_back(aConfigName + "." + itr.key(), &itr.value());
+			}
+		}
+	}
+	else if (aCurrent != aNewConfig)
+	{
+		changed.emplace_back(aConfigName, &aNewConfig);
+	}
+	if (changed.empty())
+	{
+		return aOnFinish({}, 0, aNewConfig);
+	}
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		return aOnFinish(make_error_code(Error::NoConnection), 0, {});
+	}
+
+	// Send all the changed sections at once, report when all of them are confirmed:
+	struct State
+	{
+		std::mutex mMtx;
+		size_t mNumRemaining;
+		std::error_code mFirstError;
+	};
+	auto state = std::make_shared<State>();
+	state->mNumRemaining = changed.size();
+	auto numSections = changed.size();
+	auto newConfig = std::make_shared<nlohmann::json>(aNewConfig);
+	for (const auto & section: changed)
+	{
+		conn->setConfig(section.first, *section.second,
+			[state, numSections, newConfig, aOnFinish](const std::error_code & aError, const nlohmann::json & aResponse)
+			{
+				std::error_code err;
+				{
+					std::lock_guard<std::mutex> lg(state->mMtx);
+					if (aError && !state->mFirstError)
+					{
+						state->mFirstError = aError;
+					}
+					state->mNumRemaining -= 1;
+					if (state->mNumRemaining > 0)
+					{
+						return;
+					}
+					err = state->mFirstError;
+				}
+				aOnFinish(err, numSections, *newConfig);
+			}
+		);
+	}
+}
+
+
+
+
+
 void Recorder::monitorAlarms(Connection::AlarmCallback aOnAlarm)
 {
 	auto conn = mMainConnection;
@@ -166,6 +347,36 @@ void Recorder::monitorAlarms(Connection::AlarmCallback aOnAlarm)
 
 
 
+Connection::AlarmSubscriptionId Recorder::subscribeAlarms(const Connection::AlarmFilter & aFilter, Connection::AlarmCallback aOnAlarm)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		aOnAlarm(make_error_code(Error::NoConnection), -1, false, {}, {});
+		return 0;
+	}
+	return conn->subscribeAlarms(aFilter, std::move(aOnAlarm));
+}
+
+
+
+
+
+bool Recorder::unsubscribeAlarms(Connection::AlarmSubscriptionId aSubscriptionId)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		return false;
+	}
+	return conn->unsubscribeAlarms(aSubscriptionId);
+}
+
+
+
+
+
+
 void Recorder::capturePicture(int aChannel, Connection::PictureCallback aOnFinish)
 {
 	auto conn = mMainConnection;
@@ -181,4 +392,139 @@ void Recorder::capturePicture(int aChannel, Connection::PictureCallback aOnFinis
 
 
 
+void Recorder::capturePictureSlice(int aChannel, Connection::SliceCallback aOnFinish)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		aOnFinish(make_error_code(Error::NoConnection), {});
+		return;
+	}
+	conn->capturePictureSlice(aChannel, std::move(aOnFinish));
+}
+
+
+
+
+
+void Recorder::snapshot(
+	int aChannel,
+	LiveStream::StreamType aPreferredStreamType,
+	std::chrono::milliseconds aMaxAge,
+	SnapshotCallback aOnFinish
+)
+{
+	KeyFrameCache::Snapshot snapshot;
+	if (mKeyFrameCache->find(aChannel, aPreferredStreamType, aMaxAge, snapshot))
+	{
+		aOnFinish({}, snapshot);
+		return;
+	}
+
+	// Not streamed (or the stream is stale), capture a fresh JPEG:
+	capturePictureSlice(aChannel,
+		[aOnFinish](const std::error_code & aError, BufferSlice aData)
+		{
+			KeyFrameCache::Snapshot snapshot;
+			snapshot.mSource = KeyFrameCache::Source::NetSnap;
+			snapshot.mStreamType = LiveStream::StreamType::Main;
+			snapshot.mJpeg = std::move(aData);
+			aOnFinish(aError, snapshot);
+		}
+	);
+}
+
+
+
+
+
+void Recorder::getConfigSlice(Connection::NamedSliceCallback aOnFinish, const std::string & aConfigName)
+{
+	auto conn = mMainConnection;
+	if (conn == nullptr)
+	{
+		aOnFinish(make_error_code(Error::NoConnection), aConfigName, {});
+		return;
+	}
+	conn->getConfigSlice(std::move(aOnFinish), aConfigName);
+}
+
+
+
+
+
+std::shared_ptr<FirmwareUpgrade> Recorder::upgradeFirmware(
+	std::shared_ptr<const MemoryMappedFile> aImage,
+	std::shared_ptr<BandwidthLimiter> aLimiter,
+	const FirmwareUpgrade::Options & aOptions,
+	FirmwareUpgrade::ProgressCallback aOnProgress
+)
+{
+	auto upgrade = FirmwareUpgrade::create(mMainConnection, std::move(aImage), std::move(aLimiter), aOptions, std::move(aOnProgress));
+	upgrade->start();
+	return upgrade;
+}
+
+
+
+
+
+std::shared_ptr<LogSearch> Recorder::searchLog(
+	const LogSearch::Options & aOptions,
+	LogSearch::EntryCallback aOnEntry,
+	LogSearch::FinishCallback aOnFinished
+)
+{
+	auto search = LogSearch::create(mMainConnection, aOptions, nullptr);
+	search->start(std::move(aOnEntry), std::move(aOnFinished));
+	return search;
+}
+
+
+
+
+
+std::shared_ptr<TalkSession> Recorder::startTalk(const TalkSession::Options & aOptions, TalkSession::StartCallback aOnStarted)
+{
+	auto session = TalkSession::create(mMainConnection, aOptions);
+	session->start(std::move(aOnStarted));
+	return session;
+}
+
+
+
+
+
+std::shared_ptr<LiveStream> Recorder::startLiveStream(
+	int aChannel,
+	LiveStream::StreamType aStreamType,
+	LiveStream::DataCallback aOnData,
+	LiveStream::StartCallback aOnStarted
+)
+{
+	auto stream = LiveStream::create(mMainConnection, mMediaPool, aChannel, aStreamType);
+	stream->start(std::move(aOnData), std::move(aOnStarted));
+	return stream;
+}
+
+
+
+
+
+std::shared_ptr<AdaptiveStream> Recorder::startAdaptiveStream(
+	int aChannel,
+	const AdaptiveStream::Options & aOptions,
+	AdaptiveStream::FrameCallback aOnFrame,
+	AdaptiveStream::StatusCallback aOnStatus
+)
+{
+	auto stream = AdaptiveStream::create(mMainConnection, mMediaPool, aChannel, aOptions);
+	stream->start(std::move(aOnFrame), std::move(aOnStatus));
+	return stream;
+}
+
+
+
+
+
 }  // namespace NetSurveillancePp
@@ -4,7 +4,18 @@
 #include <functional>
 #include <memory>
 #include <asio.hpp>
+#include "AdaptiveStream.hpp"
 #include "Connection.hpp"
+#include "DeviceClock.hpp"
+#include "FirmwareUpgrade.hpp"
+#include "KeyFrameCache.hpp"
+#include "LiveStream.hpp"
+#include "LogSearch.hpp"
+#include "MediaConnectionPool.hpp"
+#include "PtzController.hpp"
+#include "StreamHub.hpp"
+#include "TalkSession.hpp"
+#include "TypedConfig.hpp"
 
 
 
@@ -21,6 +32,15 @@ class Recorder:
 	public std::enable_shared_from_this<Recorder>
 {
 public:
+	/** The callback for updateConfig().
+	Receives the number of config sections sent to the device, and the resulting config. */
+	using ConfigUpdateCallback = std::function<void(
+		const std::error_code & aError,
+		size_t aNumSectionsSent,
+		const nlohmann::json & aNewConfig
+	)>;
+
+
 	/** Creates a new instance, wrapped in a shared_ptr.
 	Wrapping in shared_ptr is required due to lifetime management. */
 	static std::shared_ptr<Recorder> create();
@@ -66,22 +86,298 @@ public:
 	On error, calls the callback with an error code and the response returned from the device. */
 	void getConfig(Connection::NamedJsonCallback aOnFinish, const std::string & aConfigName);
 
+	/** Asynchronously sets the specified device config, as a whole (ConfigSet_Req).
+	See also updateConfig() for sending only the changes. */
+	void setConfig(const std::string & aConfigName, const nlohmann::json & aConfig, Connection::JsonCallback aOnFinish);
+
+	/** Asynchronously applies the changes to the specified device config, sending only the changed top-level sections.
+	aChanges is overlaid onto the current config (see applyConfigChanges()); each top-level section whose value
+	differs as a result is sent in its own ConfigSet_Req ("Name.Section"), the unchanged sections are not sent at all.
+	aCurrent is the device's current config (the value under the config name in the getConfig() response), if the
+	caller has it cached; if it is null, the current config is queried from the device first.
+	The callback receives the number of sections sent and the resulting config (to be cached for the next update). */
+	void updateConfig(
+		const std::string & aConfigName,
+		const nlohmann::json & aChanges,
+		const nlohmann::json & aCurrent,
+		ConfigUpdateCallback aOnFinish
+	);
+
+	/** Returns aCurrent with aChanges overlaid onto it.
+	Objects are merged recursively, arrays element-wise (aChanges' null elements keep the current element),
+	any other values in aChanges replace the current ones. */
+	static nlohmann::json applyConfigChanges(const nlohmann::json & aCurrent, const nlohmann::json & aChanges);
+
+	/** Asynchronously queries the config bound to the specified typed struct (see TypedConfig.hpp), such as
+	GeneralConfig or EncodeConfig. The response is parsed straight into the struct, without building a JSON DOM.
+	On error, calls the callback with an error code and a default-constructed config. */
+	template <typename Config>
+	void getTypedConfig(std::function<void(const std::error_code & aError, const Config & aConfig)> aOnFinish)
+	{
+		auto conn = mMainConnection;
+		if (conn == nullptr)
+		{
+			aOnFinish(make_error_code(Error::NoConnection), Config());
+			return;
+		}
+		conn->getConfigRaw(ConfigSection<Config>::name(),
+			[aOnFinish](const std::error_code & aError, BufferSlice aData)
+			{
+				Config config;
+				auto err = aError ? aError : TypedConfig::parse(aData.begin(), aData.end(), config);
+				aOnFinish(err, config);
+			}
+		);
+	}
+
+	/** Asynchronously sets the config bound to the specified typed struct.
+	The complete configs (ConfigSection::mIsComplete) are serialized directly into the ConfigSet_Req; the incomplete
+	ones are merged into the device's current config (TypedConfig::merge()), so that the unbound fields are kept.
+	Neither builds a JSON DOM. */
+	template <typename Config>
+	void setTypedConfig(const Config & aConfig, std::function<void(const std::error_code & aError)> aOnFinish)
+	{
+		auto conn = mMainConnection;
+		if (conn == nullptr)
+		{
+			aOnFinish(make_error_code(Error::NoConnection));
+			return;
+		}
+		if (ConfigSection<Config>::mIsComplete)
+		{
+			conn->setConfigRaw(ConfigSection<Config>::name(), TypedConfig::serialize(aConfig),
+				[aOnFinish](const std::error_code & aError, const nlohmann::json & aResponse)
+				{
+					aOnFinish(aError);
+				}
+			);
+			return;
+		}
+		conn->getConfigRaw(ConfigSection<Config>::name(),
+			[conn, aConfig, aOnFinish](const std::error_code & aError, BufferSlice aData)
+			{
+				std::string merged;
+				auto err = aError ? aError : TypedConfig::merge(aData.begin(), aData.end(), aConfig, merged);
+				if (err)
+				{
+					return aOnFinish(err);
+				}
+				conn->setConfigRaw(ConfigSection<Config>::name(), merged,
+					[aOnFinish](const std::error_code & aSetError, const nlohmann::json & aResponse)
+					{
+						aOnFinish(aSetError);
+					}
+				);
+			}
+		);
+	}
+
 	/** Installs an async alarm monitor.
 	The callback is called whenever the device reports an alarm start or stop event.
 	Only one monitor can be installed at a time, setting another one overwrites the previous one. */
 	void monitorAlarms(Connection::AlarmCallback aOnAlarm);
 
+	/** Adds an alarm subscription on the main connection (see Connection::subscribeAlarms()).
+	Returns 0 (and reports Error::NoConnection to the callback) if not connected. */
+	Connection::AlarmSubscriptionId subscribeAlarms(const Connection::AlarmFilter & aFilter, Connection::AlarmCallback aOnAlarm);
+
+	/** Removes the alarm subscription from the main connection. Returns false if there is no such subscription. */
+	bool unsubscribeAlarms(Connection::AlarmSubscriptionId aSubscriptionId);
+
 	/** Asynchronously captures a picture from the specified channel. */
 	void capturePicture(int aChannel, Connection::PictureCallback aOnFinish);
 
+	/** Asynchronously captures a picture from the specified channel.
+	The picture data is delivered as a slice of the receive buffer, which may be retained without copying. */
+	void capturePictureSlice(int aChannel, Connection::SliceCallback aOnFinish);
+
+	/** The callback for snapshot(). */
+	using SnapshotCallback = std::function<void(const std::error_code & aError, const KeyFrameCache::Snapshot & aSnapshot)>;
+
+	/** Returns a snapshot of the specified channel.
+	If the channel is streamed through streamHub() and its latest I-frame is at most aMaxAge old, the callback is
+	called right away (before returning) with that I-frame, without any device traffic. Otherwise a JPEG is captured
+	(capturePictureSlice()) and the callback is called asynchronously. The snapshot's mSource tells which happened. */
+	void snapshot(
+		int aChannel,
+		LiveStream::StreamType aPreferredStreamType,
+		std::chrono::milliseconds aMaxAge,
+		SnapshotCallback aOnFinish
+	);
+
+	/** Returns the cache of the latest I-frames of the channels streamed through streamHub(). */
+	std::shared_ptr<KeyFrameCache> keyFrameCache() const { return mKeyFrameCache; }
+
+	/** Asynchronously queries the specified device config.
+	The raw JSON response is delivered as a slice of the receive buffer, which may be retained without copying. */
+	void getConfigSlice(Connection::NamedSliceCallback aOnFinish, const std::string & aConfigName);
+
+	/** Starts upgrading the device's firmware with the specified image.
+	aLimiter may be shared among many upgrades to cap their combined bandwidth; nullptr for unlimited.
+	Returns the upgrade object, which may be used to abort the upgrade. The progress is reported through the callback.
+	See FirmwareRollout for upgrading many devices at once. */
+	std::shared_ptr<FirmwareUpgrade> upgradeFirmware(
+		std::shared_ptr<const MemoryMappedFile> aImage,
+		std::shared_ptr<BandwidthLimiter> aLimiter,
+		const FirmwareUpgrade::Options & aOptions,
+		FirmwareUpgrade::ProgressCallback aOnProgress
+	);
+
+	/** Starts searching the device log, streaming the entries to the callback in order.
+	Returns the search object, which may be used to stop the search. See LogSearch for details. */
+	std::shared_ptr<LogSearch> searchLog(
+		const LogSearch::Options & aOptions,
+		LogSearch::EntryCallback aOnEntry,
+		LogSearch::FinishCallback aOnFinished
+	);
+
+	/** Returns the device clock monitor, keeping the device's drift history (see DeviceClock and ClockSweep). */
+	std::shared_ptr<DeviceClock> clock() const { return mClock; }
+
+	/** Returns the PTZ controller for the cameras connected to the device. */
+	std::shared_ptr<PtzController> ptz() const { return mPtz; }
+
+	/** Starts a two-way audio (intercom) session with the device.
+	Returns the session object, through which the audio is exchanged; the callback is called once the device accepts
+	(or refuses) the session. */
+	std::shared_ptr<TalkSession> startTalk(const TalkSession::Options & aOptions, TalkSession::StartCallback aOnStarted);
+
+	/** Returns the pool of the media sub-connections, used by the live streams.
+	The pool is activated (and pre-warmed) once connectAndLogin() succeeds. */
+	std::shared_ptr<MediaConnectionPool> mediaPool() const { return mMediaPool; }
+
+	/** Returns the hub sharing a single live stream per channel among the local consumers.
+	Prefer subscribing through the hub over startLiveStream() when more than one consumer needs the same channel. */
+	std::shared_ptr<StreamHub> streamHub() const { return mStreamHub; }
+
+	/** Starts a live stream of the specified channel, on a connection from the media pool.
+	Returns the stream object, which may be used to stop the stream; the media packets are delivered to aOnData. */
+	std::shared_ptr<LiveStream> startLiveStream(
+		int aChannel,
+		LiveStream::StreamType aStreamType,
+		LiveStream::DataCallback aOnData,
+		LiveStream::StartCallback aOnStarted
+	);
+
+	/** Starts a live stream of the specified channel that switches between the main and the extra stream to fit the
+	connection (see AdaptiveStream). Returns the stream object, which may be used to stop the stream. */
+	std::shared_ptr<AdaptiveStream> startAdaptiveStream(
+		int aChannel,
+		const AdaptiveStream::Options & aOptions,
+		AdaptiveStream::FrameCallback aOnFrame,
+		AdaptiveStream::StatusCallback aOnStatus
+	);
+
+
+	// Completion-token (asio-style) variants of the above.
+	// These work with any ASIO completion token, such as a plain callback, asio::use_future or asio::use_awaitable
+	// (to co_await the result in a C++20 coroutine). See also whenAll() in WhenAll.hpp for concurrent fan-out.
+
+	/** Starts connecting and logging into the specified hostname + port.
+	The completion signature is void(std::error_code). */
+	template <typename CompletionToken>
+	auto asyncConnectAndLogin(
+		const std::string & aHostName,
+		uint16_t aPort,
+		const std::string & aUserName,
+		const std::string & aPassword,
+		CompletionToken && aToken
+	)
+	{
+		return asio::async_initiate<CompletionToken, void(std::error_code)>(
+			[self = shared_from_this()](
+				auto aHandler,
+				const std::string & aHostName,
+				uint16_t aPort,
+				const std::string & aUserName,
+				const std::string & aPassword
+			)
+			{
+				// connectAndLogin() needs a copyable callback, share the (possibly move-only) handler.
+				// This happens once per connection, so the single allocation doesn't matter.
+				auto handler = std::make_shared<decltype(aHandler)>(std::move(aHandler));
+				self->connectAndLogin(aHostName, aPort, aUserName, aPassword,
+					[handler](const std::error_code & aError)
+					{
+						dispatchCompletion(std::move(*handler), aError);
+					}
+				);
+			},
+			aToken, aHostName, aPort, aUserName, aPassword
+		);
+	}
+
+	/** Asynchronously queries the channel names.
+	The completion signature is void(std::error_code, std::vector<std::string>). */
+	template <typename CompletionToken>
+	auto asyncGetChannelNames(CompletionToken && aToken)
+	{
+		return mMainConnection->asyncGetChannelNames(std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously queries the specified SysInfo from the device.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetSysInfo(const std::string & aInfoName, CompletionToken && aToken)
+	{
+		return mMainConnection->asyncGetSysInfo(aInfoName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously queries the specified Ability from the device.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetAbility(const std::string & aAbilityName, CompletionToken && aToken)
+	{
+		return mMainConnection->asyncGetAbility(aAbilityName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously queries the specified device config.
+	The completion signature is void(std::error_code, nlohmann::json). */
+	template <typename CompletionToken>
+	auto asyncGetConfig(const std::string & aConfigName, CompletionToken && aToken)
+	{
+		return mMainConnection->asyncGetConfig(aConfigName, std::forward<CompletionToken>(aToken));
+	}
+
+	/** Asynchronously captures a picture from the specified channel.
+	The completion signature is void(std::error_code, BufferSlice). */
+	template <typename CompletionToken>
+	auto asyncCapturePicture(int aChannel, CompletionToken && aToken)
+	{
+		return mMainConnection->asyncCapturePicture(aChannel, std::forward<CompletionToken>(aToken));
+	}
+
 
 private:
 
 	/** The main TCP connection to the device. */
 	std::shared_ptr<Connection> mMainConnection;
 
+	/** The PTZ controller, sending its commands over mMainConnection. */
+	std::shared_ptr<PtzController> mPtz;
+
+	/** The clock monitor, querying and setting the time over mMainConnection. */
+	std::shared_ptr<DeviceClock> mClock;
+
+	/** The media sub-connections to the device. */
+	std::shared_ptr<MediaConnectionPool> mMediaPool;
+
+	/** The latest I-frames of the streams in mStreamHub, for the snapshots. */
+	std::shared_ptr<KeyFrameCache> mKeyFrameCache;
+
+	/** The shared live streams, on connections from mMediaPool. */
+	std::shared_ptr<StreamHub> mStreamHub;
+
 
 	Recorder();
+
+	/** Sends the top-level sections of aNewConfig that differ from aCurrent, then calls the callback. */
+	void sendChangedConfigSections(
+		const std::string & aConfigName,
+		const nlohmann::json & aCurrent,
+		const nlohmann::json & aNewConfig,
+		ConfigUpdateCallback aOnFinish
+	);
 };
 
 }  // namespace NetSurveillancePp
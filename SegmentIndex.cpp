@@ -0,0 +1,225 @@
+#include "SegmentIndex.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include "MemoryMappedFile.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** The magic identifying the index files (and their format version). */
+static const char INDEX_MAGIC[8] = {'N', 'S', 'P', 'P', 'S', 'I', 'X', '1'};
+
+/** The size of the index file header; the entries start right after it. */
+static const size_t INDEX_HEADER_SIZE = 16;
+
+/** The offset of the entry size in the index file header. */
+static const size_t HEADER_OFS_ENTRY_SIZE = 8;
+
+
+
+
+
+/** The on-disk format of a single entry. */
+struct RawEntry
+{
+	int64_t mTimeMs;
+	int64_t mDeviceTimeMs;
+	uint64_t mOffset;
+};
+
+static_assert(sizeof(RawEntry) == 24, "The index entry layout must not change");
+
+
+
+
+
+SegmentIndex::SegmentIndex():
+	mNumEntries(0)
+{
+}
+
+
+
+
+
+std::shared_ptr<SegmentIndex> SegmentIndex::open(const std::string & aSegmentFileName, std::error_code & aError)
+{
+	std::shared_ptr<SegmentIndex> res(new SegmentIndex);
+	res->mSegment = MemoryMappedFile::open(aSegmentFileName, aError);
+	if (res->mSegment == nullptr)
+	{
+		return nullptr;
+	}
+	res->mIndex = MemoryMappedFile::open(indexFileName(aSegmentFileName), aError);
+	if (res->mIndex == nullptr)
+	{
+		return nullptr;
+	}
+
+	// Validate the header:
+	auto data = res->mIndex->data();
+	uint32_t entrySize = 0;
+	if (res->mIndex->size() >= INDEX_HEADER_SIZE)
+	{
+		std::memcpy(&entrySize, data + HEADER_OFS_ENTRY_SIZE, sizeof(entrySize));
+	}
+	if (
+		(res->mIndex->size() < INDEX_HEADER_SIZE) ||
+		(std::memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) ||
+		(entrySize != sizeof(RawEntry))
+	)
+	{
+		aError = std::make_error_code(std::errc::invalid_argument);
+		return nullptr;
+	}
+	res->mNumEntries = (res->mIndex->size() - INDEX_HEADER_SIZE) / sizeof(RawEntry);
+
+	// Ignore the entries pointing past the end of the segment (the segment write was interrupted):
+	while ((res->mNumEntries > 0) && (res->entry(res->mNumEntries - 1).mOffset >= res->mSegment->size()))
+	{
+		res->mNumEntries -= 1;
+	}
+	aError.clear();
+	return res;
+}
+
+
+
+
+
+std::string SegmentIndex::indexFileName(const std::string & aSegmentFileName)
+{
+	return aSegmentFileName + ".idx";
+}
+
+
+
+
+
+void SegmentIndex::appendHeader(std::string & aOut)
+{
+	char header[INDEX_HEADER_SIZE] = {};
+	uint32_t entrySize = sizeof(RawEntry);
+	std::memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	std::memcpy(header + HEADER_OFS_ENTRY_SIZE, &entrySize, sizeof(entrySize));
+	aOut.append(header, sizeof(header));
+}
+
+
+
+
+
+void SegmentIndex::appendEntry(const Entry & aEntry, std::string & aOut)
+{
+	RawEntry raw;
+	raw.mTimeMs = aEntry.mTime.count();
+	raw.mDeviceTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(aEntry.mDeviceTime.time_since_epoch()).count();
+	raw.mOffset = aEntry.mOffset;
+	aOut.append(reinterpret_cast<const char *>(&raw), sizeof(raw));
+}
+
+
+
+
+
+SegmentIndex::Entry SegmentIndex::entry(size_t aIndex) const
+{
+	RawEntry raw;
+	std::memcpy(&raw, mIndex->data() + INDEX_HEADER_SIZE + aIndex * sizeof(RawEntry), sizeof(raw));
+	return
+	{
+		std::chrono::milliseconds(raw.mTimeMs),
+		SystemClock::time_point(std::chrono::duration_cast<SystemClock::duration>(std::chrono::milliseconds(raw.mDeviceTimeMs))),
+		raw.mOffset
+	};
+}
+
+
+
+
+
+bool SegmentIndex::findKeyFrame(std::chrono::milliseconds aTime, size_t & aIndex) const
+{
+	if (mNumEntries == 0)
+	{
+		return false;
+	}
+	aIndex = findLastAtOrBefore(aTime.count(), offsetof(RawEntry, mTimeMs));
+	return true;
+}
+
+
+
+
+
+bool SegmentIndex::findKeyFrameByDeviceTime(SystemClock::time_point aDeviceTime, size_t & aIndex) const
+{
+	if (mNumEntries == 0)
+	{
+		return false;
+	}
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(aDeviceTime.time_since_epoch()).count();
+	aIndex = findLastAtOrBefore(ms, offsetof(RawEntry, mDeviceTimeMs));
+	return true;
+}
+
+
+
+
+
+size_t SegmentIndex::initSegmentSize() const
+{
+	return (mNumEntries > 0) ? static_cast<size_t>(entry(0).mOffset) : mSegment->size();
+}
+
+
+
+
+
+size_t SegmentIndex::fragmentSize(size_t aIndex) const
+{
+	auto start = entry(aIndex).mOffset;
+	auto end = (aIndex + 1 < mNumEntries) ? entry(aIndex + 1).mOffset : mSegment->size();
+	return static_cast<size_t>(end - start);
+}
+
+
+
+
+
+size_t SegmentIndex::findLastAtOrBefore(int64_t aKey, size_t aKeyOffset) const
+{
+	// Binary search for the first entry after aKey; the result is the one before it:
+	auto records = mIndex->data() + INDEX_HEADER_SIZE + aKeyOffset;
+	size_t lo = 0, hi = mNumEntries;
+	while (lo < hi)
+	{
+		auto mid = lo + (hi - lo) / 2;
+		int64_t key;
+		std::memcpy(&key, records + mid * sizeof(RawEntry), sizeof(key));
+		if (key <= aKey)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return (lo > 0) ? lo - 1 : 0;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
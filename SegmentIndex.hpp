@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class MemoryMappedFile;
+
+
+
+
+
+/** The keyframe index of a recorded segment file, kept in a sidecar file next to it ("<segment>.idx").
+The index has a fixed-size binary entry (in the host byte order) for each fragment written by SegmentRecorder; each
+fragment starts with an I-frame, so the entries map the keyframe timestamps to their byte offsets in the segment.
+The reader maps both the segment and the index into the memory; looking up the keyframe for a timestamp is a binary
+search over the entries, without reading or scanning the segment. */
+class SegmentIndex
+{
+public:
+
+	using SystemClock = std::chrono::system_clock;
+
+	/** A single index entry, one per keyframe. */
+	struct Entry
+	{
+		/** The time of the keyframe, from the start of the segment. */
+		std::chrono::milliseconds mTime;
+
+		/** The device wall-clock time of the keyframe (see DeviceTime). */
+		SystemClock::time_point mDeviceTime;
+
+		/** The byte offset of the keyframe's fragment (moof) in the segment file. */
+		uint64_t mOffset;
+	};
+
+
+	/** Maps the segment file and its index into the memory.
+	Returns nullptr and sets aError on failure; a truncated last entry (from an interrupted write) is ignored. */
+	static std::shared_ptr<SegmentIndex> open(const std::string & aSegmentFileName, std::error_code & aError);
+
+	/** Returns the name of the index file for the specified segment file. */
+	static std::string indexFileName(const std::string & aSegmentFileName);
+
+	/** Appends the index file header to aOut. */
+	static void appendHeader(std::string & aOut);
+
+	/** Appends the on-disk form of the entry to aOut. */
+	static void appendEntry(const Entry & aEntry, std::string & aOut);
+
+	/** Returns the number of entries (keyframes). */
+	size_t size() const { return mNumEntries; }
+
+	/** Returns the entry at the specified index. */
+	Entry entry(size_t aIndex) const;
+
+	/** Finds the last keyframe at or before the specified time (from the segment start), in O(log n).
+	Returns the first keyframe if aTime precedes it. Returns false if there are no keyframes. */
+	bool findKeyFrame(std::chrono::milliseconds aTime, size_t & aIndex) const;
+
+	/** Finds the last keyframe at or before the specified device time, in O(log n).
+	Assumes the device time doesn't go backwards within the segment. Returns false if there are no keyframes. */
+	bool findKeyFrameByDeviceTime(SystemClock::time_point aDeviceTime, size_t & aIndex) const;
+
+	/** Returns the mapped segment file. */
+	const MemoryMappedFile & segment() const { return *mSegment; }
+
+	/** Returns the size of the init segment (ftyp + moov) at the start of the segment file. */
+	size_t initSegmentSize() const;
+
+	/** Returns the size of the fragment of the specified keyframe (up to the next keyframe, or the end of file). */
+	size_t fragmentSize(size_t aIndex) const;
+
+
+protected:
+
+	std::shared_ptr<MemoryMappedFile> mSegment;
+
+	std::shared_ptr<MemoryMappedFile> mIndex;
+
+	/** The number of complete, valid entries in mIndex. */
+	size_t mNumEntries;
+
+
+	SegmentIndex();
+
+	/** Returns the index of the last entry whose key is at or before aKey (the first entry if none is).
+	aKeyOffset is the offset of the key field within the on-disk entry. */
+	size_t findLastAtOrBefore(int64_t aKey, size_t aKeyOffset) const;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
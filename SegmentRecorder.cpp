@@ -0,0 +1,384 @@
+#include "SegmentRecorder.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include "DeviceTime.hpp"
+#include "SegmentIndex.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+/** The size of the private write buffer of the index files; the index records are small and few, there's no point
+in occupying a (large) buffer of the shared DiskIo pool with them. */
+static const size_t IndexBufferSize = 64 * 1024;
+
+
+
+
+
+SegmentRecorder::SegmentRecorder(const Options & aOptions, SegmentCallback aOnSegment):
+	mOptions(aOptions),
+	mOnSegment(std::move(aOnSegment)),
+	mFileOffset(0),
+	mNextDts(0),
+	mSegmentStartDts(0),
+	mFrameDuration(Fmp4Muxer::Timescale / 25),
+	mAnchorDts(0),
+	mHasAnchor(false)
+{
+}
+
+
+
+
+
+std::shared_ptr<SegmentRecorder> SegmentRecorder::create(const Options & aOptions, SegmentCallback aOnSegment)
+{
+	return std::shared_ptr<SegmentRecorder>(new SegmentRecorder(aOptions, std::move(aOnSegment)));
+}
+
+
+
+
+
+SegmentRecorder::~SegmentRecorder()
+{
+	close();
+}
+
+
+
+
+
+void SegmentRecorder::push(const MediaFrame & aFrame)
+{
+	std::vector<Event> events;
+	{
+		LockGuard lg(mMtx);
+		switch (aFrame.mKind)
+		{
+			case MediaFrame::Kind::IFrame:
+			{
+				flushGop(&aFrame, events);
+				bool shouldRotate = (
+					(mFile == nullptr) ||
+					!mMuxer.hasSameConfig(aFrame) ||
+					(mNextDts - mSegmentStartDts >= static_cast<uint64_t>(mOptions.mSegmentDuration.count()) * Fmp4Muxer::Timescale)
+				);
+				if (shouldRotate)
+				{
+					closeSegment();
+					if (!openSegment(aFrame, events))
+					{
+						// Wait for an I-frame with the codec parameters
+						break;
+					}
+				}
+				if (aFrame.mFps > 0)
+				{
+					mFrameDuration = Fmp4Muxer::Timescale / aFrame.mFps;
+				}
+				if (!mHasAnchor && (aFrame.mDeviceTime != SystemClock::time_point()))
+				{
+					mAnchorDeviceTime = aFrame.mDeviceTime;
+					mAnchorDts = mNextDts;
+					mHasAnchor = true;
+				}
+				mGop.push_back(aFrame);
+				break;
+			}
+			case MediaFrame::Kind::PFrame:
+			{
+				if (!mGop.empty())
+				{
+					mGop.push_back(aFrame);
+				}
+				break;
+			}
+			case MediaFrame::Kind::Audio:
+			case MediaFrame::Kind::Info:
+			{
+				break;
+			}
+		}
+	}
+	report(events);
+}
+
+
+
+
+
+void SegmentRecorder::close()
+{
+	std::vector<Event> events;
+	{
+		LockGuard lg(mMtx);
+		flushGop(nullptr, events);
+		closeSegment();
+
+		// The next push() may come after a long pause, align to the device time anew:
+		mHasAnchor = false;
+	}
+	report(events);
+}
+
+
+
+
+
+void SegmentRecorder::flushGop(const MediaFrame * aNextIFrame, std::vector<Event> & aEvents)
+{
+	if (mGop.empty())
+	{
+		return;
+	}
+	if (mFile == nullptr)
+	{
+		mGop.clear();
+		return;
+	}
+
+	// Assign the durations, normally from the frame rate; if the device time says otherwise, follow the device time:
+	auto numFrames = static_cast<uint64_t>(mGop.size());
+	auto end = mNextDts + numFrames * mFrameDuration;
+	if (mHasAnchor && (aNextIFrame != nullptr) && (aNextIFrame->mDeviceTime != SystemClock::time_point()))
+	{
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(aNextIFrame->mDeviceTime - mAnchorDeviceTime);
+		auto target = static_cast<int64_t>(mAnchorDts) + elapsed.count() * static_cast<int64_t>(Fmp4Muxer::Timescale) / 1000;
+		if (target < static_cast<int64_t>(mNextDts + numFrames))
+		{
+			// The device clock went backwards, re-align to it from now on:
+			mAnchorDeviceTime = aNextIFrame->mDeviceTime;
+			mAnchorDts = end;
+		}
+		else if (std::abs(target - static_cast<int64_t>(end)) > static_cast<int64_t>(Fmp4Muxer::Timescale))
+		{
+			// Correct by at most halving or doubling the GOP's frame durations, so that a gap in the device time doesn't
+			// produce overlong frames; the rest of the difference is corrected by the following GOPs:
+			auto nominal = static_cast<int64_t>(end - mNextDts);
+			auto minEnd = static_cast<int64_t>(mNextDts) + nominal / 2;
+			auto maxEnd = static_cast<int64_t>(end) + nominal;
+			end = static_cast<uint64_t>(std::min(std::max(target, minEnd), maxEnd));
+		}
+	}
+	auto duration = static_cast<uint32_t>((end - mNextDts) / numFrames);
+	mSamples.clear();
+	for (const auto & frame: mGop)
+	{
+		mSamples.push_back({frame.mData, duration, (frame.mKind == MediaFrame::Kind::IFrame)});
+	}
+	mSamples.back().mDuration += static_cast<uint32_t>((end - mNextDts) % numFrames);
+
+	// Index the fragment's keyframe, once the fragment is written:
+	SegmentIndex::Entry indexEntry
+	{
+		std::chrono::milliseconds((mNextDts - mSegmentStartDts) * 1000 / Fmp4Muxer::Timescale),
+		mGop.front().mDeviceTime,
+		mFileOffset
+	};
+	mMuxer.writeFragment(mSamples, mNextDts - mSegmentStartDts, mOutput);
+	mSamples.clear();
+	mGop.clear();
+	mNextDts = end;
+	if (writeOutput(aEvents) && (mIndexFile != nullptr))
+	{
+		mIndexData.clear();
+		SegmentIndex::appendEntry(indexEntry, mIndexData);
+		writeIndex(aEvents);
+	}
+}
+
+
+
+
+
+bool SegmentRecorder::openSegment(const MediaFrame & aIFrame, std::vector<Event> & aEvents)
+{
+	if (!mMuxer.configure(aIFrame))
+	{
+		return false;
+	}
+
+	// "YYYY-MM-DD HH:MM:SS" -> "YYYYMMDD-HHMMSS":
+	auto time = (aIFrame.mDeviceTime != SystemClock::time_point()) ? aIFrame.mDeviceTime : SystemClock::now();
+	std::string timeStr;
+	for (auto c: DeviceTime::format(time))
+	{
+		if (c == ' ')
+		{
+			timeStr.push_back('-');
+		}
+		else if ((c != '-') && (c != ':'))
+		{
+			timeStr.push_back(c);
+		}
+	}
+	mFileName = mOptions.mDirectory + "/" + mOptions.mFilePrefix + timeStr + ".mp4";
+
+	std::error_code err;
+	mFile = AsyncFileSink::create(mFileName, mOptions.mFileOptions, err);
+	if (mFile == nullptr)
+	{
+		aEvents.push_back({err, mFileName});
+		return false;
+	}
+	mFileOffset = 0;
+	mSegmentStartDts = mNextDts;
+	mMuxer.writeInitSegment(mOutput);
+	if (!writeOutput(aEvents))
+	{
+		return false;
+	}
+
+	// The index is optional, the segment is recorded even if the index can't be written:
+	if (mOptions.mShouldWriteIndex)
+	{
+		auto indexFileName = SegmentIndex::indexFileName(mFileName);
+		AsyncFileSink::Options indexOptions;
+		indexOptions.mPrivateBufferSize = IndexBufferSize;
+		mIndexFile = AsyncFileSink::create(indexFileName, indexOptions, err);
+		if (mIndexFile == nullptr)
+		{
+			aEvents.push_back({err, indexFileName});
+		}
+		else
+		{
+			mIndexData.clear();
+			SegmentIndex::appendHeader(mIndexData);
+			writeIndex(aEvents);
+		}
+	}
+	return true;
+}
+
+
+
+
+
+void SegmentRecorder::closeSegment()
+{
+	if (mFile == nullptr)
+	{
+		return;
+	}
+
+	// The segment is reported once all its data is on the disk; the index only if it fails:
+	auto onSegment = mOnSegment;
+	auto fileName = mFileName;
+	mFile->close(
+		[onSegment, fileName](const std::error_code & aError, uint64_t aSize)
+		{
+			if (onSegment)
+			{
+				onSegment(aError, fileName);
+			}
+		}
+	);
+	mFile.reset();
+	if (mIndexFile != nullptr)
+	{
+		auto indexFileName = SegmentIndex::indexFileName(mFileName);
+		mIndexFile->close(
+			[onSegment, indexFileName](const std::error_code & aError, uint64_t aSize)
+			{
+				if (aError && onSegment)
+				{
+					onSegment(aError, indexFileName);
+				}
+			}
+		);
+		mIndexFile.reset();
+	}
+}
+
+
+
+
+
+void SegmentRecorder::failSegment(const std::error_code & aError, std::vector<Event> & aEvents)
+{
+	mFile->close(nullptr);
+	mFile.reset();
+	if (mIndexFile != nullptr)
+	{
+		mIndexFile->close(nullptr);
+		mIndexFile.reset();
+	}
+	mGop.clear();
+	aEvents.push_back({aError, mFileName});
+}
+
+
+
+
+
+bool SegmentRecorder::writeOutput(std::vector<Event> & aEvents)
+{
+	std::error_code err;
+	auto size = mOutput.size();
+	for (const auto & piece: mOutput.mPieces)
+	{
+		err = mFile->write(mOutput.pieceData(piece), piece.mSize);
+		if (err)
+		{
+			break;
+		}
+	}
+	mOutput.clear();
+	if (err)
+	{
+		failSegment(err, aEvents);
+		return false;
+	}
+	mFileOffset += size;
+	return true;
+}
+
+
+
+
+
+void SegmentRecorder::writeIndex(std::vector<Event> & aEvents)
+{
+	auto err = mIndexFile->write(mIndexData.data(), mIndexData.size());
+	if (err)
+	{
+		// Stop indexing this segment, but keep recording it:
+		mIndexFile->close(nullptr);
+		mIndexFile.reset();
+		aEvents.push_back({err, SegmentIndex::indexFileName(mFileName)});
+	}
+}
+
+
+
+
+
+void SegmentRecorder::report(const std::vector<Event> & aEvents)
+{
+	if (!mOnSegment)
+	{
+		return;
+	}
+	for (const auto & ev: aEvents)
+	{
+		mOnSegment(ev.mError, ev.mFileName);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
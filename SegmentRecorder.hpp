@@ -0,0 +1,172 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "AsyncFileSink.hpp"
+#include "Fmp4Muxer.hpp"
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Records the video frames of a single live stream into time-rotated fragmented MP4 files.
+Each segment file is self-contained (init segment + one fragment per GOP) and playable on its own. A new segment is
+started at the first I-frame after the segment duration elapses, or when the stream's codec parameters change.
+The frame timestamps are generated from the frame rate in the I-frame headers, and re-aligned to the device time in
+the I-frame headers when they drift apart by more than a second (dropped frames, a wrong frame rate).
+The files are written through AsyncFileSink, so the disk writes never block the thread pushing the frames; if the
+disk doesn't keep up, the segment fails (and a new one is started at the next I-frame) rather than stalling the stream.
+The audio frames are not recorded.
+Unless disabled, a keyframe index is written next to each segment (see SegmentIndex), for seeking without scanning.
+Thread-safe; typically fed from LiveStream::monitorFrames(). */
+class SegmentRecorder
+{
+public:
+
+	using SystemClock = std::chrono::system_clock;
+
+	/** The tunables of the recorder. */
+	struct Options
+	{
+		/** The directory where the segment files are created. */
+		std::string mDirectory = ".";
+
+		/** The prefix of the segment file names; the file name is the prefix followed by the device time of the
+		segment's first frame ("YYYYMMDD-HHMMSS.mp4"). */
+		std::string mFilePrefix;
+
+		/** The minimum duration of a single segment. */
+		std::chrono::seconds mSegmentDuration = std::chrono::seconds(60);
+
+		/** If true, a keyframe index sidecar file is written for each segment. */
+		bool mShouldWriteIndex = true;
+
+		/** The options of the segment files, such as direct I/O (the index files always use small private buffers). */
+		AsyncFileSink::Options mFileOptions;
+	};
+
+	/** The callback called whenever a segment file is finished (all its data written and the file closed), or fails to
+	be written. On error, the recorder starts a new segment at the next I-frame. A failure to write the index is reported
+	with the index file name; the segment continues to be recorded, without the index.
+	May be called from the DiskIo thread. */
+	using SegmentCallback = std::function<void(const std::error_code & aError, const std::string & aFileName)>;
+
+
+	/** Creates a new recorder; the first segment is started with the first I-frame pushed. */
+	static std::shared_ptr<SegmentRecorder> create(const Options & aOptions, SegmentCallback aOnSegment);
+
+	~SegmentRecorder();
+
+	/** Records the frame. The frames before the first I-frame, and the non-video frames, are ignored. */
+	void push(const MediaFrame & aFrame);
+
+	/** Writes out the pending frames and closes the current segment. A subsequent push() starts a new segment. */
+	void close();
+
+
+protected:
+
+	/** A finished segment, to be reported once mMtx is unlocked. */
+	struct Event
+	{
+		std::error_code mError;
+		std::string mFileName;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	std::mutex mMtx;
+
+	const Options mOptions;
+
+	SegmentCallback mOnSegment;
+
+	Fmp4Muxer mMuxer;
+
+	/** The current segment file; nullptr if no segment is open. */
+	std::shared_ptr<AsyncFileSink> mFile;
+
+	std::string mFileName;
+
+	/** The current segment's index file; nullptr if not being written. */
+	std::shared_ptr<AsyncFileSink> mIndexFile;
+
+	/** The number of bytes written into the current segment so far. */
+	uint64_t mFileOffset;
+
+	/** The index data to be written; reused between the GOPs. */
+	std::string mIndexData;
+
+	/** The frames of the GOP being collected, written out once the next I-frame arrives. */
+	std::vector<MediaFrame> mGop;
+
+	/** The decode time of the first frame of mGop (in Fmp4Muxer::Timescale ticks, since the recording start). */
+	uint64_t mNextDts;
+
+	/** The decode time of the current segment's first frame. */
+	uint64_t mSegmentStartDts;
+
+	/** The nominal frame duration, from the last I-frame's frame rate. */
+	uint32_t mFrameDuration;
+
+	/** The device time and the decode time of the frame to which the timestamps are aligned.
+	Cleared by close(), so that a recording resumed after a pause doesn't stretch the frames over the pause. */
+	SystemClock::time_point mAnchorDeviceTime;
+	uint64_t mAnchorDts;
+	bool mHasAnchor;
+
+	/** The generated output; reused between the GOPs, to avoid reallocating. */
+	Fmp4Muxer::Output mOutput;
+
+	/** The samples of the GOP being written; reused between the GOPs. */
+	std::vector<Fmp4Muxer::Sample> mSamples;
+
+
+	SegmentRecorder(const Options & aOptions, SegmentCallback aOnSegment);
+
+	/** Writes out mGop as a single fragment. aNextIFrame is the I-frame following the GOP, used to align the
+	timestamps to the device time; nullptr if not known. Assumes mMtx is locked. */
+	void flushGop(const MediaFrame * aNextIFrame, std::vector<Event> & aEvents);
+
+	/** Starts a new segment file for the I-frame. Returns false if the frame lacks the codec parameters.
+	Assumes mMtx is locked. */
+	bool openSegment(const MediaFrame & aIFrame, std::vector<Event> & aEvents);
+
+	/** Closes the current segment file, if any; the segment is reported once its data is written.
+	Assumes mMtx is locked. */
+	void closeSegment();
+
+	/** Abandons the current segment after a write error: closes the files without reporting them, and reports the error.
+	Assumes mMtx is locked. */
+	void failSegment(const std::error_code & aError, std::vector<Event> & aEvents);
+
+	/** Queues mOutput to be written into the current segment file; clears mOutput.
+	On error, closes the segment, reports the error and returns false. Assumes mMtx is locked. */
+	bool writeOutput(std::vector<Event> & aEvents);
+
+	/** Writes mIndexData into the current index file. On error, stops indexing the segment and reports the error.
+	Assumes mMtx is locked. */
+	void writeIndex(std::vector<Event> & aEvents);
+
+	/** Calls the segment callback for each event. Must be called with mMtx unlocked. */
+	void report(const std::vector<Event> & aEvents);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
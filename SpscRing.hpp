@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** A lock-free, wait-free ring buffer for a single producer thread and a single consumer thread.
+Neither side ever blocks: push() accepts only as many items as there's room for, pop() returns only what's available.
+The capacity is rounded up to a power of two. */
+template <typename T>
+class SpscRing
+{
+	static_assert(std::is_trivially_copyable<T>::value, "SpscRing only supports trivially copyable items");
+
+public:
+
+	explicit SpscRing(size_t aCapacity):
+		mCapacity(roundUpToPowerOfTwo(std::max<size_t>(aCapacity, 2))),
+		mMask(mCapacity - 1),
+		mItems(new T[mCapacity]),
+		mWritePos(0),
+		mReadPos(0)
+	{
+	}
+
+	SpscRing(const SpscRing &) = delete;
+	SpscRing & operator =(const SpscRing &) = delete;
+
+	/** Pushes up to aCount items into the ring. Returns the number of items actually pushed.
+	Must only be called from the producer thread. */
+	size_t push(const T * aItems, size_t aCount)
+	{
+		auto writePos = mWritePos.load(std::memory_order_relaxed);
+		auto readPos = mReadPos.load(std::memory_order_acquire);
+		auto count = std::min(aCount, mCapacity - (writePos - readPos));
+		for (size_t i = 0; i < count; ++i)
+		{
+			mItems[(writePos + i) & mMask] = aItems[i];
+		}
+		mWritePos.store(writePos + count, std::memory_order_release);
+		return count;
+	}
+
+	/** Pops up to aMaxCount items from the ring into aOut. Returns the number of items actually popped.
+	Must only be called from the consumer thread. */
+	size_t pop(T * aOut, size_t aMaxCount)
+	{
+		auto readPos = mReadPos.load(std::memory_order_relaxed);
+		auto writePos = mWritePos.load(std::memory_order_acquire);
+		auto count = std::min(aMaxCount, writePos - readPos);
+		for (size_t i = 0; i < count; ++i)
+		{
+			aOut[i] = mItems[(readPos + i) & mMask];
+		}
+		mReadPos.store(readPos + count, std::memory_order_release);
+		return count;
+	}
+
+	/** Drops up to aMaxCount of the oldest items. Returns the number of items dropped.
+	Must only be called from the consumer thread. */
+	size_t discard(size_t aMaxCount)
+	{
+		auto readPos = mReadPos.load(std::memory_order_relaxed);
+		auto writePos = mWritePos.load(std::memory_order_acquire);
+		auto count = std::min(aMaxCount, writePos - readPos);
+		mReadPos.store(readPos + count, std::memory_order_release);
+		return count;
+	}
+
+	/** Returns the number of items currently in the ring.
+	Exact only when called from the producer or the consumer thread, approximate otherwise. */
+	size_t size() const
+	{
+		return mWritePos.load(std::memory_order_acquire) - mReadPos.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const { return mCapacity; }
+
+
+protected:
+
+	/** The number of items the ring can hold (power of two). */
+	const size_t mCapacity;
+
+	/** Mask to convert the positions to indices into mItems. */
+	const size_t mMask;
+
+	/** The storage for the items. */
+	std::unique_ptr<T[]> mItems;
+
+	/** The total number of items ever pushed. Written only by the producer.
+	Kept on a separate cache line from mReadPos, so that the two threads don't contend. */
+	alignas(64) std::atomic<size_t> mWritePos;
+
+	/** The total number of items ever popped. Written only by the consumer. */
+	alignas(64) std::atomic<size_t> mReadPos;
+
+
+	static size_t roundUpToPowerOfTwo(size_t aValue)
+	{
+		size_t res = 1;
+		while (res < aValue)
+		{
+			res <<= 1;
+		}
+		return res;
+	}
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,449 @@
+#include "StreamHub.hpp"
+
+#include <asio.hpp>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// StreamHub::Subscription:
+
+StreamHub::Subscription::Subscription(const SubscriptionOptions & aOptions):
+	mOptions(aOptions),
+	mNumBytes(0),
+	mIsSkippingToKeyFrame(false),
+	mNumDropped(0)
+{
+}
+
+
+
+
+
+StreamHub::Subscription::Status StreamHub::Subscription::pop(MediaFrame & aFrame, std::chrono::milliseconds aTimeout)
+{
+	std::unique_lock<std::mutex> lock(mMtx);
+	mCV.wait_for(lock, aTimeout,
+		[this]()
+		{
+			return (!mQueue.empty() || mError);
+		}
+	);
+	if (popLocked(aFrame))
+	{
+		return Status::Frame;
+	}
+	return mError ? Status::Disconnected : Status::Timeout;
+}
+
+
+
+
+
+StreamHub::Subscription::Status StreamHub::Subscription::tryPop(MediaFrame & aFrame)
+{
+	LockGuard lg(mMtx);
+	if (popLocked(aFrame))
+	{
+		return Status::Frame;
+	}
+	return mError ? Status::Disconnected : Status::Timeout;
+}
+
+
+
+
+
+std::error_code StreamHub::Subscription::error() const
+{
+	LockGuard lg(mMtx);
+	return mError;
+}
+
+
+
+
+
+uint64_t StreamHub::Subscription::numDropped() const
+{
+	LockGuard lg(mMtx);
+	return mNumDropped;
+}
+
+
+
+
+
+size_t StreamHub::Subscription::numQueued() const
+{
+	LockGuard lg(mMtx);
+	return mQueue.size();
+}
+
+
+
+
+
+bool StreamHub::Subscription::push(const MediaFrame & aFrame)
+{
+	bool isConnected;
+	{
+		LockGuard lg(mMtx);
+		if (mError)
+		{
+			return false;
+		}
+		bool isKeyFrame = (aFrame.mKind == MediaFrame::Kind::IFrame);
+		if (mIsSkippingToKeyFrame)
+		{
+			if (!isKeyFrame)
+			{
+				mNumDropped += 1;
+				return true;
+			}
+			mIsSkippingToKeyFrame = false;
+		}
+
+		auto size = aFrame.mData.blockCapacity();
+		bool isFull = (mQueue.size() >= mOptions.mMaxFrames) || (mNumBytes + size > mOptions.mMaxBytes);
+		if (isFull)
+		{
+			switch (mOptions.mPolicy)
+			{
+				case Policy::DropToKeyFrame:
+				{
+					mNumDropped += mQueue.size();
+					mQueue.clear();
+					mNumBytes = 0;
+					if (!isKeyFrame)
+					{
+						mNumDropped += 1;
+						mIsSkippingToKeyFrame = true;
+						return true;
+					}
+					break;
+				}
+				case Policy::Block:
+				{
+					if (mNumBytes + size <= mOptions.mHardMaxBytes)
+					{
+						break;
+					}
+					// Too far behind, give up on the consumer:
+					mError = std::make_error_code(std::errc::no_buffer_space);
+					break;
+				}
+				case Policy::Disconnect:
+				{
+					mError = std::make_error_code(std::errc::no_buffer_space);
+					break;
+				}
+			}
+			if (mError)
+			{
+				mNumDropped += mQueue.size() + 1;
+				mQueue.clear();
+				mNumBytes = 0;
+			}
+		}
+		isConnected = !mError;
+		if (isConnected)
+		{
+			mQueue.push_back(aFrame);
+			mNumBytes += size;
+		}
+	}
+	mCV.notify_one();
+	return isConnected;
+}
+
+
+
+
+
+void StreamHub::Subscription::disconnect(const std::error_code & aError)
+{
+	{
+		LockGuard lg(mMtx);
+		if (mError)
+		{
+			return;
+		}
+		mError = aError;
+		mQueue.clear();
+		mNumBytes = 0;
+	}
+	mCV.notify_all();
+}
+
+
+
+
+
+bool StreamHub::Subscription::popLocked(MediaFrame & aFrame)
+{
+	if (mQueue.empty())
+	{
+		return false;
+	}
+	aFrame = std::move(mQueue.front());
+	mQueue.pop_front();
+	mNumBytes -= aFrame.mData.blockCapacity();
+	return true;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// StreamHub:
+
+StreamHub::StreamHub(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	std::shared_ptr<KeyFrameCache> aKeyFrameCache
+):
+	mMainConnection(std::move(aMainConnection)),
+	mPool(std::move(aPool)),
+	mKeyFrameCache(std::move(aKeyFrameCache))
+{
+}
+
+
+
+
+
+std::shared_ptr<StreamHub> StreamHub::create(
+	std::shared_ptr<Connection> aMainConnection,
+	std::shared_ptr<MediaConnectionPool> aPool,
+	std::shared_ptr<KeyFrameCache> aKeyFrameCache
+)
+{
+	return std::shared_ptr<StreamHub>(new StreamHub(std::move(aMainConnection), std::move(aPool), std::move(aKeyFrameCache)));
+}
+
+
+
+
+
+std::shared_ptr<StreamHub::Subscription> StreamHub::subscribe(
+	int aChannel,
+	LiveStream::StreamType aStreamType,
+	const SubscriptionOptions & aOptions
+)
+{
+	auto subscription = std::make_shared<Subscription>(aOptions);
+	StreamKey key(aChannel, aStreamType);
+	std::shared_ptr<LiveStream> toStart;
+	{
+		LockGuard lg(mMtx);
+		auto itr = mStreams.find(key);
+		if (itr != mStreams.end())
+		{
+			auto subscriptions = std::make_shared<Subscriptions>(*itr->second.mSubscriptions);
+			subscriptions->push_back(subscription);
+			itr->second.mSubscriptions = std::move(subscriptions);
+			return subscription;
+		}
+		toStart = LiveStream::create(mMainConnection, mPool, aChannel, aStreamType);
+		mStreams[key] = {toStart, std::make_shared<const Subscriptions>(1, subscription)};
+	}
+
+	// First subscription to the stream, start it:
+	std::weak_ptr<StreamHub> weakSelf = shared_from_this();
+	std::weak_ptr<LiveStream> weakStream = toStart;
+	toStart->monitorFrames(
+		[weakSelf, key](const MediaFrame & aFrame)
+		{
+			auto self = weakSelf.lock();
+			if (self != nullptr)
+			{
+				self->distribute(key, aFrame);
+			}
+		}
+	);
+	auto onError = [weakSelf, weakStream, key](const std::error_code & aError)
+	{
+		auto self = weakSelf.lock();
+		auto stream = weakStream.lock();
+		if ((self != nullptr) && (stream != nullptr) && aError)
+		{
+			self->onStreamFailed(key, stream, aError);
+		}
+	};
+	toStart->start(
+		[onError](const std::error_code & aError, BufferSlice aData)
+		{
+			// The frames are delivered through monitorFrames(), only the errors are of interest here
+			onError(aError);
+		},
+		onError
+	);
+	return subscription;
+}
+
+
+
+
+
+void StreamHub::unsubscribe(const std::shared_ptr<Subscription> & aSubscription)
+{
+	aSubscription->disconnect(asio::error::operation_aborted);
+	std::vector<std::shared_ptr<LiveStream>> toStop;
+	{
+		LockGuard lg(mMtx);
+		std::vector<StreamKey> keys;
+		for (const auto & stream: mStreams)
+		{
+			keys.push_back(stream.first);
+		}
+		for (const auto & key: keys)
+		{
+			auto stream = pruneLocked(key);
+			if (stream != nullptr)
+			{
+				toStop.push_back(std::move(stream));
+			}
+		}
+	}
+	for (const auto & stream: toStop)
+	{
+		stream->stop();
+	}
+}
+
+
+
+
+
+size_t StreamHub::numStreams() const
+{
+	LockGuard lg(mMtx);
+	return mStreams.size();
+}
+
+
+
+
+
+void StreamHub::distribute(const StreamKey & aKey, const MediaFrame & aFrame)
+{
+	// The frames may be retained by the queues for long, don't let them keep the whole receive blocks alive;
+	// copy once for all the subscriptions:
+	auto frame = aFrame;
+	frame.mData = aFrame.mData.compacted();
+
+	if ((mKeyFrameCache != nullptr) && (frame.mKind == MediaFrame::Kind::IFrame))
+	{
+		mKeyFrameCache->update(aKey.first, aKey.second, frame);
+	}
+	std::shared_ptr<const Subscriptions> subscriptions;
+	{
+		LockGuard lg(mMtx);
+		auto itr = mStreams.find(aKey);
+		if (itr == mStreams.end())
+		{
+			return;
+		}
+		subscriptions = itr->second.mSubscriptions;
+	}
+	bool hasDisconnected = false;
+	for (const auto & subscription: *subscriptions)
+	{
+		if (!subscription->push(frame))
+		{
+			hasDisconnected = true;
+		}
+	}
+	if (!hasDisconnected)
+	{
+		return;
+	}
+	std::shared_ptr<LiveStream> toStop;
+	{
+		LockGuard lg(mMtx);
+		toStop = pruneLocked(aKey);
+	}
+	if (toStop != nullptr)
+	{
+		toStop->stop();
+	}
+}
+
+
+
+
+
+void StreamHub::onStreamFailed(const StreamKey & aKey, const std::shared_ptr<LiveStream> & aLiveStream, const std::error_code & aError)
+{
+	std::shared_ptr<const Subscriptions> subscriptions;
+	{
+		LockGuard lg(mMtx);
+		auto itr = mStreams.find(aKey);
+		if ((itr == mStreams.end()) || (itr->second.mLiveStream != aLiveStream))
+		{
+			// Already replaced or removed
+			return;
+		}
+		subscriptions = itr->second.mSubscriptions;
+		mStreams.erase(itr);
+	}
+	for (const auto & subscription: *subscriptions)
+	{
+		subscription->disconnect(aError);
+	}
+	aLiveStream->stop();
+}
+
+
+
+
+
+std::shared_ptr<LiveStream> StreamHub::pruneLocked(const StreamKey & aKey)
+{
+	auto itr = mStreams.find(aKey);
+	if (itr == mStreams.end())
+	{
+		return nullptr;
+	}
+	auto subscriptions = std::make_shared<Subscriptions>();
+	for (const auto & subscription: *itr->second.mSubscriptions)
+	{
+		if (!subscription->error())
+		{
+			subscriptions->push_back(subscription);
+		}
+	}
+	if (subscriptions->empty())
+	{
+		auto res = std::move(itr->second.mLiveStream);
+		mStreams.erase(itr);
+		return res;
+	}
+	if (subscriptions->size() != itr->second.mSubscriptions->size())
+	{
+		itr->second.mSubscriptions = std::move(subscriptions);
+	}
+	return nullptr;
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "KeyFrameCache.hpp"
+#include "LiveStream.hpp"
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+class MediaConnectionPool;
+
+
+
+
+
+/** Shares a single live stream per channel among any number of local consumers.
+The first subscription to a channel starts its LiveStream, the last unsubscription stops it. The frames are parsed
+once and handed to every subscription; the frames are shared (their data is a reference-counted BufferSlice),
+queueing a frame into a subscription only copies the references.
+Each subscription has its own bounded queue, read by the consumer at its own pace (typically from its own thread).
+The frames are queued from the stream's receive path without ever waiting on a consumer, so a slow consumer never
+stalls the others or the socket read; what happens when its queue is full is decided by its policy.
+The I-frames of all the streams are also stored into the KeyFrameCache, if given. */
+class StreamHub:
+	public std::enable_shared_from_this<StreamHub>
+{
+public:
+
+	/** What happens when a subscription's queue is full. */
+	enum class Policy
+	{
+		/** Drop the queued frames, then skip the incoming frames until the next I-frame, so that the consumer resumes
+		with a decodable frame. For live viewing and analysis. */
+		DropToKeyFrame,
+
+		/** Don't drop anything: the queue bounds become soft and the consumer may fall behind, up to mHardMaxBytes,
+		beyond which the subscription is disconnected. The receive path can't wait for the consumer without
+		stalling the other consumers, so this is the nearest thing to blocking. For recording. */
+		Block,
+
+		/** Disconnect the subscription. For consumers that can't tolerate a gap and would rather restart. */
+		Disconnect,
+	};
+
+	/** The tunables of a single subscription. */
+	struct SubscriptionOptions
+	{
+		Policy mPolicy = Policy::DropToKeyFrame;
+
+		/** The queue bounds; the queue is full once either is reached.
+		The bytes are counted as the capacity of the buffers held by the queued frames. */
+		size_t mMaxFrames = 256;
+		size_t mMaxBytes = 8 * 1024 * 1024;
+
+		/** The absolute limit of the queued bytes for the Block policy (counted the same as mMaxBytes). */
+		size_t mHardMaxBytes = 64 * 1024 * 1024;
+	};
+
+
+	/** A single consumer's view of a channel's stream. */
+	class Subscription
+	{
+	public:
+
+		/** The result of pop(). */
+		enum class Status
+		{
+			Frame,         // A frame has been returned
+			Timeout,       // No frame arrived within the timeout
+			Disconnected,  // The subscription has been disconnected (see error()); no more frames will arrive
+		};
+
+
+		explicit Subscription(const SubscriptionOptions & aOptions);
+
+		/** Returns the oldest queued frame in aFrame, waiting up to aTimeout for one to arrive. */
+		Status pop(MediaFrame & aFrame, std::chrono::milliseconds aTimeout);
+
+		/** Returns the oldest queued frame in aFrame, without waiting (Timeout if there's none). */
+		Status tryPop(MediaFrame & aFrame);
+
+		/** Returns the reason for the disconnection; empty while connected. */
+		std::error_code error() const;
+
+		/** Returns the number of frames dropped so far, due to the queue being full. */
+		uint64_t numDropped() const;
+
+		/** Returns the number of frames currently queued. */
+		size_t numQueued() const;
+
+
+	protected:
+
+		friend class StreamHub;
+
+		/** The mutex protecting all the member variables against multithreaded access. */
+		mutable std::mutex mMtx;
+
+		/** Signalled when a frame is queued, or the subscription is disconnected. */
+		std::condition_variable mCV;
+
+		const SubscriptionOptions mOptions;
+
+		std::deque<MediaFrame> mQueue;
+
+		/** The total capacity of the buffers held by the frames in mQueue. */
+		size_t mNumBytes;
+
+		/** True while skipping the frames until the next I-frame (DropToKeyFrame policy). */
+		bool mIsSkippingToKeyFrame;
+
+		uint64_t mNumDropped;
+
+		/** The reason for the disconnection; empty while connected. */
+		std::error_code mError;
+
+
+		/** Queues the frame according to the policy. Never waits for the consumer.
+		Returns false if the subscription is (now) disconnected. */
+		bool push(const MediaFrame & aFrame);
+
+		/** Disconnects the subscription with the specified reason, drops the queued frames. */
+		void disconnect(const std::error_code & aError);
+
+		/** Returns the frame into aFrame, if any. Assumes mMtx is locked. */
+		bool popLocked(MediaFrame & aFrame);
+	};
+
+
+	/** Creates a new hub, streaming from the device over the specified main connection and media pool.
+	aKeyFrameCache receives the I-frames of all the streams; nullptr if not needed. */
+	static std::shared_ptr<StreamHub> create(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		std::shared_ptr<KeyFrameCache> aKeyFrameCache
+	);
+
+	/** Subscribes to the specified channel's stream, starting the stream if this is its first subscription.
+	If the stream fails to start, its subscriptions are disconnected with the error. */
+	std::shared_ptr<Subscription> subscribe(
+		int aChannel,
+		LiveStream::StreamType aStreamType,
+		const SubscriptionOptions & aOptions
+	);
+
+	/** Removes the subscription (disconnecting it with asio::error::operation_aborted); stops the stream if this was
+	its last subscription. */
+	void unsubscribe(const std::shared_ptr<Subscription> & aSubscription);
+
+	/** Returns the number of streams currently running. */
+	size_t numStreams() const;
+
+
+protected:
+
+	using StreamKey = std::pair<int, LiveStream::StreamType>;
+	using Subscriptions = std::vector<std::shared_ptr<Subscription>>;
+
+	/** A single shared stream. */
+	struct Stream
+	{
+		std::shared_ptr<LiveStream> mLiveStream;
+
+		/** The subscriptions; replaced as a whole (copy-on-write), so that the frames can be distributed without
+		holding mMtx. */
+		std::shared_ptr<const Subscriptions> mSubscriptions;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	std::shared_ptr<Connection> mMainConnection;
+
+	std::shared_ptr<MediaConnectionPool> mPool;
+
+	/** The cache of the latest I-frames; nullptr if not used. */
+	std::shared_ptr<KeyFrameCache> mKeyFrameCache;
+
+	std::map<StreamKey, Stream> mStreams;
+
+
+	StreamHub(
+		std::shared_ptr<Connection> aMainConnection,
+		std::shared_ptr<MediaConnectionPool> aPool,
+		std::shared_ptr<KeyFrameCache> aKeyFrameCache
+	);
+
+	/** Distributes the frame to the stream's subscriptions (and the I-frames to the cache); removes the subscriptions
+	that got disconnected. */
+	void distribute(const StreamKey & aKey, const MediaFrame & aFrame);
+
+	/** Called when the stream fails to start or is disconnected: disconnects all its subscriptions and removes it. */
+	void onStreamFailed(const StreamKey & aKey, const std::shared_ptr<LiveStream> & aLiveStream, const std::error_code & aError);
+
+	/** Removes the disconnected subscriptions from the stream; stops the stream if none remains.
+	Returns the stream to stop (nullptr if none), to be stopped once mMtx is unlocked. Assumes mMtx is locked. */
+	std::shared_ptr<LiveStream> pruneLocked(const StreamKey & aKey);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,165 @@
+#include "StreamMeter.hpp"
+
+#include <algorithm>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+const int StreamMeter::BitratePeriodMs;
+
+/** The weight of the new bitrate sample in the smoothed value. */
+static const double BITRATE_SMOOTHING = 0.3;
+
+
+
+
+
+StreamMeter::StreamMeter()
+{
+	reset();
+}
+
+
+
+
+
+void StreamMeter::onData(size_t aNumBytes, SteadyClock::time_point aNow)
+{
+	LockGuard lg(mMtx);
+	mNumBytes += aNumBytes;
+	if (mPeriodStart == SteadyClock::time_point())
+	{
+		mPeriodStart = aNow;
+	}
+	mPeriodBytes += aNumBytes;
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(aNow - mPeriodStart).count();
+	if (elapsed >= BitratePeriodMs)
+	{
+		auto sample = static_cast<double>(mPeriodBytes) * 8000 / static_cast<double>(elapsed);
+		mBitrate = (mBitrate > 0) ? (mBitrate + (sample - mBitrate) * BITRATE_SMOOTHING) : sample;
+		mPeriodStart = aNow;
+		mPeriodBytes = 0;
+	}
+}
+
+
+
+
+
+void StreamMeter::onFrame(const MediaFrame & aFrame)
+{
+	if ((aFrame.mKind != MediaFrame::Kind::IFrame) && (aFrame.mKind != MediaFrame::Kind::PFrame))
+	{
+		return;
+	}
+	LockGuard lg(mMtx);
+	mNumFrames += 1;
+	if (mMediaStart == SteadyClock::time_point())
+	{
+		mMediaStart = aFrame.mReceivedAt;
+		mMediaTime = SteadyClock::duration::zero();
+	}
+	else
+	{
+		mMediaTime += mFramePeriod;
+	}
+	if (aFrame.mKind == MediaFrame::Kind::IFrame)
+	{
+		if (aFrame.mFps > 0)
+		{
+			mFramePeriod = std::chrono::duration_cast<SteadyClock::duration>(std::chrono::seconds(1)) / aFrame.mFps;
+		}
+
+		// Use the device time to correct the frame-counted media time (the frame rate may be off), within its
+		// one-second resolution:
+		if (aFrame.mDeviceTime != std::chrono::system_clock::time_point())
+		{
+			if (mFirstDeviceTime == std::chrono::system_clock::time_point())
+			{
+				mFirstDeviceTime = aFrame.mDeviceTime;
+				mFirstDeviceMediaTime = mMediaTime;
+			}
+			else
+			{
+				auto deviceMediaTime = mFirstDeviceMediaTime +
+					std::chrono::duration_cast<SteadyClock::duration>(aFrame.mDeviceTime - mFirstDeviceTime);
+				if (mMediaTime > deviceMediaTime + std::chrono::seconds(1))
+				{
+					// The device clock went backwards (such as when synced by DeviceClock); lowering the media time would
+					// report the step as lateness for good, re-align to the device clock from now on instead and restart
+					// the lateness measurement from this frame:
+					mFirstDeviceTime = aFrame.mDeviceTime;
+					mFirstDeviceMediaTime = mMediaTime;
+					mMediaStart = aFrame.mReceivedAt - mMediaTime;
+				}
+				else if (mMediaTime < deviceMediaTime - std::chrono::seconds(1))
+				{
+					mMediaTime = deviceMediaTime;
+				}
+			}
+		}
+	}
+
+	// Arriving ahead of the pace means the earlier frames were delayed, re-base on this frame:
+	auto lateness = (aFrame.mReceivedAt - mMediaStart) - mMediaTime;
+	if (lateness < SteadyClock::duration::zero())
+	{
+		mMediaStart = aFrame.mReceivedAt - mMediaTime;
+		lateness = SteadyClock::duration::zero();
+	}
+	mLateness = std::chrono::duration_cast<std::chrono::milliseconds>(lateness);
+}
+
+
+
+
+
+StreamMeter::Stats StreamMeter::stats(SteadyClock::time_point aNow) const
+{
+	LockGuard lg(mMtx);
+	auto lateness = mLateness;
+	if (mMediaStart != SteadyClock::time_point())
+	{
+		// If the stream stalls, no frame arrives to update the lateness; the next frame is due one frame period after
+		// the last one, anything past that is lateness as well:
+		auto overdue = (aNow - mMediaStart) - mMediaTime - mFramePeriod;
+		lateness = std::max(lateness, std::chrono::duration_cast<std::chrono::milliseconds>(overdue));
+	}
+	return {mBitrate, lateness, mNumBytes, mNumFrames};
+}
+
+
+
+
+
+void StreamMeter::reset()
+{
+	LockGuard lg(mMtx);
+	mBitrate = 0;
+	mNumBytes = 0;
+	mNumFrames = 0;
+	mPeriodStart = SteadyClock::time_point();
+	mPeriodBytes = 0;
+	mMediaStart = SteadyClock::time_point();
+	mMediaTime = SteadyClock::duration::zero();
+	mFirstDeviceTime = std::chrono::system_clock::time_point();
+	mFirstDeviceMediaTime = SteadyClock::duration::zero();
+	mFramePeriod = std::chrono::duration_cast<SteadyClock::duration>(std::chrono::milliseconds(40));
+	mLateness = std::chrono::milliseconds(0);
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
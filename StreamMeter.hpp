@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include "MediaFrame.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Measures how well a live stream is being delivered: the received bitrate, and the lateness of the frames.
+The lateness is the wall-clock time elapsed since the stream start, less the media time of the received frames
+(advanced by the device time in the I-frame headers, and by the frame period between the I-frames); it stays near
+zero while the connection keeps up, and grows steadily once the stream is produced faster than it is delivered.
+Arriving early (in a burst after a delay) re-bases the measurement, so only the accumulated delay is reported.
+The device clock stepping backwards re-aligns the device time and restarts the measurement, rather than counting
+the step as lateness.
+The lateness keeps growing while no frames arrive at all (a stalled stream), it is aged whenever queried.
+Thread-safe. */
+class StreamMeter
+{
+public:
+
+	using SteadyClock = std::chrono::steady_clock;
+
+	/** The current measurements. */
+	struct Stats
+	{
+		/** The smoothed received bitrate, in bits per second; 0 until the first full measurement period. */
+		double mBitrate;
+
+		/** How much the frames are behind the real-time pace. */
+		std::chrono::milliseconds mLateness;
+
+		/** The totals since the start. */
+		uint64_t mNumBytes;
+		uint64_t mNumFrames;
+	};
+
+
+	StreamMeter();
+
+	/** Counts the received stream data (the whole Monitor_Data payload, including the frame headers). */
+	void onData(size_t aNumBytes, SteadyClock::time_point aNow);
+
+	/** Advances the media time by the video frame. */
+	void onFrame(const MediaFrame & aFrame);
+
+	/** Returns the current measurements.
+	The lateness is at least the time by which the next video frame is overdue, as of aNow. */
+	Stats stats(SteadyClock::time_point aNow = SteadyClock::now()) const;
+
+	/** Restarts the measurements. */
+	void reset();
+
+
+protected:
+
+	/** The period over which each bitrate sample is measured. */
+	static const int BitratePeriodMs = 1000;
+
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	double mBitrate;
+
+	uint64_t mNumBytes;
+	uint64_t mNumFrames;
+
+	/** The start of the current bitrate period, and the bytes received in it. */
+	SteadyClock::time_point mPeriodStart;
+	uint64_t mPeriodBytes;
+
+	/** The wall-clock time corresponding to the media time 0; invalid until the first video frame. */
+	SteadyClock::time_point mMediaStart;
+
+	/** The media time of the last video frame, from mMediaStart. */
+	SteadyClock::duration mMediaTime;
+
+	/** The device time of the first I-frame with a valid time, and the media time at that frame. */
+	std::chrono::system_clock::time_point mFirstDeviceTime;
+	SteadyClock::duration mFirstDeviceMediaTime;
+
+	/** The frame period, from the last I-frame's frame rate. */
+	SteadyClock::duration mFramePeriod;
+
+	/** The lateness measured on the last video frame's arrival. */
+	std::chrono::milliseconds mLateness;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,57 @@
+#include "StringInterner.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+
+
+
+
+const std::string * StringInterner::intern(const char * aData, size_t aSize)
+{
+	LockGuard lg(mMtx);
+	mLookup.assign(aData, aSize);
+	auto itr = mStrings.find(mLookup);
+	if (itr == mStrings.end())
+	{
+		itr = mStrings.insert(mLookup).first;
+	}
+	return &*itr;
+}
+
+
+
+
+
+const std::string * StringInterner::find(const std::string & aValue) const
+{
+	LockGuard lg(mMtx);
+	auto itr = mStrings.find(aValue);
+	return (itr == mStrings.end()) ? nullptr : &*itr;
+}
+
+
+
+
+
+size_t StringInterner::size() const
+{
+	LockGuard lg(mMtx);
+	return mStrings.size();
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
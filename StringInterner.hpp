@@ -0,0 +1,54 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Stores a single copy of each distinct string, so that the many repetitions of the same few values (log entry
+types, user names, alarm event types) share their storage and can be compared by pointer.
+The returned pointers stay valid for the lifetime of the interner. Thread-safe. */
+class StringInterner
+{
+public:
+
+	/** Returns the stored copy of the specified string, adding it if not yet present. */
+	const std::string * intern(const char * aData, size_t aSize);
+
+	/** Returns the stored copy of the specified string, adding it if not yet present. */
+	const std::string * intern(const std::string & aValue) { return intern(aValue.data(), aValue.size()); }
+
+	/** Returns the stored copy of the specified string, or nullptr if it has not been interned. */
+	const std::string * find(const std::string & aValue) const;
+
+	/** Returns the number of distinct strings stored. */
+	size_t size() const;
+
+
+protected:
+
+	/** The mutex protecting all the member variables against multithreaded access. */
+	mutable std::mutex mMtx;
+
+	/** The stored strings; the unordered_set nodes are never moved, so the pointers to them stay valid. */
+	std::unordered_set<std::string> mStrings;
+
+	/** The buffer for looking up the raw strings, reused so that the lookups of known strings don't allocate. */
+	std::string mLookup;
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,280 @@
+#include "TalkSession.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "Connection.hpp"
+#include "Root.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+using LockGuard = std::lock_guard<std::recursive_mutex>;
+
+/** The length of the media header preceding the audio data in the talk packets. */
+static const size_t AUDIO_HEADER_LENGTH = 8;
+
+/** The media header start code for audio frames (0x000001FA). */
+static const char AUDIO_START_CODE[] = {0x00, 0x00, 0x01, static_cast<char>(0xfa)};
+
+/** The codec identifier in the media header for G.711 A-law. */
+static const char AUDIO_CODEC_G711A = 0x0e;
+
+/** The sample rate identifier in the media header for 8 kHz. */
+static const char AUDIO_SAMPLE_RATE_8K = 0x02;
+
+
+
+
+
+TalkSession::TalkSession(std::shared_ptr<Connection> aConnection, const Options & aOptions):
+	mConnection(std::move(aConnection)),
+	mOptions(sanitizeOptions(aOptions)),
+	mMaxOutgoingBytes(mOptions.mFrameSize * static_cast<size_t>(mOptions.mMaxOutgoingLatency / mOptions.mFrameDuration)),
+	mOutgoing(mMaxOutgoingBytes),
+	mIncoming(mOptions.mFrameDuration, mOptions.mMinJitterDelay, mOptions.mMaxJitterDelay),
+	mOutgoingPacket(AUDIO_HEADER_LENGTH + mOptions.mFrameSize),
+	mPacingTimer(Root::instance().ioContext()),
+	mIsRunning(false),
+	mIsStopped(false),
+	mNumOutgoingUnderruns(0)
+{
+	// Pre-fill the media header, only the audio data changes between the packets:
+	std::memcpy(mOutgoingPacket.data(), AUDIO_START_CODE, sizeof(AUDIO_START_CODE));
+	mOutgoingPacket[4] = AUDIO_CODEC_G711A;
+	mOutgoingPacket[5] = AUDIO_SAMPLE_RATE_8K;
+	mOutgoingPacket[6] = static_cast<char>(mOptions.mFrameSize & 0xff);
+	mOutgoingPacket[7] = static_cast<char>((mOptions.mFrameSize >> 8) & 0xff);
+}
+
+
+
+
+
+std::shared_ptr<TalkSession> TalkSession::create(std::shared_ptr<Connection> aConnection, const Options & aOptions)
+{
+	return std::shared_ptr<TalkSession>(new TalkSession(std::move(aConnection), aOptions));
+}
+
+
+
+
+
+TalkSession::Options TalkSession::sanitizeOptions(const Options & aOptions)
+{
+	auto res = aOptions;
+	res.mFrameSize = std::min<size_t>(std::max<size_t>(res.mFrameSize, 1), 0xffff);
+	res.mFrameDuration = std::max(res.mFrameDuration, std::chrono::milliseconds(1));
+	res.mMaxOutgoingLatency = std::max(res.mMaxOutgoingLatency, res.mFrameDuration);
+	return res;
+}
+
+
+
+
+
+void TalkSession::start(StartCallback aOnStarted)
+{
+	mIsStopped = false;
+	std::weak_ptr<TalkSession> weakSelf = shared_from_this();
+	mConnection->monitorTalkData(
+		[weakSelf](const std::error_code & aError, BufferSlice aPayload)
+		{
+			auto self = weakSelf.lock();
+			if (self != nullptr)
+			{
+				self->onIncomingData(aPayload);
+			}
+		}
+	);
+	mConnection->startTalk(
+		[self = shared_from_this(), aOnStarted](const std::error_code & aError, const nlohmann::json & aResponse)
+		{
+			self->onStarted(aError, aOnStarted);
+		}
+	);
+}
+
+
+
+
+
+void TalkSession::stop()
+{
+	mIsStopped = true;
+	auto wasRunning = mIsRunning.exchange(false);
+	{
+		// Drop the unsent audio; the pacing timer (the ring's consumer) is serialized by mMtx:
+		LockGuard lg(mMtx);
+		mPacingTimer.cancel();
+		mOutgoing.discard(mOutgoing.size());
+	}
+	mConnection->monitorTalkData(nullptr);
+	mIncoming.clear();
+	if (wasRunning)
+	{
+		mConnection->stopTalk([](const std::error_code & aError, const nlohmann::json & aResponse) {});
+	}
+	// Otherwise either not started at all, or still starting; onStarted() closes the session once accepted
+}
+
+
+
+
+
+size_t TalkSession::writeAudio(const char * aData, size_t aSize)
+{
+	// mOutgoing may be somewhat larger than the limit (rounded up to a power of two), so check the limit explicitly:
+	auto queued = mOutgoing.size();
+	if (queued >= mMaxOutgoingBytes)
+	{
+		return 0;
+	}
+	return mOutgoing.push(aData, std::min(aSize, mMaxOutgoingBytes - queued));
+}
+
+
+
+
+
+BufferSlice TalkSession::readAudio()
+{
+	return mIncoming.pop();
+}
+
+
+
+
+
+JitterBuffer::Stats TalkSession::incomingStats() const
+{
+	return mIncoming.stats();
+}
+
+
+
+
+
+void TalkSession::onStarted(const std::error_code & aError, StartCallback aOnStarted)
+{
+	if (aError)
+	{
+		mConnection->monitorTalkData(nullptr);
+		if (aOnStarted)
+		{
+			aOnStarted(aError);
+		}
+		return;
+	}
+	mIsRunning = true;
+	if (mIsStopped)
+	{
+		// stop() was called while starting; close the session the device has just accepted, unless stop() has
+		// seen it running meanwhile and closed it already:
+		if (mIsRunning.exchange(false))
+		{
+			mConnection->stopTalk([](const std::error_code & aStopError, const nlohmann::json & aResponse) {});
+		}
+		if (aOnStarted)
+		{
+			aOnStarted(asio::error::operation_aborted);
+		}
+		return;
+	}
+	{
+		LockGuard lg(mMtx);
+		mNextSendTime = std::chrono::steady_clock::now();
+		scheduleNextFrame();
+	}
+	if (aOnStarted)
+	{
+		aOnStarted({});
+	}
+}
+
+
+
+
+
+void TalkSession::scheduleNextFrame()
+{
+	LockGuard lg(mMtx);
+
+	// Schedule against absolute deadlines, so that the timer latencies don't accumulate into drift:
+	mNextSendTime += mOptions.mFrameDuration;
+	auto now = std::chrono::steady_clock::now();
+	if (mNextSendTime + mOptions.mMaxOutgoingLatency < now)
+	{
+		// Fell behind too much (system suspended?), don't try to catch up with a burst:
+		mNextSendTime = now;
+	}
+	mPacingTimer.expires_at(mNextSendTime);
+	mPacingTimer.async_wait(
+		[self = shared_from_this()](const std::error_code & aError)
+		{
+			if (!aError)
+			{
+				self->sendNextFrame();
+			}
+		}
+	);
+}
+
+
+
+
+
+void TalkSession::sendNextFrame()
+{
+	if (!mIsRunning)
+	{
+		return;
+	}
+	{
+		LockGuard lg(mMtx);
+		if (mOutgoing.size() >= mOptions.mFrameSize)
+		{
+			mOutgoing.pop(mOutgoingPacket.data() + AUDIO_HEADER_LENGTH, mOptions.mFrameSize);
+			mConnection->sendTalkData(mOutgoingPacket.data(), mOutgoingPacket.size());
+		}
+		else
+		{
+			// Not a full frame yet, the device will play silence; send the data with the next frame
+			mNumOutgoingUnderruns += 1;
+		}
+	}
+	scheduleNextFrame();
+}
+
+
+
+
+
+void TalkSession::onIncomingData(const BufferSlice & aPayload)
+{
+	// Strip the media header, if present:
+	if (
+		(aPayload.size() >= AUDIO_HEADER_LENGTH) &&
+		(std::memcmp(aPayload.data(), AUDIO_START_CODE, sizeof(AUDIO_START_CODE)) == 0)
+	)
+	{
+		mIncoming.push(aPayload.subSlice(AUDIO_HEADER_LENGTH, aPayload.size() - AUDIO_HEADER_LENGTH));
+	}
+	else if (!aPayload.empty())
+	{
+		mIncoming.push(aPayload);
+	}
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+#include <asio.hpp>
+#include "Buffer.hpp"
+#include "JitterBuffer.hpp"
+#include "SpscRing.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+// fwd:
+class Connection;
+
+
+
+
+
+/** A two-way audio (intercom) session with a device.
+The audio is G.711 A-law, 8 kHz mono, in both directions.
+Outgoing: the application's audio capture thread calls writeAudio(), which only copies the data into a lock-free ring
+and never blocks on the socket. An ASIO timer then takes one frame from the ring at each frame period and sends it
+to the device, so that the device receives the audio at real-time pace. If the capture thread gets ahead by more
+than the configured maximum latency, the excess audio is dropped.
+Incoming: the audio frames pushed by the device are stored in an adaptive JitterBuffer, from which the application's
+playback thread reads them with readAudio().
+Use Recorder::startTalk() to create and start an instance. */
+class TalkSession:
+	public std::enable_shared_from_this<TalkSession>
+{
+public:
+
+	/** The callback called once the device accepts (or refuses) the talk session. */
+	using StartCallback = std::function<void(const std::error_code & aError)>;
+
+	/** The tunables of the session. */
+	struct Options
+	{
+		/** The number of audio bytes (= samples) sent in a single packet. */
+		size_t mFrameSize = 320;
+
+		/** The duration of the audio in a single packet (320 samples at 8 kHz = 40 ms). */
+		std::chrono::milliseconds mFrameDuration = std::chrono::milliseconds(40);
+
+		/** The maximum amount of outgoing audio that may wait in the ring before being sent.
+		Audio written beyond this is dropped, so that the outgoing latency stays bounded. */
+		std::chrono::milliseconds mMaxOutgoingLatency = std::chrono::milliseconds(400);
+
+		/** The bounds of the incoming adaptive jitter buffer delay. */
+		std::chrono::milliseconds mMinJitterDelay = std::chrono::milliseconds(40);
+		std::chrono::milliseconds mMaxJitterDelay = std::chrono::milliseconds(400);
+	};
+
+
+	/** Creates a new session on the specified connection; doesn't start it yet. */
+	static std::shared_ptr<TalkSession> create(std::shared_ptr<Connection> aConnection, const Options & aOptions);
+
+	/** Asks the device to start the session. Once the device accepts, starts sending the outgoing audio.
+	The incoming audio is buffered as soon as this is called. */
+	void start(StartCallback aOnStarted);
+
+	/** Stops the session; the unsent outgoing audio and the buffered incoming audio are dropped.
+	If the start is still pending, it is aborted: the session is closed once the device accepts it, and the start
+	callback receives asio::error::operation_aborted. */
+	void stop();
+
+	/** Queues the audio data (G.711 A-law) to be sent to the device.
+	Lock-free and wait-free, to be called from a single audio capture thread.
+	Returns the number of bytes accepted; the rest was dropped because the outgoing latency would exceed the limit. */
+	size_t writeAudio(const char * aData, size_t aSize);
+
+	/** Returns the next incoming audio frame (G.711 A-law) due for playback,
+	or an empty slice if there's none available (the caller should play silence).
+	To be called from the audio playback thread, at the pace of the playback. */
+	BufferSlice readAudio();
+
+	/** Returns the statistics of the incoming jitter buffer. */
+	JitterBuffer::Stats incomingStats() const;
+
+	/** Returns the number of outgoing frame periods in which there wasn't a full frame of audio to send. */
+	uint64_t numOutgoingUnderruns() const { return mNumOutgoingUnderruns; }
+
+
+protected:
+
+	/** The mutex protecting the timer and the outgoing frame buffer against multithreaded access. */
+	std::recursive_mutex mMtx;
+
+	/** The connection to the device. */
+	std::shared_ptr<Connection> mConnection;
+
+	Options mOptions;
+
+	/** The maximum number of bytes waiting in mOutgoing (corresponds to mOptions.mMaxOutgoingLatency). */
+	size_t mMaxOutgoingBytes;
+
+	/** The outgoing audio, written by the capture thread, read by the pacing timer. */
+	SpscRing<char> mOutgoing;
+
+	/** The incoming audio frames. */
+	JitterBuffer mIncoming;
+
+	/** The buffer for assembling the outgoing packets (media header + audio frame). */
+	std::vector<char> mOutgoingPacket;
+
+	/** The timer pacing the outgoing packets. */
+	asio::steady_timer mPacingTimer;
+
+	/** The time at which the next outgoing packet is due. */
+	std::chrono::steady_clock::time_point mNextSendTime;
+
+	/** True while the session is running (after the device accepted and before stop()).
+	Whoever resets it from true (stop(), or onStarted() for a session stopped while starting) closes the session. */
+	std::atomic<bool> mIsRunning;
+
+	/** Set by stop(), reset by start(). A start still pending when set is aborted by onStarted(). */
+	std::atomic<bool> mIsStopped;
+
+	/** The number of frame periods in which there wasn't a full frame to send. */
+	std::atomic<uint64_t> mNumOutgoingUnderruns;
+
+
+	TalkSession(std::shared_ptr<Connection> aConnection, const Options & aOptions);
+
+	/** Returns the options with the values clamped to their valid ranges. */
+	static Options sanitizeOptions(const Options & aOptions);
+
+	/** Called when the device responds to the start request. */
+	void onStarted(const std::error_code & aError, StartCallback aOnStarted);
+
+	/** Schedules the pacing timer for the next frame. */
+	void scheduleNextFrame();
+
+	/** Called by the pacing timer, sends the next outgoing frame, if available. */
+	void sendNextFrame();
+
+	/** Called when the device pushes an incoming audio packet. */
+	void onIncomingData(const BufferSlice & aPayload);
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -1,4 +1,7 @@
 #include "TcpConnection.hpp"
+
+#include <algorithm>
+#include <cstring>
 #include "Root.hpp"
 
 
@@ -14,6 +17,9 @@ namespace NetSurveillancePp
 
 using LockGuard = std::lock_guard<std::recursive_mutex>;
 
+/** The size of the block used for reading the incoming data. */
+static const size_t INCOMING_BLOCK_SIZE = 128 * 1024;
+
 
 
 
@@ -22,6 +28,7 @@ TcpConnection::TcpConnection():
 	mResolver(Root::instance().ioContext()),
 	mSocket(Root::instance().ioContext()),
 	mIsOutgoing(false),
+	mIncomingData(BufferPool::instance().allocate(INCOMING_BLOCK_SIZE)),
 	mIncomingDataSize(0),
 	mIsConnected(false)
 {
@@ -67,10 +74,23 @@ void TcpConnection::connect(
 
 
 void TcpConnection::send(const std::vector<char> & aData)
+{
+	send({asio::buffer(aData)});
+}
+
+
+
+
+
+void TcpConnection::send(std::initializer_list<asio::const_buffer> aParts)
 {
 	{
 		LockGuard lg(mMtxTransfer);
-		mOutgoingQueue.insert(mOutgoingQueue.end(), aData.begin(), aData.end());
+		for (const auto & part: aParts)
+		{
+			auto data = static_cast<const char *>(part.data());
+			mOutgoingQueue.insert(mOutgoingQueue.end(), data, data + part.size());
+		}
 		if (mIsOutgoing)
 		{
 			return;
@@ -85,6 +105,7 @@ void TcpConnection::send(const std::vector<char> & aData)
 
 void TcpConnection::disconnect()
 {
+	mIsConnected = false;
 	std::error_code err;
 	mSocket.shutdown(asio::ip::tcp::socket::shutdown_both, err);
 	mSocket.close(err);
@@ -97,11 +118,13 @@ void TcpConnection::disconnect()
 void TcpConnection::queueRead()
 {
 	mSocket.async_read_some(
-		asio::buffer(mIncomingData.data() + mIncomingDataSize, mIncomingData.size() - mIncomingDataSize),
-		[self = shared_from_this()](const std::error_code & aError, std::size_t aNumBytes)
-		{
-			self->onRead(aError, aNumBytes);
-		}
+		asio::buffer(mIncomingData->data() + mIncomingDataSize, mIncomingData->capacity() - mIncomingDataSize),
+		makeAllocHandler(mReadHandlerMemory,
+			[self = shared_from_this()](const std::error_code & aError, std::size_t aNumBytes)
+			{
+				self->onRead(aError, aNumBytes);
+			}
+		)
 	);
 }
 
@@ -113,6 +136,7 @@ void TcpConnection::onWritten(const std::error_code & aError)
 {
 	if (aError)
 	{
+		mIsConnected = false;
 		disconnected();
 		return;
 	}
@@ -128,6 +152,7 @@ void TcpConnection::onRead(const std::error_code & aError, std::size_t aNumBytes
 {
 	if (aError)
 	{
+		mIsConnected = false;
 		disconnected();
 		return;
 	}
@@ -144,6 +169,46 @@ void TcpConnection::onRead(const std::error_code & aError, std::size_t aNumBytes
 
 
 
+void TcpConnection::consumeIncomingData(size_t aNumBytes)
+{
+	if (aNumBytes == 0)
+	{
+		return;
+	}
+	auto remaining = mIncomingDataSize - aNumBytes;
+	if (mIncomingData->isShared())
+	{
+		// Someone holds a slice of the current block, the data must not be overwritten; move to a fresh block:
+		auto block = BufferPool::instance().allocate(std::max(remaining, INCOMING_BLOCK_SIZE));
+		std::memcpy(block->data(), mIncomingData->data() + aNumBytes, remaining);
+		mIncomingData = std::move(block);
+	}
+	else if (remaining > 0)
+	{
+		std::memmove(mIncomingData->data(), mIncomingData->data() + aNumBytes, remaining);
+	}
+	mIncomingDataSize = remaining;
+}
+
+
+
+
+
+void TcpConnection::reserveIncomingData(size_t aTotalSize)
+{
+	if (aTotalSize <= mIncomingData->capacity())
+	{
+		return;
+	}
+	auto block = BufferPool::instance().allocate(aTotalSize);
+	std::memcpy(block->data(), mIncomingData->data(), mIncomingDataSize);
+	mIncomingData = std::move(block);
+}
+
+
+
+
+
 void TcpConnection::writeNextQueueItem()
 {
 	LockGuard lg(mMtxTransfer);
@@ -159,7 +224,14 @@ void TcpConnection::writeNextQueueItem()
 	std::swap(mOutgoingData, mOutgoingQueue);
 	mIsOutgoing = true;
 	mOutgoingQueue.clear();
-	asio::async_write(mSocket, asio::buffer(mOutgoingData), std::bind(&TcpConnection::onWritten, this, std::placeholders::_1));
+	asio::async_write(mSocket, asio::buffer(mOutgoingData),
+		makeAllocHandler(mWriteHandlerMemory,
+			[self = shared_from_this()](const std::error_code & aError, std::size_t aNumBytes)
+			{
+				self->onWritten(aError);
+			}
+		)
+	);
 }
 
 }  // namespace NetSurveillancePp
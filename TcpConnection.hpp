@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <functional>
 #include <asio.hpp>
+#include "Buffer.hpp"
+#include "HandlerAllocator.hpp"
 
 
 
@@ -42,10 +45,18 @@ public:
 	Returns immediately, there is no notification about having sent the data. */
 	void send(const std::vector<char> & aData);
 
+	/** Asynchronously sends the concatenation of the specified buffers.
+	Returns immediately, there is no notification about having sent the data.
+	The data is copied into the outgoing queue, whose capacity is reused, so there's no allocation in the steady state. */
+	void send(std::initializer_list<asio::const_buffer> aParts);
+
 	/** Disconnects the socket.
 	Ignores any errors, returns immediately. */
 	void disconnect();
 
+	/** Returns true if the socket is connected (and hasn't been disconnected since). */
+	bool isConnected() const { return mIsConnected; }
+
 
 protected:
 
@@ -69,9 +80,10 @@ protected:
 	Protected against multithreaded access by mMtxTransfer. */
 	std::vector<char> mOutgoingQueue;
 
-	/** The data incoming from mSocket (ASIO buffer).
-	mIncomingDataSize specifies how many bytes from this are valid. */
-	std::array<char, 128 * 1024> mIncomingData;
+	/** The data incoming from mSocket (ASIO buffer), in a block from the BufferPool.
+	mIncomingDataSize specifies how many bytes from this are valid.
+	Parts of the block may be referenced by BufferSlice-s handed out to the clients; those parts are never overwritten. */
+	BufferBlockPtr mIncomingData;
 
 	/** The number of bytes in mIncomingData that are valid. */
 	std::size_t mIncomingDataSize;
@@ -79,8 +91,15 @@ protected:
 	/** The mutex protecting mIsOutgoing, mOutgoingQueue, mIncomingQueue against multithreaded access. */
 	std::recursive_mutex mMtxTransfer;
 
-	/** Flag specifying whether the socket is connected. */
-	bool mIsConnected;
+	/** Flag specifying whether the socket is connected.
+	Cleared on disconnect() and whenever a disconnect is detected; read from any thread. */
+	std::atomic<bool> mIsConnected;
+
+	/** The recycled memory for the read handler (there's at most one read outstanding at any time). */
+	HandlerMemory mReadHandlerMemory;
+
+	/** The recycled memory for the write handler (there's at most one write outstanding at any time). */
+	HandlerMemory mWriteHandlerMemory;
 
 
 	/** Queues another read operation with ASIO. */
@@ -92,6 +111,21 @@ protected:
 	/** Called by ASIO when data has been read into mIncomingData. */
 	void onRead(const std::error_code & aError, std::size_t aNumBytes);
 
+	/** Returns a slice referencing the specified part of mIncomingData. */
+	BufferSlice incomingSlice(size_t aOffset, size_t aSize) const
+	{
+		return BufferSlice(mIncomingData, aOffset, aSize);
+	}
+
+	/** Removes the specified number of processed bytes from the start of mIncomingData.
+	If there are slices still referencing mIncomingData, the remaining data is moved to a new block from the pool,
+	otherwise the data is moved to the start of the current block. */
+	void consumeIncomingData(size_t aNumBytes);
+
+	/** Makes sure that mIncomingData can hold at least the specified number of bytes in total.
+	Used by descendants when they know that a packet larger than the current block is being received. */
+	void reserveIncomingData(size_t aTotalSize);
+
 	/** Takes next item in mOutgoingQueue, if available, and starts writing it.
 	Moves the item from mOutgoingQueue into mOutgoingData / mIncomingQueue.
 	Assumes that mMtxTransfer is held by the caller. */
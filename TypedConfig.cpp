@@ -0,0 +1,627 @@
+#include "TypedConfig.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include "Error.hpp"
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** The SAX handler that stores the config value from a ConfigGet_Resp into the typed target.
+The top-level object is the response envelope; of it only the "Ret" field and the config value are processed.
+Containers that have no target (unknown keys, mismatched types, too deep nesting) are skipped as a whole. */
+class ConfigSaxHandler
+{
+public:
+
+	using json = nlohmann::json;
+
+	/** The maximum nesting depth of the processed containers, including the envelope. */
+	static const size_t MaxDepth = 16;
+
+	/** The value of the "Ret" field, -1 if not present. */
+	int mRet;
+
+	/** Set to true once the config value has been encountered. */
+	bool mIsConfigFound;
+
+
+	ConfigSaxHandler(const char * aConfigName, const TypedConfig::Target & aRoot):
+		mRet(-1),
+		mIsConfigFound(false),
+		mConfigName(aConfigName),
+		mRoot(aRoot),
+		mDepth(0),
+		mSkipDepth(0)
+	{
+	}
+
+	bool null()
+	{
+		if (mSkipDepth == 0)
+		{
+			nextTarget();
+		}
+		return true;
+	}
+
+	bool boolean(bool aValue)
+	{
+		return storeNumber(aValue ? 1 : 0);
+	}
+
+	bool number_integer(json::number_integer_t aValue)
+	{
+		return storeNumber(aValue);
+	}
+
+	bool number_unsigned(json::number_unsigned_t aValue)
+	{
+		return storeNumber(static_cast<int64_t>(aValue));
+	}
+
+	bool number_float(json::number_float_t aValue, const json::string_t & aText)
+	{
+		return storeNumber(static_cast<int64_t>(aValue));
+	}
+
+	bool string(json::string_t & aValue)
+	{
+		if (mSkipDepth > 0)
+		{
+			return true;
+		}
+		auto target = nextTarget();
+		switch (target.mKind)
+		{
+			case TypedConfig::Target::Kind::String:
+			{
+				static_cast<std::string *>(target.mValue)->assign(aValue);
+				break;
+			}
+			case TypedConfig::Target::Kind::HexNumber:
+			{
+				*static_cast<uint32_t *>(target.mValue) = static_cast<uint32_t>(std::strtoul(aValue.c_str(), nullptr, 16));
+				break;
+			}
+			case TypedConfig::Target::Kind::Int:
+			{
+				*static_cast<int *>(target.mValue) = std::atoi(aValue.c_str());
+				break;
+			}
+			default:
+			{
+				// Type mismatch, ignore the value
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool binary(json::binary_t & aValue)
+	{
+		// Not produced by the text parser
+		if (mSkipDepth == 0)
+		{
+			nextTarget();
+		}
+		return true;
+	}
+
+	bool start_object(size_t aNumElements)
+	{
+		return startContainer(TypedConfig::Target::Kind::Object);
+	}
+
+	bool key(json::string_t & aKey)
+	{
+		if (mSkipDepth > 0)
+		{
+			return true;
+		}
+		if (mDepth == 1)
+		{
+			// The response envelope:
+			if (aKey == mConfigName)
+			{
+				mNext = mRoot;
+				mIsConfigFound = true;
+			}
+			else if (aKey == "Ret")
+			{
+				mNext = {TypedConfig::Target::Kind::Int, &mRet, nullptr};
+			}
+			else
+			{
+				mNext = TypedConfig::Target();
+			}
+			return true;
+		}
+		const auto & parent = mStack[mDepth - 1];
+		parent.mDescribeChild(parent.mValue, aKey, mNext);
+		return true;
+	}
+
+	bool end_object()
+	{
+		return endContainer();
+	}
+
+	bool start_array(size_t aNumElements)
+	{
+		return startContainer(TypedConfig::Target::Kind::Array);
+	}
+
+	bool end_array()
+	{
+		return endContainer();
+	}
+
+	bool parse_error(size_t aPosition, const std::string & aLastToken, const nlohmann::detail::exception & aException)
+	{
+		return false;
+	}
+
+
+protected:
+
+	const char * mConfigName;
+
+	const TypedConfig::Target mRoot;
+
+	/** The containers currently being filled; mStack[0] is the response envelope. */
+	TypedConfig::Target mStack[MaxDepth];
+
+	/** The number of valid items in mStack. */
+	size_t mDepth;
+
+	/** The nesting depth within a skipped container; 0 if not skipping. */
+	size_t mSkipDepth;
+
+	/** The target for the next value in an object, as described by the preceding key. */
+	TypedConfig::Target mNext;
+
+
+	/** Returns the target for the value that is just starting, consuming it. */
+	TypedConfig::Target nextTarget()
+	{
+		TypedConfig::Target res;
+		if (mDepth == 0)
+		{
+			return res;
+		}
+		const auto & parent = mStack[mDepth - 1];
+		if ((parent.mKind == TypedConfig::Target::Kind::Array) && (parent.mDescribeChild != nullptr))
+		{
+			static const std::string noKey;
+			parent.mDescribeChild(parent.mValue, noKey, res);
+			return res;
+		}
+		std::swap(res, mNext);
+		return res;
+	}
+
+	/** Stores the numeric value (including bools) into the next target. */
+	bool storeNumber(int64_t aValue)
+	{
+		if (mSkipDepth > 0)
+		{
+			return true;
+		}
+		auto target = nextTarget();
+		switch (target.mKind)
+		{
+			case TypedConfig::Target::Kind::Bool:      *static_cast<bool *>(target.mValue) = (aValue != 0); break;
+			case TypedConfig::Target::Kind::Int:       *static_cast<int *>(target.mValue) = static_cast<int>(aValue); break;
+			case TypedConfig::Target::Kind::HexNumber: *static_cast<uint32_t *>(target.mValue) = static_cast<uint32_t>(aValue); break;
+			default:
+			{
+				// Type mismatch, ignore the value
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool startContainer(TypedConfig::Target::Kind aKind)
+	{
+		if (mSkipDepth > 0)
+		{
+			mSkipDepth += 1;
+			return true;
+		}
+		if (mDepth == 0)
+		{
+			// The response envelope, only an object is valid:
+			if (aKind != TypedConfig::Target::Kind::Object)
+			{
+				return false;
+			}
+			mStack[mDepth++] = {TypedConfig::Target::Kind::Object, nullptr, nullptr};
+			return true;
+		}
+		auto target = nextTarget();
+		if ((target.mKind != aKind) || (mDepth >= MaxDepth))
+		{
+			mSkipDepth = 1;
+			return true;
+		}
+		mStack[mDepth++] = target;
+		return true;
+	}
+
+	bool endContainer()
+	{
+		if (mSkipDepth > 0)
+		{
+			mSkipDepth -= 1;
+		}
+		else
+		{
+			mDepth -= 1;
+		}
+		return true;
+	}
+};
+
+const size_t ConfigSaxHandler::MaxDepth;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TypedConfig:
+
+std::error_code TypedConfig::parseResponse(const char * aBegin, const char * aEnd, const char * aConfigName, const Target & aRoot)
+{
+	ConfigSaxHandler handler(aConfigName, aRoot);
+	if (!nlohmann::json::sax_parse(aBegin, aEnd, &handler))
+	{
+		return make_error_code(Error::MalformedResponse);
+	}
+	if (handler.mRet < 0)
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	if (handler.mRet != static_cast<int>(Error::Success))
+	{
+		return make_error_code(static_cast<Error>(handler.mRet));
+	}
+	if (!handler.mIsConfigFound)
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	return {};
+}
+
+
+
+
+
+std::error_code TypedConfig::mergeResponse(
+	const char * aBegin,
+	const char * aEnd,
+	const char * aConfigName,
+	const void * aConfig,
+	MergeFunction aMergeConfig,
+	std::string & aOut
+)
+{
+	// Walk the response envelope, merging the config and reading "Ret", skipping anything else:
+	aOut.clear();
+	Merger merger(aBegin, aEnd, aOut);
+	int ret = -1;
+	bool isConfigFound = false;
+	if (!merger.expect('{'))
+	{
+		return make_error_code(Error::MalformedResponse);
+	}
+	merger.skipWhitespace();
+	bool isClosed = merger.expect('}');
+	while (!isClosed)
+	{
+		std::string key;
+		merger.skipWhitespace();
+		if (!merger.readRawString(key) || !merger.expect(':'))
+		{
+			return make_error_code(Error::MalformedResponse);
+		}
+		bool isOk;
+		if (!isConfigFound && (key == aConfigName))
+		{
+			isConfigFound = true;
+			isOk = aMergeConfig(merger, aConfig);
+		}
+		else if (key == "Ret")
+		{
+			std::string retValue;
+			isOk = merger.readNumber(retValue);
+			ret = std::atoi(retValue.c_str());
+		}
+		else
+		{
+			isOk = merger.skipValue();
+		}
+		if (!isOk || !merger.skipSeparator('}', isClosed))
+		{
+			return make_error_code(Error::MalformedResponse);
+		}
+	}
+	if (ret < 0)
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	if (ret != static_cast<int>(Error::Success))
+	{
+		return make_error_code(static_cast<Error>(ret));
+	}
+	if (!isConfigFound)
+	{
+		return make_error_code(Error::ResponseMissingExpectedField);
+	}
+	return {};
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TypedConfig::Merger:
+
+bool TypedConfig::Merger::skipValue()
+{
+	skipWhitespace();
+	if (mPos >= mEnd)
+	{
+		return false;
+	}
+	if (*mPos == '"')
+	{
+		std::string ignored;
+		return readRawString(ignored);
+	}
+	if ((*mPos == '{') || (*mPos == '['))
+	{
+		// Skip the whole container, minding the brackets within the strings:
+		size_t depth = 0;
+		while (mPos < mEnd)
+		{
+			switch (*mPos)
+			{
+				case '"':
+				{
+					std::string ignored;
+					if (!readRawString(ignored))
+					{
+						return false;
+					}
+					continue;
+				}
+				case '{':
+				case '[':
+				{
+					depth += 1;
+					break;
+				}
+				case '}':
+				case ']':
+				{
+					depth -= 1;
+					if (depth == 0)
+					{
+						mPos += 1;
+						return true;
+					}
+					break;
+				}
+			}
+			mPos += 1;
+		}
+		return false;
+	}
+
+	// A number or a literal, up to the next separator:
+	auto start = mPos;
+	while ((mPos < mEnd) && (std::strchr(",}] \t\r\n", *mPos) == nullptr))
+	{
+		mPos += 1;
+	}
+	return (mPos > start);
+}
+
+
+
+
+
+bool TypedConfig::Merger::copyValue()
+{
+	skipWhitespace();
+	auto start = mPos;
+	if (!skipValue())
+	{
+		return false;
+	}
+	mOut.append(start, mPos);
+	return true;
+}
+
+
+
+
+
+bool TypedConfig::Merger::readNumber(std::string & aValue)
+{
+	skipWhitespace();
+	auto start = mPos;
+	if (isAt('"') || isAt('{') || isAt('[') || !skipValue())
+	{
+		return false;
+	}
+	aValue.assign(start, mPos);
+	return true;
+}
+
+
+
+
+
+bool TypedConfig::Merger::readRawString(std::string & aValue)
+{
+	if (!isAt('"'))
+	{
+		return false;
+	}
+	auto start = ++mPos;
+	while (mPos < mEnd)
+	{
+		if (*mPos == '\\')
+		{
+			mPos += 2;
+			continue;
+		}
+		if (*mPos == '"')
+		{
+			aValue.assign(start, mPos);
+			mPos += 1;
+			return true;
+		}
+		mPos += 1;
+	}
+	return false;
+}
+
+
+
+
+
+bool TypedConfig::Merger::skipSeparator(char aClosing, bool & aIsClosed)
+{
+	skipWhitespace();
+	if (isAt(','))
+	{
+		aIsClosed = false;
+	}
+	else if (isAt(aClosing))
+	{
+		aIsClosed = true;
+	}
+	else
+	{
+		return false;
+	}
+	mPos += 1;
+	return true;
+}
+
+
+
+
+
+bool TypedConfig::Merger::expect(char aChar)
+{
+	skipWhitespace();
+	if (!isAt(aChar))
+	{
+		return false;
+	}
+	mPos += 1;
+	return true;
+}
+
+
+
+
+
+void TypedConfig::Merger::skipWhitespace()
+{
+	while ((mPos < mEnd) && ((*mPos == ' ') || (*mPos == '\t') || (*mPos == '\r') || (*mPos == '\n')))
+	{
+		mPos += 1;
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TypedConfig::Writer:
+
+void TypedConfig::Writer::write(bool aValue)
+{
+	mOut.append(aValue ? "true" : "false");
+}
+
+
+
+
+
+void TypedConfig::Writer::write(int aValue)
+{
+	mOut.append(std::to_string(aValue));
+}
+
+
+
+
+
+void TypedConfig::Writer::write(uint32_t aValue)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "\"0x%08X\"", aValue);
+	mOut.append(buf);
+}
+
+
+
+
+
+void TypedConfig::Writer::writeString(const char * aValue, size_t aLength)
+{
+	mOut.push_back('"');
+	for (size_t i = 0; i < aLength; ++i)
+	{
+		auto c = static_cast<unsigned char>(aValue[i]);
+		switch (c)
+		{
+			case '"':  mOut.append("\\\""); break;
+			case '\\': mOut.append("\\\\"); break;
+			case '\n': mOut.append("\\n");  break;
+			case '\r': mOut.append("\\r");  break;
+			case '\t': mOut.append("\\t");  break;
+			default:
+			{
+				if (c < 0x20)
+				{
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					mOut.append(buf);
+				}
+				else
+				{
+					mOut.push_back(static_cast<char>(c));
+				}
+				break;
+			}
+		}
+	}
+	mOut.push_back('"');
+}
+
+
+
+
+
+}  // namespace NetSurveillancePp
@@ -0,0 +1,647 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+
+
+
+
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** The video encoding parameters of a single stream (Simplify.Encode[ch].MainFormat.Video). */
+struct EncodeVideoConfig
+{
+	int mBitRate = 0;
+	std::string mBitRateControl;  // "CBR" / "VBR"
+	std::string mCompression;     // "H.264" / "H.265"
+	int mFPS = 0;
+	int mGOP = 0;
+	int mQuality = 0;
+	std::string mResolution;      // "1080P", "D1", ...
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("BitRate",        aSelf.mBitRate);
+		aVisitor("BitRateControl", aSelf.mBitRateControl);
+		aVisitor("Compression",    aSelf.mCompression);
+		aVisitor("FPS",            aSelf.mFPS);
+		aVisitor("GOP",            aSelf.mGOP);
+		aVisitor("Quality",        aSelf.mQuality);
+		aVisitor("Resolution",     aSelf.mResolution);
+	}
+};
+
+
+
+
+
+/** The encoding of a single stream of a channel (Simplify.Encode[ch].MainFormat / ExtraFormat). */
+struct EncodeStreamConfig
+{
+	bool mAudioEnable = false;
+	EncodeVideoConfig mVideo;
+	bool mVideoEnable = false;
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("AudioEnable", aSelf.mAudioEnable);
+		aVisitor("Video",       aSelf.mVideo);
+		aVisitor("VideoEnable", aSelf.mVideoEnable);
+	}
+};
+
+
+
+
+
+/** The encoding of a single channel, both its streams (Simplify.Encode[ch]). */
+struct EncodeChannelConfig
+{
+	EncodeStreamConfig mExtraFormat;
+	EncodeStreamConfig mMainFormat;
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("ExtraFormat", aSelf.mExtraFormat);
+		aVisitor("MainFormat",  aSelf.mMainFormat);
+	}
+};
+
+/** The whole Simplify.Encode config, one item per channel. */
+using EncodeConfig = std::vector<EncodeChannelConfig>;
+
+
+
+
+
+/** The motion detection of a single channel (Detect.MotionDetect[ch]).
+The EventHandler (what to do on detection) is not bound. */
+struct MotionDetectChannelConfig
+{
+	bool mEnable = false;
+	int mLevel = 0;
+
+	/** The detection grid, one bitmask per row ("0x003FFFFF"). */
+	std::vector<uint32_t> mRegion;
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("Enable", aSelf.mEnable);
+		aVisitor("Level",  aSelf.mLevel);
+		aVisitor("Region", aSelf.mRegion);
+	}
+};
+
+/** The whole Detect.MotionDetect config, one item per channel. */
+using MotionDetectConfig = std::vector<MotionDetectChannelConfig>;
+
+
+
+
+
+/** The General.General config. */
+struct GeneralConfig
+{
+	int mAutoLogout = 0;
+	int mFontSize = 0;
+	int mIranCalendarEnable = 0;
+	int mLocalNo = 0;
+	std::string mMachineName;
+	std::string mOverWrite;    // "OverWrite" / "StopRecord"
+	int mScreenAutoShutdown = 0;
+	int mScreenSaveTime = 0;
+	std::string mVideoOutPut;  // "Auto", "VGA", ...
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("AutoLogout",         aSelf.mAutoLogout);
+		aVisitor("FontSize",           aSelf.mFontSize);
+		aVisitor("IranCalendarEnable", aSelf.mIranCalendarEnable);
+		aVisitor("LocalNo",            aSelf.mLocalNo);
+		aVisitor("MachineName",        aSelf.mMachineName);
+		aVisitor("OverWrite",          aSelf.mOverWrite);
+		aVisitor("ScreenAutoShutdown", aSelf.mScreenAutoShutdown);
+		aVisitor("ScreenSaveTime",     aSelf.mScreenSaveTime);
+		aVisitor("VideoOutPut",        aSelf.mVideoOutPut);
+	}
+};
+
+
+
+
+
+/** The basic network settings (NetWork.NetCommon); only the commonly needed fields are bound. */
+struct NetCommonConfig
+{
+	std::string mHostName;
+
+	/** The maximum total bitrate of the network streams, in kbps. */
+	int mMaxBps = 0;
+
+	/** The maximum number of simultaneous TCP connections the device accepts. */
+	int mMaxConn = 0;
+
+	int mTCPPort = 0;
+	int mUDPPort = 0;
+
+	template <typename Self, typename Visitor>
+	static void visitFields(Self & aSelf, Visitor & aVisitor)
+	{
+		aVisitor("HostName", aSelf.mHostName);
+		aVisitor("MaxBps",   aSelf.mMaxBps);
+		aVisitor("MaxConn",  aSelf.mMaxConn);
+		aVisitor("TCPPort",  aSelf.mTCPPort);
+		aVisitor("UDPPort",  aSelf.mUDPPort);
+	}
+};
+
+
+
+
+
+/** Binds a typed config to its name in the device's config tree.
+mIsComplete tells whether the type binds all the fields of the config, so that its serialized form can be sent in
+ConfigSet_Req as-is; the incomplete ones need to be merged into the device's current config (TypedConfig::merge()).
+The firmwares add fields (VirtualGOP, ...) that the structs don't bind, so none of the bound configs is complete. */
+template <typename Config> struct ConfigSection;
+
+template <> struct ConfigSection<EncodeConfig>
+{
+	static const char * name() { return "Simplify.Encode"; }
+	static const bool mIsComplete = false;
+};
+
+template <> struct ConfigSection<MotionDetectConfig>
+{
+	static const char * name() { return "Detect.MotionDetect"; }
+	static const bool mIsComplete = false;
+};
+
+template <> struct ConfigSection<GeneralConfig>
+{
+	static const char * name() { return "General.General"; }
+	static const bool mIsComplete = false;
+};
+
+template <> struct ConfigSection<NetCommonConfig>
+{
+	static const char * name() { return "NetWork.NetCommon"; }
+	static const bool mIsComplete = false;
+};
+
+
+
+
+
+/** Parses the config responses directly into the typed config structs, and serializes them back.
+The parser is driven by the JSON SAX events straight from the response bytes, storing the values into the struct
+members as they are encountered; no JSON DOM is built. Unknown keys are skipped, missing keys keep the struct's
+default values. The serializer writes the JSON text directly; the merger does the same, copying the unbound parts of
+the device's current config verbatim from the response bytes.
+The structs describe their fields using a static visitFields(self, visitor) template; bool, int, std::string,
+uint32_t (hex string "0x..."), std::vector and nested structs are supported. */
+class TypedConfig
+{
+public:
+
+	/** Describes where the parser stores the next JSON value. */
+	struct Target
+	{
+		enum class Kind
+		{
+			Ignore,
+			Bool,
+			Int,
+			HexNumber,
+			String,
+			Object,
+			Array,
+		};
+
+		Kind mKind = Kind::Ignore;
+
+		/** The value to store into (bool, int, uint32_t, std::string, struct or std::vector). */
+		void * mValue = nullptr;
+
+		/** Object: describes the member for the specified key into aTarget (Kind::Ignore if there's none).
+		Array: appends a new element and describes it into aTarget (aKey is unused). */
+		void (*mDescribeChild)(void * aValue, const std::string & aKey, Target & aTarget) = nullptr;
+	};
+
+
+	/** Parses the whole ConfigGet_Resp payload into aOut.
+	Returns the error from the "Ret" field, Error::MalformedResponse if the data is not valid JSON, or
+	Error::ResponseMissingExpectedField if the response doesn't contain the config. */
+	template <typename Config>
+	static std::error_code parse(const char * aBegin, const char * aEnd, Config & aOut)
+	{
+		Target root;
+		describe(aOut, root);
+		return parseResponse(aBegin, aEnd, ConfigSection<Config>::name(), root);
+	}
+
+	/** Returns the JSON text of the config value, to be sent in ConfigSet_Req (Connection::setConfigRaw()). */
+	template <typename Config>
+	static std::string serialize(const Config & aConfig)
+	{
+		std::string res;
+		Writer writer(res);
+		writer.write(aConfig);
+		return res;
+	}
+
+	/** Returns in aOut the JSON text of the device's current config, taken from the ConfigGet_Resp payload, with the
+	values bound by the typed config replaced by those in aConfig; to be sent in ConfigSet_Req (Connection::setConfigRaw()).
+	The members not bound by the struct are copied verbatim, so that the firmware fields it doesn't model are kept.
+	Arrays are merged element-wise; the bound members missing from the current config are not added.
+	Returns the same errors as parse(). */
+	template <typename Config>
+	static std::error_code merge(const char * aBegin, const char * aEnd, const Config & aConfig, std::string & aOut)
+	{
+		return mergeResponse(aBegin, aEnd, ConfigSection<Config>::name(), &aConfig, &mergeConfig<Config>, aOut);
+	}
+
+	/** Parses the ConfigGet_Resp payload, storing the value of the specified config into aRoot. */
+	static std::error_code parseResponse(const char * aBegin, const char * aEnd, const char * aConfigName, const Target & aRoot);
+
+
+protected:
+
+	class Merger;
+
+	/** Merges the config (of the type the function is instantiated for) at the merger's current position. */
+	using MergeFunction = bool (*)(Merger & aMerger, const void * aConfig);
+
+
+	/** Implements merge(): walks the response envelope, merging aConfig into the specified config using aMergeConfig. */
+	static std::error_code mergeResponse(
+		const char * aBegin,
+		const char * aEnd,
+		const char * aConfigName,
+		const void * aConfig,
+		MergeFunction aMergeConfig,
+		std::string & aOut
+	);
+
+	template <typename Config>
+	static bool mergeConfig(Merger & aMerger, const void * aConfig)
+	{
+		return aMerger.merge(*static_cast<const Config *>(aConfig));
+	}
+
+	/** The visitor that describes the struct member matching a key. */
+	struct KeyMatcher
+	{
+		const std::string & mKey;
+		Target & mTarget;
+		bool mIsFound;
+
+		template <typename T>
+		void operator()(const char * aName, T & aValue)
+		{
+			if (!mIsFound && (mKey == aName))
+			{
+				describe(aValue, mTarget);
+				mIsFound = true;
+			}
+		}
+	};
+
+
+	/** Writes the JSON text of the typed values. */
+	class Writer
+	{
+	public:
+
+		explicit Writer(std::string & aOut):
+			mOut(aOut),
+			mIsFirst(true)
+		{
+		}
+
+		/** Writes a single struct member, as a key: value pair. */
+		template <typename T>
+		void operator()(const char * aName, const T & aValue)
+		{
+			if (!mIsFirst)
+			{
+				mOut.push_back(',');
+			}
+			mIsFirst = false;
+			writeString(aName);
+			mOut.push_back(':');
+			write(aValue);
+		}
+
+		void write(bool aValue);
+		void write(int aValue);
+		void write(uint32_t aValue);
+		void write(const std::string & aValue) { writeString(aValue.c_str(), aValue.size()); }
+
+		template <typename T>
+		void write(const std::vector<T> & aValue)
+		{
+			mOut.push_back('[');
+			bool isFirst = true;
+			for (const auto & v: aValue)
+			{
+				if (!isFirst)
+				{
+					mOut.push_back(',');
+				}
+				isFirst = false;
+				write(v);
+			}
+			mOut.push_back(']');
+		}
+
+		template <typename T>
+		void write(const T & aStruct)
+		{
+			mOut.push_back('{');
+			Writer members(mOut);
+			T::visitFields(aStruct, members);
+			mOut.push_back('}');
+		}
+
+
+	protected:
+
+		std::string & mOut;
+
+		/** True until the first struct member is written. */
+		bool mIsFirst;
+
+
+		/** Writes the string as a quoted and escaped JSON string. */
+		void writeString(const char * aValue, size_t aLength);
+		void writeString(const char * aValue) { writeString(aValue, strlen(aValue)); }
+	};
+
+
+	/** Copies the JSON text of the current config into the output, replacing the typed values in it. */
+	class Merger
+	{
+	public:
+
+		Merger(const char * aBegin, const char * aEnd, std::string & aOut):
+			mPos(aBegin),
+			mEnd(aEnd),
+			mOut(aOut)
+		{
+		}
+
+		/** Replaces the scalar value at the current position with aValue. */
+		bool merge(bool aValue)                 { return replaceValue(aValue); }
+		bool merge(int aValue)                  { return replaceValue(aValue); }
+		bool merge(uint32_t aValue)             { return replaceValue(aValue); }
+		bool merge(const std::string & aValue)  { return replaceValue(aValue); }
+
+		/** Merges the array at the current position element-wise; the extra current elements are kept. */
+		template <typename T>
+		bool merge(const std::vector<T> & aValue)
+		{
+			skipWhitespace();
+			if (!isAt('['))
+			{
+				return replaceValue(aValue);
+			}
+			mPos += 1;
+			mOut.push_back('[');
+			size_t idx = 0;
+			skipWhitespace();
+			if (isAt(']'))
+			{
+				mPos += 1;
+			}
+			else
+			{
+				for (;;)
+				{
+					if (idx > 0)
+					{
+						mOut.push_back(',');
+					}
+					if (!((idx < aValue.size()) ? merge(aValue[idx]) : copyValue()))
+					{
+						return false;
+					}
+					idx += 1;
+					bool isClosed;
+					if (!skipSeparator(']', isClosed))
+					{
+						return false;
+					}
+					if (isClosed)
+					{
+						break;
+					}
+				}
+			}
+			for (; idx < aValue.size(); ++idx)
+			{
+				if (idx > 0)
+				{
+					mOut.push_back(',');
+				}
+				Writer(mOut).write(aValue[idx]);
+			}
+			mOut.push_back(']');
+			return true;
+		}
+
+		/** Merges the object at the current position, member by member; the unbound members are copied verbatim.
+		The bound members that the current config lacks are not added, the device doesn't support them. */
+		template <typename T>
+		bool merge(const T & aStruct)
+		{
+			skipWhitespace();
+			if (!isAt('{'))
+			{
+				return replaceValue(aStruct);
+			}
+			mPos += 1;
+			mOut.push_back('{');
+			uint64_t merged = 0;
+			bool isFirst = true;
+			skipWhitespace();
+			if (isAt('}'))
+			{
+				mPos += 1;
+			}
+			else
+			{
+				for (;;)
+				{
+					std::string key;
+					skipWhitespace();
+					auto keyBegin = mPos;
+					if (!readRawString(key))
+					{
+						return false;
+					}
+					auto keyEnd = mPos;
+					if (!expect(':'))
+					{
+						return false;
+					}
+					if (!isFirst)
+					{
+						mOut.push_back(',');
+					}
+					isFirst = false;
+					mOut.append(keyBegin, keyEnd);
+					mOut.push_back(':');
+					MemberMerger member{*this, key, merged, 0, false, false};
+					T::visitFields(aStruct, member);
+					if (!(member.mIsFound ? member.mIsOk : copyValue()))
+					{
+						return false;
+					}
+					bool isClosed;
+					if (!skipSeparator('}', isClosed))
+					{
+						return false;
+					}
+					if (isClosed)
+					{
+						break;
+					}
+				}
+			}
+			mOut.push_back('}');
+			return true;
+		}
+
+		/** Skips the value at the current position. Returns false if the data is malformed. */
+		bool skipValue();
+
+		/** Copies the value at the current position into the output. Returns false if the data is malformed. */
+		bool copyValue();
+
+		/** Reads the number at the current position into aValue, as text. Returns false if there's no number. */
+		bool readNumber(std::string & aValue);
+
+		/** Reads the string at the current position into aValue, without processing the escapes (the escaped keys
+		don't match any bound member, and are copied verbatim). Returns false if the data is malformed. */
+		bool readRawString(std::string & aValue);
+
+		/** Skips the whitespace, then consumes either a comma or aClosing, setting aIsClosed accordingly.
+		Returns false if there's neither. */
+		bool skipSeparator(char aClosing, bool & aIsClosed);
+
+		/** Skips the whitespace, then consumes aChar. Returns false (consuming nothing more) if aChar is not there. */
+		bool expect(char aChar);
+
+		void skipWhitespace();
+
+		/** Returns true if the current character is aChar. */
+		bool isAt(char aChar) const { return (mPos < mEnd) && (*mPos == aChar); }
+
+
+	protected:
+
+		/** Merges the struct member matching the key, if any. Tracks the merged members in a bitmask, so that a
+		repeated key is copied verbatim; only the first 64 members of a struct are tracked, the structs bind far fewer. */
+		struct MemberMerger
+		{
+			Merger & mMerger;
+			const std::string & mKey;
+			uint64_t & mMerged;
+			size_t mIndex;
+			bool mIsFound;
+			bool mIsOk;
+
+			template <typename V>
+			void operator()(const char * aName, const V & aValue)
+			{
+				auto bit = (mIndex < 64) ? (static_cast<uint64_t>(1) << mIndex) : 0;
+				mIndex += 1;
+				if (mIsFound || ((mMerged & bit) != 0) || (mKey != aName))
+				{
+					return;
+				}
+				mIsFound = true;
+				mMerged |= bit;
+				mIsOk = mMerger.merge(aValue);
+			}
+		};
+
+
+		/** The current position in the input. */
+		const char * mPos;
+
+		const char * mEnd;
+
+		std::string & mOut;
+
+
+		/** Skips the current value and writes aValue in its place. */
+		template <typename T>
+		bool replaceValue(const T & aValue)
+		{
+			if (!skipValue())
+			{
+				return false;
+			}
+			Writer(mOut).write(aValue);
+			return true;
+		}
+	};
+
+
+	static void describe(bool & aValue, Target & aTarget)        { aTarget = {Target::Kind::Bool,      &aValue, nullptr}; }
+	static void describe(int & aValue, Target & aTarget)         { aTarget = {Target::Kind::Int,       &aValue, nullptr}; }
+	static void describe(uint32_t & aValue, Target & aTarget)    { aTarget = {Target::Kind::HexNumber, &aValue, nullptr}; }
+	static void describe(std::string & aValue, Target & aTarget) { aTarget = {Target::Kind::String,    &aValue, nullptr}; }
+
+	template <typename T>
+	static void describe(std::vector<T> & aValue, Target & aTarget)
+	{
+		aTarget = {Target::Kind::Array, &aValue, &describeNewElement<T>};
+	}
+
+	template <typename T>
+	static void describe(T & aStruct, Target & aTarget)
+	{
+		aTarget = {Target::Kind::Object, &aStruct, &describeMember<T>};
+	}
+
+	/** Implements Target::mDescribeChild for structs. */
+	template <typename T>
+	static void describeMember(void * aStruct, const std::string & aKey, Target & aTarget)
+	{
+		aTarget = Target();
+		KeyMatcher matcher{aKey, aTarget, false};
+		T::visitFields(*static_cast<T *>(aStruct), matcher);
+	}
+
+	/** Implements Target::mDescribeChild for vectors. */
+	template <typename T>
+	static void describeNewElement(void * aVector, const std::string & aKey, Target & aTarget)
+	{
+		auto & vec = *static_cast<std::vector<T> *>(aVector);
+		vec.emplace_back();
+		describe(vec.back(), aTarget);
+	}
+};
+
+
+
+
+
+}  // namespace NetSurveillancePp
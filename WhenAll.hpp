@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <asio.hpp>
+
+
+
+
+
+// The awaitables are only available when compiling as C++20 with coroutine support:
+#if defined(ASIO_HAS_CO_AWAIT)
+
+namespace NetSurveillancePp
+{
+
+
+
+
+
+/** Runs all the specified awaitables concurrently and waits for all of them to finish.
+Returns the results in the same order as the awaitables.
+If any of the awaitables throws, the first exception is rethrown after all of them have finished.
+Typical usage, querying several configs at once:
+	std::vector<asio::awaitable<nlohmann::json>> queries;
+	for (const auto & name: names)
+	{
+		queries.push_back(recorder->asyncGetConfig(name, asio::use_awaitable));
+	}
+	auto configs = co_await whenAll(std::move(queries)); */
+template <typename T>
+asio::awaitable<std::vector<T>> whenAll(std::vector<asio::awaitable<T>> aAwaitables)
+{
+	auto executor = co_await asio::this_coro::executor;
+	co_return co_await asio::async_initiate<const asio::use_awaitable_t<> &, void(std::exception_ptr, std::vector<T>)>(
+		[executor](auto aHandler, std::vector<asio::awaitable<T>> aAwaitables)
+		{
+			using Handler = decltype(aHandler);
+
+			/** The state shared among all the running awaitables. */
+			struct State
+			{
+				Handler mHandler;
+				std::vector<T> mResults;
+				std::atomic<size_t> mNumRemaining;
+				std::mutex mMtx;
+				std::exception_ptr mFirstException;
+
+				State(Handler && aHandler, size_t aCount):
+					mHandler(std::move(aHandler)),
+					mResults(aCount),
+					mNumRemaining(aCount)
+				{
+				}
+			};
+
+			auto count = aAwaitables.size();
+			auto state = std::make_shared<State>(std::move(aHandler), count);
+			if (count == 0)
+			{
+				std::move(state->mHandler)(nullptr, std::move(state->mResults));
+				return;
+			}
+			for (size_t i = 0; i < count; ++i)
+			{
+				asio::co_spawn(executor, std::move(aAwaitables[i]),
+					[state, i](std::exception_ptr aException, T aResult)
+					{
+						if (aException)
+						{
+							std::lock_guard<std::mutex> lg(state->mMtx);
+							if (!state->mFirstException)
+							{
+								state->mFirstException = aException;
+							}
+						}
+						else
+						{
+							state->mResults[i] = std::move(aResult);
+						}
+						if (--state->mNumRemaining == 0)
+						{
+							std::move(state->mHandler)(state->mFirstException, std::move(state->mResults));
+						}
+					}
+				);
+			}
+		},
+		asio::use_awaitable, std::move(aAwaitables)
+	);
+}
+
+}  // namespace NetSurveillancePp
+
+#endif  // ASIO_HAS_CO_AWAIT